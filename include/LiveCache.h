@@ -60,7 +60,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <string>
+#include <thread>
 
 class LiveCache {
   protected:
@@ -72,20 +74,30 @@ class LiveCache {
       public:
         bool     st;
         uint64_t order;
+        uint8_t  rrpv;
 
         CState() {
             state = I;
+            rrpv  = DISTANT_REF;
             clearTag();
         }
 
         bool isModified() const { return state == M; }
         void setModified() { state = M; }
+        void setExclusive() { state = E; }
         bool isValid() const { return state != I; }
         bool isInvalid() const { return state == I; }
 
         StateType getState() const { return state; };
 
         void invalidate() { state = I; }
+
+        uint8_t getRRPV() const { return rrpv; }
+        void    setRRPV(uint8_t a) { rrpv = a; }
+        void    incRRPV() {
+            if (rrpv < DISTANT_REF)
+                rrpv++;
+        }
     };
 
     typedef CacheGeneric<CState, uint64_t>            CacheType;
@@ -108,17 +120,89 @@ class LiveCache {
     long long nWriteHit;
     long long nWriteMiss;
 
-    void mergeSort(Line **arr, uint64_t len);
+    static void heapUp(Line **heap, uint64_t i);
+    static void heapDown(Line **heap, uint64_t n, uint64_t i);
 
   public:
-    LiveCache(const std::string &_name, int size, uint64_t mem_base, uint64_t mem_size);
+    LiveCache(const std::string &_name, int size, int assoc, int line_size, const char *policy, uint64_t mem_base,
+              uint64_t mem_size);
     virtual ~LiveCache();
 
     int32_t getLineSize() const { return lineSize; }
+    long long getReadMiss() const { return nReadMiss; }
+    long long getWriteMiss() const { return nWriteMiss; }
+
+    // Hits to the most recent line that the caller did not send
+    void addHits(uint64_t reads, uint64_t writes) {
+        nReadHit += reads;
+        nWriteHit += writes;
+    }
+
+    // Both return true on a hit, so a miss can be sent to the next level
+    bool read(uint64_t addr);
+    bool write(uint64_t addr);
+
+    // Lines with an address, traverse writes the max most recent ones
+    // oldest first as two 32 bit words each (bit 0 set for stores)
+    uint64_t countLines();
+    uint64_t traverse(uint32_t *out, uint64_t max);
+};
+
+// Lock-free single producer, single consumer ring of 64 bit entries
+struct LiveCacheRing {
+    static const uint64_t SIZE = 1 << 16;
+
+    uint64_t *buf;
+
+    // Producer side
+    uint64_t head_local;
+    uint64_t tail_cache;
+
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+
+    void push(uint64_t e) { buf[head_local++ & (SIZE - 1)] = e; }
+    bool half_full() const { return head_local - tail_cache >= SIZE / 2; }
+};
+
+// The accesses of one hart, filtered at the producer
+struct LiveCacheHart {
+    LiveCacheRing ring;
+    uint64_t      last_line[2];  // of the last data and fetch entries
+    bool          last_st[2];    // a store to that line is already queued
+    uint64_t      repeat[2][2];  // hits not queued, by fetch and store
+};
 
-    void      read(uint64_t addr);
-    void      write(uint64_t addr);
-    uint64_t *traverse(uint64_t &n_entries);
+// Queue of the accesses from the interpreter to the LiveCache levels,
+// one ring per hart.  Each entry is a physical address tagged with the
+// kind of access.  RUN marks the first entry of a hart after entries
+// of another one, and turns holds the hart of each run, so that the
+// shared level sees the accesses in the order the harts made them.
+// The consumer is either a thread or the producer itself when a ring
+// fills up or the caches are about to be read.
+struct LiveCacheQueue {
+    static const uint64_t BATCH     = 1 << 10;  // entries between publishes
+    static const uint64_t ST        = 1ULL << 63;
+    static const uint64_t FETCH     = 1ULL << 62;
+    static const uint64_t RUN       = 1ULL << 61;
+    static const uint64_t ADDR_MASK = RUN - 1;
+
+    LiveCacheHart *harts;
+    int            n_harts;
+    LiveCacheRing  turns;
+
+    // Producer side
+    int      line_shift;
+    uint64_t last_key;  // line, hart and kind of the last entry
+    int      last_hart;
+    uint64_t unpublished;
+
+    // Consumer side
+    int run_hart;  // hart of the run being applied, -1 between runs
+
+    bool              threaded;
+    std::atomic<bool> stop;
+    std::thread *     consumer;
 };
 
 #endif
@@ -105,7 +105,7 @@ static inline short log2i(uint32_t n) {
     return i;
 }
 
-enum ReplacementPolicy { LRU, LRUp, RANDOM };
+enum ReplacementPolicy { LRU, LRUp, RANDOM, RRIP };
 
 template <class State, class Addr_t>
 class CacheGeneric {
@@ -383,6 +383,7 @@ class StateGeneric {
 #define k_RANDOM "RANDOM"
 #define k_LRU    "LRU"
 #define k_LRUp   "LRUp"
+#define k_RRIP   "RRIP"
 
 //
 // Class CacheGeneric, the combinational logic of Cache
@@ -419,6 +420,8 @@ CacheAssoc<State, Addr_t>::CacheAssoc(int32_t size, int32_t assoc, int32_t blksi
         policy = LRU;
     else if (strcasecmp(pStr, k_LRUp) == 0)
         policy = LRUp;
+    else if (strcasecmp(pStr, k_RRIP) == 0)
+        policy = RRIP;
     else {
         fprintf(stderr, "Invalid cache policy [%s]\n", pStr);
         exit(0);
@@ -447,6 +450,8 @@ typename CacheAssoc<State, Addr_t>::Line *CacheAssoc<State, Addr_t>::findLinePri
 
     // Check most typical case
     if ((*theSet)->getTag() == tag) {
+        if (policy == RRIP)
+            (*theSet)->setRRPV(NEAR_IMM_REF);
         return *theSet;
     }
 
@@ -469,6 +474,11 @@ typename CacheAssoc<State, Addr_t>::Line *CacheAssoc<State, Addr_t>::findLinePri
         return 0;
 
     Line *tmp = *lineHit;
+    if (policy == RRIP) {
+        // RRIP keeps the set in place, the age lives in the line
+        tmp->setRRPV(NEAR_IMM_REF);
+        return tmp;
+    }
     {
         Line **l = lineHit;
         while (l > theSet) {
@@ -515,6 +525,22 @@ typename CacheAssoc<State, Addr_t>::Line *CacheAssoc<State, Addr_t>::findLine2Re
         }
     }
 
+    if (policy == RRIP) {
+        if (lineHit)
+            return *lineHit;
+
+        // SRRIP: the first invalid or distant line, aging the set until one shows up
+        for (;;) {
+            for (Line **l = theSet; l < setEnd; l++) {
+                if (!(*l)->isValid() || (*l)->getRRPV() >= DISTANT_REF) {
+                    (*l)->setRRPV(LONG_REF);
+                    return *l;
+                }
+            }
+            for (Line **l = theSet; l < setEnd; l++) (*l)->incRRPV();
+        }
+    }
+
     Line * tmp;
     Line **tmp_pos;
     if (!lineHit) {
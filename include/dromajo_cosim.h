@@ -24,7 +24,26 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-typedef struct dromajo_cosim_state_st dromajo_cosim_state_t;
+typedef struct dromajo_cosim_state_st    dromajo_cosim_state_t;
+typedef struct dromajo_cosim_snapshot_st dromajo_cosim_snapshot_t;
+
+/* One instruction committed by the DUT, see dromajo_cosim_step */
+typedef struct {
+    uint64_t pc;
+    uint32_t insn;
+    uint64_t wdata;
+    uint64_t mstatus;
+    bool     check;
+} dromajo_cosim_commit_t;
+
+/* What the model retired for a commit, and the outcome of the check */
+typedef struct {
+    int      exit_code;
+    uint64_t emu_pc;
+    uint32_t emu_insn;
+    uint64_t emu_wdata;
+    bool     emu_wrote_data;
+} dromajo_cosim_result_t;
 
 /*
  * dromajo_cosim_init --
@@ -59,6 +78,23 @@ void dromajo_cosim_fini(dromajo_cosim_state_t *state);
 int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
                        uint64_t mstatus, bool check);
 
+/*
+ * dromajo_cosim_step_batch --
+ *
+ * Checks n commits of a hart in order, as many dromajo_cosim_step
+ * calls would, and stops at the first one with a non-zero exit code.
+ * Returns the number of commits processed.  When out is not NULL it
+ * receives one result per processed commit (only the exit code with
+ * dromajo_cosim_threads_start).  With libdromajo_cosim_client, a batch
+ * with out waits for the server and fills the same results; a commit
+ * that follows an earlier failing step is not processed, and that
+ * failure is returned by dromajo_cosim_step.  A DUT retiring several
+ * instructions per cycle can hand them over in one call; traps are
+ * still raised with dromajo_cosim_raise_trap between batches.
+ */
+int dromajo_cosim_step_batch(dromajo_cosim_state_t *state, int hartid, const dromajo_cosim_commit_t *commits, int n,
+                             dromajo_cosim_result_t *out);
+
 /*
  * dromajo_cosim_raise_trap --
  *
@@ -68,6 +104,40 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
  */
 void dromajo_cosim_raise_trap(dromajo_cosim_state_t *state, int hartid, int64_t cause);
 
+/*
+ * dromajo_cosim_threads_start --
+ *
+ * From now on each hart is checked on its own thread.
+ * dromajo_cosim_step, dromajo_cosim_step_batch and
+ * dromajo_cosim_raise_trap only queue the work for the hart and return
+ * at once.  Commits run concurrently between synchronization points
+ * (AMOs, LR/SC, fences, traps and device accesses), which keep the
+ * order the testbench handed them over in.  The per instruction trace
+ * is not printed.  The step calls return non-zero some time after a
+ * commit failed.  dromajo_cosim_threads_sync then reports the failure
+ * that comes first in the order of the calls, whatever the timing.
+ * Returns non-zero if this build does not support it, or if the model
+ * was started with --cosim_rewind.
+ */
+int dromajo_cosim_threads_start(dromajo_cosim_state_t *state);
+
+/*
+ * dromajo_cosim_threads_sync --
+ *
+ * Waits until every queued commit is checked.  Returns zero or the exit
+ * code of the earliest failing commit, whose messages are printed.
+ * The other calls that read or change the model (override_mem,
+ * snapshot, restore) sync first.
+ */
+int dromajo_cosim_threads_sync(dromajo_cosim_state_t *state);
+
+/*
+ * dromajo_cosim_threads_stop --
+ *
+ * Syncs and goes back to checking on the calling thread.
+ */
+void dromajo_cosim_threads_stop(dromajo_cosim_state_t *state);
+
 /*
  * dromajo_cosim_override_mem --
  *
@@ -75,6 +145,32 @@ void dromajo_cosim_raise_trap(dromajo_cosim_state_t *state, int hartid, int64_t
  */
 int dromajo_cosim_override_mem(dromajo_cosim_state_t *state, int hartid, uint64_t dut_paddr, uint64_t dut_val, int size_log2);
 
+/*
+ * dromajo_cosim_snapshot --
+ *
+ * Captures the CPU, device, and RAM state of the model so that it can
+ * later be brought back with dromajo_cosim_restore.  Several
+ * snapshots can be alive at the same time.  Returns NULL upon failure.
+ */
+dromajo_cosim_snapshot_t *dromajo_cosim_snapshot(dromajo_cosim_state_t *state);
+
+/*
+ * dromajo_cosim_restore --
+ *
+ * Resets the model to a snapshot taken earlier.  Only the RAM pages
+ * written since the snapshot was taken (or last restored) are copied
+ * back, so this is much cheaper than a fini/init cycle.  The snapshot
+ * remains valid and can be restored again.
+ */
+void dromajo_cosim_restore(dromajo_cosim_state_t *state, dromajo_cosim_snapshot_t *snap);
+
+/*
+ * dromajo_cosim_snapshot_free --
+ *
+ * Releases a snapshot.
+ */
+void dromajo_cosim_snapshot_free(dromajo_cosim_state_t *state, dromajo_cosim_snapshot_t *snap);
+
 #ifdef __cplusplus
 }  // extern C
 #endif
@@ -0,0 +1,94 @@
+/*
+ * Shared memory layout between dromajo_cosim_server and its client
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * The client (libdromajo_cosim_client, linked into the testbench)
+ * creates a POSIX shared memory object, starts dromajo_cosim_server
+ * with its name, and writes one DromajoIpcMsg per dromajo_cosim_* call
+ * into a single producer, single consumer ring.  Steps and traps do not
+ * wait for the server: the first failing step is published in
+ * exit_code and returned by the following calls.  Calls with a result
+ * (memory overrides, snapshots, thread sync) wait until the server has
+ * consumed the whole ring and read the result.  The outcome of each
+ * step goes to the results slot of its message, which
+ * dromajo_cosim_step_batch reads back when it is asked for them.
+ */
+#ifndef DROMAJO_COSIM_IPC_H
+#define DROMAJO_COSIM_IPC_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "dromajo_cosim.h"
+
+#define DROMAJO_IPC_MAGIC   "DROMAJOI"
+#define DROMAJO_IPC_VERSION   2
+#define DROMAJO_IPC_RING      (1 << 16)  /* messages */
+#define DROMAJO_IPC_UNCHECKED INT32_MIN /* result of a step after the first failure */
+
+enum {
+    DROMAJO_IPC_STEP,
+    DROMAJO_IPC_RAISE_TRAP,
+    DROMAJO_IPC_OVERRIDE_MEM,
+    DROMAJO_IPC_SNAPSHOT,
+    DROMAJO_IPC_RESTORE,
+    DROMAJO_IPC_SNAPSHOT_FREE,
+    DROMAJO_IPC_THREADS_START,
+    DROMAJO_IPC_THREADS_SYNC,
+    DROMAJO_IPC_THREADS_STOP,
+    DROMAJO_IPC_FINI,
+};
+
+enum {
+    DROMAJO_IPC_STARTING,
+    DROMAJO_IPC_READY,
+    DROMAJO_IPC_FAILED, /* dromajo_cosim_init failed */
+    DROMAJO_IPC_DONE,
+};
+
+typedef struct {
+    uint16_t kind;
+    uint8_t  check;
+    uint8_t  size_log2;
+    int32_t  hartid;
+    uint32_t insn;
+    uint64_t addr;  /* pc, physical address, or snapshot */
+    uint64_t value; /* wdata, memory value, or trap cause */
+    uint64_t mstatus;
+} DromajoIpcMsg;
+
+struct DromajoIpc {
+    char     magic[8];
+    uint32_t version;
+
+    std::atomic<uint32_t> state;
+
+    /* Written by the client */
+    alignas(64) std::atomic<uint64_t> head;
+
+    /* Written by the server */
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<int32_t> exit_code; /* of the first failing step */
+    int64_t              result;    /* of the last call with a result */
+
+    alignas(64) DromajoIpcMsg ring[DROMAJO_IPC_RING];
+
+    /* Written by the server, results[i] is the outcome of the step in ring[i] */
+    alignas(64) dromajo_cosim_result_t results[DROMAJO_IPC_RING];
+};
+
+#endif
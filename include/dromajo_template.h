@@ -211,6 +211,34 @@ static inline uintx_t glue(mulhsu, XLEN)(intx_t a, uintx_t b) {
 #define NEXT_INSN  \
     code_ptr += 4; \
     break
+
+/* Ends the basic block at a transfer to s->pc, icount instructions in */
+#ifdef SIMPOINT_BB
+#define BBV_JUMP_AT(icount)                                \
+    do {                                                   \
+        if (unlikely(s->bbv != NULL))                      \
+            bbv_jump(s->bbv, s->pc, (icount), roi_region); \
+    } while (0)
+#else
+#define BBV_JUMP_AT(icount) \
+    do {                    \
+    } while (0)
+#endif
+/* For the instruction that is running, or a trap that leaves through done_interp */
+#define BBV_JUMP() BBV_JUMP_AT(GET_INSN_COUNTER() + 1)
+
+#ifdef LIVECACHE
+#define TRACK_IFETCH()                                                          \
+    do {                                                                        \
+        if (unlikely((s->pc >> s->livecache_ishift) != s->livecache_iline))    \
+            track_ifetch(s, s->pc);                                             \
+    } while (0)
+#else
+#define TRACK_IFETCH() \
+    do {               \
+    } while (0)
+#endif
+
 #define JUMP_INSN(kind)            \
     do {                           \
         code_ptr          = NULL;  \
@@ -218,9 +246,17 @@ static inline uintx_t glue(mulhsu, XLEN)(intx_t a, uintx_t b) {
         code_to_pc_addend = s->pc; \
         s->info           = kind;  \
         s->next_addr      = s->pc; \
+        BBV_JUMP();                \
         goto jump_insn;            \
     } while (0)
 
+/* A taken branch ends the block, its HPM event costs nothing on the fast path */
+#define BRANCH_INSN()                     \
+    do {                                  \
+        s->hpm_event[HPM_BRANCH_TAKEN]++; \
+        JUMP_INSN(ctf_taken_branch);      \
+    } while (0)
+
 #define chkfp32 glue(chkfp32, XLEN)
 
 static uint32_t chkfp32(target_ulong a) {
@@ -255,6 +291,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
     int32_t  rm;
 #endif
     int insn_executed               = 0;
+    int hpm_class                   = -1; /* class counted at the last fetch, see hpm_insn_class */
     s->most_recently_written_reg    = -1;
     s->most_recently_written_fp_reg = -1;
     s->info                         = ctf_nop;
@@ -267,6 +304,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
     if (unlikely(((s->mip & s->mie) != 0) && (s->machine->common.pending_interrupt != -1 || !s->machine->common.cosim))) {
         if (raise_interrupt(s)) {
             --insn_counter_addend;
+            BBV_JUMP();
             goto done_interp;
         }
     }
@@ -287,22 +325,6 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
 
         ++insn_executed;
 
-        /* Handled any breakpoint triggers in order (note, we
-         * precompute the mask and pattern to lower some of the
-         * cost). */
-        target_ulong t_mctl  = MCONTROL_EXECUTE | (MCONTROL_U << s->priv);
-        target_ulong t_mask  = ((target_ulong)0xF << 60) | t_mctl;
-        target_ulong t_match = ((target_ulong)0x2 << 60) | t_mctl;
-
-        for (int i = 0; i < MAX_TRIGGERS; ++i)
-            if ((s->tdata1[i] & t_mask) != t_match && s->tdata2[i] == s->pc) {
-                --insn_counter_addend;
-                s->pending_exception = CAUSE_BREAKPOINT;
-                s->pending_tval      = 0;
-                raise_exception2(s, s->pending_exception, s->pending_tval);
-                goto done_interp;
-            }
-
         if (unlikely(code_ptr >= code_end)) {
             uint32_t     tlb_idx;
             uint16_t     insn_high;
@@ -311,6 +333,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
             /* check pending interrupts */
             if (unlikely(((s->mip & s->mie) != 0) && (s->machine->common.pending_interrupt != -1 || !s->machine->common.cosim))) {
                 if (raise_interrupt(s)) {
+                    BBV_JUMP_AT(GET_INSN_COUNTER());
                     goto the_end;
                 }
             }
@@ -330,8 +353,10 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                     insn = *(uint16_t *)code_ptr;
                     if ((insn & 3) == 3) {
                         /* instruction is half way between two pages */
-                        if (unlikely(target_read_insn_u16(s, &insn_high, addr + 2)))
+                        if (unlikely(target_read_insn_u16(s, &insn_high, addr + 2))) {
+                            hpm_class = -1;
                             goto mmu_exception;
+                        }
                         insn |= insn_high << 16;
                     }
                 } else {
@@ -339,13 +364,32 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                 }
 
             } else {
-                if (unlikely(target_read_insn_slow(s, &insn, 32, addr)))
+                /* Pages with an execute trigger never hit the TLB, see trigger_page */
+                if (unlikely(s->trigger_exec) && trigger_hit(s, addr)) {
+                    --insn_counter_addend;
+                    s->pending_exception = CAUSE_BREAKPOINT;
+                    s->pending_tval      = 0;
+                    raise_exception2(s, s->pending_exception, s->pending_tval);
+                    BBV_JUMP();
+                    goto done_interp;
+                }
+                if (unlikely(target_read_insn_slow(s, &insn, 32, addr))) {
+                    hpm_class = -1;
                     goto mmu_exception;
+                }
+            }
+
+            /* Every instruction comes this way while a counter needs its class */
+            if (unlikely(s->hpm_classify)) {
+                code_end  = code_ptr;
+                hpm_class = hpm_insn_class(insn);
+                s->hpm_event[hpm_class]++;
             }
         } else {
             /* fast path */
             insn = get_insn32(code_ptr);
         }
+        TRACK_IFETCH();
 
         opcode = insn & 0x7f;
         rd     = (insn >> 7) & 0x1f;
@@ -579,7 +623,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                                9);
                     if (read_reg(rs1) == 0) {
                         s->pc = (intx_t)(GET_PC() + imm);
-                        JUMP_INSN(ctf_taken_branch);
+                        BRANCH_INSN();
                     }
                     break;
                 case 7: /* c.bnez */
@@ -589,7 +633,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                                9);
                     if (read_reg(rs1) != 0) {
                         s->pc = (intx_t)(GET_PC() + imm);
-                        JUMP_INSN(ctf_taken_branch);
+                        BRANCH_INSN();
                     }
                     break;
                 default: goto illegal_insn;
@@ -811,7 +855,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                     }
 
                     s->pc = (intx_t)(GET_PC() + imm);
-                    JUMP_INSN(ctf_taken_branch);
+                    BRANCH_INSN();
                 }
                 NEXT_INSN;
             case 0x03: /* load */
@@ -1655,9 +1699,12 @@ exception:
              * counted in minstret */
             --insn_counter_addend;
             --insn_executed;
+            if (unlikely(hpm_class >= 0) && s->hpm_classify)
+                s->hpm_event[hpm_class]--;
         }
 
         raise_exception2(s, s->pending_exception, s->pending_tval);
+        BBV_JUMP();
     }
     /* we exit because XLEN may have changed */
 
@@ -34,6 +34,9 @@
 bool elf64_is_riscv64(const uint8_t *image, size_t image_size);
 bool elf64_find_global(const uint8_t *image, size_t image_size, const char *key, uint64_t *value);
 
+typedef void (*Elf64SymbolFunc)(void *opaque, const char *name, uint64_t addr, uint64_t size);
+int elf64_for_each_function(const uint8_t *image, size_t image_size, Elf64SymbolFunc fn, void *opaque);
+
 uint64_t elf64_get_entrypoint(const uint8_t *image);
 
 #endif
@@ -0,0 +1,44 @@
+/*
+ * GDB remote serial protocol server
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --gdbinit PORT makes dromajo wait for gdb on PORT and run the target
+ * under it.  Each hart is a thread (hart i is thread i + 1); registers
+ * and memory are those of the thread gdb selected, memory being read
+ * and written through its MMU.  While the target runs, the connection
+ * is only polled between quanta of steps, so an attached debugger
+ * costs next to nothing until a breakpoint, a watchpoint or a ^C stops
+ * the target.  Reverse execution is described in gdb_stub.cpp.
+ */
+#ifndef GDB_STUB_H
+#define GDB_STUB_H
+
+typedef struct GdbStub GdbStub;
+struct RISCVMachine;
+
+/*
+ * Waits for gdb to connect on port, NULL after printing why.  rewind
+ * is the INTERVAL[:DEPTH] of --gdb_rewind, or NULL for the default.
+ */
+GdbStub *gdb_stub_open(struct RISCVMachine *m, int port, const char *rewind);
+/*
+ * Runs the target under gdb until the session ends.  Returns true if
+ * gdb detached and the target is to go on by itself.
+ */
+bool gdb_stub_run(GdbStub *g);
+void gdb_stub_close(GdbStub *g);
+
+#endif
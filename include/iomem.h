@@ -116,7 +116,9 @@ static inline void phys_mem_set_dirty_bit(PhysMemoryRange *pr, size_t offset) {
         page_index     = offset >> DEVRAM_PAGE_SIZE_LOG2;
         mask           = 1 << (page_index & 0x1f);
         dirty_bits_ptr = pr->dirty_bits + (page_index >> 5);
-        *dirty_bits_ptr |= mask;
+        /* Harts may store from several threads, see dromajo_cosim_threads_start */
+        if (!(*dirty_bits_ptr & mask))
+            __atomic_fetch_or(dirty_bits_ptr, mask, __ATOMIC_RELAXED);
     }
 }
 
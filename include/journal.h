@@ -0,0 +1,98 @@
+/*
+ * Journal of the external inputs of a run
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Everything else in a run is a function of the initial state (time
+ * is derived from mcycle and block devices complete synchronously),
+ * so recording what comes from outside with the position it arrived
+ * at is enough to run it again bit for bit.  --journal_record FILE
+ * writes:
+ *
+ *   console bytes handed to a UART read
+ *   packets handed to the virtio network device
+ *   and under cosim, what the DUT imposed on the model: interrupts,
+ *   register values of MMIO loads and CSR reads, failed SCs, and
+ *   memory writes
+ *
+ * and --journal_replay FILE feeds them back at the same positions,
+ * ignoring the host console and network.
+ *
+ * The file starts with JOURNAL_MAGIC, a 32 bit version and 32 bit
+ * flags (JOURNAL_F_*), followed by one record per input:
+ *
+ *   kind     byte, one of JOURNAL_*
+ *   hart     byte
+ *   pos      zigzag varint delta from the previous record of the hart;
+ *            the position is the number of instructions the hart had
+ *            retired (insn_counter) when the input arrived
+ *   arg      byte: register, interrupt cause or size_log2, for the
+ *            kinds that have one
+ *   addr     varint physical address (JOURNAL_MEM)
+ *   value    varint (JOURNAL_INTERRUPT excepted)
+ *   data     varint length and the bytes (JOURNAL_CONSOLE, JOURNAL_NET)
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "virtio.h"
+
+#define JOURNAL_MAGIC   "DROMAJOJ"
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_F_COSIM 0x01 /* recorded under cosim, interrupts come from the journal */
+
+enum {
+    JOURNAL_CONSOLE,   /* data */
+    JOURNAL_NET,       /* data */
+    JOURNAL_INTERRUPT, /* arg cause */
+    JOURNAL_REG,       /* arg register, value */
+    JOURNAL_SC_FAIL,   /* arg register, value; the SC is skipped */
+    JOURNAL_MEM,       /* arg size_log2, addr, value */
+};
+
+typedef struct Journal Journal;
+struct RISCVMachine;
+
+/* Both return NULL after printing why */
+Journal *journal_open_record(const char *filename);
+Journal *journal_open_replay(const char *filename);
+void     journal_close(Journal *j);
+bool     journal_replaying(const Journal *j);
+
+/* Returns the console to give the devices in place of cs */
+CharacterDevice *journal_console(Journal *j, CharacterDevice *cs);
+/* Once the machine is built, also hooks its network device */
+void journal_attach(Journal *j, struct RISCVMachine *m);
+void journal_set_cosim(Journal *j);
+/* The machine went back in time, replay from the positions of its harts */
+void journal_seek(Journal *j);
+
+/*
+ * Around each instruction of a hart.  When replaying, journal_step_begin
+ * applies the inputs due and returns true if it retired the instruction
+ * itself (a failed SC).
+ */
+bool journal_step_begin(Journal *j, int hartid);
+void journal_step_end(Journal *j, int hartid);
+
+/* Inputs the cosim API gets from the DUT */
+void journal_interrupt(Journal *j, int hartid, int cause);
+void journal_reg(Journal *j, int hartid, int kind, int regno, uint64_t value);
+void journal_mem(Journal *j, int hartid, uint64_t paddr, uint64_t value, int size_log2);
+
+#endif
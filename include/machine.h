@@ -215,10 +215,37 @@ typedef struct VirtMachine {
     uint64_t maxinsns;
     uint64_t trace;
 
+    /* Binary trace of the retired instructions, NULL for text */
+    struct TraceWriter *trace_writer;
+
+    /* Guest profiler, NULL when not profiling */
+    struct Profile *profile;
+
+    /* Periodic sampling, sample_period is 0 when disabled */
+    uint64_t sample_period;
+    uint64_t sample_warmup;
+    uint64_t sample_window;
+    bool     sample_trace;
+
     /* For co-simulation only, they are -1 if nothing is pending. */
     bool cosim;
     int  pending_interrupt;
     int  pending_exception;
+
+    /* Per hart checking threads, NULL when checking on the caller */
+    struct CosimThreads *cosim_threads;
+
+    /* Replay of the calls before a mismatch, cosim_rewind_interval is 0 when disabled */
+    uint64_t            cosim_rewind_interval;
+    int                 cosim_rewind_depth;
+    char *              cosim_rewind_log;
+    struct CosimRewind *cosim_rewind;
+
+    /* External inputs recorded or replayed, NULL when neither */
+    struct Journal *journal;
+
+    /* Host statistics, NULL without --stats */
+    struct Stats *stats;
 } VirtMachine;
 
 int load_file(uint8_t **pbuf, const char *filename);
@@ -252,6 +279,9 @@ VGAState *pci_vga_init(PCIBus *bus, FBDevice *fb_dev, int width, int height, con
 
 /* block_net.c */
 BlockDevice *block_device_init_http(const char *url, int max_cache_size_kb, void (*start_cb)(void *opaque), void *start_opaque);
+typedef struct VirtMachineSnapshot VirtMachineSnapshot;
+typedef struct VirtMachineRewind   VirtMachineRewind;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -259,6 +289,18 @@ RISCVMachine *virt_machine_main(int argc, char **argv);
 void          virt_machine_end(RISCVMachine *s);
 void          virt_machine_serialize(RISCVMachine *m, const char *dump_name);
 void          virt_machine_deserialize(RISCVMachine *m, const char *dump_name);
+VirtMachineSnapshot *virt_machine_snapshot(RISCVMachine *m);
+void                 virt_machine_restore(RISCVMachine *m, VirtMachineSnapshot *snap);
+void                 virt_machine_snapshot_free(RISCVMachine *m, VirtMachineSnapshot *snap);
+VirtMachineRewind *  virt_machine_rewind_init(RISCVMachine *m, int depth, uint64_t tag);
+bool                 virt_machine_rewind_checkpoint(RISCVMachine *m, VirtMachineRewind *rw, uint64_t tag);
+void                 virt_machine_rewind_forget(RISCVMachine *m, VirtMachineRewind *rw, uint64_t tag);
+int                  virt_machine_rewind_count(const VirtMachineRewind *rw);
+uint64_t             virt_machine_rewind_tag(VirtMachineRewind *rw, int i);
+void                 virt_machine_rewind_drop(RISCVMachine *m, VirtMachineRewind *rw, int i);
+void                 virt_machine_rewind(RISCVMachine *m, VirtMachineRewind *rw, int i);
+void                 virt_machine_rewind_free(RISCVMachine *m, VirtMachineRewind *rw);
+void                 virt_machine_set_watch(RISCVMachine *m, const uint64_t *paddr, const uint64_t *len, int n);
 BOOL          virt_machine_run(RISCVMachine *m, int hartid);
 uint64_t      virt_machine_get_pc(RISCVMachine *m, int hartid);
 uint64_t      virt_machine_get_reg(RISCVMachine *m, int hartid, int rn);
@@ -0,0 +1,47 @@
+/*
+ * Sampling guest profiler
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --profile FILE[:PERIOD[:VMLINUX]] samples each hart every PERIOD
+ * retired instructions (default 10007, a prime so that loops do not
+ * alias with it).  A sample is the privilege level, the pc and the
+ * return addresses of a shadow call stack that follows the RAS hints
+ * of the jumps (see ctf_compute_hint), one stack per privilege level.
+ * Addresses are named after the function symbols of the ELF being run
+ * and of VMLINUX, if given.
+ *
+ * At the end of the run FILE gets one "[priv];outer;...;inner count"
+ * line per distinct stack, the folded format of flamegraph.pl, and
+ * FILE.functions the instructions spent in each function (samples
+ * times PERIOD), in the function itself and with its callees.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Profile Profile;
+
+Profile *profile_open(const char *filename, uint64_t period, int ncpus);
+/* Adds the function symbols of an ELF image, false if it has none */
+bool profile_add_symbols(Profile *p, const uint8_t *image, size_t image_size);
+/* Called after each retired instruction, ctf is the RISCVCTFInfo of the hart */
+void profile_retire(Profile *p, int hartid, int priv, uint64_t pc, uint32_t insn, int ctf);
+/* Writes the profile out and frees p */
+void profile_close(Profile *p);
+
+#endif
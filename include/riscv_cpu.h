@@ -142,6 +142,9 @@ typedef uint128_t mem_uint_t;
 #define MAX_TRIGGERS 1  // As of right now, one trigger register
 #endif
 
+#define WATCH_READ  1
+#define WATCH_WRITE 2
+
 /* HPM masks
 
    Follows Rocket here; the lower 8-bits are reserved in any
@@ -150,11 +153,54 @@ typedef uint128_t mem_uint_t;
    possible events, i.e. 64-8, where each bit represents the mask for
    a particular event in an event-set.
 
-   Dromajo currently has 7 event-sets and not all 56-events are
-   implemented for each set.
+   Dromajo implements the 3 event-sets below, with the 24 events of
+   HPM_EVENT_EVENTMASK each.  A counter selecting several events of a
+   set counts their sum.  Set 0 and the TLB events of set 2 are
+   numbered as in Rocket.
 */
 #define HPM_EVENT_SETMASK   0x00000007
 #define HPM_EVENT_EVENTMASK 0xffffff00
+#define HPM_EVENT_SETS      3
+#define HPM_SET_EVENTS      24
+
+/* Index of an event in hpm_event, the bit of mhpmevent is 8 + (index % 24) */
+enum {
+    /* Set 0: retired instructions by class, and exceptions */
+    HPM_EXCEPTION = 0,
+    HPM_LOAD,
+    HPM_STORE,
+    HPM_AMO,
+    HPM_SYSTEM,
+    HPM_ARITH,
+    HPM_BRANCH,
+    HPM_JAL,
+    HPM_JALR,
+    HPM_MUL,
+    HPM_DIV,
+    HPM_FP_LOAD,
+    HPM_FP_STORE,
+    HPM_FP_ADD,
+    HPM_FP_MUL,
+    HPM_FP_MADD,
+    HPM_FP_DIVSQRT,
+    HPM_FP_OTHER,
+
+    /* Set 1: control flow */
+    HPM_BRANCH_TAKEN = HPM_SET_EVENTS,
+    HPM_INTERRUPT,
+
+    /* Set 2: memory system, the caches are the LiveCache levels */
+    HPM_ICACHE_MISS = 2 * HPM_SET_EVENTS,
+    HPM_DCACHE_MISS,
+    HPM_ITLB_MISS = 2 * HPM_SET_EVENTS + 3,
+    HPM_DTLB_MISS,
+    HPM_PAGE_WALK,
+    HPM_ICACHE_HIT,
+    HPM_DCACHE_HIT,
+    HPM_LLC_MISS,
+
+    HPM_EVENTS = HPM_EVENT_SETS * HPM_SET_EVENTS
+};
 
 typedef struct {
     target_ulong vaddr;
@@ -174,6 +220,14 @@ typedef enum {
     ctf_taken_jalr_pop_push,
 } RISCVCTFInfo;
 
+/* Host statistics of a hart (see stats.h), loading a snapshot keeps them */
+typedef struct {
+    uint64_t translate; /* riscv_cpu_get_phys_addr calls */
+    uint64_t mmio_read; /* device accesses */
+    uint64_t mmio_write;
+    uint64_t rewound;   /* instructions undone by loading a snapshot */
+} RISCVCPUHostStats;
+
 typedef struct RISCVCPUState {
     RISCVMachine *machine;
     target_ulong  pc;
@@ -233,6 +287,7 @@ typedef struct RISCVCPUState {
     target_ulong tdata1[MAX_TRIGGERS];
     target_ulong tdata2[MAX_TRIGGERS];
     target_ulong tdata3[MAX_TRIGGERS];
+    int          trigger_exec; /* armed execute triggers, their pages stay out of tlb_code */
 
     target_ulong mhpmevent[32];
 
@@ -286,6 +341,32 @@ typedef struct RISCVCPUState {
 
     bool ignore_sbi_shutdown;
 
+    /* Accesses to the pages of virt_machine_set_watch since watch_access
+       was last cleared: WATCH_READ/WATCH_WRITE and the bytes they span */
+    int          watch_access;
+    target_ulong watch_paddr;
+    int          watch_size;
+
+    /* HPM event totals and, for each mhpmcounter, its value minus the
+       total of its events (see hpm_total) */
+    uint64_t hpm_event[HPM_EVENTS];
+    uint64_t hpm_offset[32];
+    bool     hpm_classify; /* some counter counts instruction classes */
+
+    /* The TLB misses and page walks are in hpm_event */
+    RISCVCPUHostStats host_stats;
+
+#ifdef SIMPOINT_BB
+    /* Basic block vector profile, NULL when not collecting */
+    struct BBVProfile *bbv;
+#endif
+
+#ifdef LIVECACHE
+    /* Last fetched line, fetches in the same line are not tracked */
+    uint64_t livecache_iline;
+    int      livecache_ishift;
+#endif
+
     /* Extension state, not used by Dromajo itself */
     void *ext_cpu_state;
 } RISCVCPUState;
@@ -300,6 +381,7 @@ uint32_t       riscv_cpu_get_mip(RISCVCPUState *s);
 BOOL           riscv_cpu_get_power_down(RISCVCPUState *s);
 uint32_t       riscv_cpu_get_misa(RISCVCPUState *s);
 void           riscv_cpu_flush_tlb_write_range_ram(RISCVCPUState *s, uint8_t *ram_ptr, size_t ram_size);
+void           riscv_cpu_flush_tlb(RISCVCPUState *s);
 void           riscv_set_pc(RISCVCPUState *s, uint64_t pc);
 uint64_t       riscv_get_pc(RISCVCPUState *s);
 uint64_t       riscv_get_reg(RISCVCPUState *s, int rn);
@@ -339,6 +421,16 @@ PHYS_MEM_READ_WRITE(64, uint64_t)
 
 #undef PHYS_MEM_READ_WRITE
 
+/* Loads as the interpreter does them, through the data TLB */
+#define TARGET_READ_EXPORT(size, uint_type) int riscv_target_read_u##size(RISCVCPUState *, uint_type *, target_ulong);
+
+TARGET_READ_EXPORT(8, uint8_t)
+TARGET_READ_EXPORT(16, uint16_t)
+TARGET_READ_EXPORT(32, uint32_t)
+TARGET_READ_EXPORT(64, uint64_t)
+
+#undef TARGET_READ_EXPORT
+
 typedef enum {
     ACCESS_READ,
     ACCESS_WRITE,
@@ -62,7 +62,19 @@ struct RISCVMachine {
     RISCVMachineHooks hooks;
     PhysMemoryMap *   mem_map;
 #ifdef LIVECACHE
-    LiveCache *llc;
+    LiveCache *llc;               /* shared last level */
+    LiveCache *l1i[MAX_CPUS];     /* private levels, NULL when not modeled */
+    LiveCache *l1d[MAX_CPUS];
+    bool       llc_enabled; /* off while sampling fast-forwards */
+
+    LiveCacheQueue *llc_queue; /* accesses not applied to the levels yet */
+
+    /* HPM cache events of each hart, fetches then data, counted by the
+       consumer of llc_queue and by livecache_sync for the hits that
+       were not queued */
+    uint64_t llc_hit[MAX_CPUS][2];
+    uint64_t llc_miss[MAX_CPUS][2];
+    uint64_t llc_shared_miss[MAX_CPUS];
 #endif
     RISCVCPUState *cpu_state[MAX_CPUS];
     int            ncpus;
@@ -86,6 +98,8 @@ struct RISCVMachine {
     uint64_t    mmio_end;
     AddressSet *mmio_addrset;
     uint64_t    mmio_addrset_size;
+    AddressSet *mmio_index; /* both of the above, sorted and merged */
+    int         mmio_index_size;
 
     /* Reset vector */
     uint64_t reset_vector;
@@ -105,6 +119,16 @@ struct RISCVMachine {
     /* Clear mimpid, marchid, mvendorid */
     bool clear_ids;
 
+    /* In-process snapshots still alive (see virt_machine_snapshot) */
+    VirtMachineSnapshot *snapshots;
+
+    /* Checkpoints kept by virt_machine_rewind_init, NULL if none */
+    VirtMachineRewind *rewind;
+
+    /* Physical page numbers of virt_machine_set_watch, sorted */
+    uint64_t *watch_page;
+    int       watch_page_count;
+
     /* Extension state, not used by Dromajo itself */
     void *ext_state;
 };
@@ -138,4 +162,17 @@ struct RISCVMachine {
 #endif
 #define UART0_IRQ 3
 
+bool riscv_machine_is_mmio(const RISCVMachine *m, uint64_t paddr);
+int  riscv_machine_override_mem(RISCVMachine *m, uint64_t paddr, uint64_t val, int size_log2);
+/* Registers the host statistics of the harts and devices (see stats.h) */
+void virt_machine_add_stats(RISCVMachine *m, struct Stats *st);
+
+#ifdef LIVECACHE
+void livecache_init_ring(RISCVMachine *m, int line_shift, bool threaded);
+void livecache_end_ring(RISCVMachine *m);
+void livecache_ring_publish(RISCVMachine *m);
+void livecache_sync(RISCVMachine *m);
+void livecache_after_fork(RISCVMachine *m);
+#endif
+
 #endif
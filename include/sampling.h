@@ -0,0 +1,49 @@
+/*
+ * SMARTS style periodic sampling
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Every sample period is split in three phases:
+ *
+ *   fast-forward  period - warmup - window instructions, run in large
+ *                 interpreter chunks with the LiveCache off
+ *   warmup        warmup instructions with the LiveCache tracking
+ *   window        window instructions, the detailed part of the
+ *                 sample: a checkpoint is written at its start (the
+ *                 LiveCache warmup goes with it) or it is traced
+ *
+ * Per-window LiveCache statistics are written to dromajo_sample.csv
+ * and summarized with a confidence interval at the end of the run.
+ */
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <stdint.h>
+
+typedef struct RISCVMachine RISCVMachine;
+
+typedef struct {
+    uint64_t start;      /* instruction count at the window start */
+    uint64_t insns;      /* instructions retired in the window */
+    uint64_t read_miss;  /* LiveCache misses in the window */
+    uint64_t write_miss;
+} SampleRecord;
+
+/* Called for each window instruction in trace mode, see iterate_core */
+typedef int (*SampleStepFunc)(RISCVMachine *m, int hartid);
+
+int sample_run(RISCVMachine *m, SampleStepFunc step);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * SimPoint basic block vector collection
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * The interpreter reports every taken control transfer (JUMP_INSN)
+ * with the target and the current instruction count.  The
+ * instructions since the previous transfer are credited to the block
+ * that started at the previous target, so nothing is done for
+ * straight-line code.  Blocks live in a flat open-addressing table
+ * keyed by block start and each interval is written as one
+ * "T:id:count ..." line through a large output buffer.
+ *
+ * In checkpoint mode each simpoint is handed to a forked writer so the
+ * run goes on while the checkpoint is serialized and validated.
+ */
+#ifndef SIMPOINT_H
+#define SIMPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    uint64_t key;   /* block start | 1, 0 for empty slots */
+    uint64_t count; /* instructions in the current interval */
+    uint32_t id;    /* 1.. in order of first appearance */
+} BBVEntry;
+
+typedef struct BBVProfile {
+    uint64_t interval;       /* instructions per interval */
+    uint64_t interval_insns; /* instructions counted in the current interval */
+
+    uint64_t block_start;  /* pc of the running block */
+    uint64_t block_icount; /* instruction count when it started */
+
+    BBVEntry *table;
+    uint32_t  table_mask; /* table size - 1, the size is a power of two */
+    uint32_t  n_entries;
+    uint32_t *touched; /* slots with a non zero count */
+    uint32_t  n_touched;
+
+    FILE *f;
+    char *buf;
+    int   buf_len;
+} BBVProfile;
+
+BBVProfile *bbv_init(const char *filename, uint64_t interval);
+void        bbv_end(BBVProfile *p);
+void        bbv_insert(BBVProfile *p, uint64_t pc, uint64_t count);
+void        bbv_dump_interval(BBVProfile *p);
+
+/* Checkpoint writers, see simpoint.cpp */
+typedef struct RISCVMachine RISCVMachine;
+void simpoint_checkpoint(RISCVMachine *m, const char *name);
+int  simpoint_checkpoint_wait(void);
+
+static inline uint32_t bbv_hash(uint64_t key) { return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32); }
+
+/*
+ * bbv_jump --
+ *
+ * Called from the interpreter on each taken control transfer.  Only
+ * the instructions retired inside the ROI are accounted.
+ */
+static inline void bbv_jump(BBVProfile *p, uint64_t target, uint64_t icount, int in_roi) {
+    uint64_t n = icount - p->block_icount;
+
+    /* block_start is 0 until the first transfer is seen */
+    if (in_roi && n && p->block_start) {
+        uint64_t  key = p->block_start | 1;
+        BBVEntry *e   = &p->table[bbv_hash(key) & p->table_mask];
+
+        if (e->key == key && e->count) {
+            e->count += n;
+        } else {
+            bbv_insert(p, p->block_start, n);
+        }
+
+        p->interval_insns += n;
+        if (p->interval_insns >= p->interval)
+            bbv_dump_interval(p);
+    }
+
+    p->block_start  = target;
+    p->block_icount = icount;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Host statistics
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --stats FILE[:SECONDS] writes how the simulator itself is doing to
+ * FILE as one JSON object: the host time spent in each phase of the
+ * run, the simulated MIPS and the counters registered with stats_add
+ * (slow path accesses, device accesses, virtio requests, LiveCache
+ * hits and misses...).  FILE is rewritten every SECONDS (default 10, 0
+ * for never), on SIGUSR1 and at the end of the run.
+ *
+ * The counters are the ones the simulator keeps anyway, so nothing is
+ * counted on the fast paths.  The run loops call stats_poll between
+ * steps, which looks at the clock every so many calls and writes FILE
+ * from there.  Only dromajo itself handles SIGUSR1 (stats_signals),
+ * which just sets stats_requested: libdromajo_cosim installs no signal
+ * handler or timer in the testbench.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "cutils.h"
+
+typedef struct Stats Stats;
+
+/* Set by SIGUSR1, cleared by stats_dump */
+extern volatile sig_atomic_t stats_requested;
+/* Calls of stats_poll left until it looks at the clock */
+extern uint32_t stats_poll_countdown;
+
+Stats *stats_open(const char *filename, int period);
+/* Dumps on SIGUSR1 too, until stats_close puts the old handler back */
+void stats_signals(Stats *st);
+/* Reports *counter as name, insns counters also make the MIPS */
+void stats_add(Stats *st, const char *name, const uint64_t *counter, bool insns);
+/* sync(opaque) is called before each dump to bring counters up to date */
+void stats_add_sync(Stats *st, void (*sync)(void *opaque), void *opaque);
+/* Charges the host time from now on to phase, a string that outlives st */
+void stats_phase(Stats *st, const char *phase);
+void stats_dump(Stats *st);
+/* Dumps if SIGUSR1 asked for it or the period is over */
+void stats_tick(Stats *st);
+/* Writes FILE out one last time and frees st */
+void stats_close(Stats *st);
+
+/* Called from the run loops */
+static inline void stats_poll(Stats *st) {
+    if (st && (unlikely(stats_requested) || unlikely(--stats_poll_countdown == 0)))
+        stats_tick(st);
+}
+
+#endif
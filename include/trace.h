@@ -0,0 +1,104 @@
+/*
+ * Binary trace of retired instructions
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * The file starts with TRACE_MAGIC and a 32 bit version, followed by
+ * one record per retired instruction:
+ *
+ *   flags    byte, see TRACE_F_*
+ *   context  hart and privilege bytes, when they differ from the
+ *            previous record (TRACE_F_CTX)
+ *   pc       zigzag varint delta from the next sequential pc of the
+ *            hart, only when the pc did not follow (TRACE_F_JUMP)
+ *   insn     2 bytes for compressed instructions (TRACE_F_RVC), else 4
+ *   result   xreg/freg: register byte and zigzag varint value
+ *            exception: varint cause and varint tval
+ *   mem      zigzag varint delta from the previous physical data
+ *            address of the hart (TRACE_F_MEM)
+ *
+ * Multi-byte fields are little endian, varints are LEB128.  Records
+ * are produced in large buffers that a thread writes out, so tracing
+ * does not wait on the file.  dromajo_trace converts a binary trace
+ * to the text format printed by dromajo.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC   "DROMAJOT"
+#define TRACE_VERSION 1
+
+#define TRACE_F_KIND 0x03 /* one of TRACE_KIND_* */
+#define TRACE_F_JUMP 0x04
+#define TRACE_F_RVC  0x08
+#define TRACE_F_MEM  0x10
+#define TRACE_F_CTX  0x20
+
+enum {
+    TRACE_KIND_NONE,
+    TRACE_KIND_XREG,
+    TRACE_KIND_FREG,
+    TRACE_KIND_EXCEPTION,
+};
+
+typedef struct {
+    int      hartid;
+    int      priv;
+    uint64_t pc;
+    uint32_t insn;
+    int      kind;
+    int      regno; /* xreg/freg written */
+    uint64_t value; /* register value, or tval of an exception */
+    int      cause;
+    bool     has_mem;
+    uint64_t mem_addr; /* physical address of the data access */
+} TraceRecord;
+
+/* Per hart state shared by the encoder and the decoder */
+typedef struct {
+    uint64_t next_pc;
+    uint64_t last_mem;
+} TraceHartState;
+
+#define TRACE_MAX_HARTS 256
+
+typedef struct TraceWriter TraceWriter;
+
+TraceWriter *trace_writer_open(const char *filename);
+void         trace_writer_write(TraceWriter *w, const TraceRecord *r);
+void         trace_writer_close(TraceWriter *w);
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    int            hartid;
+    int            priv;
+    TraceHartState hart[TRACE_MAX_HARTS];
+} TraceReader;
+
+/* Returns false if data is not a binary trace */
+bool trace_reader_init(TraceReader *rd, const void *data, size_t len);
+/* Returns 1 for a record, 0 at the end and -1 on a truncated record */
+int trace_reader_next(TraceReader *rd, TraceRecord *r);
+
+bool trace_insn_is_mem(uint32_t insn);
+/* The text format of dromajo, optionally with " mem 0x..." appended */
+void trace_print_text(FILE *f, const TraceRecord *r, bool with_mem);
+
+#endif
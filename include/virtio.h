@@ -64,6 +64,8 @@ typedef struct VIRTIODevice VIRTIODevice;
 #define VIRTIO_DEBUG_9P (1 << 1)
 
 void virtio_set_debug(VIRTIODevice *s, int debug_flags);
+/* Registers the host statistics of the virtio MMIO device at pr */
+bool virtio_add_stats(struct Stats *st, PhysMemoryRange *pr);
 
 /* block device */
 
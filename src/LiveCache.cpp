@@ -55,8 +55,10 @@
 // int)mreq->getAddr()); fprintf(stderr,##a); fprintf(stderr,"\n"); }while(0)
 #define MTRACE(a...)
 
-LiveCache::LiveCache(const std::string &_name, int size, uint64_t _mem_base, uint64_t _mem_size) : name(_name) {
-    cacheBank    = CacheType::create(size, 16, 64, "LRU", false);
+LiveCache::LiveCache(const std::string &_name, int size, int assoc, int line_size, const char *policy, uint64_t _mem_base,
+                     uint64_t _mem_size)
+    : name(_name) {
+    cacheBank    = CacheType::create(size, assoc, line_size, policy, false);
     lineSize     = cacheBank->getLineSize();
     lineSizeBits = log2i(lineSize);
     mem_base     = _mem_base;
@@ -93,110 +95,126 @@ LiveCache::~LiveCache() {
     cacheBank->destroy();
 }
 
-void LiveCache::read(uint64_t addr) {
+bool LiveCache::read(uint64_t addr) {
     if (addr<mem_base || addr>mem_end)
-      return; // only track between mem_base and mem_end
+      return true; // only track between mem_base and mem_end
 
     Line *l = cacheBank->findLine(addr);
     if (l) {
-        l->order = maxOrder++;
+        l->order = ++maxOrder;
         nReadHit++;
-        return;
+        return true;
     }
     nReadMiss++;
 
     l        = cacheBank->fillLine(addr);
     l->st    = false;
-    l->order = maxOrder++;
+    l->order = ++maxOrder;
+    l->setExclusive();
+
+    return false;
 }
 
-void LiveCache::write(uint64_t addr) {
+bool LiveCache::write(uint64_t addr) {
     if (addr<mem_base || addr>mem_end)
-      return; // only track between mem_base and mem_end
+      return true; // only track between mem_base and mem_end
 
     Line *l = cacheBank->findLine(addr);
     if (l) {
-        l->order = maxOrder++;
+        l->order = ++maxOrder;
         l->st    = true;
+        l->setModified();
 
         nWriteHit++;
-        return;
+        return true;
     }
     nWriteMiss++;
 
     l        = cacheBank->fillLine(addr);
     l->st    = true;
-    l->order = maxOrder++;
+    l->order = ++maxOrder;
+    l->setModified();
+
+    return false;
 }
 
-uint64_t *LiveCache::traverse(uint64_t &n_entries) {
-    // Creating an array of cache lines
-    Line *   arr[lineCount];
+uint64_t LiveCache::countLines() {
     uint64_t cnt = 0;
+
     for (uint64_t i = 0; i < lineCount; i++) {
-        if (cacheBank->getPLine(i) && cacheBank->getPLine(i)->order) {
-            arr[cnt] = cacheBank->getPLine(i);
+        Line *l = cacheBank->getPLine(i);
+        if (l && l->order && l->getTag())
             cnt++;
-        }
     }
-    mergeSort(arr, cnt);
 
-    uint64_t *addrs = (uint64_t *)malloc(sizeof(uint64_t) * cnt);
+    return cnt;
+}
 
-    // creating loads and stores arrays
-    uint64_t in = 0;
-    for (uint64_t i = 0; i < cnt; i++) {
-        if (!arr[i]->getTag())
-            continue;
-        if (arr[i]->st) {
-            addrs[in] = 1 | (uint64_t)cacheBank->calcAddr4Tag(arr[i]->getTag());
-        } else {
-            addrs[in] = (uint64_t)cacheBank->calcAddr4Tag(arr[i]->getTag());
-            assert((addrs[in] & 1) == 0);
-        }
-        in++;
+// Min-heap on order, used to keep the most recent lines
+void LiveCache::heapDown(Line **heap, uint64_t n, uint64_t i) {
+    for (;;) {
+        uint64_t c = 2 * i + 1;
+        if (c >= n)
+            return;
+        if (c + 1 < n && heap[c + 1]->order < heap[c]->order)
+            c++;
+        if (heap[i]->order <= heap[c]->order)
+            return;
+        Line *t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i       = c;
     }
+}
 
-    n_entries = in;
-
-    return addrs;
+void LiveCache::heapUp(Line **heap, uint64_t i) {
+    while (i && heap[(i - 1) / 2]->order > heap[i]->order) {
+        Line *t           = heap[i];
+        heap[i]           = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+        i                 = (i - 1) / 2;
+    }
 }
 
-void LiveCache::mergeSort(Line **arr, uint64_t len) {
-    // in case we had one element
-    if (len < 2)
-        return;
-
-    // in case we had two elements
-    if (len == 2) {
-        if (arr[0]->order > arr[1]->order) {
-            // swap
-            Line *t = arr[0];
-            arr[0]  = arr[1];
-            arr[1]  = t;
+uint64_t LiveCache::traverse(uint32_t *out, uint64_t max) {
+    if (max == 0)
+        return 0;
+
+    // Keep the max most recent lines: a min-heap whose root is the oldest kept
+    Line **  heap = (Line **)malloc(sizeof(Line *) * max);
+    uint64_t n    = 0;
+    assert(heap);
+
+    for (uint64_t i = 0; i < lineCount; i++) {
+        Line *l = cacheBank->getPLine(i);
+        if (!l || !l->order || !l->getTag())
+            continue;
+
+        if (n < max) {
+            heap[n] = l;
+            heapUp(heap, n++);
+        } else if (l->order > heap[0]->order) {
+            heap[0] = l;
+            heapDown(heap, n, 0);
         }
-        return;
     }
 
-    // divide and conquer
-    uint64_t mid = (uint64_t)(len / 2);
-    Line *   arr1[mid];
-    Line *   arr2[len - mid];
-    for (uint64_t i = 0; i < mid; i++) arr1[i] = arr[i];
-    for (uint64_t i = 0; i < len - mid; i++) arr2[i] = arr[mid + i];
-    mergeSort(arr1, mid);
-    mergeSort(arr2, len - mid);
-
-    // merging
-    uint64_t m = 0;
-    uint64_t n = 0;
-    for (uint64_t i = 0; i < len; i++) {
-        if (n >= (len - mid) || (m < mid && arr1[m]->order <= arr2[n]->order)) {
-            arr[i] = arr1[m];
-            m++;
-        } else {
-            arr[i] = arr2[n];
-            n++;
-        }
+    // Popping the root gives the lines oldest first
+    uint64_t cnt = n;
+    for (uint64_t i = 0; i < cnt; i++) {
+        Line *   l    = heap[0];
+        uint64_t addr = (uint64_t)cacheBank->calcAddr4Tag(l->getTag());
+
+        assert((addr & 1) == 0);
+        if (l->st)
+            addr |= 1;
+        *out++ = addr & 0xFFFFFFFF;
+        *out++ = addr >> 32;
+
+        heap[0] = heap[--n];
+        heapDown(heap, n, 0);
     }
+    free(heap);
+
+    return cnt;
 }
@@ -0,0 +1,383 @@
+/*
+ * Dromajo simulator benchmark
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Runs dromajo on the small guest kernels of tests/bench, each of which
+ * stresses one part of the simulator (integer loop, pointer chasing,
+ * FP, TLB misses, MMIO, compressed instructions, AMOs), and reports the
+ * host MIPS, the wall time and the rate of the slow paths per thousand
+ * instructions as read from the --stats file.  Given a baseline (an
+ * earlier output of dromajo_bench), it fails when a kernel got slower
+ * or takes a slow path more often than the tolerance allows.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef DROMAJO_BENCH_DIR
+#define DROMAJO_BENCH_DIR "tests/bench"
+#endif
+
+static const char *all_kernels[] = {"intloop", "ptrchase", "fp", "tlb", "mmio", "rvc", "amo"};
+
+/* Rates reported per thousand instructions, from the hartN.* counters */
+static const struct {
+    const char *name;
+    const char *counters[2];
+} rates[] = {
+    {"translate_pki", {"translate"}},
+    {"itlb_miss_pki", {"itlb_miss"}},
+    {"dtlb_miss_pki", {"dtlb_miss"}},
+    {"page_walk_pki", {"page_walk"}},
+    {"mmio_pki", {"mmio_read", "mmio_write"}},
+    {"exception_pki", {"exception"}},
+};
+
+/* Values slack added to the rate tolerance, so that 0 may become 0.001 */
+#define RATE_SLACK 0.001
+
+typedef std::map<std::string, double> BenchResult;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s {options} [kernel...]\n"
+            "       -d dromajo       simulator to run (default the one next to %s)\n"
+            "       -k dir           directory of the kernels (default %s)\n"
+            "       -n insns         instructions per run (default 10000000)\n"
+            "       -r runs          runs per kernel, the fastest is kept (default 3)\n"
+            "       -o file          write the results to file (default stdout)\n"
+            "       -b file          compare with a baseline, an earlier output (may be repeated)\n"
+            "       -t percent       tolerance of the comparison (default 10)\n"
+            "kernels: intloop ptrchase fp tlb mmio rvc amo (default all)\n",
+            prog,
+            prog,
+            DROMAJO_BENCH_DIR);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * read_stats --
+ *
+ * Picks "mips" and the hartN.* counters, summed over the harts, out of
+ * a --stats file.  The file has one value per line.
+ */
+static bool read_stats(const char *filename, double &mips, std::map<std::string, double> &counters) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    char line[256];
+    bool found = false;
+    while (fgets(line, sizeof line, f)) {
+        char               name[64];
+        unsigned           hart;
+        unsigned long long value;
+
+        if (sscanf(line, " \"mips\": %lf", &mips) == 1)
+            found = true;
+        else if (sscanf(line, " \"hart%u.%63[^\"]\": %llu", &hart, name, &value) == 3)
+            counters[name] += value;
+    }
+    fclose(f);
+
+    if (!found)
+        fprintf(stderr, "%s: no mips found\n", filename);
+    return found;
+}
+
+/*
+ * run_kernel --
+ *
+ * Runs dromajo on one kernel with its output thrown away, returns the
+ * wall time or a negative value if it failed.
+ */
+static double run_kernel(const char *dromajo, const char *kernel, const char *insns, const char *stats) {
+    std::string stats_arg = std::string(stats) + ":0";
+    double      start     = now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        const char *argv[] = {dromajo, "--maxinsns", insns, "--stats", stats_arg.c_str(), kernel, NULL};
+        execv(dromajo, (char **)argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s %s: failed (status 0x%x)\n", dromajo, kernel, status);
+        return -1;
+    }
+    return now() - start;
+}
+
+static bool bench_kernel(const char *dromajo, const char *kernel, uint64_t insns, int runs, BenchResult &result) {
+    char insns_arg[32];
+    char stats[] = "/tmp/dromajo_bench.XXXXXX";
+
+    snprintf(insns_arg, sizeof insns_arg, "%llu", (unsigned long long)insns);
+    int fd = mkstemp(stats);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+    close(fd);
+
+    std::map<std::string, double> counters;
+    double                        best_seconds = 0;
+    double                        best_mips    = 0;
+    bool                          ok           = true;
+
+    for (int i = 0; i < runs && ok; ++i) {
+        double mips;
+
+        counters.clear();
+        double seconds = run_kernel(dromajo, kernel, insns_arg, stats);
+        ok             = seconds >= 0 && read_stats(stats, mips, counters);
+        if (ok && (i == 0 || seconds < best_seconds))
+            best_seconds = seconds;
+        if (ok && mips > best_mips)
+            best_mips = mips;
+    }
+    unlink(stats);
+    if (!ok)
+        return false;
+
+    result["seconds"] = best_seconds;
+    result["mips"]    = best_mips;
+
+    /* The counters are the same on every run, the last ones will do */
+    for (auto &r : rates) {
+        double n = 0;
+        for (const char *c : r.counters)
+            if (c)
+                n += counters[c];
+        result[r.name] = n * 1000 / insns;
+    }
+    return true;
+}
+
+static void write_results(FILE *f, uint64_t insns, const std::vector<std::pair<std::string, BenchResult>> &results) {
+    fprintf(f, "{\n");
+    fprintf(f, "  \"insns\": %llu,\n", (unsigned long long)insns);
+    fprintf(f, "  \"kernels\": {");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i].second;
+
+        fprintf(f, "%s\n    \"%s\": {", i ? "," : "", results[i].first.c_str());
+        fprintf(f, "\"seconds\": %.3f, \"mips\": %.3f", r.at("seconds"), r.at("mips"));
+        for (auto &rate : rates) fprintf(f, ", \"%s\": %.3f", rate.name, r.at(rate.name));
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+/*
+ * read_baseline --
+ *
+ * Reads an output of dromajo_bench, one kernel per line.  A baseline
+ * may leave values out (the MIPS of another host, say), those are not
+ * compared.
+ */
+static bool read_baseline(const char *filename, uint64_t &insns, std::map<std::string, BenchResult> &baseline) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    char line[1024];
+    insns = 0;
+    while (fgets(line, sizeof line, f)) {
+        char               kernel[64];
+        unsigned long long n;
+        int                pos;
+
+        if (sscanf(line, " \"insns\": %llu", &n) == 1) {
+            insns = n;
+            continue;
+        }
+        if (sscanf(line, " \"%63[^\"]\": {%n", kernel, &pos) != 1 || !strcmp(kernel, "kernels"))
+            continue;
+
+        BenchResult &r = baseline[kernel];
+        const char * p = line + pos;
+        char         name[64];
+        double       value;
+        int          len;
+        while (sscanf(p, " \"%63[^\"]\": %lf%n", name, &value, &len) == 2) {
+            r[name] = value;
+            p += len;
+            if (*p == ',')
+                ++p;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+ * compare --
+ *
+ * Prints each kernel against the baseline to stderr and returns the
+ * number of regressions: MIPS down or a slow path rate up by more than
+ * tolerance percent.
+ */
+static int compare(const std::string &kernel, const BenchResult &r, const BenchResult &base, double tolerance) {
+    int regressions = 0;
+
+    for (auto &b : base) {
+        auto it = r.find(b.first);
+        if (it == r.end() || b.first == "seconds")
+            continue;
+
+        double value = it->second;
+        bool   bad;
+        if (b.first == "mips")
+            bad = value < b.second * (1 - tolerance / 100);
+        else
+            bad = value > b.second * (1 + tolerance / 100) + RATE_SLACK;
+
+        if (bad || b.first == "mips")
+            fprintf(stderr,
+                    "%s%s %s %.3f, baseline %.3f\n",
+                    bad ? "REGRESSION " : "",
+                    kernel.c_str(),
+                    b.first.c_str(),
+                    value,
+                    b.second);
+        regressions += bad;
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    const char *prog          = argv[0];
+    const char *kernel_dir    = DROMAJO_BENCH_DIR;
+    const char *output_name   = NULL;
+    uint64_t    insns         = 10000000;
+    int         runs          = 3;
+    double      tolerance     = 10;
+    std::string dromajo;
+    int         c;
+
+    std::vector<const char *> baseline_names;
+
+    while ((c = getopt(argc, argv, "d:k:n:r:o:b:t:h")) != -1) {
+        switch (c) {
+            case 'd': dromajo = optarg; break;
+            case 'k': kernel_dir = optarg; break;
+            case 'n': insns = strtoull(optarg, NULL, 0); break;
+            case 'r': runs = atoi(optarg); break;
+            case 'o': output_name = optarg; break;
+            case 'b': baseline_names.push_back(optarg); break;
+            case 't': tolerance = atof(optarg); break;
+            default: usage(prog);
+        }
+    }
+
+    if (insns == 0 || runs < 1 || tolerance < 0)
+        usage(prog);
+
+    if (dromajo.empty()) {
+        const char *slash = strrchr(prog, '/');
+        dromajo           = slash ? std::string(prog, slash + 1 - prog) + "dromajo" : "./dromajo";
+    }
+
+    std::vector<std::string> kernels(argv + optind, argv + argc);
+    if (kernels.empty())
+        kernels.assign(all_kernels, all_kernels + sizeof all_kernels / sizeof *all_kernels);
+
+    /* Typically the checked-in rates and, optionally, a baseline of this host */
+    std::vector<std::map<std::string, BenchResult>> baselines(baseline_names.size());
+    for (size_t i = 0; i < baseline_names.size(); ++i) {
+        uint64_t baseline_insns = 0;
+        if (!read_baseline(baseline_names[i], baseline_insns, baselines[i]))
+            return 2;
+        if (baseline_insns != insns)
+            fprintf(stderr,
+                    "%s: baseline of %llu instructions, the rates will not compare\n",
+                    baseline_names[i],
+                    (unsigned long long)baseline_insns);
+    }
+
+    std::vector<std::pair<std::string, BenchResult>> results;
+    int                                              regressions = 0;
+    for (auto &k : kernels) {
+        std::string path = std::string(kernel_dir) + "/" + k;
+        BenchResult r;
+
+        if (!bench_kernel(dromajo.c_str(), path.c_str(), insns, runs, r))
+            return 2;
+        results.push_back(std::make_pair(k, r));
+
+        for (auto &baseline : baselines) {
+            auto b = baseline.find(k);
+            if (b != baseline.end())
+                regressions += compare(k, r, b->second, tolerance);
+        }
+    }
+
+    FILE *f = output_name ? fopen(output_name, "w") : stdout;
+    if (!f) {
+        perror(output_name);
+        return 2;
+    }
+    write_results(f, insns, results);
+    if (output_name)
+        fclose(f);
+
+    if (regressions) {
+        fprintf(stderr, "%d regression%s\n", regressions, regressions > 1 ? "s" : "");
+        return 1;
+    }
+    return 0;
+}
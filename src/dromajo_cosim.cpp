@@ -21,11 +21,18 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
 
 #include "cutils.h"
 #include "dromajo.h"
 #include "iomem.h"
+#include "journal.h"
 #include "riscv_machine.h"
+#include "stats.h"
+#include "trace.h"
 
 #ifdef GOLDMEM_INORDER
 void check_inorder_load(int cid, uint64_t addr, uint8_t sz, uint64_t ld_data, bool io_map);
@@ -34,6 +41,26 @@ void check_inorder_amo(int cid, uint64_t addr, uint8_t sz, uint64_t st_data, uin
 void check_inorder_init(int ncores);
 #endif
 
+/* A call logged for cosim_rewind_replay */
+enum { COSIM_LOG_STEP, COSIM_LOG_TRAP, COSIM_LOG_OVERRIDE_MEM };
+
+typedef struct {
+    uint8_t  kind;
+    uint8_t  hartid;
+    uint8_t  check;
+    uint8_t  size_log2;
+    uint32_t insn;
+    uint64_t addr;  /* pc or physical address */
+    uint64_t value; /* wdata, trap cause or memory value */
+    uint64_t mstatus;
+} CosimLogEntry;
+
+static int  cosim_rewind_init(RISCVMachine *r);
+static void cosim_rewind_end(RISCVMachine *r);
+static void cosim_rewind_record(RISCVMachine *r, const CosimLogEntry *e);
+static void cosim_rewind_forget(RISCVMachine *r);
+static void cosim_rewind_replay(RISCVMachine *r, int hartid, int exit_code);
+
 /*
  * dromajo_cosim_init --
  *
@@ -51,10 +78,31 @@ dromajo_cosim_state_t *dromajo_cosim_init(int argc, char *argv[]) {
     m->common.pending_interrupt = -1;
     m->common.pending_exception = -1;
 
+    if (m->common.journal) {
+        if (journal_replaying(m->common.journal)) {
+            fprintf(dromajo_stderr, "dromajo: --journal_replay runs without the DUT, it cannot be used for cosim\n");
+            virt_machine_end(m);
+            return NULL;
+        }
+        journal_set_cosim(m->common.journal);
+    }
+
+    if (m->common.cosim_rewind_interval && cosim_rewind_init(m) < 0) {
+        virt_machine_end(m);
+        return NULL;
+    }
+
     return (dromajo_cosim_state_t *)m;
 }
 
-void dromajo_cosim_fini(dromajo_cosim_state_t *state) { virt_machine_end((RISCVMachine *)state); }
+void dromajo_cosim_fini(dromajo_cosim_state_t *state) {
+    RISCVMachine *r = (RISCVMachine *)state;
+
+    dromajo_cosim_threads_stop(state);
+    if (r->common.cosim_rewind)
+        cosim_rewind_end(r);
+    virt_machine_end(r);
+}
 
 static bool is_store_conditional(uint32_t insn) {
     int opcode = insn & 0x7f, funct3 = insn >> 12 & 7;
@@ -98,25 +146,35 @@ static inline bool is_amo(uint32_t insn) {
  * is MMIO space.  NB: get_phys_addr() is the identity if the CPU is
  * running without virtual memory enabled.
  */
-static inline bool is_mmio_load(RISCVCPUState *s, int reg, int offset, uint64_t mmio_start, uint64_t mmio_end) {
+static inline bool is_mmio_load(RISCVCPUState *s, int reg, int offset) {
     uint64_t pa;
     uint64_t va = riscv_get_reg_previous(s, reg) + offset;
 
-    if (!riscv_cpu_get_phys_addr(s, va, ACCESS_READ, &pa) && mmio_start <= pa && pa < mmio_end) {
-        return true;
-    }
+    return !riscv_cpu_get_phys_addr(s, va, ACCESS_READ, &pa) && riscv_machine_is_mmio(s->machine, pa);
+}
 
-    if (s->machine->mmio_addrset_size > 0) {
-        RISCVMachine *m = s->machine;
-        for (size_t i = 0; i < m->mmio_addrset_size; ++i) {
-            uint64_t start = m->mmio_addrset[i].start;
-            uint64_t end   = m->mmio_addrset[i].start + m->mmio_addrset[i].size;
-            if (!riscv_cpu_get_phys_addr(s, va, ACCESS_READ, &pa) && start <= pa && pa < end)
-                return true;
-        }
-    }
+/*
+ * Instruction classes handle_dut_overrides may have to override: bit
+ * opcode[6:2] for the 32-bit forms, bit 32 + quadrant:funct3 for the
+ * compressed ones.
+ */
+static inline int override_class(uint32_t insn) {
+    return (insn & 3) == 3 ? (insn >> 2) & 31 : 32 + ((insn & 3) << 3 | (insn >> 13 & 7));
+}
+
+static const uint64_t override_classes = 1ULL << (0x03 >> 2)   /* loads */
+                                         | 1ULL << (0x2f >> 2) /* AMOs */
+                                         | 1ULL << (0x73 >> 2) /* CSR reads */
+                                         | 1ULL << (32 + 2)    /* c.lw */
+                                         | 1ULL << (32 + 3);   /* c.ld */
+
+/* Gives rd the value the DUT got */
+static inline void cosim_override_reg(RISCVCPUState *s, int rd, uint64_t dut_wdata) {
+    Journal *j = s->machine->common.journal;
 
-    return false;
+    if (j)
+        journal_reg(j, s->mhartid, JOURNAL_REG, rd, dut_wdata);
+    riscv_set_reg(s, rd, dut_wdata);
 }
 
 /*
@@ -129,14 +187,17 @@ static inline bool is_mmio_load(RISCVCPUState *s, int reg, int offset, uint64_t
  *
  * Right now we handle just mcycle.
  */
-static inline void handle_dut_overrides(RISCVCPUState *s, uint64_t mmio_start, uint64_t mmio_end, int priv, uint64_t pc,
-                                        uint32_t insn, uint64_t emu_wdata, uint64_t dut_wdata) {
+static inline void handle_dut_overrides(RISCVCPUState *s, int priv, uint64_t pc, uint32_t insn, uint64_t emu_wdata,
+                                        uint64_t dut_wdata) {
     int opcode = insn & 0x7f;
     int csrno  = insn >> 20;
     int rd     = (insn >> 7) & 0x1f;
     int rdc    = ((insn >> 2) & 7) + 8;
     int reg, offset;
 
+    if (!(override_classes >> override_class(insn) & 1))
+        return;
+
     /* Catch reads from CSR mcycle, ucycle, instret, hpmcounters,
      * hpmoverflows, mip, and sip.
      * If the destination register is x0 then it is actually a csr-write
@@ -144,7 +205,7 @@ static inline void handle_dut_overrides(RISCVCPUState *s, uint64_t mmio_start, u
     if (opcode == 0x73 && rd != 0
         && (0xB00 <= csrno && csrno < 0xB20 || 0xC00 <= csrno && csrno < 0xC20
             || (csrno == 0x344 /* mip */ || csrno == 0x144 /* sip */)))
-        riscv_set_reg(s, rd, dut_wdata);
+        cosim_override_reg(s, rd, dut_wdata);
 
     /* Catch loads and amo from MMIO space */
     if ((opcode == 3 || is_amo(insn)) && rd != 0) {
@@ -163,92 +224,86 @@ static inline void handle_dut_overrides(RISCVCPUState *s, uint64_t mmio_start, u
     } else
         return;
 
-    if (is_mmio_load(s, reg, offset, mmio_start, mmio_end)) {
-        riscv_set_reg(s, rd, dut_wdata);
+    if (is_mmio_load(s, reg, offset)) {
+        cosim_override_reg(s, rd, dut_wdata);
     }
 }
 
-/*
- * dromajo_cosim_raise_trap --
- *
- * DUT raises a trap (exception or interrupt) and provides the cause.
- * MSB indicates an asynchronous interrupt, synchronous exception
- * otherwise.
- */
-void dromajo_cosim_raise_trap(dromajo_cosim_state_t *state, int hartid, int64_t cause) {
-    VirtMachine *m = (VirtMachine *)state;
+static int cosim_threads_push(RISCVMachine *r, int hartid, bool trap, int64_t cause, const dromajo_cosim_commit_t *c);
 
+static void cosim_raise_trap(VirtMachine *m, int64_t cause, FILE *log) {
     if (cause < 0) {
         assert(m->pending_interrupt == -1);
         m->pending_interrupt = cause & 63;
-        fprintf(dromajo_stderr, "[DEBUG] DUT raised interrupt %d\n", m->pending_interrupt);
+        fprintf(log, "[DEBUG] DUT raised interrupt %d\n", m->pending_interrupt);
     } else {
         m->pending_exception = cause;
-        fprintf(dromajo_stderr, "[DEBUG] DUT raised exception %d\n", m->pending_exception);
+        fprintf(log, "[DEBUG] DUT raised exception %d\n", m->pending_exception);
     }
 }
 
 /*
- * dromajo_cosim_step --
- *
- * executes exactly one instruction in the golden model and returns
- * zero if the supplied expected values match and execution should
- * continue.  A non-zero value signals termination with the exit code
- * being the upper bits (ie., all but LSB).  Caveat: the DUT provides
- * the instructions bit after expansion, so this is only matched on
- * non-compressed instruction.
+ * dromajo_cosim_raise_trap --
  *
- * There are a number of situations where the model cannot match the
- * DUT, such as loads from IO devices, interrupts, and CSRs cycle,
- * time, and instret.  For all these cases the model will override
- * with the expected values.
+ * DUT raises a trap (exception or interrupt) and provides the cause.
+ * MSB indicates an asynchronous interrupt, synchronous exception
+ * otherwise.
  */
-int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
-                       uint64_t dut_mstatus, bool check) {
+void dromajo_cosim_raise_trap(dromajo_cosim_state_t *state, int hartid, int64_t cause) {
     RISCVMachine *r = (RISCVMachine *)state;
-    assert(r->ncpus > hartid);
-    RISCVCPUState *s = r->cpu_state[hartid];
-    uint64_t       emu_pc, emu_wdata = 0;
-    int            emu_priv;
-    uint32_t       emu_insn;
-    bool           emu_wrote_data = false;
-    int            exit_code      = 0;
-    bool           verbose        = true;
-    int            iregno, fregno;
 
-    /* Succeed after N instructions without failure. */
-    if (r->common.maxinsns == 0) {
-        return 1;
+    if (r->common.cosim_threads) {
+        cosim_threads_push(r, hartid, true, cause, NULL);
+        return;
     }
 
-    r->common.maxinsns--;
-
-    if (riscv_terminated(s)) {
-        return 1;
+    if (r->common.cosim_rewind) {
+        CosimLogEntry e = {COSIM_LOG_TRAP, (uint8_t)hartid, 0, 0, 0, 0, (uint64_t)cause, 0};
+        cosim_rewind_record(r, &e);
     }
+    if (r->common.journal && cause < 0)
+        journal_interrupt(r->common.journal, hartid, cause & 63);
+    cosim_raise_trap(&r->common, cause, dromajo_stderr);
+}
 
-    /*
-     * Execute one instruction in the simulator.  Because exceptions
-     * may fire, the current instruction may not be executed, thus we
-     * have to iterate until one does.
-     */
-    iregno = -1;
-    fregno = -1;
+/* The instruction the model retired for a DUT commit */
+typedef struct {
+    uint64_t pc;
+    uint32_t insn;
+    int      priv;
+    int      iregno;
+    int      fregno;
+} CosimRetired;
+
+/*
+ * cosim_execute --
+ *
+ * Executes one instruction in the simulator.  Because exceptions may
+ * fire, the current instruction may not be executed, thus we have to
+ * iterate until one does.  Returns non zero if the model and the DUT
+ * disagree on an exception.
+ */
+static int cosim_execute(RISCVMachine *r, RISCVCPUState *s, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
+                         CosimRetired *e, FILE *log) {
+    e->iregno = -1;
+    e->fregno = -1;
 
     for (;;) {
-        emu_priv = riscv_get_priv_level(s);
-        emu_pc   = riscv_get_pc(s);
-        riscv_read_insn(s, &emu_insn, emu_pc);
+        e->priv = riscv_get_priv_level(s);
+        e->pc   = riscv_get_pc(s);
+        riscv_read_insn(s, &e->insn, e->pc);
 
-        if ((emu_insn & 3) != 3)
-            emu_insn &= 0xFFFF;
+        if ((e->insn & 3) != 3)
+            e->insn &= 0xFFFF;
 
-        if (emu_pc == dut_pc && emu_insn == dut_insn && is_store_conditional(emu_insn) && dut_wdata != 0) {
+        if (e->pc == dut_pc && e->insn == dut_insn && is_store_conditional(e->insn) && dut_wdata != 0) {
             /* When DUT fails an SC, we must simulate the same behavior */
-            iregno = emu_insn >> 7 & 0x1f;
-            if (iregno > 0)
-                riscv_set_reg(s, iregno, dut_wdata);
-            riscv_set_pc(s, emu_pc + 4);
+            e->iregno = e->insn >> 7 & 0x1f;
+            if (r->common.journal)
+                journal_reg(r->common.journal, s->mhartid, JOURNAL_SC_FAIL, e->iregno, dut_wdata);
+            if (e->iregno > 0)
+                riscv_set_reg(s, e->iregno, dut_wdata);
+            riscv_set_pc(s, e->pc + 4);
             break;
         }
 
@@ -256,7 +311,7 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
             /* On the DUT, the interrupt can race the exception.
                Let's try to match that behavior */
 
-            fprintf(dromajo_stderr, "[DEBUG] DUT also raised exception %d\n", r->common.pending_exception);
+            fprintf(log, "[DEBUG] DUT also raised exception %d\n", r->common.pending_exception);
             riscv_cpu_interp64(s, 1);  // Advance into the exception
 
             int cause = s->priv == PRV_S ? s->scause : s->mcause;
@@ -267,9 +322,9 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
                 /* Unfortunately, handling the error case is awkward,
                  * so we just exit from here */
 
-                fprintf(dromajo_stderr, "%d 0x%016" PRIx64 " ", emu_priv, emu_pc);
-                fprintf(dromajo_stderr, "(0x%08x) ", emu_insn);
-                fprintf(dromajo_stderr,
+                fprintf(log, "%d 0x%016" PRIx64 " ", e->priv, e->pc);
+                fprintf(log, "(0x%08x) ", e->insn);
+                fprintf(log,
                         "[error] EMU %cCAUSE %d != DUT %cCAUSE %d\n",
                         priv,
                         cause,
@@ -282,15 +337,15 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
 
         if (r->common.pending_interrupt != -1) {
             riscv_cpu_set_mip(s, riscv_cpu_get_mip(s) | 1 << r->common.pending_interrupt);
-            fprintf(dromajo_stderr,
+            fprintf(log,
                     "[DEBUG] Interrupt: MIP <- %d: Now MIP = %x\n",
                     r->common.pending_interrupt,
                     riscv_cpu_get_mip(s));
         }
 
         if (riscv_cpu_interp64(s, 1) != 0) {
-            iregno = riscv_get_most_recently_written_reg(s);
-            fregno = riscv_get_most_recently_written_fp_reg(s);
+            e->iregno = riscv_get_most_recently_written_reg(s);
+            e->fregno = riscv_get_most_recently_written_fp_reg(s);
 
             //// ABE: I think this is the solution
             // r->common.pending_interrupt = -1;
@@ -303,6 +358,55 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
         r->common.pending_exception = -1;
     }
 
+    return 0;
+}
+
+/*
+ * cosim_execute_fast --
+ *
+ * The common case of cosim_execute, with no trap raised by the DUT and
+ * no failed store conditional to replay.  Returns -1 without touching
+ * the model when it does not apply.
+ */
+static inline int cosim_execute_fast(RISCVMachine *r, RISCVCPUState *s, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
+                                     CosimRetired *e, FILE *log) {
+    if (r->common.pending_interrupt != -1 || r->common.pending_exception != -1)
+        return -1;
+
+    e->priv = s->priv;
+    e->pc   = s->pc;
+    if (riscv_read_insn(s, &e->insn, e->pc))
+        return -1;
+    if ((e->insn & 3) != 3)
+        e->insn &= 0xFFFF;
+    if (is_store_conditional(e->insn))
+        return -1;
+
+    /* An exception was taken instead, let the slow path find the next one */
+    if (riscv_cpu_interp64(s, 1) == 0)
+        return cosim_execute(r, s, dut_pc, dut_insn, dut_wdata, e, log);
+
+    e->iregno = riscv_get_most_recently_written_reg(s);
+    e->fregno = riscv_get_most_recently_written_fp_reg(s);
+
+    return 0;
+}
+
+/*
+ * cosim_check --
+ *
+ * Applies the DUT overrides to the retired instruction, prints it, and
+ * compares it with what the DUT committed.
+ */
+static int cosim_check(RISCVMachine *r, RISCVCPUState *s, int hartid, const CosimRetired *e, uint64_t dut_pc, uint32_t dut_insn,
+                       uint64_t dut_wdata, uint64_t dut_mstatus, bool check, dromajo_cosim_result_t *out, FILE *log,
+                       bool verbose) {
+    uint64_t emu_wdata      = 0;
+    bool     emu_wrote_data = false;
+    int      exit_code      = 0;
+
+    (void)hartid;
+
 #ifdef GOLDMEM_INORDER
     bool do_clw = (dut_insn & 0x3) == 0 && (dut_insn & 0xe000) == 0x4000;
     bool do_cld = (dut_insn & 0x3) == 0 && (dut_insn & 0xe000) == 0x6000;
@@ -409,28 +513,36 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
 #endif
 
     if (check)
-        handle_dut_overrides(s, r->mmio_start, r->mmio_end, emu_priv, emu_pc, emu_insn, emu_wdata, dut_wdata);
-
-    if (verbose) {
-        fprintf(dromajo_stderr, "%d 0x%016" PRIx64 " ", emu_priv, emu_pc);
-        fprintf(dromajo_stderr, "(0x%08x) ", emu_insn);
-    }
+        handle_dut_overrides(s, e->priv, e->pc, e->insn, emu_wdata, dut_wdata);
 
-    if (iregno > 0) {
-        emu_wdata      = riscv_get_reg(s, iregno);
+    if (e->iregno > 0) {
+        emu_wdata      = riscv_get_reg(s, e->iregno);
         emu_wrote_data = 1;
-        if (verbose)
-            fprintf(dromajo_stderr, "x%-2d 0x%016" PRIx64, iregno, emu_wdata);
-    } else if (fregno >= 0) {
-        emu_wdata      = riscv_get_fpreg(s, fregno);
+    } else if (e->fregno >= 0) {
+        emu_wdata      = riscv_get_fpreg(s, e->fregno);
         emu_wrote_data = 1;
-        if (verbose)
-            fprintf(dromajo_stderr, "f%-2d 0x%016" PRIx64, fregno, emu_wdata);
-    } else if (verbose)
-        fprintf(dromajo_stderr, "                      ");
+    }
 
-    if (verbose)
-        fprintf(dromajo_stderr, " DASM(0x%08x)\n", emu_insn);
+    /* A single write per line, the log is usually unbuffered */
+    if (verbose && emu_wrote_data)
+        fprintf(log,
+                "%d 0x%016" PRIx64 " (0x%08x) %c%-2d 0x%016" PRIx64 " DASM(0x%08x)\n",
+                e->priv,
+                e->pc,
+                e->insn,
+                e->iregno > 0 ? 'x' : 'f',
+                e->iregno > 0 ? e->iregno : e->fregno,
+                emu_wdata,
+                e->insn);
+    else if (verbose)
+        fprintf(log, "%d 0x%016" PRIx64 " (0x%08x)                        DASM(0x%08x)\n", e->priv, e->pc, e->insn, e->insn);
+
+    if (out) {
+        out->emu_pc         = e->pc;
+        out->emu_insn       = e->insn;
+        out->emu_wdata      = emu_wdata;
+        out->emu_wrote_data = emu_wrote_data;
+    }
 
     if (!check)
         return 0;
@@ -442,14 +554,14 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
      * varies between pre-commit (all FP instructions) and post-commit
      * (CSR instructions).
      */
-    if (emu_pc != dut_pc || emu_insn != dut_insn && (emu_insn & 3) == 3 ||  // DUT expands all C instructions
+    if (e->pc != dut_pc || e->insn != dut_insn && (e->insn & 3) == 3 ||  // DUT expands all C instructions
         emu_wdata != dut_wdata && emu_wrote_data) {
-        fprintf(dromajo_stderr, "[error] EMU PC %016" PRIx64 ", DUT PC %016" PRIx64 "\n", emu_pc, dut_pc);
-        fprintf(dromajo_stderr, "[error] EMU INSN %08x, DUT INSN %08x\n", emu_insn, dut_insn);
+        fprintf(log, "[error] EMU PC %016" PRIx64 ", DUT PC %016" PRIx64 "\n", e->pc, dut_pc);
+        fprintf(log, "[error] EMU INSN %08x, DUT INSN %08x\n", e->insn, dut_insn);
         if (emu_wrote_data)
-            fprintf(dromajo_stderr, "[error] EMU WDATA %016" PRIx64 ", DUT WDATA %016" PRIx64 "\n", emu_wdata, dut_wdata);
-        fprintf(dromajo_stderr, "[error] EMU MSTATUS %08" PRIx64 ", DUT MSTATUS %08" PRIx64 "\n", emu_mstatus, dut_mstatus);
-        fprintf(dromajo_stderr,
+            fprintf(log, "[error] EMU WDATA %016" PRIx64 ", DUT WDATA %016" PRIx64 "\n", emu_wdata, dut_wdata);
+        fprintf(log, "[error] EMU MSTATUS %08" PRIx64 ", DUT MSTATUS %08" PRIx64 "\n", emu_mstatus, dut_mstatus);
+        fprintf(log,
                 "[error] DUT pending exception %d pending interrupt %d\n",
                 r->common.pending_exception,
                 r->common.pending_interrupt);
@@ -464,59 +576,704 @@ int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc
     return exit_code;
 }
 
+
 /*
- * dromajo_cosim_override_mem --
+ * dromajo_cosim_step --
  *
- * DUT sets Dromajo memory. Used so that other devices (i.e. block device, accelerators, can write to memory).
+ * executes exactly one instruction in the golden model and returns
+ * zero if the supplied expected values match and execution should
+ * continue.  A non-zero value signals termination with the exit code
+ * being the upper bits (ie., all but LSB).  Caveat: the DUT provides
+ * the instructions bit after expansion, so this is only matched on
+ * non-compressed instruction.
+ *
+ * There are a number of situations where the model cannot match the
+ * DUT, such as loads from IO devices, interrupts, and CSRs cycle,
+ * time, and instret.  For all these cases the model will override
+ * with the expected values.
  */
-int dromajo_cosim_override_mem(dromajo_cosim_state_t *state, int hartid, uint64_t dut_paddr, uint64_t dut_val, int size_log2) {
-    RISCVMachine * r = (RISCVMachine *)state;
+int dromajo_cosim_step(dromajo_cosim_state_t *state, int hartid, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
+                       uint64_t dut_mstatus, bool check) {
+    RISCVMachine *r = (RISCVMachine *)state;
+    assert(r->ncpus > hartid);
     RISCVCPUState *s = r->cpu_state[hartid];
+    CosimRetired   e;
 
-    uint8_t *        ptr;
-    target_ulong     offset;
-    PhysMemoryRange *pr = get_phys_mem_range(s->mem_map, dut_paddr);
+    /* Succeed after N instructions without failure. */
+    if (r->common.maxinsns == 0) {
+        return 1;
+    }
 
-    if (!pr) {
-#ifdef DUMP_INVALID_MEM_ACCESS
-        fprintf(dromajo_stderr, "riscv_cpu_write_memory: invalid physical address 0x%016" PRIx64 "\n", dut_paddr);
-#endif
+    r->common.maxinsns--;
+    stats_poll(r->common.stats);
+
+    if (r->common.cosim_threads) {
+        dromajo_cosim_commit_t c = {dut_pc, dut_insn, dut_wdata, dut_mstatus, check};
+        return cosim_threads_push(r, hartid, false, 0, &c);
+    }
+
+    if (r->common.cosim_rewind) {
+        CosimLogEntry l = {COSIM_LOG_STEP, (uint8_t)hartid, check, 0, dut_insn, dut_pc, dut_wdata, dut_mstatus};
+        cosim_rewind_record(r, &l);
+    }
+
+    if (riscv_terminated(s)) {
         return 1;
-    } else if (pr->is_ram) {
-        phys_mem_set_dirty_bit(pr, dut_paddr - pr->addr);
-        ptr = pr->phys_mem + (uintptr_t)(dut_paddr - pr->addr);
-        switch (size_log2) {
-            case 0: *(uint8_t *)ptr = dut_val; break;
-            case 1: *(uint16_t *)ptr = dut_val; break;
-            case 2: *(uint32_t *)ptr = dut_val; break;
-#if MLEN >= 64
-            case 3: *(uint64_t *)ptr = dut_val; break;
-#endif
-#if MLEN >= 128
-            case 4: *(uint128_t *)ptr = dut_val; break;
-#endif
-            default: abort();
+    }
+
+    if (r->common.journal)
+        journal_step_begin(r->common.journal, hartid);
+
+    int exit_code = cosim_execute(r, s, dut_pc, dut_insn, dut_wdata, &e, dromajo_stderr);
+    if (exit_code == 0)
+        exit_code = cosim_check(r, s, hartid, &e, dut_pc, dut_insn, dut_wdata, dut_mstatus, check, NULL, dromajo_stderr, true);
+    if (exit_code && r->common.cosim_rewind)
+        cosim_rewind_replay(r, hartid, exit_code);
+
+    return exit_code;
+}
+
+/*
+ * dromajo_cosim_step_batch --
+ *
+ * Same as calling dromajo_cosim_step on each commit in order, stopping
+ * at the first non-zero exit code.  Commits that do not involve a trap
+ * raised by the DUT take a shorter path through the model.
+ */
+int dromajo_cosim_step_batch(dromajo_cosim_state_t *state, int hartid, const dromajo_cosim_commit_t *commits, int n,
+                             dromajo_cosim_result_t *out) {
+    RISCVMachine *r = (RISCVMachine *)state;
+    assert(r->ncpus > hartid);
+    RISCVCPUState *s = r->cpu_state[hartid];
+
+    stats_poll(r->common.stats);
+    for (int i = 0; i < n; ++i) {
+        const dromajo_cosim_commit_t *c = &commits[i];
+        dromajo_cosim_result_t *      o = out ? &out[i] : NULL;
+        CosimRetired                  e;
+        int                           exit_code;
+
+        if (o)
+            memset(o, 0, sizeof *o);
+
+        if (r->common.maxinsns == 0) {
+            exit_code = 1;
+        } else if (r->common.cosim_threads) {
+            r->common.maxinsns--;
+            exit_code = cosim_threads_push(r, hartid, false, 0, c);
+        } else if (riscv_terminated(s)) {
+            exit_code = 1;
+        } else {
+            r->common.maxinsns--;
+            if (r->common.cosim_rewind) {
+                CosimLogEntry l = {COSIM_LOG_STEP, (uint8_t)hartid, c->check, 0, c->insn, c->pc, c->wdata, c->mstatus};
+                cosim_rewind_record(r, &l);
+            }
+            if (r->common.journal)
+                journal_step_begin(r->common.journal, hartid);
+            exit_code = cosim_execute_fast(r, s, c->pc, c->insn, c->wdata, &e, dromajo_stderr);
+            if (exit_code < 0)
+                exit_code = cosim_execute(r, s, c->pc, c->insn, c->wdata, &e, dromajo_stderr);
+            if (exit_code == 0)
+                exit_code
+                    = cosim_check(r, s, hartid, &e, c->pc, c->insn, c->wdata, c->mstatus, c->check, o, dromajo_stderr, true);
+            if (exit_code && r->common.cosim_rewind)
+                cosim_rewind_replay(r, hartid, exit_code);
         }
-    } else {
-        offset = dut_paddr - pr->addr;
-        if (((pr->devio_flags >> size_log2) & 1) != 0) {
-            pr->write_func(pr->opaque, offset, dut_val, size_log2);
+
+        if (o)
+            o->exit_code = exit_code;
+        if (exit_code)
+            return i + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Per hart checking threads
+ *
+ * Every commit and trap gets a sequence number in the order the
+ * testbench hands them over, and is queued for the thread of its hart.
+ * A thread runs its commits freely until a commit that touches shared
+ * state: an AMO, LR/SC, a fence, a trap (the pending trap is machine
+ * wide), or an access to a device.  Such a synchronization point waits
+ * for every earlier commit of the other harts, and the commits that
+ * follow it on any hart wait for it, so the shared state changes in
+ * the same order as with dromajo_cosim_step.  Device accesses are only
+ * known once the address is computed, so they only wait for the
+ * earlier commits.
+ */
+#define COSIM_QUEUE_SIZE 4096
+#define COSIM_SYNC_SIZE  (COSIM_QUEUE_SIZE * 4)
+
+typedef struct {
+    dromajo_cosim_commit_t commit;
+    uint64_t               seq;
+    int64_t                cause; /* of a trap */
+    bool                   trap;
+    bool                   sync;
+} CosimQueued;
+
+typedef struct {
+    CosimQueued *         queue;
+    std::atomic<uint64_t> head; /* queued by the testbench */
+    std::atomic<uint64_t> tail; /* done by the thread */
+    bool                  after_trap;
+
+    /* The messages of the current commit, printed if it fails */
+    FILE * log;
+    char * log_buf;
+    size_t log_size;
+
+    uint64_t    fail_seq;
+    int         exit_code;
+    std::thread thread;
+} CosimHart;
+
+struct CosimThreads {
+    RISCVMachine *machine;
+    CosimHart     hart[MAX_CPUS];
+    uint64_t      seq;
+
+    /* Sequence numbers of the synchronization points not done yet */
+    uint64_t *            sync_seq;
+    std::atomic<uint64_t> sync_head;
+    std::atomic<uint64_t> sync_tail;
+
+    std::atomic<uint64_t> fail_seq; /* earliest failing commit found so far */
+    bool                  reported;
+    std::atomic<bool>     stop;
+};
+
+static bool cosim_is_sync(uint32_t insn) {
+    int opcode = insn & 0x7f;
+
+    return opcode == 0x2f                             /* AMO, LR, SC */
+           || opcode == 0x0f                          /* FENCE, FENCE.I */
+           || opcode == 0x73 && (insn >> 25) == 0x09; /* SFENCE.VMA */
+}
+
+/* Base register and offset of a load or store, the forms handle_dut_overrides knows */
+static bool cosim_mem_operand(uint32_t insn, int *reg, int *offset) {
+    int opcode = insn & 0x7f;
+
+    if (opcode == 0x03 || opcode == 0x23) {
+        *reg    = (insn >> 15) & 0x1f;
+        *offset = opcode == 0x03 ? (int32_t)insn >> 20 : (int32_t)(insn & 0xFE000000) >> 20 | (insn >> 7 & 0x1f);
+    } else if ((insn & 0x6003) == 0x6000) {
+        // c.ld, c.sd
+        *reg    = ((insn >> 7) & 7) + 8;
+        *offset = get_field1(insn, 10, 3, 5) | get_field1(insn, 5, 6, 7);
+    } else if ((insn & 0x6003) == 0x4000) {
+        // c.lw, c.sw
+        *reg    = ((insn >> 7) & 7) + 8;
+        *offset = get_field1(insn, 10, 3, 5) | get_field1(insn, 6, 2, 2) | get_field1(insn, 5, 6, 6);
+    } else
+        return false;
+
+    return true;
+}
+
+/*
+ * cosim_is_device_access --
+ *
+ * True when the next instruction of the hart is a load or store that
+ * does not go to RAM.
+ */
+static bool cosim_is_device_access(RISCVMachine *r, RISCVCPUState *s) {
+    uint32_t insn;
+    int      reg, offset;
+    uint64_t pa;
+
+    if (riscv_read_insn(s, &insn, riscv_get_pc(s)))
+        return false;
+    if ((insn & 3) != 3)
+        insn &= 0xFFFF;
+    if (!cosim_mem_operand(insn, &reg, &offset))
+        return false;
+    if (riscv_cpu_get_phys_addr(s, riscv_get_reg(s, reg) + offset, ACCESS_READ, &pa))
+        return false;
+
+    if (riscv_machine_is_mmio(r, pa))
+        return true;
+
+    PhysMemoryRange *pr = get_phys_mem_range(r->mem_map, pa);
+    return !pr || !pr->is_ram;
+}
+
+/* Sequence number of the oldest synchronization point not done */
+static uint64_t cosim_oldest_sync(CosimThreads *t) {
+    uint64_t tail = t->sync_tail.load(std::memory_order_acquire);
+
+    if (tail == t->sync_head.load(std::memory_order_acquire))
+        return UINT64_MAX;
+
+    return t->sync_seq[tail % COSIM_SYNC_SIZE];
+}
+
+/* True once every commit of hart before seq is done */
+static bool cosim_hart_done_before(CosimHart *h, uint64_t seq) {
+    uint64_t tail = h->tail.load(std::memory_order_acquire);
+
+    return tail == h->head.load(std::memory_order_acquire) || h->queue[tail % COSIM_QUEUE_SIZE].seq > seq;
+}
+
+static void cosim_wait_earlier(CosimThreads *t, int hartid, uint64_t seq) {
+    for (int i = 0; i < t->machine->ncpus; ++i)
+        while (i != hartid && !cosim_hart_done_before(&t->hart[i], seq) && !t->stop.load(std::memory_order_acquire))
+            std::this_thread::yield();
+}
+
+static int cosim_run_queued(CosimThreads *t, int hartid, const CosimQueued *q) {
+    RISCVMachine *                r = t->machine;
+    RISCVCPUState *               s = r->cpu_state[hartid];
+    CosimHart *                   h = &t->hart[hartid];
+    const dromajo_cosim_commit_t *c = &q->commit;
+    CosimRetired                  e;
+
+    if (q->trap) {
+        cosim_raise_trap(&r->common, q->cause, h->log);
+        return 0;
+    }
+
+    if (riscv_terminated(s))
+        return 1;
+
+    int exit_code = cosim_execute_fast(r, s, c->pc, c->insn, c->wdata, &e, h->log);
+    if (exit_code < 0)
+        exit_code = cosim_execute(r, s, c->pc, c->insn, c->wdata, &e, h->log);
+    if (exit_code == 0)
+        exit_code = cosim_check(r, s, hartid, &e, c->pc, c->insn, c->wdata, c->mstatus, c->check, NULL, h->log, false);
+
+    return exit_code;
+}
+
+static void cosim_thread(CosimThreads *t, int hartid) {
+    CosimHart *h    = &t->hart[hartid];
+    uint64_t   tail = 0;
+
+    for (;;) {
+        if (tail == h->head.load(std::memory_order_acquire)) {
+            if (t->stop.load(std::memory_order_acquire))
+                return;
+            std::this_thread::yield();
+            continue;
         }
-#if MLEN >= 64
-        else if ((pr->devio_flags & DEVIO_SIZE32) && size_log2 == 3) {
-            /* emulate 64 bit access */
-            pr->write_func(pr->opaque, offset, dut_val & 0xffffffff, 2);
-            pr->write_func(pr->opaque, offset + 4, (dut_val >> 32) & 0xffffffff, 2);
+
+        const CosimQueued *q = &h->queue[tail % COSIM_QUEUE_SIZE];
+
+        if (q->sync)
+            cosim_wait_earlier(t, hartid, q->seq);
+        else
+            while (cosim_oldest_sync(t) < q->seq && !t->stop.load(std::memory_order_acquire)) std::this_thread::yield();
+
+        /* Nothing runs past the earliest failure, so the report does not depend on timing */
+        if (q->seq < t->fail_seq.load(std::memory_order_acquire)) {
+            if (!q->sync && !q->trap && cosim_is_device_access(t->machine, t->machine->cpu_state[hartid]))
+                cosim_wait_earlier(t, hartid, q->seq);
+
+            rewind(h->log);
+            int exit_code = cosim_run_queued(t, hartid, q);
+            if (exit_code) {
+                fflush(h->log);
+                h->exit_code = exit_code;
+                h->fail_seq  = q->seq;
+
+                uint64_t fail_seq = t->fail_seq.load(std::memory_order_acquire);
+                while (q->seq < fail_seq && !t->fail_seq.compare_exchange_weak(fail_seq, q->seq)) continue;
+            }
         }
+
+        if (q->sync)
+            t->sync_tail.fetch_add(1, std::memory_order_release);
+        h->tail.store(++tail, std::memory_order_release);
+    }
+}
+
+/*
+ * cosim_threads_push --
+ *
+ * Queues a commit, or a trap when trap is set, for the thread of the
+ * hart.  Returns non zero once a commit failed, see
+ * dromajo_cosim_threads_sync.
+ */
+static int cosim_threads_push(RISCVMachine *r, int hartid, bool trap, int64_t cause, const dromajo_cosim_commit_t *c) {
+    CosimThreads *t = r->common.cosim_threads;
+    CosimHart *   h = &t->hart[hartid];
+
+    assert(r->ncpus > hartid);
+    if (t->fail_seq.load(std::memory_order_acquire) != UINT64_MAX)
+        return dromajo_cosim_threads_sync((dromajo_cosim_state_t *)r);
+
+    uint64_t head = h->head.load(std::memory_order_relaxed);
+    while (head - h->tail.load(std::memory_order_acquire) >= COSIM_QUEUE_SIZE) std::this_thread::yield();
+
+    CosimQueued *q = &h->queue[head % COSIM_QUEUE_SIZE];
+    q->seq         = t->seq++;
+    q->trap        = trap;
+    q->cause       = cause;
+    q->sync        = trap || h->after_trap || cosim_is_sync(c->insn);
+    if (c)
+        q->commit = *c;
+    h->after_trap = trap;
+
+    if (q->sync) {
+        uint64_t sync_head = t->sync_head.load(std::memory_order_relaxed);
+        while (sync_head - t->sync_tail.load(std::memory_order_acquire) >= COSIM_SYNC_SIZE) std::this_thread::yield();
+        t->sync_seq[sync_head % COSIM_SYNC_SIZE] = q->seq;
+        t->sync_head.store(sync_head + 1, std::memory_order_release);
+    }
+    h->head.store(head + 1, std::memory_order_release);
+
+    return 0;
+}
+
+/* After a restore, the failure found before is gone with its state */
+static void cosim_threads_forget_failure(CosimThreads *t) {
+    for (int i = 0; i < t->machine->ncpus; ++i) {
+        t->hart[i].fail_seq  = UINT64_MAX;
+        t->hart[i].exit_code = 0;
+    }
+    t->fail_seq.store(UINT64_MAX, std::memory_order_release);
+    t->reported = false;
+}
+
+int dromajo_cosim_threads_start(dromajo_cosim_state_t *state) {
+    RISCVMachine *r = (RISCVMachine *)state;
+
+#if defined(LIVECACHE) || defined(GOLDMEM_INORDER)
+    fprintf(dromajo_stderr, "dromajo: cosim threads are not supported with LIVECACHE or GOLDMEM_INORDER\n");
+    return -1;
 #endif
-        else {
-#ifdef DUMP_INVALID_MEM_ACCESS
-            fprintf(dromajo_stderr,
-                    "unsupported device write access: addr=0x%016" PRIx64 "  width=%d bits\n",
-                    dut_paddr,
-                    1 << (3 + size_log2));
+    if (r->common.cosim_rewind) {
+        fprintf(dromajo_stderr, "dromajo: cosim threads are not supported with --cosim_rewind\n");
+        return -1;
+    }
+    if (r->common.journal) {
+        fprintf(dromajo_stderr, "dromajo: cosim threads are not supported with --journal_record\n");
+        return -1;
+    }
+    if (r->common.cosim_threads)
+        return 0;
+
+    CosimThreads *t = new CosimThreads;
+    t->machine      = r;
+    t->seq          = 0;
+    t->sync_seq     = (uint64_t *)mallocz(COSIM_SYNC_SIZE * sizeof *t->sync_seq);
+    t->sync_head    = 0;
+    t->sync_tail    = 0;
+    t->fail_seq     = UINT64_MAX;
+    t->reported     = false;
+    t->stop         = false;
+
+    for (int i = 0; i < r->ncpus; ++i) {
+        CosimHart *h  = &t->hart[i];
+        h->queue      = (CosimQueued *)mallocz(COSIM_QUEUE_SIZE * sizeof *h->queue);
+        h->head       = 0;
+        h->tail       = 0;
+        h->after_trap = false;
+        h->log_buf    = NULL;
+        h->log_size   = 0;
+        h->log        = open_memstream(&h->log_buf, &h->log_size);
+        h->fail_seq   = UINT64_MAX;
+        h->exit_code  = 0;
+        assert(h->log);
+    }
+    for (int i = 0; i < r->ncpus; ++i) t->hart[i].thread = std::thread(cosim_thread, t, i);
+
+    r->common.cosim_threads = t;
+
+    return 0;
+}
+
+int dromajo_cosim_threads_sync(dromajo_cosim_state_t *state) {
+    RISCVMachine *r = (RISCVMachine *)state;
+    CosimThreads *t = r->common.cosim_threads;
+
+    if (!t)
+        return 0;
+
+    for (int i = 0; i < r->ncpus; ++i) {
+        CosimHart *h = &t->hart[i];
+        while (h->tail.load(std::memory_order_acquire) != h->head.load(std::memory_order_relaxed)) std::this_thread::yield();
+    }
+
+    uint64_t fail_seq = t->fail_seq.load(std::memory_order_acquire);
+    for (int i = 0; i < r->ncpus; ++i) {
+        CosimHart *h = &t->hart[i];
+        if (h->fail_seq == fail_seq) {
+            if (!t->reported)
+                fwrite(h->log_buf, 1, ftell(h->log), dromajo_stderr);
+            t->reported = true;
+            return h->exit_code;
+        }
+    }
+
+    return 0;
+}
+
+void dromajo_cosim_threads_stop(dromajo_cosim_state_t *state) {
+    RISCVMachine *r = (RISCVMachine *)state;
+    CosimThreads *t = r->common.cosim_threads;
+
+    if (!t)
+        return;
+
+    dromajo_cosim_threads_sync(state);
+    t->stop.store(true, std::memory_order_release);
+    for (int i = 0; i < r->ncpus; ++i) {
+        CosimHart *h = &t->hart[i];
+        h->thread.join();
+        fclose(h->log);
+        free(h->log_buf);
+        free(h->queue);
+    }
+    free(t->sync_seq);
+    delete t;
+    r->common.cosim_threads = NULL;
+}
+
+/*
+ * dromajo_cosim_override_mem --
+ *
+ * DUT sets Dromajo memory. Used so that other devices (i.e. block device, accelerators, can write to memory).
+ */
+int dromajo_cosim_override_mem(dromajo_cosim_state_t *state, int hartid, uint64_t dut_paddr, uint64_t dut_val, int size_log2) {
+    RISCVMachine *r = (RISCVMachine *)state;
+
+    /* The write lands after every commit queued so far */
+    dromajo_cosim_threads_sync(state);
+
+    if (r->common.cosim_rewind) {
+        CosimLogEntry e = {COSIM_LOG_OVERRIDE_MEM, (uint8_t)hartid, 0, (uint8_t)size_log2, 0, dut_paddr, dut_val, 0};
+        cosim_rewind_record(r, &e);
+    }
+    if (r->common.journal)
+        journal_mem(r->common.journal, hartid, dut_paddr, dut_val, size_log2);
+
+    return riscv_machine_override_mem(r, dut_paddr, dut_val, size_log2);
+}
+
+/*
+ * dromajo_cosim_snapshot --
+ *
+ * Captures the CPU, device, and RAM state of the model.
+ */
+dromajo_cosim_snapshot_t *dromajo_cosim_snapshot(dromajo_cosim_state_t *state) {
+    dromajo_cosim_threads_sync(state);
+    return (dromajo_cosim_snapshot_t *)virt_machine_snapshot((RISCVMachine *)state);
+}
+
+/*
+ * dromajo_cosim_restore --
+ *
+ * Rolls the model back to a snapshot, copying back only dirty RAM pages.
+ */
+void dromajo_cosim_restore(dromajo_cosim_state_t *state, dromajo_cosim_snapshot_t *snap) {
+    RISCVMachine *r = (RISCVMachine *)state;
+
+    dromajo_cosim_threads_sync(state);
+    if (r->common.cosim_threads)
+        cosim_threads_forget_failure(r->common.cosim_threads);
+    virt_machine_restore(r, (VirtMachineSnapshot *)snap);
+    if (r->common.cosim_rewind)
+        cosim_rewind_forget(r);
+
+    /* Positions in the journal only go forward */
+    if (r->common.journal) {
+        fprintf(dromajo_stderr, "dromajo: restoring a snapshot ends the journal\n");
+        journal_close(r->common.journal);
+        r->common.journal = NULL;
+    }
+}
+
+void dromajo_cosim_snapshot_free(dromajo_cosim_state_t *state, dromajo_cosim_snapshot_t *snap) {
+    virt_machine_snapshot_free((RISCVMachine *)state, (VirtMachineSnapshot *)snap);
+}
+
+/*
+ * Rewind on mismatch
+ *
+ * With --cosim_rewind INTERVAL[:DEPTH[:FILE]] the model takes a
+ * checkpoint every INTERVAL steps into a ring of DEPTH (see
+ * virt_machine_rewind_init) and logs the steps, traps and memory
+ * overrides since the oldest one.  When a step fails, the model goes
+ * back to the newest checkpoint at least INTERVAL calls before the
+ * failure and replays the log up to the failing step into FILE, with
+ * the data addresses and, at the end, the registers of the hart.  The
+ * model then is in the same state as right after the failure.
+ */
+struct CosimRewind {
+    VirtMachineRewind *ring;
+    uint64_t           interval;
+    uint64_t           steps; /* since the newest checkpoint */
+    FILE *             out;
+
+    CosimLogEntry *log;
+    size_t         log_size;
+    size_t         log_max;
+    uint64_t       log_first; /* number of the call in log[0] */
+};
+
+static int cosim_rewind_init(RISCVMachine *r) {
+#ifdef GOLDMEM_INORDER
+    fprintf(dromajo_stderr, "dromajo: --cosim_rewind is not supported with GOLDMEM_INORDER\n");
+    return -1;
 #endif
+    CosimRewind *rw = (CosimRewind *)mallocz(sizeof *rw);
+
+    rw->interval = r->common.cosim_rewind_interval;
+    rw->out      = dromajo_stderr;
+    if (r->common.cosim_rewind_log) {
+        rw->out = fopen(r->common.cosim_rewind_log, "w");
+        if (!rw->out) {
+            perror(r->common.cosim_rewind_log);
+            free(rw);
+            return -1;
         }
     }
+
+    rw->ring = virt_machine_rewind_init(r, r->common.cosim_rewind_depth, 0);
+    if (!rw->ring) {
+        if (rw->out != dromajo_stderr)
+            fclose(rw->out);
+        free(rw);
+        return -1;
+    }
+
+    r->common.cosim_rewind = rw;
+
     return 0;
 }
+
+static void cosim_rewind_end(RISCVMachine *r) {
+    CosimRewind *rw = r->common.cosim_rewind;
+
+    virt_machine_rewind_free(r, rw->ring);
+    if (rw->out != dromajo_stderr)
+        fclose(rw->out);
+    free(rw->log);
+    free(rw);
+    free(r->common.cosim_rewind_log);
+    r->common.cosim_rewind     = NULL;
+    r->common.cosim_rewind_log = NULL;
+}
+
+/* Drops the calls before the oldest checkpoint */
+static void cosim_rewind_trim(CosimRewind *rw) {
+    uint64_t oldest = virt_machine_rewind_tag(rw->ring, 0);
+    size_t   n      = oldest - rw->log_first;
+
+    if (n == 0)
+        return;
+
+    memmove(rw->log, rw->log + n, (rw->log_size - n) * sizeof *rw->log);
+    rw->log_size -= n;
+    rw->log_first = oldest;
+}
+
+static void cosim_rewind_record(RISCVMachine *r, const CosimLogEntry *e) {
+    CosimRewind *rw = r->common.cosim_rewind;
+
+    if (e->kind == COSIM_LOG_STEP && rw->steps++ >= rw->interval) {
+        if (virt_machine_rewind_checkpoint(r, rw->ring, rw->log_first + rw->log_size))
+            cosim_rewind_trim(rw);
+        rw->steps = 1;
+    }
+
+    if (rw->log_size == rw->log_max) {
+        rw->log_max = rw->log_max ? rw->log_max * 2 : 4096;
+        rw->log     = (CosimLogEntry *)realloc(rw->log, rw->log_max * sizeof *rw->log);
+        assert(rw->log);
+    }
+    rw->log[rw->log_size++] = *e;
+}
+
+/* The model was reset behind the log, start over from here */
+static void cosim_rewind_forget(RISCVMachine *r) {
+    CosimRewind *rw = r->common.cosim_rewind;
+
+    virt_machine_rewind_forget(r, rw->ring, rw->log_first + rw->log_size);
+    cosim_rewind_trim(rw);
+    rw->steps = 0;
+}
+
+static void cosim_rewind_dump_regs(FILE *f, RISCVCPUState *s, int hartid) {
+    fprintf(f,
+            "[rewind] hart %d pc %016" PRIx64 " priv %d mstatus %016" PRIx64 "\n",
+            hartid,
+            riscv_get_pc(s),
+            riscv_get_priv_level(s),
+            riscv_cpu_get_mstatus(s));
+    for (int i = 0; i < 32; ++i)
+        fprintf(f, "x%-2d %016" PRIx64 "%s", i, riscv_get_reg(s, i), i % 4 == 3 ? "\n" : "  ");
+    for (int i = 0; i < 32; ++i)
+        fprintf(f, "f%-2d %016" PRIx64 "%s", i, riscv_get_fpreg(s, i), i % 4 == 3 ? "\n" : "  ");
+}
+
+/*
+ * cosim_rewind_replay --
+ *
+ * Called right after the last logged step failed with exit_code.
+ */
+static void cosim_rewind_replay(RISCVMachine *r, int hartid, int exit_code) {
+    CosimRewind *rw   = r->common.cosim_rewind;
+    FILE *       out  = rw->out;
+    uint64_t     fail = rw->log_first + rw->log_size - 1;
+    int          i    = virt_machine_rewind_count(rw->ring) - 1;
+
+    while (i > 0 && virt_machine_rewind_tag(rw->ring, i) + rw->interval > fail) --i;
+
+    uint64_t from = virt_machine_rewind_tag(rw->ring, i);
+    fprintf(out,
+            "[rewind] hart %d failed with exit code %d, replaying the %" PRIu64 " calls before it\n",
+            hartid,
+            exit_code,
+            fail - from);
+
+    virt_machine_rewind(r, rw->ring, i);
+
+    /* The journal already has these calls */
+    Journal *journal  = r->common.journal;
+    r->common.journal = NULL;
+
+    int code = 0;
+    rw->steps = 0;
+    for (uint64_t k = from; k <= fail; ++k) {
+        const CosimLogEntry *e = &rw->log[k - rw->log_first];
+        RISCVCPUState *      s = r->cpu_state[e->hartid];
+        CosimRetired         ret;
+
+        switch (e->kind) {
+            case COSIM_LOG_STEP:
+                rw->steps++;
+                r->common.maxinsns--;
+                if (riscv_terminated(s))
+                    break;
+                code = cosim_execute(r, s, e->addr, e->insn, e->value, &ret, out);
+                if (code == 0)
+                    code = cosim_check(r, s, e->hartid, &ret, e->addr, e->insn, e->value, e->mstatus, e->check, NULL, out, true);
+                if (trace_insn_is_mem(ret.insn))
+                    fprintf(out, "  mem 0x%016" PRIx64 "\n", s->last_data_paddr);
+                break;
+
+            case COSIM_LOG_TRAP: cosim_raise_trap(&r->common, e->value, out); break;
+
+            case COSIM_LOG_OVERRIDE_MEM:
+                fprintf(out,
+                        "[DEBUG] DUT wrote %016" PRIx64 " (%d bytes) at %016" PRIx64 "\n",
+                        e->value,
+                        1 << e->size_log2,
+                        e->addr);
+                riscv_machine_override_mem(r, e->addr, e->value, e->size_log2);
+                break;
+        }
+    }
+
+    r->common.journal = journal;
+
+    cosim_rewind_dump_regs(out, r->cpu_state[hartid], hartid);
+    fprintf(out, "[rewind] the replay %s\n", code == exit_code ? "failed the same way" : "did not fail the same way");
+    fflush(out);
+}
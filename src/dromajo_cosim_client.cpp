@@ -0,0 +1,324 @@
+/*
+ * dromajo_cosim API on top of dromajo_cosim_server
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Link libdromajo_cosim_client instead of libdromajo_cosim to run the
+ * reference model in a dromajo_cosim_server process.  The server is
+ * looked up in $DROMAJO_COSIM_SERVER, then in the PATH.  Steps are
+ * queued and return at once, so a step reports a mismatch found by the
+ * server some calls later, except for batches that ask for the results;
+ * dromajo_cosim_fini returns once the server is done.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "dromajo_cosim.h"
+#include "dromajo_cosim_ipc.h"
+
+struct dromajo_cosim_state_st {
+    DromajoIpc *ipc;
+    char        name[64];
+    pid_t       server;
+    bool        server_dead; /* already reaped */
+    uint64_t    head;
+    uint64_t    tail_cache;
+
+    /* Where messages go once the server is dead */
+    DromajoIpcMsg dead_msg;
+};
+
+static void client_cleanup(dromajo_cosim_state_t *c) {
+    munmap(c->ipc, sizeof(DromajoIpc));
+    shm_unlink(c->name);
+    free(c);
+}
+
+dromajo_cosim_state_t *dromajo_cosim_init(int argc, char *argv[]) {
+    dromajo_cosim_state_t *c = (dromajo_cosim_state_t *)calloc(1, sizeof *c);
+
+    snprintf(c->name, sizeof c->name, "/dromajo_cosim.%d", (int)getpid());
+    int fd = shm_open(c->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(DromajoIpc)) < 0) {
+        perror(c->name);
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(c->name);
+        }
+        free(c);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(DromajoIpc), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(c->name);
+        shm_unlink(c->name);
+        free(c);
+        return NULL;
+    }
+
+    /* The object is zero filled, which is a valid state for the atomics */
+    c->ipc = (DromajoIpc *)p;
+    memcpy(c->ipc->magic, DROMAJO_IPC_MAGIC, 8);
+    c->ipc->version = DROMAJO_IPC_VERSION;
+    c->ipc->state.store(DROMAJO_IPC_STARTING, std::memory_order_release);
+
+    const char *server = getenv("DROMAJO_COSIM_SERVER");
+    if (!server)
+        server = "dromajo_cosim_server";
+
+    char **args = (char **)calloc(argc + 2, sizeof *args);
+    args[0]     = (char *)server;
+    args[1]     = c->name;
+    for (int i = 1; i < argc; ++i) args[i + 1] = argv[i];
+
+    c->server = fork();
+    if (c->server == 0) {
+        execvp(server, args);
+        perror(server);
+        _exit(127);
+    }
+    free(args);
+    if (c->server < 0) {
+        perror("fork");
+        client_cleanup(c);
+        return NULL;
+    }
+
+    while (c->ipc->state.load(std::memory_order_acquire) == DROMAJO_IPC_STARTING) {
+        if (waitpid(c->server, NULL, WNOHANG) == c->server)
+            break;
+        std::this_thread::yield();
+    }
+    if (c->ipc->state.load(std::memory_order_acquire) != DROMAJO_IPC_READY) {
+        fprintf(stderr, "dromajo_cosim_init: %s did not start\n", server);
+        waitpid(c->server, NULL, 0);
+        client_cleanup(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/*
+ * client_server_dead --
+ *
+ * Called while waiting for the server.  If it died (an assert, an exit
+ * of the model or a kill), reaps it and fails the run through
+ * exit_code, so that the calls return instead of waiting forever.
+ */
+static bool client_server_dead(dromajo_cosim_state_t *c) {
+    int status;
+
+    if (c->server_dead)
+        return true;
+    if (waitpid(c->server, &status, WNOHANG) != c->server)
+        return false;
+
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "dromajo_cosim: the server was killed by signal %d\n", WTERMSIG(status));
+    else
+        fprintf(stderr, "dromajo_cosim: the server exited with status %d\n", WEXITSTATUS(status));
+    c->server_dead = true;
+    if (!c->ipc->exit_code.load(std::memory_order_relaxed))
+        c->ipc->exit_code.store(1, std::memory_order_release);
+    return true;
+}
+
+/* Returns the next free message of the ring */
+static DromajoIpcMsg *client_msg(dromajo_cosim_state_t *c, int kind, int hartid) {
+    while (c->head - c->tail_cache >= DROMAJO_IPC_RING) {
+        c->tail_cache = c->ipc->tail.load(std::memory_order_acquire);
+        if (c->head - c->tail_cache < DROMAJO_IPC_RING)
+            break;
+        if (client_server_dead(c))
+            return &c->dead_msg;
+        std::this_thread::yield();
+    }
+
+    DromajoIpcMsg *msg = c->server_dead ? &c->dead_msg : &c->ipc->ring[c->head % DROMAJO_IPC_RING];
+    msg->kind          = kind;
+    msg->hartid        = hartid;
+
+    return msg;
+}
+
+static void client_send(dromajo_cosim_state_t *c) {
+    if (!c->server_dead)
+        c->ipc->head.store(++c->head, std::memory_order_release);
+}
+
+/* Waits for the server to go through the ring, returns false if it is dead */
+static bool client_wait(dromajo_cosim_state_t *c) {
+    while (c->ipc->tail.load(std::memory_order_acquire) != c->head) {
+        if (client_server_dead(c))
+            return false;
+        std::this_thread::yield();
+    }
+    c->tail_cache = c->head;
+
+    return true;
+}
+
+/* Sends a call and waits for the server to go through it, returns
+   exit_code instead if the server is dead */
+static int64_t client_call(dromajo_cosim_state_t *c) {
+    client_send(c);
+    if (!client_wait(c))
+        return c->ipc->exit_code.load(std::memory_order_acquire);
+
+    return c->ipc->result;
+}
+
+void dromajo_cosim_fini(dromajo_cosim_state_t *c) {
+    if (!client_server_dead(c)) {
+        client_msg(c, DROMAJO_IPC_FINI, 0);
+        client_call(c);
+        if (!c->server_dead)
+            waitpid(c->server, NULL, 0);
+    }
+    client_cleanup(c);
+}
+
+int dromajo_cosim_step(dromajo_cosim_state_t *c, int hartid, uint64_t dut_pc, uint32_t dut_insn, uint64_t dut_wdata,
+                       uint64_t mstatus, bool check) {
+    DromajoIpcMsg *msg = client_msg(c, DROMAJO_IPC_STEP, hartid);
+    msg->addr          = dut_pc;
+    msg->insn          = dut_insn;
+    msg->value         = dut_wdata;
+    msg->mstatus       = mstatus;
+    msg->check         = check;
+    client_send(c);
+
+    return c->ipc->exit_code.load(std::memory_order_acquire);
+}
+
+/*
+ * dromajo_cosim_step_batch --
+ *
+ * Without out the commits are queued like steps.  With out the
+ * commits are sent a ring at a time and the server is waited for, so
+ * that the result of each commit can be read back from its slot.
+ */
+int dromajo_cosim_step_batch(dromajo_cosim_state_t *c, int hartid, const dromajo_cosim_commit_t *commits, int n,
+                             dromajo_cosim_result_t *out) {
+    if (!out) {
+        for (int i = 0; i < n; ++i) {
+            if (dromajo_cosim_step(c,
+                                   hartid,
+                                   commits[i].pc,
+                                   commits[i].insn,
+                                   commits[i].wdata,
+                                   commits[i].mstatus,
+                                   commits[i].check))
+                return i + 1;
+        }
+        return n;
+    }
+
+    for (int i = 0; i < n;) {
+        int      k     = n - i < DROMAJO_IPC_RING ? n - i : DROMAJO_IPC_RING;
+        uint64_t first = c->head;
+
+        for (int j = 0; j < k; ++j) {
+            const dromajo_cosim_commit_t *e   = &commits[i + j];
+            DromajoIpcMsg *               msg = client_msg(c, DROMAJO_IPC_STEP, hartid);
+            msg->addr                         = e->pc;
+            msg->insn                         = e->insn;
+            msg->value                        = e->wdata;
+            msg->mstatus                      = e->mstatus;
+            msg->check                        = e->check;
+            client_send(c);
+        }
+        client_wait(c);
+        uint64_t tail = c->ipc->tail.load(std::memory_order_acquire);
+
+        for (int j = 0; j < k; ++j, ++i) {
+            if (first + j >= tail) {
+                /* The server died before it got to this commit */
+                memset(&out[i], 0, sizeof out[i]);
+                out[i].exit_code = c->ipc->exit_code.load(std::memory_order_acquire);
+                return i + 1;
+            }
+            out[i] = c->ipc->results[(first + j) % DROMAJO_IPC_RING];
+            /* An earlier step had already failed, dromajo_cosim_step reports it */
+            if (out[i].exit_code == DROMAJO_IPC_UNCHECKED)
+                return i;
+            if (out[i].exit_code)
+                return i + 1;
+        }
+    }
+
+    return n;
+}
+
+void dromajo_cosim_raise_trap(dromajo_cosim_state_t *c, int hartid, int64_t cause) {
+    DromajoIpcMsg *msg = client_msg(c, DROMAJO_IPC_RAISE_TRAP, hartid);
+    msg->value         = cause;
+    client_send(c);
+}
+
+int dromajo_cosim_override_mem(dromajo_cosim_state_t *c, int hartid, uint64_t dut_paddr, uint64_t dut_val, int size_log2) {
+    DromajoIpcMsg *msg = client_msg(c, DROMAJO_IPC_OVERRIDE_MEM, hartid);
+    msg->addr          = dut_paddr;
+    msg->value         = dut_val;
+    msg->size_log2     = size_log2;
+
+    return client_call(c);
+}
+
+/* The snapshots live in the server, the handle is its address there */
+dromajo_cosim_snapshot_t *dromajo_cosim_snapshot(dromajo_cosim_state_t *c) {
+    client_msg(c, DROMAJO_IPC_SNAPSHOT, 0);
+    int64_t snap = client_call(c);
+
+    return c->server_dead ? NULL : (dromajo_cosim_snapshot_t *)(uintptr_t)snap;
+}
+
+void dromajo_cosim_restore(dromajo_cosim_state_t *c, dromajo_cosim_snapshot_t *snap) {
+    DromajoIpcMsg *msg = client_msg(c, DROMAJO_IPC_RESTORE, 0);
+    msg->addr          = (uintptr_t)snap;
+    client_call(c);
+}
+
+void dromajo_cosim_snapshot_free(dromajo_cosim_state_t *c, dromajo_cosim_snapshot_t *snap) {
+    DromajoIpcMsg *msg = client_msg(c, DROMAJO_IPC_SNAPSHOT_FREE, 0);
+    msg->addr          = (uintptr_t)snap;
+    client_send(c);
+}
+
+int dromajo_cosim_threads_start(dromajo_cosim_state_t *c) {
+    client_msg(c, DROMAJO_IPC_THREADS_START, 0);
+
+    return client_call(c);
+}
+
+int dromajo_cosim_threads_sync(dromajo_cosim_state_t *c) {
+    client_msg(c, DROMAJO_IPC_THREADS_SYNC, 0);
+
+    return client_call(c);
+}
+
+void dromajo_cosim_threads_stop(dromajo_cosim_state_t *c) {
+    client_msg(c, DROMAJO_IPC_THREADS_STOP, 0);
+    client_call(c);
+}
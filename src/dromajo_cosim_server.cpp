@@ -0,0 +1,193 @@
+/*
+ * Cosimulation server
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Runs the reference model in its own process for a testbench linked
+ * with libdromajo_cosim_client, which starts it as
+ *
+ *   dromajo_cosim_server $shm_name $dromajoargs ...
+ *
+ * and sends the dromajo_cosim_* calls through the shared memory ring
+ * described in dromajo_cosim_ipc.h.  Consecutive steps of a hart are
+ * checked with one dromajo_cosim_step_batch call.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "dromajo.h"
+#include "dromajo_cosim.h"
+#include "dromajo_cosim_ipc.h"
+
+#define SERVER_BATCH 256
+
+static DromajoIpc *server_map(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, sizeof(DromajoIpc), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(name);
+        return NULL;
+    }
+
+    DromajoIpc *ipc = (DromajoIpc *)p;
+    if (memcmp(ipc->magic, DROMAJO_IPC_MAGIC, 8) || ipc->version != DROMAJO_IPC_VERSION) {
+        fprintf(stderr, "%s: not a dromajo cosim ring\n", name);
+        return NULL;
+    }
+
+    return ipc;
+}
+
+/*
+ * server_steps --
+ *
+ * Checks the steps of one hart starting at msg, at most n of them,
+ * and leaves their outcome in the matching results slots.  Returns the
+ * number of messages consumed.
+ */
+static uint64_t server_steps(dromajo_cosim_state_t *s, DromajoIpc *ipc, const DromajoIpcMsg *msg, uint64_t n) {
+    static dromajo_cosim_commit_t commits[SERVER_BATCH];
+    dromajo_cosim_result_t *      results = &ipc->results[msg - ipc->ring];
+    int                           done    = 0;
+    int                           k;
+
+    for (k = 0; k < (int)n && k < SERVER_BATCH && msg[k].kind == DROMAJO_IPC_STEP && msg[k].hartid == msg->hartid; ++k) {
+        commits[k].pc      = msg[k].addr;
+        commits[k].insn    = msg[k].insn;
+        commits[k].wdata   = msg[k].value;
+        commits[k].mstatus = msg[k].mstatus;
+        commits[k].check   = msg[k].check;
+    }
+
+    /* Nothing is checked past the first failure, until a restore */
+    if (!ipc->exit_code.load(std::memory_order_relaxed)) {
+        done = dromajo_cosim_step_batch(s, msg->hartid, commits, k, results);
+        if (done && results[done - 1].exit_code)
+            ipc->exit_code.store(results[done - 1].exit_code, std::memory_order_release);
+    }
+    for (int i = done; i < k; ++i) results[i].exit_code = DROMAJO_IPC_UNCHECKED;
+
+    return k;
+}
+
+/* Returns false after DROMAJO_IPC_FINI */
+static bool server_call(dromajo_cosim_state_t *s, DromajoIpc *ipc, const DromajoIpcMsg *msg) {
+    switch (msg->kind) {
+        case DROMAJO_IPC_RAISE_TRAP: dromajo_cosim_raise_trap(s, msg->hartid, msg->value); break;
+
+        case DROMAJO_IPC_OVERRIDE_MEM:
+            ipc->result = dromajo_cosim_override_mem(s, msg->hartid, msg->addr, msg->value, msg->size_log2);
+            break;
+
+        case DROMAJO_IPC_SNAPSHOT: ipc->result = (int64_t)(uintptr_t)dromajo_cosim_snapshot(s); break;
+
+        case DROMAJO_IPC_RESTORE:
+            dromajo_cosim_restore(s, (dromajo_cosim_snapshot_t *)(uintptr_t)msg->addr);
+            ipc->exit_code.store(0, std::memory_order_release);
+            break;
+
+        case DROMAJO_IPC_SNAPSHOT_FREE: dromajo_cosim_snapshot_free(s, (dromajo_cosim_snapshot_t *)(uintptr_t)msg->addr); break;
+
+        case DROMAJO_IPC_THREADS_START: ipc->result = dromajo_cosim_threads_start(s); break;
+
+        case DROMAJO_IPC_THREADS_SYNC: {
+            int exit_code = dromajo_cosim_threads_sync(s);
+            if (exit_code && !ipc->exit_code.load(std::memory_order_relaxed))
+                ipc->exit_code.store(exit_code, std::memory_order_release);
+            ipc->result = ipc->exit_code.load(std::memory_order_relaxed);
+            break;
+        }
+
+        case DROMAJO_IPC_THREADS_STOP: dromajo_cosim_threads_stop(s); break;
+
+        case DROMAJO_IPC_FINI: dromajo_cosim_fini(s); return false;
+
+        default: fprintf(dromajo_stderr, "dromajo_cosim_server: unknown message %d\n", msg->kind); exit(EXIT_FAILURE);
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    dromajo_stdout = stdout;
+    dromajo_stderr = stderr;
+
+    if (argc < 3) {
+        fprintf(stderr,
+                "usage: %s $shm_name $dromajoargs ...\n"
+                "       started by the testbench through libdromajo_cosim_client\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    DromajoIpc *ipc = server_map(argv[1]);
+    if (!ipc)
+        return EXIT_FAILURE;
+
+    /* Prep args for dromajo_cosim_init */
+    char *progname = argv[0];
+    argc -= 1;
+    argv += 1;
+    argv[0] = progname;
+
+    dromajo_cosim_state_t *s = dromajo_cosim_init(argc, argv);
+    if (!s) {
+        ipc->state.store(DROMAJO_IPC_FAILED, std::memory_order_release);
+        return EXIT_FAILURE;
+    }
+    ipc->state.store(DROMAJO_IPC_READY, std::memory_order_release);
+
+    pid_t    client = getppid();
+    uint64_t tail   = ipc->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        uint64_t head = ipc->head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            /* The testbench went away without a dromajo_cosim_fini */
+            if (getppid() != client)
+                return EXIT_FAILURE;
+            std::this_thread::yield();
+            continue;
+        }
+
+        const DromajoIpcMsg *msg = &ipc->ring[tail % DROMAJO_IPC_RING];
+        if (msg->kind == DROMAJO_IPC_STEP) {
+            /* A run of steps up to the end of the ring or of what was written */
+            uint64_t n = DROMAJO_IPC_RING - tail % DROMAJO_IPC_RING;
+            tail += server_steps(s, ipc, msg, n < head - tail ? n : head - tail);
+        } else {
+            bool keep_going = server_call(s, ipc, msg);
+            tail++;
+            if (!keep_going) {
+                ipc->state.store(DROMAJO_IPC_DONE, std::memory_order_release);
+                ipc->tail.store(tail, std::memory_order_release);
+                return EXIT_SUCCESS;
+            }
+        }
+        ipc->tail.store(tail, std::memory_order_release);
+    }
+}
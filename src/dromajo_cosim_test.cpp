@@ -15,29 +15,296 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  *
- * Parse the trace output and check that we cosim correctly.
+ * Parse the trace output (text or binary) and check that we cosim correctly.
  */
 #include "dromajo_cosim.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "dromajo.h"
+#include "trace.h"
+
+/* Binary traces are decoded by a thread, TRACE_NBATCH batches ahead */
+#define TRACE_BATCH  4096
+#define TRACE_NBATCH 4
+
+typedef struct {
+    TraceRecord rec[TRACE_BATCH];
+    int         n;
+} TraceBatch;
+
+struct TraceFeeder {
+    TraceReader rd;
+    TraceBatch  batch[TRACE_NBATCH];
+
+    std::mutex              lock;
+    std::condition_variable cv;
+    uint64_t                produced;
+    uint64_t                consumed;
+    bool                    done;
+    bool                    truncated;
+    bool                    quit;
+    std::thread             thread;
+};
 
 void usage(char *progname) {
     fprintf(stderr,
             "Usage:\n"
             "  %s cosim $trace $dromajoargs ...\n"
-            "  %s read $trace\n",
+            "  %s cosim_threads $trace $dromajoargs ...\n"
+            "  %s read $trace\n"
+            "$trace is either text or a binary trace (dromajo --binary_trace)\n",
+            progname,
             progname,
             progname);
     exit(EXIT_FAILURE);
 }
 
+static void print_record(const TraceRecord *r) {
+    switch (r->kind) {
+        case TRACE_KIND_NONE:
+            fprintf(dromajo_stdout,
+                    "%d %d %016" PRIx64 " %08x                           DASM(%08x)\n",
+                    r->hartid,
+                    r->priv,
+                    r->pc,
+                    r->insn,
+                    r->insn);
+            break;
+
+        case TRACE_KIND_XREG:
+        case TRACE_KIND_FREG:
+            fprintf(dromajo_stdout,
+                    "%d %d %016" PRIx64 " %08x [x%-2d <- %016" PRIx64 "] DASM(%08x)\n",
+                    r->hartid,
+                    r->priv,
+                    r->pc,
+                    r->insn,
+                    r->regno,
+                    r->value,
+                    r->insn);
+            break;
+    }
+}
+
+/*
+ * check_record --
+ *
+ * Prints one retired instruction of the trace and, in cosim mode,
+ * steps dromajo with it.  Returns non zero on a mismatch.
+ */
+static int check_record(dromajo_cosim_state_t *s, const TraceRecord *r) {
+    int exception = r->kind == TRACE_KIND_EXCEPTION ? r->cause : 0;
+
+    print_record(r);
+    if (!s)
+        return 0;
+
+    if (exception && (exception < 8 || exception > 11)) {  // do not skip ECALLS
+        dromajo_cosim_raise_trap(s, r->hartid, exception);
+        fprintf(dromajo_stdout, "exception %d with tval %08" PRIx64 "\n", exception, r->value);
+        return 0;
+    }
+
+    int rc = dromajo_cosim_step(s, r->hartid, r->pc, r->insn, r->kind == TRACE_KIND_EXCEPTION ? 0 : r->value, 0, true);
+    if (rc)
+        fprintf(dromajo_stdout, "Exited with %08x\n", rc);
+
+    return rc;
+}
+
+/* Returns the number of records checked, -1 on a failure */
+static int64_t run_text_trace(dromajo_cosim_state_t *s, const char *trace_name, FILE *f) {
+    int64_t steps = 0;
+
+    for (int lineno = 1; !feof(f); ++lineno) {
+        char        buf[99];
+        TraceRecord r;
+        uint32_t    rd = 0;
+
+        if (!fgets(buf, sizeof buf, f))
+            break;
+
+        memset(&r, 0, sizeof r);
+        r.kind = TRACE_KIND_XREG;
+        char x_or_f_reg;
+        int  got = sscanf(buf,
+                         "%d %d %" PRIx64 " (0x%x) %c%d 0x%" PRIx64,
+                         &r.hartid,
+                         &r.priv,
+                         &r.pc,
+                         &r.insn,
+                         &x_or_f_reg,
+                         &rd,
+                         &r.value);
+        r.regno = rd;
+
+        switch (got) {
+            case 4: r.kind = TRACE_KIND_NONE; break;
+
+            case 5:
+                r.kind = TRACE_KIND_EXCEPTION;
+                got    = sscanf(buf,
+                             "%d %d %" PRIx64 " (0x%x) exception %d, tval %" PRIx64,
+                             &r.hartid,
+                             &r.priv,
+                             &r.pc,
+                             &r.insn,
+                             &r.cause,
+                             &r.value);
+                if (got != 6) {
+                    fprintf(dromajo_stderr, "%s:%d: expected exception, coult not parse %s\n", trace_name, lineno, buf);
+                    return -1;
+                }
+                break;
+
+            case 7: break;
+
+            default: fprintf(dromajo_stderr, "%s:%d: couldn't parse %s\n", trace_name, lineno, buf); return -1;
+
+            case 0:
+            case -1: continue;
+        }
+
+        if (check_record(s, &r))
+            return -1;
+        steps++;
+    }
+
+    return steps;
+}
+
+/*
+ * check_commits --
+ *
+ * Steps dromajo with n records of the same hart, none of them an
+ * exception, in a single dromajo_cosim_step_batch call.  Returns the
+ * number of records checked, -1 on a mismatch.
+ */
+static int check_commits(dromajo_cosim_state_t *s, const TraceRecord *r, int n) {
+    static dromajo_cosim_commit_t commits[TRACE_BATCH];
+    static dromajo_cosim_result_t results[TRACE_BATCH];
+
+    for (int i = 0; i < n; ++i) {
+        commits[i].pc      = r[i].pc;
+        commits[i].insn    = r[i].insn;
+        commits[i].wdata   = r[i].value;
+        commits[i].mstatus = 0;
+        commits[i].check   = true;
+    }
+
+    int done = dromajo_cosim_step_batch(s, r->hartid, commits, n, results);
+    for (int i = 0; i < done; ++i) print_record(&r[i]);
+
+    if (done && results[done - 1].exit_code) {
+        fprintf(dromajo_stdout, "Exited with %08x\n", results[done - 1].exit_code);
+        return -1;
+    }
+
+    return done;
+}
+
+static void trace_feeder_thread(TraceFeeder *t) {
+    std::unique_lock<std::mutex> guard(t->lock);
+
+    while (!t->done) {
+        while (t->produced - t->consumed >= TRACE_NBATCH && !t->quit) t->cv.wait(guard);
+        if (t->quit)
+            return;
+        guard.unlock();
+
+        TraceBatch *b = &t->batch[t->produced % TRACE_NBATCH];
+        int         got = 1;
+        for (b->n = 0; b->n < TRACE_BATCH && (got = trace_reader_next(&t->rd, &b->rec[b->n])) > 0; b->n++)
+            ;
+
+        guard.lock();
+        t->truncated = got < 0;
+        t->done      = got <= 0;
+        t->produced++;
+        t->cv.notify_all();
+    }
+}
+
+/*
+ * run_binary_trace --
+ *
+ * The trace is mapped and a thread decodes it in batches while the
+ * records of the previous batches are checked with
+ * dromajo_cosim_step_batch.
+ */
+static int64_t run_binary_trace(dromajo_cosim_state_t *s, const char *trace_name, const void *data, size_t len) {
+    TraceFeeder *t = new TraceFeeder;
+    int64_t      steps = 0;
+
+    trace_reader_init(&t->rd, data, len);
+    t->produced  = 0;
+    t->consumed  = 0;
+    t->done      = false;
+    t->truncated = false;
+    t->quit      = false;
+    t->thread    = std::thread(trace_feeder_thread, t);
+
+    for (;;) {
+        std::unique_lock<std::mutex> guard(t->lock);
+        while (t->consumed == t->produced && !t->done) t->cv.wait(guard);
+        if (t->consumed == t->produced)
+            break;
+        guard.unlock();
+
+        /* Runs of instructions of a hart are checked in one call */
+        TraceBatch *b = &t->batch[t->consumed % TRACE_NBATCH];
+        for (int i = 0, j; i < b->n; i = j) {
+            for (j = i; s && j < b->n && b->rec[j].kind != TRACE_KIND_EXCEPTION && b->rec[j].hartid == b->rec[i].hartid; ++j)
+                ;
+
+            int done = j > i ? check_commits(s, &b->rec[i], j - i) : check_record(s, &b->rec[i]) ? -1 : 1;
+            if (done < 0) {
+                steps = -1;
+                break;
+            }
+            steps += done;
+            j = i + done;
+        }
+
+        guard.lock();
+        t->consumed++;
+        t->cv.notify_all();
+        if (steps < 0)
+            break;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->quit = true;
+        t->cv.notify_all();
+    }
+    t->thread.join();
+
+    if (steps >= 0 && t->truncated) {
+        fprintf(dromajo_stderr, "%s: truncated record after %" PRId64 " steps\n", trace_name, steps);
+        steps = -1;
+    }
+    delete t;
+
+    return steps;
+}
+
 int main(int argc, char *argv[]) {
     char *progname  = argv[0];
     bool  cosim     = false;
+    bool  threads   = false;
     int   exit_code = EXIT_SUCCESS;
 
     dromajo_stdout = stdout;
@@ -51,6 +318,8 @@ int main(int argc, char *argv[]) {
         cosim = false;
     else if (strcmp(cmd, "cosim") == 0)
         cosim = true;
+    else if (strcmp(cmd, "cosim_threads") == 0)
+        cosim = threads = true;
     else
         usage(progname);
 
@@ -61,6 +330,20 @@ int main(int argc, char *argv[]) {
         usage(progname);
     }
 
+    struct stat st;
+    void *      data = MAP_FAILED;
+    char        magic[8];
+    if (fread(magic, 1, sizeof magic, f) == sizeof magic && memcmp(magic, TRACE_MAGIC, sizeof magic) == 0
+        && fstat(fileno(f), &st) == 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (data == MAP_FAILED) {
+            perror(trace_name);
+            usage(progname);
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    rewind(f);
+
     dromajo_cosim_state_t *s = NULL;
     if (cosim) {
         /* Prep args for dromajo_cosim_init */
@@ -71,91 +354,43 @@ int main(int argc, char *argv[]) {
         s = dromajo_cosim_init(argc, argv);
         if (!s)
             usage(progname);
+        if (threads && dromajo_cosim_threads_start(s))
+            usage(progname);
     }
 
-    for (int lineno = 1; !feof(f); ++lineno) {
-        char     buf[99];
-        uint64_t insn_addr, wdata;
-        uint32_t insn, rd;
-        int      priv;
-        int      hartid;
-        uint64_t tval;
-        int      exception;
-
-        if (!fgets(buf, sizeof buf, f))
-            break;
-
-        rd        = 0;
-        wdata     = 0;
-        exception = 0;
-        tval      = 0;
-        char x_or_f_reg;
-        int  got
-            = sscanf(buf, "%d %d %" PRIx64 " (0x%x) %c%d 0x%" PRIx64, &hartid, &priv, &insn_addr, &insn, &x_or_f_reg, &rd, &wdata);
-
-        switch (got) {
-            case 4:
-                fprintf(dromajo_stdout,
-                        "%d %d %016" PRIx64 " %08x                           DASM(%08x)\n",
-                        hartid,
-                        priv,
-                        insn_addr,
-                        insn,
-                        insn);
-                break;
-
-            case 5:
-                got = sscanf(buf,
-                             "%d %d %" PRIx64 " (0x%x) exception %d, tval %" PRIx64,
-                             &hartid,
-                             &priv,
-                             &insn_addr,
-                             &insn,
-                             &exception,
-                             &tval);
-                if (got != 6) {
-                    fprintf(dromajo_stderr, "%s:%d: expected exception, coult not parse %s\n", trace_name, lineno, buf);
-                    goto fail;
-                }
-
-                break;
-
-            case 7:
-                fprintf(dromajo_stdout,
-                        "%d %d %016" PRIx64 " %08x [x%-2d <- %016" PRIx64 "] DASM(%08x)\n",
-                        hartid,
-                        priv,
-                        insn_addr,
-                        insn,
-                        rd,
-                        wdata,
-                        insn);
-                break;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-            default: fprintf(dromajo_stderr, "%s:%d: couldn't parse %s\n", trace_name, lineno, buf); goto fail;
+    int64_t steps;
+    if (data != MAP_FAILED)
+        steps = run_binary_trace(s, trace_name, data, st.st_size);
+    else
+        steps = run_text_trace(s, trace_name, f);
 
-            case 0:
-            case -1: continue;
-        }
+    /* The last commits may still be checked on the hart threads or by a server */
+    int rc;
+    if (cosim && steps >= 0 && (rc = dromajo_cosim_threads_sync(s)) != 0) {
+        fprintf(dromajo_stdout, "Exited with %08x\n", rc);
+        steps = -1;
+    }
 
-        if (!cosim)
-            continue;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
 
-        if (exception && (exception < 8 || exception > 11)) {  // do not skip ECALLS
-            dromajo_cosim_raise_trap(s, hartid, exception);
-            fprintf(dromajo_stdout, "exception %d with tval %08" PRIx64 "\n", exception, tval);
-            continue;
-        }
-        int r = dromajo_cosim_step(s, hartid, insn_addr, insn, wdata, 0, true);
-        if (r) {
-            fprintf(dromajo_stdout, "Exited with %08x\n", r);
-            goto fail;
-        }
-    }
+    if (steps < 0)
+        exit_code = EXIT_FAILURE;
+    else
+        fprintf(dromajo_stderr,
+                "%" PRId64 " steps in %.3f s (%.0f steps/s)\n",
+                steps,
+                secs,
+                secs > 0 ? steps / secs : 0.0);
 
-done:
     if (cosim)
         dromajo_cosim_fini(s);
+    if (data != MAP_FAILED)
+        munmap(data, st.st_size);
+    fclose(f);
 
     if (exit_code == EXIT_SUCCESS)
         fprintf(dromajo_stdout, "\nSUCCESS, PASSED, GOOD!\n");
@@ -166,8 +401,4 @@ done:
         fclose(dromajo_stdout);
 
     exit(exit_code);
-
-fail:
-    exit_code = EXIT_FAILURE;
-    goto done;
 }
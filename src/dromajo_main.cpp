@@ -76,6 +76,10 @@
 #include "slirp/libslirp.h"
 #endif
 #include "elf64.h"
+#include "journal.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
 
 FILE *dromajo_stdout;
 FILE *dromajo_stderr;
@@ -488,7 +492,10 @@ static EthernetDevice *slirp_open(void) {
 BOOL virt_machine_run(RISCVMachine *s, int hartid) {
     (void)virt_machine_get_sleep_duration(s, hartid, MAX_SLEEP_TIME);
 
-    riscv_cpu_interp64(s->cpu_state[hartid], 1);
+    if (!s->common.journal || !journal_step_begin(s->common.journal, hartid))
+        riscv_cpu_interp64(s->cpu_state[hartid], 1);
+    if (s->common.journal)
+        journal_step_end(s->common.journal, hartid);
     RISCVCPUState *cpu = s->cpu_state[hartid];
     if (s->htif_tohost_addr) {
         uint32_t tohost;
@@ -542,6 +549,77 @@ static BOOL net_poll_cb(void *arg) { return net_completed; }
 
 #endif
 
+/* Instruction count with an optional k, M or G suffix */
+static uint64_t parse_insn_count(const char *str) {
+    uint64_t n    = (uint64_t)atoll(str);
+    char     last = str[strlen(str) - 1];
+
+    if (last == 'k' || last == 'K')
+        n *= 1000;
+    else if (last == 'm' || last == 'M')
+        n *= 1000000;
+    else if (last == 'g' || last == 'G')
+        n *= 1000000000;
+
+    return n;
+}
+
+#ifdef LIVECACHE
+typedef struct {
+    uint64_t size;
+    int      assoc;
+    int      line;
+    char     policy[8];
+} LiveCacheGeometry;
+
+/* Cache size with an optional k, M or G (power of two) suffix */
+static uint64_t parse_cache_size(const char *str) {
+    char *   end;
+    uint64_t n = strtoull(str, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+        n <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        n <<= 20;
+    else if (*end == 'g' || *end == 'G')
+        n <<= 30;
+
+    return n;
+}
+
+static void usage(const char *prog, const char *msg);
+
+/* SIZE[:ASSOC[:LINE[:POLICY]]], the omitted fields keep their value */
+static void parse_live_cache(const char *prog, const char *arg, LiveCacheGeometry *g) {
+    char *copy   = strdup(arg);
+    char *size   = strtok(copy, ":");
+    char *assoc  = size ? strtok(NULL, ":") : NULL;
+    char *line   = assoc ? strtok(NULL, ":") : NULL;
+    char *policy = line ? strtok(NULL, ":") : NULL;
+
+    if (!size)
+        usage(prog, "live cache expects an argument like SIZE:ASSOC:LINE:POLICY");
+
+    g->size = parse_cache_size(size);
+    if (assoc)
+        g->assoc = atoi(assoc);
+    if (line)
+        g->line = atoi(line);
+    if (policy)
+        snprintf(g->policy, sizeof g->policy, "%s", policy);
+
+    if (g->size && (g->assoc <= 0 || g->line <= 0 || (g->line & (g->line - 1))
+                    || g->size % ((uint64_t)g->assoc * g->line)))
+        usage(prog, "live cache geometry must have a power of two line and a whole number of sets");
+
+    free(copy);
+}
+
+static LiveCache *new_live_cache(const char *name, const LiveCacheGeometry *g, const VirtMachineParams *p) {
+    return new LiveCache(name, g->size, g->assoc, g->line, g->policy, p->ram_base_addr, p->ram_size);
+}
+#endif
+
 static void usage(const char *prog, const char *msg) {
     fprintf(dromajo_stderr,
             "error: %s\n"
@@ -569,8 +647,26 @@ static void usage(const char *prog, const char *msg) {
             "       --clint START:SIZE set CLINT start address and size in B (defaults to 0x%lx:0x%lx)\n"
             "       --custom_extension add X extension to misa for all cores\n"
 			"       --gdbinit <portname> initialize dromajo with gdb and start listening on localhost:<portname>\n"
+            "       --gdb_rewind INTERVAL[:DEPTH] gdb reverse execution checkpoints every INTERVAL steps, DEPTH kept\n"
+            "                    (default 1000000:64)\n"
+            "       --sample PERIOD:WARMUP:WINDOW SMARTS sampling, checkpoint (or trace) a window every period\n"
+            "       --sample_trace trace the sample windows instead of writing checkpoints\n"
+            "       --binary_trace FILE write the trace in binary (see dromajo_trace)\n"
+            "       --cosim_rewind INTERVAL[:DEPTH[:FILE]] cosim checkpoints every INTERVAL steps, DEPTH kept (default 3),\n"
+            "                      a mismatch replays from one of them into FILE (default stderr)\n"
+            "       --journal_record FILE record the console, network and DUT inputs\n"
+            "       --journal_replay FILE replay the inputs of a recorded run instead of the host ones\n"
+            "       --profile FILE[:PERIOD[:VMLINUX]] sample the guest every PERIOD instructions (default 10007),\n"
+            "                 write folded stacks to FILE and a function table to FILE.functions\n"
+            "       --stats FILE[:SECONDS] write host statistics to FILE every SECONDS (default 10, 0 for none),\n"
+            "               on SIGUSR1 and at the end\n"
 #ifdef LIVECACHE
             "       --live_cache_size live cache warmup for checkpoint (default 8M)\n"
+            "       --live_cache_llc SIZE[:ASSOC[:LINE[:POLICY]]] shared level (default 8M:16:64:LRU)\n"
+            "       --live_cache_l1i SIZE[:ASSOC[:LINE[:POLICY]]] private L1I per hart (default none, 32K:8:64:LRU is typical)\n"
+            "       --live_cache_l1d SIZE[:ASSOC[:LINE[:POLICY]]] private L1D per hart (default none, 32K:8:64:LRU is typical)\n"
+            "                        POLICY is LRU, LRUp, RANDOM or RRIP\n"
+            "       --live_cache_thread update the live caches from a separate thread\n"
 #endif
             "       --clear_ids clear mvendorid, marchid, mimpid for all cores\n",
             msg,
@@ -633,8 +729,26 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     bool        custom_extension         = false;
     const char *simpoint_file            = 0;
     bool        clear_ids                = false;
+    uint64_t    sample_period            = 0;
+    uint64_t    sample_warmup            = 0;
+    uint64_t    sample_window            = 0;
+    bool        sample_trace             = false;
+    uint64_t    cosim_rewind_interval    = 0;
+    int         cosim_rewind_depth       = 3;
+    char *      cosim_rewind_log         = 0;
+    const char *binary_trace_name           = 0;
+    const char *journal_name             = 0;
+    bool        journal_replay           = false;
+    char *      profile_name             = 0;
+    uint64_t    profile_period           = 10007;
+    char *      profile_vmlinux          = 0;
+    char *      stats_name               = 0;
+    int         stats_period             = 10;
 #ifdef LIVECACHE
-    uint64_t    live_cache_size          = 8*1024*1024;
+    LiveCacheGeometry llc_geometry       = {8 << 20, 16, 64, "LRU"};
+    LiveCacheGeometry l1i_geometry       = {0, 8, 64, "LRU"};
+    LiveCacheGeometry l1d_geometry       = {0, 8, 64, "LRU"};
+    bool              live_cache_thread  = false;
 #endif
 
     dromajo_stdout = stdout;
@@ -667,8 +781,21 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
             {"custom_extension",              no_argument, 0,  'u' }, // CFG
             {"clear_ids",                     no_argument, 0,  'L' }, // CFG
             {"gdbinit",                     required_argument, 0,  'G' }, // CFG
+            {"gdb_rewind",              required_argument, 0,  'g' },
+            {"sample",                  required_argument, 0,  'Y' },
+            {"sample_trace",                  no_argument, 0,  'T' },
+            {"binary_trace",            required_argument, 0,  'B' },
+            {"cosim_rewind",            required_argument, 0,  'W' },
+            {"journal_record",          required_argument, 0,  'j' },
+            {"journal_replay",          required_argument, 0,  'k' },
+            {"profile",                 required_argument, 0,  'F' },
+            {"stats",                   required_argument, 0,  'H' },
 #ifdef LIVECACHE
             {"live_cache_size",         required_argument, 0,  'w' }, // CFG
+            {"live_cache_llc",          required_argument, 0,  'K' },
+            {"live_cache_l1i",          required_argument, 0,  'I' },
+            {"live_cache_l1d",          required_argument, 0,  'J' },
+            {"live_cache_thread",             no_argument, 0,  'E' },
 #endif
             {0,                         0,                 0,  0 }
         };
@@ -712,16 +839,7 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
             case 'm':
                 if (maxinsns)
                     usage(prog, "already had a max instructions");
-                maxinsns = (uint64_t)atoll(optarg);
-                {
-                    char last = optarg[strlen(optarg) - 1];
-                    if (last == 'k' || last == 'K')
-                        maxinsns *= 1000;
-                    else if (last == 'm' || last == 'M')
-                        maxinsns *= 1000000;
-                    else if (last == 'g' || last == 'G')
-                        maxinsns *= 1000000000;
-                }
+                maxinsns = parse_insn_count(optarg);
                 break;
 
             case 't':
@@ -828,23 +946,114 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
 
             case 'L': clear_ids = true; break;
 
+            case 'Y': {
+                char *copy = strdup(optarg);
+                char *a    = strtok(copy, ":");
+                char *b    = a ? strtok(NULL, ":") : NULL;
+                char *c    = b ? strtok(NULL, ":") : NULL;
+
+                if (!c)
+                    usage(prog, "--sample expects an argument like PERIOD:WARMUP:WINDOW");
+                sample_period = parse_insn_count(a);
+                sample_warmup = parse_insn_count(b);
+                sample_window = parse_insn_count(c);
+                if (sample_window == 0 || sample_warmup + sample_window > sample_period)
+                    usage(prog, "--sample WARMUP + WINDOW must fit in PERIOD");
+
+                free(copy);
+            } break;
+
+            case 'T': sample_trace = true; break;
+
+            case 'W': {
+                char *copy = strdup(optarg);
+                char *a    = strtok(copy, ":");
+                char *b    = a ? strtok(NULL, ":") : NULL;
+                char *c    = b ? strtok(NULL, "") : NULL;
+
+                cosim_rewind_interval = a ? parse_insn_count(a) : 0;
+                if (cosim_rewind_interval == 0)
+                    usage(prog, "--cosim_rewind expects an argument like INTERVAL[:DEPTH[:FILE]]");
+                if (b)
+                    cosim_rewind_depth = atoi(b);
+                if (cosim_rewind_depth < 1)
+                    usage(prog, "--cosim_rewind DEPTH must be at least 1");
+                if (c)
+                    cosim_rewind_log = strdup(c);
+
+                free(copy);
+            } break;
+
+            case 'j':
+            case 'k':
+                if (journal_name)
+                    usage(prog, "already had a journal");
+                journal_name   = strdup(optarg);
+                journal_replay = c == 'k';
+                break;
+
+            case 'F': {
+                char *copy = strdup(optarg);
+                char *a    = strtok(copy, ":");
+                char *b    = a ? strtok(NULL, ":") : NULL;
+                char *c    = b ? strtok(NULL, "") : NULL;
+
+                if (!a)
+                    usage(prog, "--profile expects an argument like FILE[:PERIOD[:VMLINUX]]");
+                profile_name = strdup(a);
+                if (b)
+                    profile_period = parse_insn_count(b);
+                if (profile_period == 0)
+                    usage(prog, "--profile PERIOD must be at least 1");
+                if (c)
+                    profile_vmlinux = strdup(c);
+
+                free(copy);
+            } break;
+
+            case 'H': {
+                char *copy = strdup(optarg);
+                char *a    = strtok(copy, ":");
+                char *b    = a ? strtok(NULL, "") : NULL;
+
+                if (!a)
+                    usage(prog, "--stats expects an argument like FILE[:SECONDS]");
+                stats_name = strdup(a);
+                if (b)
+                    stats_period = atoi(b);
+                if (stats_period < 0)
+                    usage(prog, "--stats SECONDS must not be negative");
+
+                free(copy);
+            } break;
+
+            case 'B':
+                if (binary_trace_name)
+                    usage(prog, "already had a binary trace file");
+                binary_trace_name = strdup(optarg);
+                break;
+
 #ifdef LIVECACHE
             case 'w':
-                if (live_cache_size)
-                    usage(prog, "already had a live_cache_size");
-                live_cache_size = (uint64_t)atoll(optarg);
+                llc_geometry.size = (uint64_t)atoll(optarg);
                 {
                     char last = optarg[strlen(optarg) - 1];
                     if (last == 'k' || last == 'K')
-                        live_cache_size *= 1000;
+                        llc_geometry.size *= 1000;
                     else if (last == 'm' || last == 'M')
-                        live_cache_size *= 1000000;
+                        llc_geometry.size *= 1000000;
                     else if (last == 'g' || last == 'G')
-                        live_cache_size *= 1000000000;
+                        llc_geometry.size *= 1000000000;
                 }
                 break;
+
+            case 'K': parse_live_cache(prog, optarg, &llc_geometry); break;
+            case 'I': parse_live_cache(prog, optarg, &l1i_geometry); break;
+            case 'J': parse_live_cache(prog, optarg, &l1d_geometry); break;
+            case 'E': live_cache_thread = true; break;
 #endif
             case 'G':
+            case 'g':
                 break;
 
             default: usage(prog, "I'm not having this argument");
@@ -977,6 +1186,14 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     p->console       = console_init(TRUE, stdin, dromajo_stdout);
     p->dump_memories = dump_memories;
 
+    Journal *journal = NULL;
+    if (journal_name) {
+        journal = journal_replay ? journal_open_replay(journal_name) : journal_open_record(journal_name);
+        if (!journal)
+            exit(1);
+        p->console = journal_console(journal, p->console);
+    }
+
     // Setup bootrom params
     if (bootrom_name)
         p->bootrom_name = bootrom_name;
@@ -1014,9 +1231,39 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     if (!s)
         return NULL;
 
+    if (journal) {
+        journal_attach(journal, s);
+        s->common.journal = journal;
+    }
+
 #ifdef LIVECACHE
     // LiveCache (should be ~2x larger than real LLC)
-    s->llc = new LiveCache("LiveCache", live_cache_size, p->ram_base_addr, p->ram_size);
+    s->llc         = new_live_cache("LLC", &llc_geometry, p);
+    s->llc_enabled = true;
+    for (int i = 0; i < s->ncpus; ++i) {
+        char name[16];
+
+        snprintf(name, sizeof name, "L1I%d", i);
+        s->l1i[i] = l1i_geometry.size ? new_live_cache(name, &l1i_geometry, p) : NULL;
+        snprintf(name, sizeof name, "L1D%d", i);
+        s->l1d[i] = l1d_geometry.size ? new_live_cache(name, &l1d_geometry, p) : NULL;
+
+        // Fetches are tracked once per line of the smallest instruction side line
+        int line = s->l1i[i] && s->l1i[i]->getLineSize() < s->llc->getLineSize() ? s->l1i[i]->getLineSize()
+                                                                                 : s->llc->getLineSize();
+        s->cpu_state[i]->livecache_ishift = log2i(line);
+        s->cpu_state[i]->livecache_iline  = UINT64_MAX;
+    }
+
+    // Accesses are queued per line of the smallest level
+    int min_line = s->llc->getLineSize();
+    for (int i = 0; i < s->ncpus; ++i) {
+        if (s->l1i[i] && s->l1i[i]->getLineSize() < min_line)
+            min_line = s->l1i[i]->getLineSize();
+        if (s->l1d[i] && s->l1d[i]->getLineSize() < min_line)
+            min_line = s->l1d[i]->getLineSize();
+    }
+    livecache_init_ring(s, log2i(min_line), live_cache_thread);
 #endif
 
     // Overwrite the value specified in the configuration file
@@ -1061,6 +1308,44 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
 
     s->common.snapshot_save_name = snapshot_save_name;
     s->common.trace              = trace;
+    s->common.sample_period      = sample_period;
+    s->common.sample_warmup      = sample_warmup;
+    s->common.sample_window      = sample_window;
+    s->common.sample_trace       = sample_trace;
+
+    s->common.cosim_rewind_interval = cosim_rewind_interval;
+    s->common.cosim_rewind_depth    = cosim_rewind_depth;
+    s->common.cosim_rewind_log      = cosim_rewind_log;
+
+    if (binary_trace_name) {
+        s->common.trace_writer = trace_writer_open(binary_trace_name);
+        if (!s->common.trace_writer)
+            exit(1);
+    }
+
+    if (profile_name) {
+        s->common.profile = profile_open(profile_name, profile_period, s->ncpus);
+        if (!s->common.profile)
+            exit(1);
+
+        /* The ELF run directly is the BIOS, a kernel may be one too */
+        bool symbols = false;
+        if (p->files[VM_FILE_BIOS].buf)
+            symbols |= profile_add_symbols(s->common.profile, p->files[VM_FILE_BIOS].buf, p->files[VM_FILE_BIOS].len);
+        if (p->files[VM_FILE_KERNEL].buf)
+            symbols |= profile_add_symbols(s->common.profile, p->files[VM_FILE_KERNEL].buf, p->files[VM_FILE_KERNEL].len);
+        if (profile_vmlinux) {
+            uint8_t *buf;
+            int      buf_len = load_file(&buf, profile_vmlinux);
+            if (!profile_add_symbols(s->common.profile, buf, buf_len))
+                fprintf(dromajo_stderr, "%s: no function symbols\n", profile_vmlinux);
+            else
+                symbols = true;
+            free(buf);
+        }
+        if (!symbols)
+            fprintf(dromajo_stderr, "--profile: no function symbols, the profile will show addresses as [unknown]\n");
+    }
 
     // Allow the command option argument to overwrite the value
     // specified in the configuration file
@@ -1083,5 +1368,13 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     if (s->common.snapshot_load_name)
         virt_machine_deserialize(s, s->common.snapshot_load_name);
 
+    /* Last, so that loading the machine counts as the "load" phase */
+    if (stats_name) {
+        s->common.stats = stats_open(stats_name, stats_period);
+        if (!s->common.stats)
+            exit(1);
+        virt_machine_add_stats(s, s->common.stats);
+    }
+
     return s;
 }
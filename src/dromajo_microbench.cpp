@@ -0,0 +1,557 @@
+/*
+ * Dromajo host microbenchmarks
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Times the host paths the interpreter leans on, one at a time and
+ * without a guest image: address translation, the loads through the
+ * data TLB (hit and miss), the physical memory map lookup, the softfp
+ * FMA, divide and square root, the copies of virtio descriptors, the
+ * LiveCache lookups and the LiveCache warmup export, and the restore of
+ * an in-process snapshot.  The machine is built by hand, with the
+ * memory map of a regular one, a hart and a virtio console whose queues
+ * are set up as a driver would.
+ *
+ * Each benchmark is run for about -t milliseconds, -r times, and the
+ * fastest run gives its time per operation.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "LiveCacheCore.h"
+#include "riscv_machine.h"
+#include "softfp.h"
+
+/* RAM_BASE_ADDR as in riscv_cpu.h */
+#define RAM_SIZE (64 << 20)
+
+/* Sv39 tables mapping the first 2 MiB of RAM with 4 KiB pages */
+#define PT_ROOT  (RAM_BASE_ADDR + 0x300000)
+#define PT_L1    (PT_ROOT + 0x1000)
+#define PT_L0    (PT_ROOT + 0x2000)
+#define PT_PAGES 512
+
+/* Twice the pages of the TLB, each access evicts the next one to use */
+#define MISS_PAGES (2 * TLB_SIZE)
+
+/* Lines a checkpoint boot ROM has room for, kept by each export */
+#define EXPORT_LINES 1024
+
+/* RAM pages a short random instruction test dirties between resets */
+#define RESTORE_PAGES 60
+
+/* virtio MMIO registers and descriptors, from the virtio 1.0 spec */
+#define VIRTIO_MMIO_QUEUE_SEL        0x030
+#define VIRTIO_MMIO_QUEUE_NUM        0x038
+#define VIRTIO_MMIO_QUEUE_READY      0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY     0x050
+#define VIRTIO_MMIO_QUEUE_DESC_LOW   0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH  0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW  0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW   0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH  0x0a4
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VIRTIODesc;
+
+/* Console queues: 0 goes to the guest, 1 comes from it */
+#define VQ_BASE(q)    (RAM_BASE_ADDR + 0x400000 + (q)*0x1000)
+#define VQ_DESC(q)    VQ_BASE(q)
+#define VQ_AVAIL(q)   (VQ_BASE(q) + 0x400)
+#define VQ_USED(q)    (VQ_BASE(q) + 0x800)
+#define VQ_BUF(q)     (RAM_BASE_ADDR + 0x500000 + (q)*0x10000)
+#define VQ_NUM        16
+#define VQ_CHAIN      4    /* descriptors per request */
+#define VQ_DESC_BYTES 1024 /* bytes per descriptor */
+
+static RISCVMachine *   machine;
+static RISCVCPUState *  cpu;
+static PhysMemoryRange *ram;
+static VIRTIODevice *   console;
+static PhysMemoryRange *console_range;
+static IRQSignal        console_irq;
+static LiveCache *      llc;
+
+/* Everything computed ends up here, so that nothing is optimized out */
+static volatile uint64_t sink;
+
+static uint8_t *ram_ptr(uint64_t paddr) { return ram->phys_mem + (paddr - RAM_BASE_ADDR); }
+
+static uint32_t dev_read(void *opaque, uint32_t offset, int size_log2) { return 0; }
+
+static void dev_write(void *opaque, uint32_t offset, uint32_t val, int size_log2) {}
+
+static void nop_set_irq(void *opaque, int irq_num, int level) {}
+
+static void nop_write_data(void *opaque, const uint8_t *buf, int len) {}
+
+static int nop_read_data(void *opaque, uint8_t *buf, int len) { return 0; }
+
+static CharacterDevice nop_console = {NULL, nop_write_data, nop_read_data};
+
+static void flush_tlb_write_range(void *opaque, uint8_t *ram_addr, size_t ram_size) {
+    riscv_cpu_flush_tlb_write_range_ram(cpu, ram_addr, ram_size);
+}
+
+static void console_mmio_write(uint32_t offset, uint32_t val) {
+    console_range->write_func(console_range->opaque, offset, val, 2);
+}
+
+static void console_queue_init(int q, uint16_t flags) {
+    VIRTIODesc *desc = (VIRTIODesc *)ram_ptr(VQ_DESC(q));
+
+    for (int i = 0; i < VQ_CHAIN; ++i) {
+        desc[i].addr  = VQ_BUF(q) + i * VQ_DESC_BYTES;
+        desc[i].len   = VQ_DESC_BYTES;
+        desc[i].flags = flags | (i + 1 < VQ_CHAIN ? VRING_DESC_F_NEXT : 0);
+        desc[i].next  = i + 1;
+    }
+    /* Every request is the same chain, starting at descriptor 0 */
+    memset(ram_ptr(VQ_AVAIL(q)), 0, 4 + 2 * VQ_NUM);
+
+    console_mmio_write(VIRTIO_MMIO_QUEUE_SEL, q);
+    console_mmio_write(VIRTIO_MMIO_QUEUE_NUM, VQ_NUM);
+    console_mmio_write(VIRTIO_MMIO_QUEUE_DESC_LOW, (uint32_t)VQ_DESC(q));
+    console_mmio_write(VIRTIO_MMIO_QUEUE_DESC_HIGH, (uint64_t)VQ_DESC(q) >> 32);
+    console_mmio_write(VIRTIO_MMIO_QUEUE_AVAIL_LOW, (uint32_t)VQ_AVAIL(q));
+    console_mmio_write(VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (uint64_t)VQ_AVAIL(q) >> 32);
+    console_mmio_write(VIRTIO_MMIO_QUEUE_USED_LOW, (uint32_t)VQ_USED(q));
+    console_mmio_write(VIRTIO_MMIO_QUEUE_USED_HIGH, (uint64_t)VQ_USED(q) >> 32);
+    console_mmio_write(VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+/* Makes one more request available on queue q, as the driver would */
+static void console_queue_push(int q) { ++*(uint16_t *)ram_ptr(VQ_AVAIL(q) + 2); }
+
+/*
+ * machine_init --
+ *
+ * Registers the memory map of virt_machine_init (RAM, boot ROM, UART,
+ * CLINT, PLIC and a virtio console) and creates hart 0, with Sv39 page
+ * tables in RAM for the S mode benchmarks.
+ */
+static void machine_init(void) {
+    machine          = (RISCVMachine *)mallocz(sizeof *machine);
+    machine->mem_map = phys_mem_map_init();
+
+    PhysMemoryMap *map = machine->mem_map;
+    /* needed to handle the RAM dirty bits */
+    map->flush_tlb_write_range = flush_tlb_write_range;
+    cpu_register_ram(map, 0, 4096, DEVRAM_FLAG_DIRTY_BITS);
+    ram = cpu_register_ram(map, RAM_BASE_ADDR, RAM_SIZE, DEVRAM_FLAG_DIRTY_BITS);
+    cpu_register_ram(map, ROM_BASE_ADDR, ROM_SIZE, DEVRAM_FLAG_DIRTY_BITS);
+    cpu_register_device(map, UART0_BASE_ADDR, UART0_SIZE, NULL, dev_read, dev_write, DEVIO_SIZE32);
+    cpu_register_device(map, CLINT_BASE_ADDR, CLINT_SIZE, NULL, dev_read, dev_write, DEVIO_SIZE32);
+    cpu_register_device(map, PLIC_BASE_ADDR, PLIC_SIZE, NULL, dev_read, dev_write, DEVIO_SIZE32);
+
+    VIRTIOBusDef bus;
+    memset(&bus, 0, sizeof bus);
+    irq_init(&console_irq, nop_set_irq, NULL, VIRTIO_IRQ);
+    bus.mem_map   = map;
+    bus.addr      = VIRTIO_BASE_ADDR;
+    bus.irq       = &console_irq;
+    console       = virtio_console_init(&bus, &nop_console);
+    console_range = get_phys_mem_range(map, VIRTIO_BASE_ADDR);
+    console_queue_init(0, VRING_DESC_F_WRITE);
+    console_queue_init(1, 0);
+
+    uint64_t *root = (uint64_t *)ram_ptr(PT_ROOT);
+    uint64_t *l1   = (uint64_t *)ram_ptr(PT_L1);
+    uint64_t *l0   = (uint64_t *)ram_ptr(PT_L0);
+    root[(RAM_BASE_ADDR >> 30) & 511] = (PT_L1 >> 12) << 10 | 1;
+    l1[(RAM_BASE_ADDR >> 21) & 511]   = (PT_L0 >> 12) << 10 | 1;
+    for (int i = 0; i < PT_PAGES; ++i) l0[i] = ((RAM_BASE_ADDR >> 12) + i) << 10 | 0xcf; /* DAXWRV */
+
+    cpu                    = riscv_cpu_init(machine, 0);
+    cpu->physical_addr_len = PHYSICAL_ADDR_LEN_DEFAULT;
+    machine->cpu_state[0]  = cpu;
+    machine->ncpus         = 1;
+
+    llc = new LiveCache("llc", 8 << 20, 16, 64, "LRU", RAM_BASE_ADDR, RAM_SIZE);
+}
+
+/* M mode, or S mode with the Sv39 tables and a PMP entry letting it in */
+static void cpu_set_mode(int priv) {
+    cpu->priv      = priv;
+    cpu->satp      = priv == PRV_M ? 0 : (uint64_t)8 << 60 | PT_ROOT >> 12;
+    cpu->pmp_n     = 1;
+    cpu->pmp[0].lo = 0;
+    cpu->pmp[0].hi = ~(uint64_t)0;
+    cpu->pmpcfg[0] = PMPCFG_R | PMPCFG_W | PMPCFG_X;
+    riscv_cpu_flush_tlb(cpu);
+}
+
+static uint64_t bench_get_phys_addr(uint64_t n, int priv) {
+    target_ulong paddr, sum = 0;
+
+    cpu_set_mode(priv);
+    for (uint64_t i = 0; i < n; ++i) {
+        if (riscv_cpu_get_phys_addr(cpu, RAM_BASE_ADDR + (i % PT_PAGES) * 4096, ACCESS_READ, &paddr))
+            abort();
+        sum += paddr;
+    }
+    return sum;
+}
+
+static uint64_t bench_get_phys_addr_bare(uint64_t n) { return bench_get_phys_addr(n, PRV_M); }
+
+static uint64_t bench_get_phys_addr_sv39(uint64_t n) { return bench_get_phys_addr(n, PRV_S); }
+
+/* Loads within one page, all but the first hit the TLB */
+#define BENCH_READ_HIT(size, uint_type)                                                      \
+    static uint64_t bench_read_u##size##_hit(uint64_t n) {                                   \
+        uint64_t  sum = 0;                                                                   \
+        uint_type val;                                                                       \
+                                                                                             \
+        cpu_set_mode(PRV_M);                                                                 \
+        for (uint64_t i = 0; i < n; ++i) {                                                   \
+            if (riscv_target_read_u##size(cpu, &val, RAM_BASE_ADDR + (i * (size / 8) & 4095))) \
+                abort();                                                                     \
+            sum += val;                                                                      \
+        }                                                                                    \
+        return sum;                                                                          \
+    }
+
+BENCH_READ_HIT(8, uint8_t)
+BENCH_READ_HIT(16, uint16_t)
+BENCH_READ_HIT(32, uint32_t)
+BENCH_READ_HIT(64, uint64_t)
+
+/* Loads from a new page each time, all of them take the slow path */
+static uint64_t bench_read_u64_miss(uint64_t n, int priv) {
+    uint64_t sum = 0, val;
+
+    cpu_set_mode(priv);
+    for (uint64_t i = 0; i < n; ++i) {
+        if (riscv_target_read_u64(cpu, &val, RAM_BASE_ADDR + (i % MISS_PAGES) * 4096))
+            abort();
+        sum += val;
+    }
+    return sum;
+}
+
+static uint64_t bench_read_u64_miss_bare(uint64_t n) { return bench_read_u64_miss(n, PRV_M); }
+
+static uint64_t bench_read_u64_miss_sv39(uint64_t n) { return bench_read_u64_miss(n, PRV_S); }
+
+static uint64_t bench_mem_range(uint64_t n, uint64_t paddr) {
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < n; ++i) sum += (uintptr_t)get_phys_mem_range(machine->mem_map, paddr + (i & 4095));
+    return sum;
+}
+
+static uint64_t bench_mem_range_ram(uint64_t n) { return bench_mem_range(n, RAM_BASE_ADDR); }
+
+static uint64_t bench_mem_range_device(uint64_t n) { return bench_mem_range(n, CLINT_BASE_ADDR); }
+
+static uint64_t bench_mem_range_unmapped(uint64_t n) { return bench_mem_range(n, 0x70000000); }
+
+/* Operands with full mantissas, all positive so that sqrt is defined */
+static sfloat64 fp_operand(uint64_t i) {
+    static const double values[8] = {1.1, 3.14159265358979, 2.718281828459045, 1e10, 7.5e-3, 123456.789, 0.333333333333, 42.0};
+    sfloat64            v;
+
+    memcpy(&v, &values[i & 7], sizeof v);
+    return v;
+}
+
+static uint64_t bench_fma_sf64(uint64_t n) {
+    uint64_t sum = 0;
+    uint32_t fflags;
+
+    for (uint64_t i = 0; i < n; ++i) sum ^= fma_sf64(fp_operand(i), fp_operand(i >> 3), fp_operand(i >> 6), RM_RNE, &fflags);
+    return sum;
+}
+
+static uint64_t bench_div_sf64(uint64_t n) {
+    uint64_t sum = 0;
+    uint32_t fflags;
+
+    for (uint64_t i = 0; i < n; ++i) sum ^= div_sf64(fp_operand(i), fp_operand(i >> 3), RM_RNE, &fflags);
+    return sum;
+}
+
+static uint64_t bench_sqrt_sf64(uint64_t n) {
+    uint64_t sum = 0;
+    uint32_t fflags;
+
+    for (uint64_t i = 0; i < n; ++i) sum ^= sqrt_sf64(fp_operand(i), RM_RNE, &fflags);
+    return sum;
+}
+
+/* Host to guest: 4 KiB into a chain of write descriptors */
+static uint64_t bench_virtio_to_guest(uint64_t n) {
+    static uint8_t buf[VQ_CHAIN * VQ_DESC_BYTES];
+    uint64_t       sum = 0;
+
+    for (uint64_t i = 0; i < n; ++i) {
+        console_queue_push(0);
+        sum += virtio_console_write_data(console, buf, sizeof buf);
+    }
+    return sum;
+}
+
+/* Guest to host: a queue notification for 4 KiB of read descriptors */
+static uint64_t bench_virtio_from_guest(uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+        console_queue_push(1);
+        console_mmio_write(VIRTIO_MMIO_QUEUE_NOTIFY, 1);
+    }
+    return *(uint16_t *)ram_ptr(VQ_USED(1) + 2);
+}
+
+/* 16 KiB of lines that stay in the cache */
+static uint64_t bench_livecache_hit(uint64_t n) {
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < n; ++i) sum += llc->read(RAM_BASE_ADDR + (i * 64 & 0x3fff));
+    return sum;
+}
+
+/* Streams over all of RAM, 8 times the cache, so each line misses */
+static uint64_t bench_livecache_miss(uint64_t n) {
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < n; ++i) sum += llc->read(RAM_BASE_ADDR + (i * 64 & (RAM_SIZE - 1)));
+    return sum;
+}
+
+/*
+ * bench_livecache_export --
+ *
+ * The warmup export of a checkpoint: the EXPORT_LINES most recent lines
+ * of a size_mb MiB cache.  The cache is built in *c on first use and
+ * filled with random reads and writes over twice its size, so most
+ * lines are valid and in no particular order.
+ */
+static uint64_t bench_livecache_export(uint64_t n, LiveCache **cache, int size_mb) {
+    static uint32_t out[2 * EXPORT_LINES];
+    LiveCache *&    c   = *cache;
+    uint64_t        sum = 0;
+
+    if (!c) {
+        uint64_t size  = (uint64_t)size_mb << 20;
+        uint64_t lines = size / 64;
+        uint64_t x     = 88172645463325252ULL;
+
+        c = new LiveCache("export", size, 16, 64, "LRU", RAM_BASE_ADDR, 2 * size);
+        for (uint64_t i = 0; i < 2 * lines; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uint64_t addr = RAM_BASE_ADDR + (x % (2 * lines)) * 64;
+            if (x >> 60)
+                c->read(addr);
+            else
+                c->write(addr);
+        }
+    }
+
+    for (uint64_t i = 0; i < n; ++i) sum += c->traverse(out, EXPORT_LINES);
+    return sum + out[0];
+}
+
+static LiveCache *export_4m, *export_16m, *export_64m, *export_256m;
+
+static uint64_t bench_livecache_export_4m(uint64_t n) { return bench_livecache_export(n, &export_4m, 4); }
+
+static uint64_t bench_livecache_export_16m(uint64_t n) { return bench_livecache_export(n, &export_16m, 16); }
+
+static uint64_t bench_livecache_export_64m(uint64_t n) { return bench_livecache_export(n, &export_64m, 64); }
+
+static uint64_t bench_livecache_export_256m(uint64_t n) { return bench_livecache_export(n, &export_256m, 256); }
+
+/*
+ * bench_snapshot_restore --
+ *
+ * A cosim fast reset: RESTORE_PAGES RAM pages spread over RAM are
+ * written, as the stores of a test would mark them, and the machine
+ * goes back to a snapshot taken on first use.
+ */
+static uint64_t bench_snapshot_restore(uint64_t n) {
+    static VirtMachineSnapshot *snap;
+
+    if (!snap)
+        snap = virt_machine_snapshot(machine);
+
+    for (uint64_t i = 0; i < n; ++i) {
+        for (int p = 0; p < RESTORE_PAGES; ++p) {
+            size_t offset = (size_t)(p * 257 % (RAM_SIZE >> DEVRAM_PAGE_SIZE_LOG2)) << DEVRAM_PAGE_SIZE_LOG2;
+            ram->phys_mem[offset] = (uint8_t)i;
+            phys_mem_set_dirty_bit(ram, offset);
+        }
+        virt_machine_restore(machine, snap);
+    }
+    return ram->phys_mem[0];
+}
+
+static const struct {
+    const char *name;
+    uint64_t (*run)(uint64_t n); /* n operations, returns something to sink */
+} benchmarks[] = {
+    {"get_phys_addr.bare", bench_get_phys_addr_bare},
+    {"get_phys_addr.sv39", bench_get_phys_addr_sv39},
+    {"target_read_u8.hit", bench_read_u8_hit},
+    {"target_read_u16.hit", bench_read_u16_hit},
+    {"target_read_u32.hit", bench_read_u32_hit},
+    {"target_read_u64.hit", bench_read_u64_hit},
+    {"target_read_u64.miss", bench_read_u64_miss_bare},
+    {"target_read_u64.miss_sv39", bench_read_u64_miss_sv39},
+    {"get_phys_mem_range.ram", bench_mem_range_ram},
+    {"get_phys_mem_range.device", bench_mem_range_device},
+    {"get_phys_mem_range.unmapped", bench_mem_range_unmapped},
+    {"softfp.fma_sf64", bench_fma_sf64},
+    {"softfp.div_sf64", bench_div_sf64},
+    {"softfp.sqrt_sf64", bench_sqrt_sf64},
+    {"virtio.to_guest_4k", bench_virtio_to_guest},
+    {"virtio.from_guest_4k", bench_virtio_from_guest},
+    {"livecache.read_hit", bench_livecache_hit},
+    {"livecache.read_miss", bench_livecache_miss},
+    {"livecache.export_4m", bench_livecache_export_4m},
+    {"livecache.export_16m", bench_livecache_export_16m},
+    {"livecache.export_64m", bench_livecache_export_64m},
+    {"livecache.export_256m", bench_livecache_export_256m},
+    {"snapshot.restore_60_pages", bench_snapshot_restore},
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s {options} [benchmark...]\n"
+            "       -r runs          runs per benchmark, the fastest is kept (default 5)\n"
+            "       -t ms            length of a run (default 100)\n"
+            "       -o file          write the results to file (default stdout)\n"
+            "       -l               list the benchmarks\n"
+            "a benchmark argument runs the benchmarks whose name starts with it\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double time_run(uint64_t (*run)(uint64_t), uint64_t n) {
+    double start = now();
+
+    sink += run(n);
+    return now() - start;
+}
+
+/*
+ * measure --
+ *
+ * Finds how many operations take about run_seconds, then returns the
+ * best time per operation over runs runs of that many.  A first
+ * operation, not timed, sets up what the benchmark builds on first use.
+ */
+static double measure(uint64_t (*run)(uint64_t), double run_seconds, int runs, uint64_t &n) {
+    double seconds;
+
+    sink += run(1);
+    for (n = 16;; n *= 2) {
+        seconds = time_run(run, n);
+        if (seconds >= run_seconds / 8)
+            break;
+    }
+    n = n * (run_seconds / seconds) + 1;
+
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        seconds = time_run(run, n) / n;
+        if (i == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    const char *prog        = argv[0];
+    const char *output_name = NULL;
+    int         runs        = 5;
+    double      run_ms      = 100;
+    int         c;
+
+    while ((c = getopt(argc, argv, "r:t:o:lh")) != -1) {
+        switch (c) {
+            case 'r': runs = atoi(optarg); break;
+            case 't': run_ms = atof(optarg); break;
+            case 'o': output_name = optarg; break;
+            case 'l':
+                for (auto &b : benchmarks) printf("%s\n", b.name);
+                return 0;
+            default: usage(prog);
+        }
+    }
+
+    if (runs < 1 || run_ms <= 0)
+        usage(prog);
+
+    /* The benchmarks named by a prefix on the command line, all by default */
+    std::vector<bool> selected(sizeof benchmarks / sizeof *benchmarks, optind == argc);
+    for (int i = optind; i < argc; ++i) {
+        bool found = false;
+        for (size_t j = 0; j < selected.size(); ++j)
+            if (!strncmp(benchmarks[j].name, argv[i], strlen(argv[i])))
+                selected[j] = found = true;
+        if (!found) {
+            fprintf(stderr, "%s: no such benchmark\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *f = output_name ? fopen(output_name, "w") : stdout;
+    if (!f) {
+        perror(output_name);
+        return EXIT_FAILURE;
+    }
+
+    machine_init();
+
+    const char *sep = "";
+    fprintf(f, "{\n  \"benchmarks\": {");
+    for (size_t j = 0; j < selected.size(); ++j) {
+        uint64_t n;
+
+        if (!selected[j])
+            continue;
+        double ns = measure(benchmarks[j].run, run_ms * 1e-3, runs, n) * 1e9;
+        fprintf(f, "%s\n    \"%s\": {\"ns\": %.3f, \"iterations\": %llu}", sep, benchmarks[j].name, ns, (unsigned long long)n);
+        fflush(f);
+        sep = ",";
+    }
+    fprintf(f, "\n  }\n}\n");
+
+    if (output_name)
+        fclose(f);
+    return 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * SimPoint selection for Dromajo basic block vectors
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Reads the dromajo_simpoint.bb file produced by a SIMPOINT build and
+ * follows the SimPoint 3.0 recipe: each interval is normalized and
+ * randomly projected to a few dimensions, k-means is run for every K
+ * up to maxK (several seeds each, in parallel), and the smallest K
+ * whose BIC score reaches a fraction of the best one is picked.  The
+ * interval closest to each centroid is the simpoint.  The output files
+ * use the same format as the SimPoint tool, so the simpoints file is
+ * directly usable with dromajo --simpoint.
+ */
+#include <assert.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef std::vector<std::pair<uint32_t, double>> SparseVector;
+
+struct KMeansResult {
+    int                 k;
+    uint64_t            seed;
+    double              distortion = 0; /* sum of squared distances */
+    double              bic        = 0;
+    std::vector<int>    assign;
+    std::vector<double> centers; /* k * dims */
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s {options} dromajo_simpoint.bb\n"
+            "       -k maxK          largest number of clusters to try (default 30)\n"
+            "       -d dims          dimensions after random projection (default 15)\n"
+            "       -n seeds         k-means initializations per K (default 5)\n"
+            "       -i iterations    maximum k-means iterations (default 100)\n"
+            "       -t threshold     BIC threshold in [0, 1] (default 0.9)\n"
+            "       -j threads       worker threads (default all cores)\n"
+            "       -s seed          random seed (default 1)\n"
+            "       -o file          simpoints output (default simpoints)\n"
+            "       -w file          weights output (default weights)\n"
+            "       -v               print the score of every K\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/* xorshift64*, good enough and reproducible across hosts */
+static uint64_t rand_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rand_double(uint64_t *state) { return (rand_next(state) >> 11) * (1.0 / 9007199254740992.0); }
+
+/* One "T:id:count :id:count ..." line per interval */
+static bool load_bbv(const char *filename, std::vector<SparseVector> &intervals, uint32_t &max_id) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    max_id = 0;
+
+    SparseVector cur;
+    int          c;
+    bool         in_interval = false;
+
+    while ((c = getc(f)) != EOF) {
+        if (c == 'T') {
+            in_interval = true;
+            cur.clear();
+        } else if (c == ':' && in_interval) {
+            unsigned long long id, count;
+            if (fscanf(f, "%llu:%llu", &id, &count) != 2) {
+                fprintf(stderr, "%s: malformed interval %zu\n", filename, intervals.size() + 1);
+                fclose(f);
+                return false;
+            }
+            cur.push_back(std::make_pair((uint32_t)id, (double)count));
+            if (id > max_id)
+                max_id = id;
+        } else if (c == '\n' && in_interval) {
+            intervals.push_back(cur);
+            in_interval = false;
+        }
+    }
+
+    if (in_interval && !cur.empty())
+        intervals.push_back(cur);
+
+    fclose(f);
+    return true;
+}
+
+/*
+ * Normalize each interval to a frequency vector and project it with
+ * a random matrix whose entries are uniform in [-1, 1].  The matrix
+ * rows are generated from the block id so the whole matrix is never
+ * materialized.
+ */
+static std::vector<double> project(const std::vector<SparseVector> &intervals, int dims, uint64_t seed) {
+    std::vector<double> points(intervals.size() * dims, 0.0);
+    std::vector<double> row(dims);
+
+    for (size_t i = 0; i < intervals.size(); ++i) {
+        double total = 0;
+        for (const auto &e : intervals[i]) total += e.second;
+        if (total == 0)
+            continue;
+
+        double *p = &points[i * dims];
+        for (const auto &e : intervals[i]) {
+            uint64_t state = (seed ^ ((uint64_t)e.first * 0x9E3779B97F4A7C15ULL)) | 1;
+            double   w     = e.second / total;
+            for (int d = 0; d < dims; ++d) p[d] += w * (2 * rand_double(&state) - 1);
+        }
+    }
+
+    return points;
+}
+
+static double dist2(const double *a, const double *b, int dims) {
+    double sum = 0;
+    for (int d = 0; d < dims; ++d) {
+        double x = a[d] - b[d];
+        sum += x * x;
+    }
+    return sum;
+}
+
+/* k-means++ seeding followed by Lloyd iterations */
+static void kmeans(const std::vector<double> &points, int n, int dims, int max_iter, KMeansResult &r) {
+    int                 k     = r.k;
+    uint64_t            state = r.seed | 1;
+    std::vector<double> best(n, INFINITY);
+    std::vector<int>    count(k);
+    std::vector<double> sum((size_t)k * dims);
+
+    r.centers.assign((size_t)k * dims, 0.0);
+    r.assign.assign(n, 0);
+
+    int first = rand_next(&state) % n;
+    memcpy(&r.centers[0], &points[(size_t)first * dims], dims * sizeof(double));
+    for (int c = 1; c < k; ++c) {
+        double total = 0;
+        for (int i = 0; i < n; ++i) {
+            double d = dist2(&points[(size_t)i * dims], &r.centers[(size_t)(c - 1) * dims], dims);
+            if (d < best[i])
+                best[i] = d;
+            total += best[i];
+        }
+
+        double target = rand_double(&state) * total;
+        int    pick   = n - 1;
+        for (int i = 0; i < n; ++i) {
+            target -= best[i];
+            if (target <= 0) {
+                pick = i;
+                break;
+            }
+        }
+        memcpy(&r.centers[(size_t)c * dims], &points[(size_t)pick * dims], dims * sizeof(double));
+    }
+
+    for (int iter = 0; iter < max_iter; ++iter) {
+        bool changed = false;
+
+        r.distortion = 0;
+        for (int i = 0; i < n; ++i) {
+            const double *p      = &points[(size_t)i * dims];
+            int           best_c = 0;
+            double        best_d = INFINITY;
+            for (int c = 0; c < k; ++c) {
+                double d = dist2(p, &r.centers[(size_t)c * dims], dims);
+                if (d < best_d) {
+                    best_d = d;
+                    best_c = c;
+                }
+            }
+            if (r.assign[i] != best_c || iter == 0)
+                changed = true;
+            r.assign[i] = best_c;
+            r.distortion += best_d;
+        }
+
+        if (!changed)
+            break;
+
+        std::fill(sum.begin(), sum.end(), 0.0);
+        std::fill(count.begin(), count.end(), 0);
+        for (int i = 0; i < n; ++i) {
+            double *ctr = &sum[(size_t)r.assign[i] * dims];
+            for (int d = 0; d < dims; ++d) ctr[d] += points[(size_t)i * dims + d];
+            count[r.assign[i]]++;
+        }
+        for (int c = 0; c < k; ++c) {
+            if (count[c] == 0)
+                continue; /* an empty cluster keeps its old center */
+            for (int d = 0; d < dims; ++d) r.centers[(size_t)c * dims + d] = sum[(size_t)c * dims + d] / count[c];
+        }
+    }
+}
+
+/* BIC of a clustering, as defined by Pelleg and Moore for X-means */
+static double bic(const KMeansResult &r, int n, int dims) {
+    int              k = r.k;
+    std::vector<int> count(k, 0);
+    for (int i = 0; i < n; ++i) count[r.assign[i]]++;
+
+    if (n <= k)
+        return 0;
+
+    double variance = r.distortion / (double)(n - k);
+    if (variance <= 0)
+        variance = 1e-300;
+
+    double loglike = 0;
+    for (int c = 0; c < k; ++c) {
+        double rc = count[c];
+        if (rc == 0)
+            continue;
+        loglike += -rc / 2 * log(2 * M_PI) - rc * dims / 2 * log(variance) - (rc - k) / 2 + rc * log(rc) - rc * log((double)n);
+    }
+
+    double params = (k - 1) + (double)dims * k + 1;
+
+    return loglike - params / 2 * log((double)n);
+}
+
+int main(int argc, char *argv[]) {
+    const char *prog          = argv[0];
+    const char *simpoint_name = "simpoints";
+    const char *weight_name   = "weights";
+    int         max_k         = 30;
+    int         dims          = 15;
+    int         n_seeds       = 5;
+    int         max_iter      = 100;
+    double      threshold     = 0.9;
+    int         n_threads     = std::thread::hardware_concurrency();
+    uint64_t    seed          = 1;
+    bool        verbose       = false;
+    int         c;
+
+    while ((c = getopt(argc, argv, "k:d:n:i:t:j:s:o:w:vh")) != -1) {
+        switch (c) {
+            case 'k': max_k = atoi(optarg); break;
+            case 'd': dims = atoi(optarg); break;
+            case 'n': n_seeds = atoi(optarg); break;
+            case 'i': max_iter = atoi(optarg); break;
+            case 't': threshold = atof(optarg); break;
+            case 'j': n_threads = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'o': simpoint_name = optarg; break;
+            case 'w': weight_name = optarg; break;
+            case 'v': verbose = true; break;
+            default: usage(prog);
+        }
+    }
+
+    if (optind + 1 != argc || max_k < 1 || dims < 1 || n_seeds < 1 || max_iter < 1 || threshold < 0 || threshold > 1)
+        usage(prog);
+    if (n_threads < 1)
+        n_threads = 1;
+
+    std::vector<SparseVector> intervals;
+    uint32_t                  max_id;
+    if (!load_bbv(argv[optind], intervals, max_id))
+        return EXIT_FAILURE;
+
+    int n = intervals.size();
+    if (n == 0) {
+        fprintf(stderr, "%s: no intervals found\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (max_k > n)
+        max_k = n;
+
+    fprintf(stderr, "%d intervals, %u basic blocks, trying K=1..%d\n", n, max_id, max_k);
+
+    std::vector<double> points = project(intervals, dims, seed);
+
+    /* Every (K, seed) run is independent, hand them out to the workers */
+    std::vector<KMeansResult> runs(max_k * n_seeds);
+    uint64_t                  state = seed | 1;
+    for (int k = 1; k <= max_k; ++k) {
+        for (int j = 0; j < n_seeds; ++j) {
+            runs[(k - 1) * n_seeds + j].k    = k;
+            runs[(k - 1) * n_seeds + j].seed = rand_next(&state);
+        }
+    }
+
+    std::atomic<int>         next_run(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+        workers.push_back(std::thread([&]() {
+            for (int i; (i = next_run++) < (int)runs.size();) {
+                kmeans(points, n, dims, max_iter, runs[i]);
+                runs[i].bic = bic(runs[i], n, dims);
+            }
+        }));
+    }
+    for (auto &w : workers) w.join();
+
+    /* Best of the seeds for each K, lowest distortion wins */
+    std::vector<KMeansResult *> best(max_k + 1, nullptr);
+    double                      min_bic = INFINITY, max_bic = -INFINITY;
+    for (auto &r : runs) {
+        if (!best[r.k] || r.distortion < best[r.k]->distortion)
+            best[r.k] = &r;
+    }
+    for (int k = 1; k <= max_k; ++k) {
+        if (verbose)
+            fprintf(stderr, "K=%-3d distortion %g BIC %g\n", k, best[k]->distortion, best[k]->bic);
+        if (best[k]->bic < min_bic)
+            min_bic = best[k]->bic;
+        if (best[k]->bic > max_bic)
+            max_bic = best[k]->bic;
+    }
+
+    KMeansResult *chosen = best[max_k];
+    for (int k = 1; k <= max_k; ++k) {
+        if (best[k]->bic >= min_bic + threshold * (max_bic - min_bic)) {
+            chosen = best[k];
+            break;
+        }
+    }
+
+    fprintf(stderr, "picked K=%d (BIC %g, range [%g, %g])\n", chosen->k, chosen->bic, min_bic, max_bic);
+
+    FILE *sf = fopen(simpoint_name, "w");
+    if (!sf) {
+        perror(simpoint_name);
+        return EXIT_FAILURE;
+    }
+    FILE *wf = fopen(weight_name, "w");
+    if (!wf) {
+        perror(weight_name);
+        return EXIT_FAILURE;
+    }
+
+    /* Representative: the interval closest to the centroid */
+    int id = 0;
+    for (int c = 0; c < chosen->k; ++c) {
+        int    rep    = -1;
+        int    count  = 0;
+        double best_d = INFINITY;
+        for (int i = 0; i < n; ++i) {
+            if (chosen->assign[i] != c)
+                continue;
+            count++;
+            double d = dist2(&points[(size_t)i * dims], &chosen->centers[(size_t)c * dims], dims);
+            if (d < best_d) {
+                best_d = d;
+                rep    = i;
+            }
+        }
+        if (rep < 0)
+            continue;
+
+        fprintf(sf, "%d %d\n", rep, id);
+        fprintf(wf, "%f %d\n", (double)count / n, id);
+        id++;
+    }
+
+    fclose(sf);
+    fclose(wf);
+
+    return EXIT_SUCCESS;
+}
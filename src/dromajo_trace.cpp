@@ -0,0 +1,104 @@
+/*
+ * Converts a binary trace to text
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Reads a trace written with dromajo --binary_trace and prints it in the
+ * text format dromajo prints by default, so the usual tools (and
+ * dromajo_cosim_test) can read it.  With -m the physical address of
+ * the data accesses is appended to the loads and stores.
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s {options} trace.bin\n"
+            "       -o file  text output (default stdout)\n"
+            "       -m       print the data addresses\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *out_name = NULL;
+    bool        mem      = false;
+    int         c;
+
+    while ((c = getopt(argc, argv, "o:m")) != -1) {
+        switch (c) {
+            case 'o': out_name = optarg; break;
+            case 'm': mem = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    const char *name = argv[optind];
+    int         fd   = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(name);
+        return EXIT_FAILURE;
+    }
+
+    void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: cannot map the trace\n", name);
+        return EXIT_FAILURE;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    static TraceReader rd;
+    if (!trace_reader_init(&rd, data, st.st_size)) {
+        fprintf(stderr, "%s: not a binary trace\n", name);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = out_name ? fopen(out_name, "w") : stdout;
+    if (!out) {
+        perror(out_name);
+        return EXIT_FAILURE;
+    }
+    static char out_buf[1 << 20];
+    setvbuf(out, out_buf, _IOFBF, sizeof out_buf);
+
+    TraceRecord r;
+    uint64_t    n = 0;
+    int         got;
+    while ((got = trace_reader_next(&rd, &r)) > 0) {
+        trace_print_text(out, &r, mem);
+        n++;
+    }
+
+    if (got < 0)
+        fprintf(stderr, "%s: truncated record after %" PRIu64 " instructions\n", name, n);
+
+    if (out != stdout)
+        fclose(out);
+    munmap(data, st.st_size);
+    close(fd);
+
+    return got < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
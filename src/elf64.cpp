@@ -60,51 +60,100 @@ uint64_t elf64_get_entrypoint(const uint8_t *image) {
     return ehdr->e_entry;
 }
 
-bool elf64_find_global(const uint8_t *image, size_t image_size, const char *key, uint64_t *value) {
-    const uint8_t *image_end = image + image_size;
-    Elf64_Ehdr *   ehdr      = (Elf64_Ehdr *)image;
+/* The symbol table of image and its string table, false if there is none */
+static bool elf64_symtab(const uint8_t *image, size_t image_size, const Elf64_Sym **symtab, int *symtab_len,
+                         const char **strtab, size_t *strtab_size) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
 
-    if (ehdr->e_shoff + sizeof(Elf64_Shdr) - 1 > image_size)
+    if (ehdr->e_shoff > image_size || ehdr->e_shnum > (image_size - ehdr->e_shoff) / sizeof(Elf64_Shdr))
         return false;
 
-    Elf64_Shdr *shdr = (Elf64_Shdr *)&image[ehdr->e_shoff];
+    const Elf64_Shdr *shdr = (const Elf64_Shdr *)&image[ehdr->e_shoff];
 
-    if ((const uint8_t *)&shdr[ehdr->e_shstrndx + 1] > image_end)
-        return false;
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        const Elf64_Shdr *sh = &shdr[i];
 
-    const Elf64_Sym *symtab     = 0;
-    int              symtab_len = 0;
-    const char *     strtab     = 0;
+        if (sh->sh_type != SHT_SYMTAB || sh->sh_link >= ehdr->e_shnum)
+            continue;
 
-    if ((const uint8_t *)&shdr[ehdr->e_shnum] > image_end)
-        return false;
+        const Elf64_Shdr *str = &shdr[sh->sh_link];
+        if (sh->sh_offset > image_size || sh->sh_size > image_size - sh->sh_offset || str->sh_offset > image_size
+            || str->sh_size > image_size - str->sh_offset || str->sh_size == 0)
+            return false;
 
-    /* Look for symbol table */
-    for (int i = 0; i < ehdr->e_shnum; ++i) {
-        Elf64_Shdr *sh = &shdr[i];
+        *symtab      = (const Elf64_Sym *)&image[sh->sh_offset];
+        *symtab_len  = sh->sh_size / sizeof(Elf64_Sym);
+        *strtab      = (const char *)&image[str->sh_offset];
+        *strtab_size = str->sh_size;
+        return true;
+    }
 
-        if (sh->sh_type == SHT_STRTAB && i != ehdr->e_shstrndx)
-            strtab = (const char *)(image + sh->sh_offset);
+    return false;
+}
 
-        if (sh->sh_type == SHT_SYMTAB) {
-            symtab     = (Elf64_Sym *)&image[sh->sh_offset];
-            symtab_len = sh->sh_size / sizeof(Elf64_Sym);
-        }
-    }
+bool elf64_find_global(const uint8_t *image, size_t image_size, const char *key, uint64_t *value) {
+    const Elf64_Sym *symtab;
+    int              symtab_len;
+    const char *     strtab;
+    size_t           strtab_size;
 
-    if (symtab && strtab) {
-        if ((const uint8_t *)&symtab[symtab_len] > image_end)
-            return false;
+    if (!elf64_symtab(image, image_size, &symtab, &symtab_len, &strtab, &strtab_size))
+        return false;
 
-        for (int i = 0; i < symtab_len; ++i) {
-            const Elf64_Sym *sym = &symtab[i];
+    for (int i = 0; i < symtab_len; ++i) {
+        const Elf64_Sym *sym = &symtab[i];
 
-            if (strcmp(key, strtab + sym->st_name) == 0 && ELF32_ST_BIND(sym->st_info) == STB_GLOBAL) {
-                *value = sym->st_value;
-                return true;
-            }
+        if (sym->st_name < strtab_size && strcmp(key, strtab + sym->st_name) == 0
+            && ELF32_ST_BIND(sym->st_info) == STB_GLOBAL) {
+            *value = sym->st_value;
+            return true;
         }
     }
 
     return false;
 }
+
+/*
+ * elf64_for_each_function --
+ *
+ * Calls fn with the name, address and size (0 if unknown) of the
+ * symbols of image that are code: functions, and the untyped labels
+ * of executable sections that hand written assembly leaves.  Returns
+ * the number of symbols passed to fn.
+ */
+int elf64_for_each_function(const uint8_t *image, size_t image_size, Elf64SymbolFunc fn, void *opaque) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    const Elf64_Sym * symtab;
+    int               symtab_len;
+    const char *      strtab;
+    size_t            strtab_size;
+    int               n = 0;
+
+    if (!elf64_symtab(image, image_size, &symtab, &symtab_len, &strtab, &strtab_size))
+        return 0;
+
+    const Elf64_Shdr *shdr = (const Elf64_Shdr *)&image[ehdr->e_shoff];
+
+    for (int i = 0; i < symtab_len; ++i) {
+        const Elf64_Sym *sym  = &symtab[i];
+        int              type = ELF64_ST_TYPE(sym->st_info);
+
+        if (type != STT_FUNC && type != STT_NOTYPE)
+            continue;
+        if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= ehdr->e_shnum || !(shdr[sym->st_shndx].sh_flags & SHF_EXECINSTR))
+            continue;
+        if (sym->st_name == 0 || sym->st_name >= strtab_size)
+            continue;
+        if (strnlen(strtab + sym->st_name, strtab_size - sym->st_name) == strtab_size - sym->st_name)
+            continue; /* not terminated */
+
+        const char *name = strtab + sym->st_name;
+        if (type == STT_NOTYPE && name[0] == '.')
+            continue; /* local labels */
+
+        fn(opaque, name, sym->st_value, sym->st_size);
+        n++;
+    }
+
+    return n;
+}
@@ -0,0 +1,982 @@
+/*
+ * GDB remote serial protocol server
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Reverse execution
+ *
+ * A step runs one instruction on each hart, and everything but the
+ * console and network input is a function of the state, so the
+ * session is a sequence of states numbered by step.  Every INTERVAL
+ * steps (--gdb_rewind) the stub takes a checkpoint into a rewind ring
+ * (see virt_machine_rewind); going back to step T restores the newest
+ * checkpoint at or before T and runs forward from it.  When the ring
+ * is full the checkpoint whose loss makes the smallest gap for its age
+ * goes, so the checkpoints thin out with age and a step back replays
+ * a small fraction of the distance travelled whatever the distance.
+ *
+ * reverse-continue replays the segments between checkpoints from the
+ * newest back and stops at the last breakpoint or watchpoint hit in
+ * the first segment that has one.
+ *
+ * Console output is only printed the first time through.  Console and
+ * network input are read from the host again on re-execution unless
+ * the run replays a journal (--journal_replay), which delivers them at
+ * the same positions every time; reverse execution is not available
+ * while recording one.  Writing a register or memory starts a new
+ * future from the current step.
+ */
+#include "gdb_stub.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cutils.h"
+#include "dromajo.h"
+#include "iomem.h"
+#include "journal.h"
+#include "riscv_machine.h"
+#include "stats.h"
+
+#define GDB_PACKET_MAX      16384
+#define GDB_QUANTUM         65536 /* steps between two looks at the connection */
+#define GDB_MAX_POINTS      64
+#define GDB_REWIND_INTERVAL 1000000
+#define GDB_REWIND_DEPTH    64
+
+/* gdb's numbering of the registers past x0-x31 */
+#define GDB_REG_PC     32
+#define GDB_REG_F0     33
+#define GDB_REG_FFLAGS 66
+#define GDB_REG_FRM    67
+#define GDB_REG_FCSR   68
+
+typedef struct {
+    int      type; /* of the Z packet: 0, 1 breakpoint, 2 write, 3 read, 4 access watchpoint */
+    uint64_t addr;
+    uint64_t paddr; /* watchpoints are on the physical address addr had when set */
+    uint64_t len;
+} GdbPoint;
+
+typedef struct {
+    int      signal; /* 0 until the target stops */
+    int      hart;
+    int      watch; /* type of the watchpoint hit, 0 if none */
+    uint64_t addr;
+    bool     begin; /* went back to the start of the session */
+    bool     exited;
+} GdbStop;
+
+enum {
+    GDB_SERVE,
+    GDB_DETACH,
+    GDB_KILL,
+};
+
+struct GdbStub {
+    RISCVMachine *m;
+    int           fd;
+    bool          no_ack;
+    char          in[GDB_PACKET_MAX + 8];
+    size_t        in_len;
+    char          last[GDB_PACKET_MAX + 4]; /* resent on a '-' */
+    size_t        last_len;
+
+    int     hart; /* selected by Hg */
+    bool    running;
+    GdbStop stop;
+
+    GdbPoint point[GDB_MAX_POINTS];
+    int      n_point;
+    int      n_break;
+    int      n_watch;
+
+    VirtMachineRewind *rw; /* NULL without reverse execution */
+    uint64_t           interval;
+    int                depth;
+    uint64_t           now;     /* steps since the session started */
+    uint64_t           horizon; /* furthest step reached */
+    uint64_t           next_checkpoint;
+
+    CharacterDevice *console;
+    void (*console_write)(void *opaque, const uint8_t *buf, int len);
+};
+
+/* The console callback only gets the opaque of the device */
+static GdbStub *console_stub;
+
+static const char hexchars[] = "0123456789abcdef";
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Registers go on the wire as little endian bytes */
+static char *put_hex_le(char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i, v >>= 8) {
+        *p++ = hexchars[(v >> 4) & 0xF];
+        *p++ = hexchars[v & 0xF];
+    }
+    *p = 0;
+
+    return p;
+}
+
+static bool get_hex_le(const char **p, uint64_t *v, int bytes) {
+    *v = 0;
+    for (int i = 0; i < bytes; ++i) {
+        int hi = hex_digit((*p)[0]);
+        int lo = hi < 0 ? -1 : hex_digit((*p)[1]);
+        if (lo < 0)
+            return false;
+        *v |= (uint64_t)(hi << 4 | lo) << (8 * i);
+        *p += 2;
+    }
+
+    return true;
+}
+
+/*
+ * Transport
+ */
+
+static bool gdb_write(GdbStub *g, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(g->fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void gdb_send(GdbStub *g, const char *payload) {
+    size_t  len = strlen(payload);
+    uint8_t sum = 0;
+
+    assert(len <= GDB_PACKET_MAX);
+    g->last[0] = '$';
+    for (size_t i = 0; i < len; ++i) sum += (uint8_t)(g->last[i + 1] = payload[i]);
+    snprintf(g->last + len + 1, 4, "#%02x", sum);
+    g->last_len = len + 4;
+
+    gdb_write(g, g->last, g->last_len);
+}
+
+/*
+ * gdb_read --
+ *
+ * Appends what the connection has to the input, waiting up to timeout
+ * ms for it (-1 for ever).  Returns false once gdb is gone.
+ */
+static bool gdb_read(GdbStub *g, int timeout) {
+    struct pollfd pfd = {g->fd, POLLIN, 0};
+
+    if (poll(&pfd, 1, timeout) <= 0)
+        return true;
+
+    /* Nothing gdb sends is that long, start over */
+    if (g->in_len == sizeof g->in)
+        g->in_len = 0;
+
+    ssize_t n = recv(g->fd, g->in + g->in_len, sizeof g->in - g->in_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return false;
+    if (n > 0)
+        g->in_len += n;
+
+    return true;
+}
+
+/*
+ * gdb_packet --
+ *
+ * Takes the next packet out of the input into buf, NUL terminated, and
+ * acks it.  Returns 1 for a packet, -1 for a ^C and 0 if the input has
+ * neither yet.  A '-' resends the last packet, '+' and anything else
+ * outside a packet is skipped.
+ */
+static int gdb_packet(GdbStub *g, char *buf) {
+    size_t i = 0;
+    int    r = 0;
+
+    while (i < g->in_len && !r) {
+        char c = g->in[i];
+
+        if (c != '$') {
+            ++i;
+            if (c == 0x03)
+                r = -1;
+            else if (c == '-')
+                gdb_write(g, g->last, g->last_len);
+            continue;
+        }
+
+        char *end = (char *)memchr(g->in + i, '#', g->in_len - i);
+        if (!end || g->in + g->in_len - end < 3)
+            break;
+
+        size_t  len = end - (g->in + i + 1);
+        uint8_t sum = 0;
+        for (size_t k = 0; k < len; ++k) sum += (uint8_t)g->in[i + 1 + k];
+        bool ok = hex_digit(end[1]) >= 0 && hex_digit(end[2]) >= 0 && (hex_digit(end[1]) << 4 | hex_digit(end[2])) == sum;
+
+        if (!g->no_ack)
+            gdb_write(g, ok ? "+" : "-", 1);
+        if (ok) {
+            memcpy(buf, g->in + i + 1, len);
+            buf[len] = 0;
+            r        = 1;
+        }
+        i = end + 3 - g->in;
+    }
+
+    memmove(g->in, g->in + i, g->in_len - i);
+    g->in_len -= i;
+
+    return r;
+}
+
+/* Only a ^C comes while the target runs, the rest waits */
+static bool gdb_interrupted(GdbStub *g) {
+    if (!gdb_read(g, 0))
+        return false;
+
+    char *p = (char *)memchr(g->in, 0x03, g->in_len);
+    if (!p)
+        return false;
+
+    memmove(p, p + 1, g->in + g->in_len - (p + 1));
+    g->in_len--;
+
+    return true;
+}
+
+/*
+ * Execution
+ */
+
+static void gdb_console_write(void *opaque, const uint8_t *buf, int len) {
+    GdbStub *g = console_stub;
+
+    /* Already printed the first time through */
+    if (g->now < g->horizon)
+        return;
+
+    g->console_write(opaque, buf, len);
+}
+
+static void gdb_check_watch(GdbStub *g, int hart, uint64_t paddr, int size, int access, GdbStop *stop) {
+    for (int i = 0; i < g->n_point; ++i) {
+        const GdbPoint *p = &g->point[i];
+
+        if (p->type < 2 || paddr >= p->paddr + p->len || p->paddr >= paddr + size)
+            continue;
+        if ((p->type == 2 && !(access & WATCH_WRITE)) || (p->type == 3 && !(access & WATCH_READ)))
+            continue;
+
+        stop->watch = p->type;
+        stop->addr  = p->addr;
+        stop->hart  = hart;
+        return;
+    }
+}
+
+static bool gdb_at_breakpoint(GdbStub *g, GdbStop *stop) {
+    for (int i = 0; i < g->n_point; ++i) {
+        if (g->point[i].type >= 2)
+            continue;
+        for (int h = 0; h < g->m->ncpus; ++h) {
+            if (virt_machine_get_pc(g->m, h) == g->point[i].addr) {
+                stop->hart = h;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * gdb_checkpoint --
+ *
+ * Takes the checkpoint of the current step.  With the ring full, the
+ * checkpoint i (neither the first nor the newest) with the smallest
+ * (tag[i + 1] - tag[i - 1]) / (now - tag[i]) is dropped first, which
+ * keeps the gaps roughly proportional to their age.
+ */
+static void gdb_checkpoint(GdbStub *g) {
+    VirtMachineRewind *rw = g->rw;
+    int                n  = virt_machine_rewind_count(rw);
+
+    if (n == g->depth) {
+        int    drop      = 1;
+        double drop_cost = 0;
+        for (int i = 1; i < n - 1; ++i) {
+            double cost = (double)(virt_machine_rewind_tag(rw, i + 1) - virt_machine_rewind_tag(rw, i - 1))
+                          / (g->now - virt_machine_rewind_tag(rw, i));
+            if (i == 1 || cost < drop_cost) {
+                drop      = i;
+                drop_cost = cost;
+            }
+        }
+        virt_machine_rewind_drop(g->m, rw, drop);
+    }
+
+    /* On failure the next interval tries again */
+    (void)virt_machine_rewind_checkpoint(g->m, rw, g->now);
+    g->next_checkpoint = g->now + g->interval;
+}
+
+/* Runs one instruction on each hart, the watchpoints hit go to stop unless NULL */
+static bool gdb_step(GdbStub *g, GdbStop *stop) {
+    RISCVMachine *m          = g->m;
+    bool          keep_going = false;
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        RISCVCPUState *cpu = m->cpu_state[i];
+
+        if (m->common.maxinsns-- == 0) {
+            m->common.maxinsns = 0;
+            return false;
+        }
+
+        cpu->watch_access = 0;
+        keep_going |= virt_machine_run(m, i);
+
+        /* Only the accesses to the watched pages are reported */
+        if (stop && cpu->watch_access)
+            gdb_check_watch(g, i, cpu->watch_paddr, cpu->watch_size, cpu->watch_access, stop);
+    }
+
+    if (++g->now > g->horizon)
+        g->horizon = g->now;
+    if (g->rw && g->now >= g->next_checkpoint)
+        gdb_checkpoint(g);
+
+    return keep_going;
+}
+
+/* Brings the machine back to step t, at most the current one */
+static void gdb_goto(GdbStub *g, uint64_t t) {
+    int i = virt_machine_rewind_count(g->rw) - 1;
+
+    while (i > 0 && virt_machine_rewind_tag(g->rw, i) > t) --i;
+
+    virt_machine_rewind(g->m, g->rw, i);
+    g->now             = virt_machine_rewind_tag(g->rw, i);
+    g->next_checkpoint = g->now + g->interval;
+    if (g->m->common.journal)
+        journal_seek(g->m->common.journal);
+
+    while (g->now < t) gdb_step(g, NULL);
+}
+
+/* Runs up to a quantum of steps, false if the target stopped */
+static bool gdb_run_quantum(GdbStub *g, GdbStop *stop) {
+    for (int k = 0; k < GDB_QUANTUM; ++k) {
+        if (!gdb_step(g, stop)) {
+            stop->exited = true;
+            return false;
+        }
+        if (stop->watch || (g->n_break && gdb_at_breakpoint(g, stop))) {
+            stop->signal = 5;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void gdb_reverse_step(GdbStub *g, GdbStop *stop) {
+    stop->signal = 5;
+    if (g->now == 0)
+        stop->begin = true;
+    else
+        gdb_goto(g, g->now - 1);
+}
+
+static void gdb_reverse_continue(GdbStub *g, GdbStop *stop) {
+    uint64_t end = g->now;
+
+    stop->signal = 5;
+    while (end > 0) {
+        int i = virt_machine_rewind_count(g->rw) - 1;
+        while (virt_machine_rewind_tag(g->rw, i) >= end) --i;
+
+        uint64_t start = virt_machine_rewind_tag(g->rw, i);
+        uint64_t found = UINT64_MAX;
+        GdbStop  hit   = *stop;
+
+        gdb_goto(g, start);
+        while (g->now < end) {
+            GdbStop step = {};
+
+            if (g->n_break && gdb_at_breakpoint(g, &step)) {
+                found     = g->now;
+                hit.hart  = step.hart;
+                hit.watch = 0;
+            }
+            if (!gdb_step(g, &step))
+                break;
+            if (step.watch) {
+                found     = g->now - 1;
+                hit.hart  = step.hart;
+                hit.watch = step.watch;
+                hit.addr  = step.addr;
+            }
+            if (g->now % GDB_QUANTUM == 0 && gdb_interrupted(g)) {
+                stop->signal = 2;
+                return;
+            }
+        }
+
+        if (found != UINT64_MAX) {
+            gdb_goto(g, found);
+            *stop = hit;
+            return;
+        }
+        end = start;
+    }
+
+    gdb_goto(g, 0);
+    stop->begin = true;
+}
+
+/*
+ * Packets
+ */
+
+static void gdb_send_stop(GdbStub *g) {
+    const GdbStop *stop = &g->stop;
+    char           response[96];
+
+    if (stop->exited) {
+        snprintf(response, sizeof response, "W%02x", riscv_benchmark_exit_code(g->m->cpu_state[0]) & 0xFF);
+        gdb_send(g, response);
+        return;
+    }
+
+    g->hart = stop->hart;
+    int n   = snprintf(response, sizeof response, "T%02xthread:%x;", stop->signal, stop->hart + 1);
+    if (stop->watch)
+        snprintf(response + n,
+                 sizeof response - n,
+                 "%swatch:%" PRIx64 ";",
+                 stop->watch == 3 ? "r" : stop->watch == 4 ? "a" : "",
+                 stop->addr);
+    else if (stop->begin)
+        snprintf(response + n, sizeof response - n, "replaylog:begin;");
+    gdb_send(g, response);
+}
+
+/* Register n in gdb's numbering, false if there is no such register */
+static bool gdb_get_reg(GdbStub *g, int n, uint64_t *val) {
+    RISCVCPUState *s = g->m->cpu_state[g->hart];
+
+    if (n >= 0 && n < 32)
+        *val = riscv_get_reg(s, n);
+    else if (n == GDB_REG_PC)
+        *val = riscv_get_pc(s);
+#if FLEN > 0
+    else if (n >= GDB_REG_F0 && n < GDB_REG_F0 + 32)
+        *val = s->fp_reg[n - GDB_REG_F0];
+    else if (n == GDB_REG_FFLAGS)
+        *val = s->fflags;
+    else if (n == GDB_REG_FRM)
+        *val = s->frm;
+    else if (n == GDB_REG_FCSR)
+        *val = s->fflags | s->frm << 5;
+#endif
+    else
+        return false;
+
+    return true;
+}
+
+static bool gdb_set_reg(GdbStub *g, int n, uint64_t val) {
+    RISCVCPUState *s = g->m->cpu_state[g->hart];
+
+    if (n > 0 && n < 32)
+        riscv_set_reg(s, n, val);
+    else if (n == 0)
+        ;
+    else if (n == GDB_REG_PC)
+        riscv_set_pc(s, val);
+#if FLEN > 0
+    else if (n >= GDB_REG_F0 && n < GDB_REG_F0 + 32) {
+        s->fp_reg[n - GDB_REG_F0] = val;
+        s->fs                     = 3;
+    } else if (n == GDB_REG_FFLAGS)
+        s->fflags = val & 0x1F;
+    else if (n == GDB_REG_FRM)
+        s->frm = val & 7;
+    else if (n == GDB_REG_FCSR) {
+        s->fflags = val & 0x1F;
+        s->frm    = (val >> 5) & 7;
+    }
+#endif
+    else
+        return false;
+
+    /* What was run past this step is not the future anymore */
+    g->horizon = g->now;
+
+    return true;
+}
+
+/*
+ * gdb_access_mem --
+ *
+ * Copies len bytes at vaddr to or from buf, through the MMU of the
+ * selected hart.  Only RAM is accessed, a device read could have side
+ * effects.  Code pages are writable for gdb.
+ */
+static bool gdb_access_mem(GdbStub *g, uint64_t vaddr, uint8_t *buf, size_t len, bool write) {
+    RISCVCPUState *s = g->m->cpu_state[g->hart];
+
+    while (len) {
+        size_t       n = PG_MASK + 1 - (vaddr & PG_MASK);
+        target_ulong paddr;
+
+        if (n > len)
+            n = len;
+        if (riscv_cpu_get_phys_addr(s, vaddr, ACCESS_READ, &paddr) && riscv_cpu_get_phys_addr(s, vaddr, ACCESS_CODE, &paddr))
+            return false;
+
+        PhysMemoryRange *pr = get_phys_mem_range(g->m->mem_map, paddr);
+        if (!pr || !pr->is_ram || paddr + n > pr->addr + pr->size)
+            return false;
+
+        uint8_t *ptr = pr->phys_mem + (paddr - pr->addr);
+        if (write) {
+            memcpy(ptr, buf, n);
+            phys_mem_set_dirty_bit(pr, paddr - pr->addr);
+            phys_mem_set_dirty_bit(pr, paddr - pr->addr + n - 1);
+            g->horizon = g->now;
+        } else {
+            memcpy(buf, ptr, n);
+        }
+
+        vaddr += n;
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void gdb_handle_g(GdbStub *g) {
+    char     response[33 * 16 + 1];
+    char *   p = response;
+    uint64_t val;
+
+    for (int n = 0; n <= GDB_REG_PC; ++n) {
+        gdb_get_reg(g, n, &val);
+        p = put_hex_le(p, val, 8);
+    }
+    gdb_send(g, response);
+}
+
+static void gdb_handle_G(GdbStub *g, const char *buf) {
+    const char *p = buf + 1;
+    uint64_t    val;
+
+    for (int n = 0; n <= GDB_REG_PC && get_hex_le(&p, &val, 8); ++n) gdb_set_reg(g, n, val);
+    gdb_send(g, "OK");
+}
+
+static void gdb_handle_p(GdbStub *g, const char *buf) {
+    char     response[17];
+    uint64_t val;
+
+    if (!gdb_get_reg(g, strtol(buf + 1, NULL, 16), &val)) {
+        gdb_send(g, "E01");
+        return;
+    }
+    put_hex_le(response, val, 8);
+    gdb_send(g, response);
+}
+
+static void gdb_handle_P(GdbStub *g, const char *buf) {
+    char *      eq;
+    int         n = strtol(buf + 1, &eq, 16);
+    const char *p = eq + 1;
+    uint64_t    val;
+
+    /* gdb sends as many bytes as the register has */
+    size_t bytes = *eq == '=' ? strlen(p) / 2 : 0;
+    if (bytes == 0 || bytes > 8 || !get_hex_le(&p, &val, bytes) || !gdb_set_reg(g, n, val)) {
+        gdb_send(g, "E01");
+        return;
+    }
+    gdb_send(g, "OK");
+}
+
+static void gdb_handle_m(GdbStub *g, const char *buf) {
+    static uint8_t data[GDB_PACKET_MAX / 2];
+    static char    response[GDB_PACKET_MAX + 1];
+    uint64_t       addr, len;
+
+    if (sscanf(buf + 1, "%" SCNx64 ",%" SCNx64, &addr, &len) != 2) {
+        gdb_send(g, "E01");
+        return;
+    }
+    if (len > sizeof data)
+        len = sizeof data;
+    if (!gdb_access_mem(g, addr, data, len, false)) {
+        gdb_send(g, "E14");
+        return;
+    }
+
+    for (uint64_t i = 0; i < len; ++i) {
+        response[2 * i]     = hexchars[data[i] >> 4];
+        response[2 * i + 1] = hexchars[data[i] & 0xF];
+    }
+    response[2 * len] = 0;
+    gdb_send(g, response);
+}
+
+static void gdb_handle_M(GdbStub *g, const char *buf) {
+    static uint8_t data[GDB_PACKET_MAX / 2];
+    uint64_t       addr, len;
+    int            n;
+
+    if (sscanf(buf + 1, "%" SCNx64 ",%" SCNx64 ":%n", &addr, &len, &n) != 2 || len > sizeof data) {
+        gdb_send(g, "E01");
+        return;
+    }
+
+    const char *p = buf + 1 + n;
+    for (uint64_t i = 0; i < len; ++i) {
+        uint64_t v;
+        if (!get_hex_le(&p, &v, 1)) {
+            gdb_send(g, "E01");
+            return;
+        }
+        data[i] = v;
+    }
+    gdb_send(g, gdb_access_mem(g, addr, data, len, true) ? "OK" : "E14");
+}
+
+/* The machine only reports the accesses to the pages of the watchpoints */
+static void gdb_update_watch(GdbStub *g) {
+    uint64_t paddr[GDB_MAX_POINTS], len[GDB_MAX_POINTS];
+    int      n = 0;
+
+    for (int i = 0; i < g->n_point; ++i) {
+        if (g->point[i].type < 2)
+            continue;
+        paddr[n] = g->point[i].paddr;
+        len[n]   = g->point[i].len;
+        n++;
+    }
+    virt_machine_set_watch(g->m, paddr, len, n);
+}
+
+/* Z and z: insert and remove breakpoints and watchpoints */
+static void gdb_handle_z(GdbStub *g, const char *buf) {
+    int      type;
+    uint64_t addr, len;
+
+    if (sscanf(buf + 1, "%d,%" SCNx64 ",%" SCNx64, &type, &addr, &len) != 3 || type < 0 || type > 4) {
+        gdb_send(g, "");
+        return;
+    }
+
+    int i = 0;
+    while (i < g->n_point && (g->point[i].type != type || g->point[i].addr != addr)) ++i;
+
+    if (buf[0] == 'z') {
+        if (i < g->n_point) {
+            g->n_break -= type < 2;
+            g->n_watch -= type >= 2;
+            g->point[i] = g->point[--g->n_point];
+            if (type >= 2)
+                gdb_update_watch(g);
+        }
+        gdb_send(g, "OK");
+        return;
+    }
+
+    if (i < g->n_point) {
+        gdb_send(g, "OK");
+        return;
+    }
+
+    GdbPoint p = {type, addr, addr, len};
+    if (g->n_point == GDB_MAX_POINTS
+        || (type >= 2 && riscv_cpu_get_phys_addr(g->m->cpu_state[g->hart], addr, ACCESS_READ, &p.paddr))) {
+        gdb_send(g, "E01");
+        return;
+    }
+    g->n_break += type < 2;
+    g->n_watch += type >= 2;
+    g->point[g->n_point++] = p;
+    if (type >= 2)
+        gdb_update_watch(g);
+    gdb_send(g, "OK");
+}
+
+/* Thread ids are hart + 1, 0 and -1 are any and all */
+static int gdb_thread_hart(GdbStub *g, const char *p) {
+    long tid = strtol(p, NULL, 16);
+
+    if (tid <= 0)
+        return g->hart;
+
+    return tid <= g->m->ncpus ? tid - 1 : -1;
+}
+
+static void gdb_handle_q(GdbStub *g, const char *buf) {
+    char response[64];
+
+    if (!strncmp(buf, "qSupported", 10)) {
+        snprintf(response,
+                 sizeof response,
+                 "PacketSize=%x;QStartNoAckMode+%s",
+                 GDB_PACKET_MAX,
+                 g->rw ? ";ReverseStep+;ReverseContinue+" : "");
+        gdb_send(g, response);
+    } else if (!strcmp(buf, "QStartNoAckMode")) {
+        gdb_send(g, "OK");
+        g->no_ack = true;
+    } else if (!strcmp(buf, "qfThreadInfo")) {
+        static char threads[MAX_CPUS * 4 + 2];
+        char *      p = threads;
+        for (int i = 0; i < g->m->ncpus; ++i) p += sprintf(p, "%c%x", i ? ',' : 'm', i + 1);
+        gdb_send(g, threads);
+    } else if (!strcmp(buf, "qsThreadInfo")) {
+        gdb_send(g, "l");
+    } else if (!strcmp(buf, "qC")) {
+        snprintf(response, sizeof response, "QC%x", g->hart + 1);
+        gdb_send(g, response);
+    } else if (!strncmp(buf, "qThreadExtraInfo,", 17)) {
+        char name[16];
+        int  n = snprintf(name, sizeof name, "hart %d", gdb_thread_hart(g, buf + 17));
+        for (int i = 0; i < n; ++i) put_hex_le(response + 2 * i, (uint8_t)name[i], 1);
+        gdb_send(g, response);
+    } else if (!strcmp(buf, "qAttached")) {
+        gdb_send(g, "1");
+    } else {
+        gdb_send(g, "");
+    }
+}
+
+/* Returns GDB_DETACH or GDB_KILL to end the session */
+static int gdb_handle(GdbStub *g, const char *buf) {
+    switch (buf[0]) {
+        case '?': gdb_send_stop(g); break;
+
+        case 'c':
+            g->stop      = GdbStop();
+            g->stop.hart = g->hart;
+            g->running   = true;
+            break;
+
+        case 's':
+            g->stop      = GdbStop();
+            g->stop.hart = g->hart;
+            if (gdb_step(g, &g->stop))
+                g->stop.signal = 5;
+            else
+                g->stop.exited = true;
+            gdb_send_stop(g);
+            break;
+
+        case 'b':
+            if ((buf[1] != 's' && buf[1] != 'c') || !g->rw) {
+                gdb_send(g, "E01");
+                break;
+            }
+            g->stop      = GdbStop();
+            g->stop.hart = g->hart;
+            if (buf[1] == 's')
+                gdb_reverse_step(g, &g->stop);
+            else
+                gdb_reverse_continue(g, &g->stop);
+            gdb_send_stop(g);
+            break;
+
+        case 'g': gdb_handle_g(g); break;
+        case 'G': gdb_handle_G(g, buf); break;
+        case 'p': gdb_handle_p(g, buf); break;
+        case 'P': gdb_handle_P(g, buf); break;
+        case 'm': gdb_handle_m(g, buf); break;
+        case 'M': gdb_handle_M(g, buf); break;
+
+        case 'Z':
+        case 'z': gdb_handle_z(g, buf); break;
+
+        case 'H': {
+            int hart = gdb_thread_hart(g, buf + 2);
+            if (hart < 0) {
+                gdb_send(g, "E01");
+                break;
+            }
+            /* All the harts run together, Hc is only acknowledged */
+            if (buf[1] == 'g')
+                g->hart = hart;
+            gdb_send(g, "OK");
+            break;
+        }
+
+        case 'T': gdb_send(g, gdb_thread_hart(g, buf + 1) < 0 ? "E01" : "OK"); break;
+
+        case 'q':
+        case 'Q': gdb_handle_q(g, buf); break;
+
+        case 'D': gdb_send(g, "OK"); return GDB_DETACH;
+        case 'k': return GDB_KILL;
+
+        /* X, vCont and the rest fall back on what is above */
+        default: gdb_send(g, ""); break;
+    }
+
+    return GDB_SERVE;
+}
+
+GdbStub *gdb_stub_open(RISCVMachine *m, int port, const char *rewind) {
+    uint64_t interval = GDB_REWIND_INTERVAL;
+    int      depth    = GDB_REWIND_DEPTH;
+
+    if (rewind) {
+        char *end;
+        interval = strtoull(rewind, &end, 0);
+        if (*end == ':')
+            depth = strtol(end + 1, &end, 0);
+        if (*end || interval == 0 || depth < 3) {
+            fprintf(dromajo_stderr, "--gdb_rewind INTERVAL[:DEPTH] needs a non-zero INTERVAL and a DEPTH of 3 or more\n");
+            return NULL;
+        }
+    }
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("gdb: socket");
+        return NULL;
+    }
+
+    struct sockaddr_in addr;
+    int                reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if (bind(server, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(server, 1) < 0) {
+        perror("gdb: bind");
+        close(server);
+        return NULL;
+    }
+
+    fprintf(dromajo_stderr, "gdb: waiting for a connection on port %d\n", port);
+    int fd = accept(server, NULL, NULL);
+    close(server);
+    if (fd < 0) {
+        perror("gdb: accept");
+        return NULL;
+    }
+
+    GdbStub *g  = (GdbStub *)mallocz(sizeof *g);
+    g->m        = m;
+    g->fd       = fd;
+    g->interval = interval;
+    g->depth    = depth;
+
+    if (m->common.journal && !journal_replaying(m->common.journal))
+        fprintf(dromajo_stderr, "gdb: no reverse execution while recording a journal\n");
+    else
+        g->rw = virt_machine_rewind_init(m, depth, 0);
+    g->next_checkpoint = interval;
+    g->stop.signal     = 5;
+
+    if (m->common.console && !console_stub) {
+        console_stub           = g;
+        g->console             = m->common.console;
+        g->console_write       = g->console->write_data;
+        g->console->write_data = gdb_console_write;
+    }
+
+    return g;
+}
+
+bool gdb_stub_run(GdbStub *g) {
+    static char buf[GDB_PACKET_MAX + 8];
+
+    for (;;) {
+        if (g->running && !gdb_run_quantum(g, &g->stop)) {
+            g->running = false;
+            gdb_send_stop(g);
+        }
+        stats_poll(g->m->common.stats);
+
+        /* Only between quanta while running, for as long as it takes when stopped */
+        if (!gdb_read(g, g->running ? 0 : -1))
+            return false;
+
+        int r;
+        while ((r = gdb_packet(g, buf)) != 0) {
+            if (r < 0) {
+                if (g->running) {
+                    g->running     = false;
+                    g->stop.signal = 2;
+                    gdb_send_stop(g);
+                }
+                continue;
+            }
+
+            int what = gdb_handle(g, buf);
+            if (what != GDB_SERVE)
+                return what == GDB_DETACH;
+        }
+
+        /* The W reply ended the session */
+        if (g->stop.exited)
+            return false;
+    }
+}
+
+void gdb_stub_close(GdbStub *g) {
+    if (console_stub == g) {
+        g->console->write_data = g->console_write;
+        console_stub           = NULL;
+    }
+    if (g->rw)
+        virt_machine_rewind_free(g->m, g->rw);
+    if (g->n_watch)
+        virt_machine_set_watch(g->m, NULL, NULL, 0);
+
+    close(g->fd);
+    free(g);
+}
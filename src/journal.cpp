@@ -0,0 +1,467 @@
+/*
+ * Journal of the external inputs of a run
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "journal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutils.h"
+#include "dromajo.h"
+#include "riscv_machine.h"
+
+/* An input read back from the journal */
+typedef struct {
+    uint8_t        kind;
+    uint8_t        hartid;
+    uint8_t        arg;
+    int            next; /* index of the next input of the hart, -1 at the end */
+    uint64_t       pos;
+    uint64_t       addr;
+    uint64_t       value;
+    const uint8_t *data;
+    uint32_t       len;
+} JournalInput;
+
+struct Journal {
+    char *        name;
+    bool          replay;
+    uint32_t      flags;
+    RISCVMachine *m;
+    int           hart; /* hart being stepped, the console and network inputs go to it */
+
+    CharacterDevice  console;
+    CharacterDevice *host_console;
+    EthernetDevice * net;
+    void (*net_write_packet)(EthernetDevice *net, const uint8_t *buf, int len);
+
+    /* Recording */
+    FILE *   f;
+    bool     header_written;
+    uint64_t last_pos[MAX_CPUS];
+
+    /* Replaying */
+    uint8_t *     buf;
+    JournalInput *input;
+    int           n_input;
+    int           first[MAX_CPUS];
+    int           head[MAX_CPUS];
+    uint64_t      step_pos[MAX_CPUS];
+    uint64_t      missed;
+};
+
+/* There is a single network device, its callback only gets the device */
+static Journal *net_journal;
+
+static inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+static inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((uint8_t)v | 0x80, f);
+        v >>= 7;
+    }
+    fputc((uint8_t)v, f);
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t r     = 0;
+    int      shift = 0;
+
+    do {
+        if (*p == end || shift > 63)
+            return false;
+        r |= (uint64_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    *v = r;
+
+    return true;
+}
+
+static uint64_t journal_pos(Journal *j, int hartid) { return j->m->cpu_state[hartid]->insn_counter; }
+
+/* Written with the first record, once the flags are known */
+static void journal_put_header(Journal *j) {
+    uint32_t version = JOURNAL_VERSION;
+
+    fwrite(JOURNAL_MAGIC, 1, 8, j->f);
+    fwrite(&version, 4, 1, j->f);
+    fwrite(&j->flags, 4, 1, j->f);
+    j->header_written = true;
+}
+
+/* Writes the record header, the caller follows with the payload */
+static void journal_put(Journal *j, int kind, int hartid) {
+    uint64_t pos = journal_pos(j, hartid);
+
+    if (!j->header_written)
+        journal_put_header(j);
+
+    fputc(kind, j->f);
+    fputc(hartid, j->f);
+    put_varint(j->f, zigzag(pos - j->last_pos[hartid]));
+    j->last_pos[hartid] = pos;
+}
+
+static Journal *journal_new(const char *filename, bool replay) {
+    Journal *j = (Journal *)mallocz(sizeof *j);
+
+    j->name   = strdup(filename);
+    j->replay = replay;
+    j->hart   = 0;
+    for (int i = 0; i < MAX_CPUS; ++i) j->first[i] = j->head[i] = -1;
+
+    return j;
+}
+
+Journal *journal_open_record(const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+
+    Journal *j = journal_new(filename, false);
+    j->f       = f;
+
+    return j;
+}
+
+/* Decodes the whole journal and links the inputs of each hart */
+static bool journal_decode(Journal *j, const uint8_t *p, const uint8_t *end) {
+    int      tail[MAX_CPUS];
+    uint64_t pos[MAX_CPUS] = {0};
+    int      size          = 0;
+
+    for (int i = 0; i < MAX_CPUS; ++i) tail[i] = -1;
+
+    while (p < end) {
+        if (j->n_input == size) {
+            size     = size ? size * 2 : 256;
+            j->input = (JournalInput *)realloc(j->input, size * sizeof *j->input);
+        }
+
+        JournalInput *in = &j->input[j->n_input];
+        uint64_t      v;
+
+        memset(in, 0, sizeof *in);
+        if (end - p < 2)
+            return false;
+        in->kind   = *p++;
+        in->hartid = *p++;
+        in->next   = -1;
+        if (in->hartid >= MAX_CPUS || !get_varint(&p, end, &v))
+            return false;
+        in->pos = pos[in->hartid] += unzigzag(v);
+
+        switch (in->kind) {
+            case JOURNAL_CONSOLE:
+            case JOURNAL_NET:
+                if (!get_varint(&p, end, &v) || v > (uint64_t)(end - p))
+                    return false;
+                in->data = p;
+                in->len  = v;
+                p += v;
+                break;
+
+            case JOURNAL_INTERRUPT:
+                if (p == end)
+                    return false;
+                in->arg = *p++;
+                break;
+
+            case JOURNAL_REG:
+            case JOURNAL_SC_FAIL:
+                if (p == end)
+                    return false;
+                in->arg = *p++;
+                if (!get_varint(&p, end, &in->value))
+                    return false;
+                break;
+
+            case JOURNAL_MEM:
+                if (p == end)
+                    return false;
+                in->arg = *p++;
+                if (!get_varint(&p, end, &in->addr) || !get_varint(&p, end, &in->value))
+                    return false;
+                break;
+
+            default: return false;
+        }
+
+        if (tail[in->hartid] < 0)
+            j->first[in->hartid] = j->head[in->hartid] = j->n_input;
+        else
+            j->input[tail[in->hartid]].next = j->n_input;
+        tail[in->hartid] = j->n_input++;
+    }
+
+    return true;
+}
+
+Journal *journal_open_replay(const char *filename) {
+    uint8_t *buf;
+    int      len = load_file(&buf, filename);
+
+    if (len < 16 || memcmp(buf, JOURNAL_MAGIC, 8)) {
+        fprintf(dromajo_stderr, "%s: not a journal\n", filename);
+        free(buf);
+        return NULL;
+    }
+
+    uint32_t version;
+    memcpy(&version, buf + 8, 4);
+    if (version != JOURNAL_VERSION) {
+        fprintf(dromajo_stderr, "%s: journal version %u, expected %u\n", filename, version, JOURNAL_VERSION);
+        free(buf);
+        return NULL;
+    }
+
+    Journal *j = journal_new(filename, true);
+    j->buf     = buf;
+    memcpy(&j->flags, buf + 12, 4);
+
+    if (!journal_decode(j, buf + 16, buf + len)) {
+        fprintf(dromajo_stderr, "%s: truncated journal after %d inputs\n", filename, j->n_input);
+        journal_close(j);
+        return NULL;
+    }
+
+    return j;
+}
+
+void journal_close(Journal *j) {
+    if (j->f) {
+        if (!j->header_written)
+            journal_put_header(j);
+        fclose(j->f);
+    }
+
+    if (j->replay && j->m) {
+        int left = 0;
+        for (int i = 0; i < MAX_CPUS; ++i)
+            for (int k = j->head[i]; k >= 0; k = j->input[k].next) ++left;
+        if (j->missed || left)
+            fprintf(dromajo_stderr,
+                    "%s: %" PRIu64 " inputs came too late for the run, %d were never reached\n",
+                    j->name,
+                    j->missed,
+                    left);
+    }
+
+    if (net_journal == j) {
+        j->net->device_write_packet = j->net_write_packet;
+        net_journal                 = NULL;
+    }
+
+    free(j->input);
+    free(j->buf);
+    free(j->name);
+    free(j);
+}
+
+bool journal_replaying(const Journal *j) { return j->replay; }
+
+static void journal_console_write(void *opaque, const uint8_t *buf, int len) {
+    Journal *j = (Journal *)opaque;
+
+    j->host_console->write_data(j->host_console->opaque, buf, len);
+}
+
+static int journal_console_read(void *opaque, uint8_t *buf, int len) {
+    Journal *j = (Journal *)opaque;
+
+    if (!j->replay) {
+        int n = j->host_console->read_data(j->host_console->opaque, buf, len);
+        if (n > 0 && j->m) {
+            journal_put(j, JOURNAL_CONSOLE, j->hart);
+            put_varint(j->f, n);
+            fwrite(buf, 1, n, j->f);
+        }
+        return n;
+    }
+
+    /* Nothing came at this position unless the next input says so */
+    int i = j->head[j->hart];
+    if (i < 0 || !j->m)
+        return 0;
+
+    JournalInput *in = &j->input[i];
+    if (in->kind != JOURNAL_CONSOLE || in->pos != journal_pos(j, j->hart) || (int)in->len > len)
+        return 0;
+
+    memcpy(buf, in->data, in->len);
+    j->head[j->hart] = in->next;
+
+    return in->len;
+}
+
+CharacterDevice *journal_console(Journal *j, CharacterDevice *cs) {
+    if (!cs)
+        return NULL;
+
+    j->host_console       = cs;
+    j->console.opaque     = j;
+    j->console.write_data = journal_console_write;
+    j->console.read_data  = journal_console_read;
+
+    return &j->console;
+}
+
+static void journal_net_write_packet(EthernetDevice *net, const uint8_t *buf, int len) {
+    Journal *j = net_journal;
+
+    /* The host network is not listened to when replaying */
+    if (j->replay)
+        return;
+
+    journal_put(j, JOURNAL_NET, j->hart);
+    put_varint(j->f, len);
+    fwrite(buf, 1, len, j->f);
+
+    j->net_write_packet(net, buf, len);
+}
+
+void journal_attach(Journal *j, RISCVMachine *m) {
+    j->m = m;
+
+    if (m->common.net && !net_journal) {
+        net_journal                 = j;
+        j->net                      = m->common.net;
+        j->net_write_packet         = j->net->device_write_packet;
+        j->net->device_write_packet = journal_net_write_packet;
+    }
+
+    /* The model does not raise interrupts on its own under cosim */
+    if (j->replay && j->flags & JOURNAL_F_COSIM) {
+        m->common.cosim             = true;
+        m->common.pending_interrupt = -1;
+        m->common.pending_exception = -1;
+    }
+}
+
+void journal_set_cosim(Journal *j) { j->flags |= JOURNAL_F_COSIM; }
+
+void journal_seek(Journal *j) {
+    if (!j->replay)
+        return;
+
+    for (int h = 0; h < j->m->ncpus; ++h) {
+        uint64_t pos = journal_pos(j, h);
+        int      i   = j->first[h];
+
+        while (i >= 0 && j->input[i].pos < pos) i = j->input[i].next;
+        j->head[h] = i;
+    }
+}
+
+/*
+ * journal_step_begin --
+ *
+ * Applies the inputs of the hart due at its position, in the order
+ * they were recorded, up to a console input which the instruction
+ * itself reads.  Inputs whose position went by are counted and
+ * dropped, the run diverged from the recorded one.
+ */
+bool journal_step_begin(Journal *j, int hartid) {
+    j->hart = hartid;
+    if (!j->replay)
+        return false;
+
+    RISCVMachine * m       = j->m;
+    RISCVCPUState *s       = m->cpu_state[hartid];
+    uint64_t       pos     = s->insn_counter;
+    bool           retired = false;
+    int            i;
+
+    while (!retired && (i = j->head[hartid]) >= 0) {
+        JournalInput *in = &j->input[i];
+
+        if (in->pos > pos)
+            break;
+        if (in->pos == pos && in->kind == JOURNAL_CONSOLE)
+            break;
+
+        j->head[hartid] = in->next;
+        if (in->pos < pos) {
+            j->missed++;
+            continue;
+        }
+
+        switch (in->kind) {
+            case JOURNAL_NET:
+                if (j->net)
+                    j->net_write_packet(j->net, in->data, in->len);
+                break;
+
+            case JOURNAL_INTERRUPT: m->common.pending_interrupt = in->arg; break;
+
+            case JOURNAL_REG: riscv_set_reg(s, in->arg, in->value); break;
+
+            case JOURNAL_SC_FAIL:
+                if (in->arg > 0)
+                    riscv_set_reg(s, in->arg, in->value);
+                riscv_set_pc(s, riscv_get_pc(s) + 4);
+                retired = true;
+                break;
+
+            case JOURNAL_MEM: riscv_machine_override_mem(m, in->addr, in->value, in->arg); break;
+        }
+    }
+
+    /* A failed SC does not take the pending trap */
+    j->step_pos[hartid] = retired ? UINT64_MAX : pos;
+
+    /* As cosim does before each try at an instruction */
+    if (!retired && m->common.cosim && m->common.pending_interrupt != -1)
+        riscv_cpu_set_mip(s, riscv_cpu_get_mip(s) | 1 << m->common.pending_interrupt);
+
+    return retired;
+}
+
+void journal_step_end(Journal *j, int hartid) {
+    RISCVMachine *m = j->m;
+
+    /* Cosim forgets the trap once it is taken */
+    if (j->replay && m->common.cosim && m->cpu_state[hartid]->insn_counter == j->step_pos[hartid]) {
+        m->common.pending_interrupt = -1;
+        m->common.pending_exception = -1;
+    }
+}
+
+void journal_interrupt(Journal *j, int hartid, int cause) {
+    journal_put(j, JOURNAL_INTERRUPT, hartid);
+    fputc(cause, j->f);
+}
+
+void journal_reg(Journal *j, int hartid, int kind, int regno, uint64_t value) {
+    journal_put(j, kind, hartid);
+    fputc(regno, j->f);
+    put_varint(j->f, value);
+}
+
+void journal_mem(Journal *j, int hartid, uint64_t paddr, uint64_t value, int size_log2) {
+    journal_put(j, JOURNAL_MEM, hartid);
+    fputc(size_log2, j->f);
+    put_varint(j->f, paddr);
+    put_varint(j->f, value);
+}
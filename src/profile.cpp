@@ -0,0 +1,276 @@
+/*
+ * Sampling guest profiler
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "profile.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cutils.h"
+#include "elf64.h"
+#include "riscv_machine.h"
+
+/* Innermost return addresses kept, a power of two */
+#define PROFILE_MAX_DEPTH 128
+
+#define PROFILE_UNKNOWN -1
+
+typedef struct {
+    uint64_t start;
+    uint64_t end; /* the next symbol when the size is not known */
+    int      name;
+} ProfileSymbol;
+
+/*
+ * Shadow call stack, a ring of the innermost PROFILE_MAX_DEPTH return
+ * addresses.  depth keeps counting past it, so that returning from
+ * the frames that fell off does not pop the ones still in the ring.
+ */
+typedef struct {
+    uint64_t ret[PROFILE_MAX_DEPTH];
+    uint64_t depth;
+} ProfileStack;
+
+typedef struct {
+    uint64_t     left; /* instructions to the next sample */
+    ProfileStack stack[4];
+} ProfileHart;
+
+struct Profile {
+    FILE *      folded;
+    FILE *      functions;
+    uint64_t    period;
+    int         ncpus;
+    ProfileHart hart[MAX_CPUS];
+
+    std::vector<std::string>   names;
+    std::vector<ProfileSymbol> sym; /* sorted by start once sampling begins */
+    bool                       sorted;
+
+    /* Privilege level, then the function of each frame, outermost first */
+    std::map<std::vector<int>, uint64_t> stacks;
+    uint64_t                             samples;
+};
+
+static const char *profile_priv_name[4] = {"[U]", "[S]", "[H]", "[M]"};
+
+Profile *profile_open(const char *filename, uint64_t period, int ncpus) {
+    std::string functions_name = std::string(filename) + ".functions";
+
+    assert(period > 0 && ncpus <= MAX_CPUS);
+
+    FILE *folded = fopen(filename, "w");
+    if (!folded) {
+        perror(filename);
+        return NULL;
+    }
+    FILE *functions = fopen(functions_name.c_str(), "w");
+    if (!functions) {
+        perror(functions_name.c_str());
+        fclose(folded);
+        return NULL;
+    }
+
+    Profile *p   = new Profile;
+    p->folded    = folded;
+    p->functions = functions;
+    p->period    = period;
+    p->ncpus     = ncpus;
+    p->sorted    = false;
+    p->samples   = 0;
+    memset(p->hart, 0, sizeof p->hart);
+    for (int i = 0; i < ncpus; ++i) p->hart[i].left = period;
+
+    return p;
+}
+
+static void profile_add_symbol(void *opaque, const char *name, uint64_t addr, uint64_t size) {
+    Profile *     p = (Profile *)opaque;
+    ProfileSymbol s = {addr, size ? addr + size : 0, (int)p->names.size()};
+
+    p->names.push_back(name);
+    p->sym.push_back(s);
+}
+
+bool profile_add_symbols(Profile *p, const uint8_t *image, size_t image_size) {
+    if (!elf64_is_riscv64(image, image_size))
+        return false;
+
+    p->sorted = false;
+
+    return elf64_for_each_function(image, image_size, profile_add_symbol, p) > 0;
+}
+
+/* Sorts the symbols and gives the unsized ones the room up to the next */
+static void profile_sort_symbols(Profile *p) {
+    std::vector<ProfileSymbol> &sym = p->sym;
+
+    std::sort(sym.begin(), sym.end(), [](const ProfileSymbol &a, const ProfileSymbol &b) {
+        return a.start < b.start || (a.start == b.start && a.end > b.end);
+    });
+
+    /* Aliases keep the first (sized, if any) symbol of an address */
+    size_t n = 0;
+    for (size_t i = 0; i < sym.size(); ++i)
+        if (n == 0 || sym[n - 1].start != sym[i].start)
+            sym[n++] = sym[i];
+    sym.resize(n);
+
+    for (size_t i = 0; i < n; ++i)
+        if (sym[i].end == 0)
+            sym[i].end = i + 1 < n ? sym[i + 1].start : sym[i].start + 1;
+
+    p->sorted = true;
+}
+
+static int profile_lookup(Profile *p, uint64_t addr) {
+    const std::vector<ProfileSymbol> &sym = p->sym;
+
+    auto it = std::upper_bound(sym.begin(), sym.end(), addr, [](uint64_t a, const ProfileSymbol &s) { return a < s.start; });
+    if (it == sym.begin() || addr >= (it - 1)->end)
+        return PROFILE_UNKNOWN;
+
+    return (it - 1)->name;
+}
+
+static void profile_sample(Profile *p, ProfileHart *h, int priv, uint64_t pc) {
+    const ProfileStack *st = &h->stack[priv];
+    uint64_t            n  = st->depth < PROFILE_MAX_DEPTH ? st->depth : PROFILE_MAX_DEPTH;
+    std::vector<int>    key;
+
+    if (!p->sorted)
+        profile_sort_symbols(p);
+
+    key.reserve(n + 2);
+    key.push_back(priv);
+    for (uint64_t i = st->depth - n; i < st->depth; ++i)
+        key.push_back(profile_lookup(p, st->ret[i & (PROFILE_MAX_DEPTH - 1)]));
+    key.push_back(profile_lookup(p, pc));
+
+    p->stacks[key]++;
+    p->samples++;
+}
+
+static void profile_push(ProfileStack *st, uint64_t ret) { st->ret[st->depth++ & (PROFILE_MAX_DEPTH - 1)] = ret; }
+
+static void profile_pop(ProfileStack *st) {
+    if (st->depth > 0)
+        st->depth--;
+}
+
+/*
+ * profile_retire --
+ *
+ * The sample is taken before the stack follows the instruction, so a
+ * call is charged to the caller alone.  jal leaves no hint, its link
+ * register is checked here as Table 2.1 of the ISA manual says.
+ */
+void profile_retire(Profile *p, int hartid, int priv, uint64_t pc, uint32_t insn, int ctf) {
+    ProfileHart * h  = &p->hart[hartid];
+    ProfileStack *st = &h->stack[priv & 3];
+    uint64_t      ret;
+
+    if (unlikely(--h->left == 0)) {
+        h->left = p->period;
+        profile_sample(p, h, priv & 3, pc);
+    }
+
+    if (ctf == ctf_nop || ctf == ctf_taken_branch)
+        return;
+
+    ret = pc + ((insn & 3) == 3 ? 4 : 2);
+    switch (ctf) {
+        case ctf_taken_jump: {
+            int rd = (insn >> 7) & 31;
+            if ((insn & 0x7F) == 0x6F && (rd == 1 || rd == 5))
+                profile_push(st, ret);
+        } break;
+        case ctf_taken_jalr_pop: profile_pop(st); break;
+        case ctf_taken_jalr_push: profile_push(st, ret); break;
+        case ctf_taken_jalr_pop_push:
+            profile_pop(st);
+            profile_push(st, ret);
+            break;
+        default: break;
+    }
+}
+
+static const char *profile_name(const Profile *p, int name) {
+    return name == PROFILE_UNKNOWN ? "[unknown]" : p->names[name].c_str();
+}
+
+typedef struct {
+    int      name;
+    uint64_t self;
+    uint64_t total;
+} ProfileFunction;
+
+static void profile_write(Profile *p) {
+    std::map<int, ProfileFunction> func;
+
+    for (const auto &e : p->stacks) {
+        const std::vector<int> &key = e.first;
+
+        fputs(profile_priv_name[key[0]], p->folded);
+        for (size_t i = 1; i < key.size(); ++i) fprintf(p->folded, ";%s", profile_name(p, key[i]));
+        fprintf(p->folded, " %" PRIu64 "\n", e.second);
+
+        /* A recursive function is counted once per sample */
+        std::vector<int> names(key.begin() + 1, key.end());
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        for (int name : names) {
+            ProfileFunction &f = func[name];
+            f.name             = name;
+            f.total += e.second;
+        }
+        func[key.back()].self += e.second;
+    }
+
+    std::vector<ProfileFunction> table;
+    for (const auto &e : func) table.push_back(e.second);
+    std::sort(table.begin(), table.end(), [](const ProfileFunction &a, const ProfileFunction &b) {
+        return a.self > b.self || (a.self == b.self && a.total > b.total);
+    });
+
+    double scale = p->samples ? 100.0 / p->samples : 0;
+    fprintf(p->functions, "# %" PRIu64 " samples, one every %" PRIu64 " instructions\n", p->samples, p->period);
+    fprintf(p->functions, "# %14s %7s %14s %7s  %s\n", "self insns", "self", "total insns", "total", "function");
+    for (const ProfileFunction &f : table)
+        fprintf(p->functions,
+                "%16" PRIu64 " %6.2f%% %14" PRIu64 " %6.2f%%  %s\n",
+                f.self * p->period,
+                f.self * scale,
+                f.total * p->period,
+                f.total * scale,
+                profile_name(p, f.name));
+}
+
+void profile_close(Profile *p) {
+    profile_write(p);
+    fclose(p->folded);
+    fclose(p->functions);
+    delete p;
+}
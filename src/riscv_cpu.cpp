@@ -53,6 +53,7 @@
 #include "dromajo.h"
 #include "iomem.h"
 #include "riscv_machine.h"
+#include "simpoint.h"
 
 // NOTE: Use GET_INSN_COUNTER not mcycle because this is just to track advancement of simulation
 #define write_reg(x, val)                         \
@@ -149,9 +150,82 @@ static void         dump_regs(RISCVCPUState *s) {
 #endif
 }
 
+#ifdef LIVECACHE
+/*
+ * livecache_access --
+ *
+ * Queues an access for the LiveCache levels, see livecache_ring_publish.
+ * An access to the line the first level of the hart saw last is a hit
+ * that does not change the LRU order: it is only counted here, unless
+ * the first level is shared and another access came in between.  A
+ * store to a line only read so far is still sent, it marks the line
+ * modified.
+ */
+static inline void livecache_access(RISCVCPUState *s, bool fetch, uint64_t paddr, bool st) {
+    RISCVMachine *  m = s->machine;
+    LiveCacheQueue *q = m->llc_queue;
+
+    if (!m->llc_enabled)
+        return;
+
+    int            hartid = s->mhartid & (MAX_CPUS - 1);
+    LiveCacheHart *h      = &q->harts[hartid];
+    uint64_t       line   = paddr >> q->line_shift;
+    uint64_t       key    = line << 4 | (uint64_t)hartid << 1 | fetch;
+    bool           shared = !(fetch ? m->l1i[hartid] : m->l1d[hartid]);
+
+    if (line == h->last_line[fetch] && (!st || h->last_st[fetch]) && (!shared || key == q->last_key)) {
+        h->repeat[fetch][st]++;
+        return;
+    }
+    if (line != h->last_line[fetch]) {
+        h->last_line[fetch] = line;
+        h->last_st[fetch]   = false;
+    }
+    h->last_st[fetch] |= st;
+    q->last_key = key;
+
+    uint64_t e = paddr | (uint64_t)fetch * LiveCacheQueue::FETCH | (uint64_t)st * LiveCacheQueue::ST;
+    if (hartid != q->last_hart) {
+        q->last_hart = hartid;
+        q->turns.push(hartid);
+        e |= LiveCacheQueue::RUN;
+    }
+    h->ring.push(e);
+    if (++q->unpublished == LiveCacheQueue::BATCH)
+        livecache_ring_publish(m);
+}
+
+/*
+ * track_ifetch --
+ *
+ * Called by the interpreter when the pc moves to another line.  The
+ * fetch itself went through the code TLB, or through the slow path
+ * that just filled it.
+ */
+static void track_ifetch(RISCVCPUState *s, target_ulong pc) {
+    uint32_t     tlb_idx = (pc >> PG_SHIFT) & (TLB_SIZE - 1);
+    target_ulong paddr;
+
+    s->livecache_iline = pc >> s->livecache_ishift;
+
+    if (s->tlb_code[tlb_idx].vaddr == (pc & ~PG_MASK)) {
+#ifdef PADDR_INLINE
+        paddr = s->tlb_code[tlb_idx].paddr_addend + pc;
+#else
+        paddr = s->tlb_code_paddr_addend[tlb_idx] + pc;
+#endif
+    } else if (riscv_cpu_get_phys_addr(s, pc, ACCESS_CODE, &paddr)) {
+        return;
+    }
+
+    livecache_access(s, true, paddr, false);
+}
+#endif
+
 static inline void track_write(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr, uint64_t data, int size) {
 #ifdef LIVECACHE
-    s->machine->llc->write(paddr);
+    livecache_access(s, false, paddr, true);
 #endif
     //printf("track.st[%llx:%llx]=%llx\n", paddr, paddr+size-1, data);
     s->last_data_paddr = paddr;
@@ -162,7 +236,7 @@ static inline void track_write(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr,
 
 static inline uint64_t track_dread(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr, uint64_t data, int size) {
 #ifdef LIVECACHE
-    s->machine->llc->read(paddr);
+    livecache_access(s, false, paddr, false);
 #endif
     s->last_data_paddr = paddr;
     //printf("track.ld[%llx:%llx]=%llx\n", paddr, paddr+size-1, data);
@@ -171,15 +245,102 @@ static inline uint64_t track_dread(RISCVCPUState *s, uint64_t vaddr, uint64_t pa
 }
 
 static inline uint64_t track_iread(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr, uint64_t data, int size) {
-#ifdef LIVECACHE
-    s->machine->llc->read(paddr);
-#endif
+    /* The LiveCache sees the fetches once per line, see track_ifetch */
     //printf("track.ic[%llx:%llx]=%llx\n", paddr, paddr+size-1, data);
     assert(size == 16 || size == 32);
 
     return data;
 }
 
+/*
+ * hpm_tlb_miss --
+ *
+ * Counts a miss of the code or data TLB, and the page walk that follows
+ * it unless riscv_cpu_get_phys_addr is going to leave the address as is.
+ */
+static void hpm_tlb_miss(RISCVCPUState *s, int event, riscv_memory_access_t access) {
+    int priv = s->priv;
+
+    if ((s->mstatus & MSTATUS_MPRV) && access != ACCESS_CODE)
+        priv = (s->mstatus >> MSTATUS_MPP_SHIFT) & 3;
+
+    s->hpm_event[event]++;
+    if (priv != PRV_M && (s->satp >> 60) != 0)
+        s->hpm_event[HPM_PAGE_WALK]++;
+}
+
+/*
+ * watch_access --
+ *
+ * Returns true if paddr is on a page of virt_machine_set_watch, after
+ * adding the access to watch_access.  Such pages are never entered in
+ * tlb_read and tlb_write, so every access to them comes through here.
+ */
+static bool watch_access(RISCVCPUState *s, target_ulong paddr, int size, int access) {
+    const RISCVMachine *m    = s->machine;
+    uint64_t            page = paddr >> PG_SHIFT;
+    int                 lo = 0, hi = m->watch_page_count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->watch_page[mid] < page)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == m->watch_page_count || m->watch_page[lo] != page)
+        return false;
+
+    if (!s->watch_access) {
+        s->watch_paddr = paddr;
+        s->watch_size  = size;
+    } else {
+        target_ulong end = s->watch_paddr + s->watch_size;
+        if (paddr < s->watch_paddr)
+            s->watch_paddr = paddr;
+        if (paddr + size > end)
+            end = paddr + size;
+        s->watch_size = end - s->watch_paddr;
+    }
+    s->watch_access |= access;
+
+    return true;
+}
+
+/* Trigger i is an mcontrol execute trigger for some privilege level */
+static bool trigger_armed(const RISCVCPUState *s, int i) {
+    target_ulong mctl = MCONTROL_M | MCONTROL_S | MCONTROL_U;
+
+    return (s->tdata1[i] >> 60) == 2 && (s->tdata1[i] & MCONTROL_EXECUTE) && (s->tdata1[i] & mctl);
+}
+
+/*
+ * trigger_page --
+ *
+ * Pages with an armed execute trigger are kept out of tlb_code, so
+ * the interpreter fetches each of their instructions through the slow
+ * path, where trigger_hit is checked.  Everywhere else triggers cost
+ * nothing.
+ */
+static bool trigger_page(const RISCVCPUState *s, target_ulong addr) {
+    if (likely(!s->trigger_exec))
+        return false;
+
+    for (int i = 0; i < MAX_TRIGGERS; ++i)
+        if (trigger_armed(s, i) && ((s->tdata2[i] ^ addr) & ~(target_ulong)PG_MASK) == 0)
+            return true;
+
+    return false;
+}
+
+static bool trigger_hit(const RISCVCPUState *s, target_ulong pc) {
+    for (int i = 0; i < MAX_TRIGGERS; ++i)
+        if (trigger_armed(s, i) && (s->tdata1[i] & (MCONTROL_U << s->priv)) && s->tdata2[i] == pc)
+            return true;
+
+    return false;
+}
+
 /* "PMP checks are applied to all accesses when the hart is running in
  * S or U modes, and for loads and stores when the MPRV bit is set in
  * the mstatus register and the MPP field in the mstatus register
@@ -233,6 +394,7 @@ static inline PhysMemoryRange *get_phys_mem_range_pmp(RISCVCPUState *s, uint64_t
             return;                                                                                  \
         }                                                                                            \
         track_write(s, paddr, paddr, val, size);                                                     \
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);                                                \
         *(uint_type *)(pr->phys_mem + (uintptr_t)(paddr - pr->addr)) = val;                          \
         *fail                                                        = false;                        \
     }                                                                                                \
@@ -306,6 +468,17 @@ TARGET_READ_WRITE(64, uint64_t, 3)
 TARGET_READ_WRITE(128, uint128_t, 4)
 #endif
 
+/* The load paths of the interpreter, TLB hit and miss, for dromajo_microbench */
+#define TARGET_READ_EXPORT(size, uint_type)                                               \
+    int riscv_target_read_u##size(RISCVCPUState *s, uint_type *pval, target_ulong addr) { \
+        return target_read_u##size(s, pval, addr);                                        \
+    }
+
+TARGET_READ_EXPORT(8, uint8_t)
+TARGET_READ_EXPORT(16, uint16_t)
+TARGET_READ_EXPORT(32, uint32_t)
+TARGET_READ_EXPORT(64, uint64_t)
+
 #define PTE_V_MASK (1 << 0)
 #define PTE_U_MASK (1 << 4)
 #define PTE_A_MASK (1 << 6)
@@ -319,6 +492,7 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
     int          need_write, vaddr_shift, i, pte_addr_bits;
     target_ulong pte_addr, pte, vaddr_mask, paddr;
 
+    s->host_stats.translate++;
     if ((s->mstatus & MSTATUS_MPRV) && access != ACCESS_CODE) {
         /* use previous privilege */
         priv = (s->mstatus >> MSTATUS_MPP_SHIFT) & 3;
@@ -501,6 +675,8 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
         }
         paddr = addr;  // No translation for this request
     } else {
+        hpm_tlb_miss(s, HPM_DTLB_MISS, ACCESS_READ);
+
         int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_READ, &paddr);
 
         if (err) {
@@ -521,15 +697,17 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
         }
 
         if (pr->is_ram) {
-            tlb_idx                    = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
-            ptr                        = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_read[tlb_idx].vaddr = addr & ~PG_MASK;
+            ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+            if (likely(!s->machine->watch_page_count) || !watch_access(s, paddr, size, WATCH_READ)) {
+                tlb_idx                    = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+                s->tlb_read[tlb_idx].vaddr = addr & ~PG_MASK;
 #ifdef PADDR_INLINE
-            s->tlb_read[tlb_idx].paddr_addend = paddr - addr;
+                s->tlb_read[tlb_idx].paddr_addend = paddr - addr;
 #else
-            s->tlb_read_paddr_addend[tlb_idx]  = paddr - addr;
+                s->tlb_read_paddr_addend[tlb_idx] = paddr - addr;
 #endif
-            s->tlb_read[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_read[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+            }
             switch (size_log2) {
                 case 0: ret = *(uint8_t *)ptr; break;
                 case 1: ret = *(uint16_t *)ptr; break;
@@ -543,6 +721,7 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
                 default: abort();
             }
         } else {
+            s->host_stats.mmio_read++;
             offset = paddr - pr->addr;
             if (((pr->devio_flags >> size_log2) & 1) != 0) {
                 ret = pr->read_func(pr->opaque, offset, size_log2);
@@ -589,6 +768,8 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
         }
         paddr = addr;
     } else {
+        hpm_tlb_miss(s, HPM_DTLB_MISS, ACCESS_WRITE);
+
         int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_WRITE, &paddr);
 
         if (err) {
@@ -608,15 +789,17 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
             return -1;
         } else if (pr->is_ram) {
             phys_mem_set_dirty_bit(pr, paddr - pr->addr);
-            tlb_idx                     = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
-            ptr                         = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
+            ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+            if (likely(!s->machine->watch_page_count) || !watch_access(s, paddr, size, WATCH_WRITE)) {
+                tlb_idx                     = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+                s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
 #ifdef PADDR_INLINE
-            s->tlb_write[tlb_idx].paddr_addend = paddr - addr;
+                s->tlb_write[tlb_idx].paddr_addend = paddr - addr;
 #else
-            s->tlb_write_paddr_addend[tlb_idx] = paddr - addr;
+                s->tlb_write_paddr_addend[tlb_idx] = paddr - addr;
 #endif
-            s->tlb_write[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_write[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+            }
             switch (size_log2) {
                 case 0: *(uint8_t *)ptr = val; break;
                 case 1: *(uint16_t *)ptr = val; break;
@@ -630,6 +813,7 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
                 default: abort();
             }
         } else {
+            s->host_stats.mmio_write++;
             offset = paddr - pr->addr;
             if (((pr->devio_flags >> size_log2) & 1) != 0) {
                 pr->write_func(pr->opaque, offset, val, size_log2);
@@ -668,6 +852,8 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
     uint8_t *        ptr;
     PhysMemoryRange *pr;
 
+    hpm_tlb_miss(s, HPM_ITLB_MISS, ACCESS_CODE);
+
     int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_CODE, &paddr);
     if (err) {
         s->pending_tval      = addr;
@@ -683,7 +869,7 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
     }
     tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
     ptr     = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-    if (riscv_cpu_pmp_access_ok(s, paddr & ~PG_MASK, PG_MASK + 1, PMPCFG_X)) {
+    if (riscv_cpu_pmp_access_ok(s, paddr & ~PG_MASK, PG_MASK + 1, PMPCFG_X) && !trigger_page(s, addr)) {
         /* All of this page has full execute access so we can bypass
          * the slow PMP checks. */
         s->tlb_code[tlb_idx].vaddr        = addr & ~PG_MASK;
@@ -768,6 +954,15 @@ static void tlb_init(RISCVCPUState *s) {
 
 static void tlb_flush_all(RISCVCPUState *s) { tlb_init(s); }
 
+void riscv_cpu_flush_tlb(RISCVCPUState *s) { tlb_flush_all(s); }
+
+/* The trigger CSRs changed, the pages of the new triggers may be in tlb_code */
+static void update_triggers(RISCVCPUState *s) {
+    s->trigger_exec = 0;
+    for (int i = 0; i < MAX_TRIGGERS; ++i) s->trigger_exec += trigger_armed(s, i);
+    tlb_flush_all(s);
+}
+
 static void tlb_flush_vaddr(RISCVCPUState *s, target_ulong vaddr) { tlb_flush_all(s); }
 
 void riscv_cpu_flush_tlb_write_range_ram(RISCVCPUState *s, uint8_t *ram_ptr, size_t ram_size) {
@@ -823,6 +1018,155 @@ static BOOL counter_access_ok(RISCVCPUState *s, uint32_t csr) {
     return (counteren >> (csr & 31)) & 1;
 }
 
+static uint64_t hpm_event_count(RISCVCPUState *s, int event) {
+#ifdef LIVECACHE
+    RISCVMachine *m = s->machine;
+    int           h = s->mhartid & (MAX_CPUS - 1);
+
+    switch (event) {
+        case HPM_ICACHE_HIT: return m->llc_hit[h][0];
+        case HPM_DCACHE_HIT: return m->llc_hit[h][1];
+        case HPM_ICACHE_MISS: return m->llc_miss[h][0];
+        case HPM_DCACHE_MISS: return m->llc_miss[h][1];
+        case HPM_LLC_MISS: return m->llc_shared_miss[h];
+        default:;
+    }
+#endif
+    return s->hpm_event[event];
+}
+
+/*
+ * hpm_total --
+ *
+ * Total of the events selected by mhpmevent[n] since reset.  The events
+ * are counted where the interpreter leaves its fast path anyway (TLB
+ * misses, traps, the end of a block at a taken branch), except the
+ * instruction classes of set 0, see hpm_insn_class.
+ */
+static uint64_t hpm_total(RISCVCPUState *s, int n) {
+    unsigned set   = s->mhpmevent[n] & HPM_EVENT_SETMASK;
+    uint32_t mask  = (s->mhpmevent[n] & HPM_EVENT_EVENTMASK) >> 8;
+    uint64_t total = 0;
+
+    if (set >= HPM_EVENT_SETS || !mask)
+        return 0;
+
+#ifdef LIVECACHE
+    if (set == 2 && s->machine->llc_queue)
+        livecache_sync(s->machine);
+#endif
+
+    for (int i = 0; mask; ++i, mask >>= 1)
+        if (mask & 1)
+            total += hpm_event_count(s, set * HPM_SET_EVENTS + i);
+
+    return total;
+}
+
+/* An inhibited counter keeps its value in hpm_offset */
+static uint64_t hpm_counter(RISCVCPUState *s, int n) {
+    if ((s->mcountinhibit >> n) & 1)
+        return s->hpm_offset[n];
+
+    return hpm_total(s, n) + s->hpm_offset[n];
+}
+
+static void hpm_set_counter(RISCVCPUState *s, int n, uint64_t val) {
+    if ((s->mcountinhibit >> n) & 1)
+        s->hpm_offset[n] = val;
+    else
+        s->hpm_offset[n] = val - hpm_total(s, n);
+}
+
+/*
+ * hpm_update_classify --
+ *
+ * Classifying the retired instructions is only paid for while a counter
+ * needs it.  The CSR writes that call this end the block (return 2), so
+ * that the interpreter picks the change up at the next fetch.
+ */
+static void hpm_update_classify(RISCVCPUState *s) {
+    const target_ulong classes = HPM_EVENT_EVENTMASK & ~((target_ulong)1 << (8 + HPM_EXCEPTION));
+
+    s->hpm_classify = false;
+    for (int n = 3; n < 32; ++n)
+        if (!((s->mcountinhibit >> n) & 1) && (s->mhpmevent[n] & HPM_EVENT_SETMASK) == 0 && (s->mhpmevent[n] & classes))
+            s->hpm_classify = true;
+}
+
+/*
+ * hpm_insn_class --
+ *
+ * The set 0 event of an instruction.  While hpm_classify is set the
+ * interpreter fetches every instruction through its slow path, counts
+ * its class there and takes it back if the instruction traps.
+ */
+static int hpm_insn_class(uint32_t insn) {
+    int event = HPM_ARITH;
+
+    if ((insn & 3) != 3) {
+        uint32_t funct3 = (insn >> 13) & 7;
+
+        switch ((insn & 3) << 3 | funct3) {
+            case 0 << 3 | 1:
+            case 2 << 3 | 1: event = HPM_FP_LOAD; break; /* c.fld, c.fldsp */
+            case 0 << 3 | 2:
+            case 0 << 3 | 3:
+            case 2 << 3 | 2:
+            case 2 << 3 | 3: event = HPM_LOAD; break;
+            case 0 << 3 | 5:
+            case 2 << 3 | 5: event = HPM_FP_STORE; break; /* c.fsd, c.fsdsp */
+            case 0 << 3 | 6:
+            case 0 << 3 | 7:
+            case 2 << 3 | 6:
+            case 2 << 3 | 7: event = HPM_STORE; break;
+            case 1 << 3 | 5: event = HPM_JAL; break; /* c.j */
+            case 1 << 3 | 6:
+            case 1 << 3 | 7: event = HPM_BRANCH; break;
+            case 2 << 3 | 4:
+                if (((insn >> 2) & 31) == 0) /* c.jr, c.jalr and c.ebreak */
+                    event = ((insn >> 7) & 31) == 0 ? HPM_SYSTEM : HPM_JALR;
+                break;
+            default: break;
+        }
+    } else {
+        switch (insn & 0x7f) {
+            case 0x03: event = HPM_LOAD; break;
+            case 0x07: event = HPM_FP_LOAD; break;
+            case 0x23: event = HPM_STORE; break;
+            case 0x27: event = HPM_FP_STORE; break;
+            case 0x2f: event = HPM_AMO; break;
+            case 0x0f:
+            case 0x73: event = HPM_SYSTEM; break;
+            case 0x63: event = HPM_BRANCH; break;
+            case 0x6f: event = HPM_JAL; break;
+            case 0x67: event = HPM_JALR; break;
+            case 0x33:
+            case 0x3b:
+                if ((insn >> 25) == 1)
+                    event = (insn >> 12) & 4 ? HPM_DIV : HPM_MUL;
+                break;
+            case 0x43:
+            case 0x47:
+            case 0x4b:
+            case 0x4f: event = HPM_FP_MADD; break;
+            case 0x53:
+                switch (insn >> 27) {
+                    case 0x00:
+                    case 0x01: event = HPM_FP_ADD; break;
+                    case 0x02: event = HPM_FP_MUL; break;
+                    case 0x03:
+                    case 0x0b: event = HPM_FP_DIVSQRT; break;
+                    default: event = HPM_FP_OTHER; break;
+                }
+                break;
+            default: break;
+        }
+    }
+
+    return event;
+}
+
 /* return -1 if invalid CSR. 0 if OK. 'will_write' indicate that the
    csr will be written after (used for CSR access check) */
 static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr, BOOL will_write) {
@@ -989,7 +1333,7 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr, BOOL wil
         case 0xc1f:
             if (!counter_access_ok(s, csr))
                 goto invalid_csr;
-            val = 0;  // mhpmcounter3..31
+            val = hpm_counter(s, csr & 0x1F);  // mhpmcounter3..31
             break;
 
         case 0xf14: val = s->mhartid; break;
@@ -1224,7 +1568,20 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val) {
             s->mtvec = val & ((1ull << s->physical_addr_len) - 3);  // mtvec[1] === 0
             break;
         case 0x306: s->mcounteren = val; break;
-        case 0x320: s->mcountinhibit = val & ~2; break;
+        case 0x320: {
+            uint32_t changed = (s->mcountinhibit ^ val) & ~7;
+            uint64_t counter[32];
+
+            for (int n = 3; n < 32; ++n)
+                if ((changed >> n) & 1)
+                    counter[n] = hpm_counter(s, n);
+            s->mcountinhibit = val & ~2;
+            for (int n = 3; n < 32; ++n)
+                if ((changed >> n) & 1)
+                    hpm_set_counter(s, n, counter[n]);
+            hpm_update_classify(s);
+            return 2;
+        }
         case 0x340: s->mscratch = val; break;
         case 0x341:
             s->mepc = val & (s->misa & MCPUID_C ? ~1 : ~3);
@@ -1251,11 +1608,13 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val) {
                 mask                  = ((target_ulong)15 << 60) | MCONTROL_M | MCONTROL_EXECUTE;
                 s->tdata1[s->tselect] = s->tdata1[s->tselect] & ~mask | val & mask;
             }
-            break;
+            update_triggers(s);
+            return 2;
 
         case 0x7a2:  // tdata2
             s->tdata2[s->tselect] = val;
-            break;
+            update_triggers(s);
+            return 2;
 
         case 0x7a3:  // tdata3
             s->tdata3[s->tselect] = val;
@@ -1311,7 +1670,15 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val) {
         case 0x33c:
         case 0x33d:
         case 0x33e:
-        case 0x33f: s->mhpmevent[csr & 0x1F] = val & (HPM_EVENT_SETMASK | HPM_EVENT_EVENTMASK); break;
+        case 0x33f: {
+            int      n       = csr & 0x1F;
+            uint64_t counter = hpm_counter(s, n);
+
+            s->mhpmevent[n] = val & (HPM_EVENT_SETMASK | HPM_EVENT_EVENTMASK);
+            hpm_set_counter(s, n, counter);
+            hpm_update_classify(s);
+            return 2;
+        }
 
         case CSR_PMPCFG(0):  // NB: 1 and 3 are _illegal_ in RV64
         case CSR_PMPCFG(2): {
@@ -1394,7 +1761,7 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val) {
         case 0xb1d:
         case 0xb1e:
         case 0xb1f:
-            // Allow, but ignore to write to performance counters mhpmcounter
+            hpm_set_counter(s, csr & 0x1F, val);
             break;
         case 0x8C2:
             if ((val & 3) == 3) {
@@ -1481,6 +1848,8 @@ static void raise_exception2(RISCVCPUState *s, uint64_t cause, target_ulong tval
     }
 #endif
 
+    s->hpm_event[cause & CAUSE_INTERRUPT ? HPM_INTERRUPT : HPM_EXCEPTION]++;
+
     if (s->priv <= PRV_S) {
         /* delegate the exception to the supervisor priviledge */
         if (cause & CAUSE_INTERRUPT)
@@ -1817,6 +2186,13 @@ void riscv_set_reg(RISCVCPUState *s, int rn, uint64_t val) {
 void riscv_dump_regs(RISCVCPUState *s) { dump_regs(s); }
 
 int riscv_read_insn(RISCVCPUState *s, uint32_t *insn, uint64_t addr) {
+    /* Code TLB hit with the whole word on the page: nothing can fault */
+    uint32_t tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+    if (likely(s->tlb_code[tlb_idx].vaddr == (addr & ~PG_MASK)) && (addr & PG_MASK) <= PG_MASK - 3) {
+        *insn = *(uint32_t *)(s->tlb_code[tlb_idx].mem_addend + (uintptr_t)addr);
+        return 0;
+    }
+
     /* target_read_insn_slow() wasn't designed for being used outside
        execution and will potentially raise exceptions.  Unfortunately
        fixing this correctly is invasive so we just protect the
@@ -1978,10 +2354,6 @@ static uint32_t create_auipc(int rd, uint32_t addr) {
     return 0x17 | ((rd & 0x1F) << 7) | ((addr >> 12) << 12);
 }
 
-static uint32_t create_lui(int rd, uint32_t addr) {
-    return 0x37 | ((rd & 0x1F) << 7) | ((addr >> 12) << 12);
-}
-
 static uint32_t create_addi(int rd, uint32_t addr) {
     uint32_t pos = addr & 0xFFF;
 
@@ -2002,72 +2374,293 @@ static void create_csr12_recovery(uint32_t *rom, uint32_t *code_pos, uint32_t cs
 }
 
 #ifdef LIVECACHE
-static void create_warmup_data(uint32_t *rom, uint32_t *data_pos, uint64_t addr) {
-    rom[(*data_pos)++] = addr & 0xFFFFFFFF;
-    rom[(*data_pos)++] = addr >> 32;
+static uint32_t create_itype(uint32_t opcode, int funct3, int rd, int rs1, int32_t imm) {
+    return opcode | ((rd & 0x1F) << 7) | ((funct3 & 7) << 12) | ((rs1 & 0x1F) << 15) | ((uint32_t)(imm & 0xFFF) << 20);
 }
 
-static void create_warmup_loop(uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos, uint32_t warmup_size) {
-    uint32_t data_off = sizeof(uint32_t) * (*data_pos - *code_pos);
+static uint32_t create_stype(int funct3, int rs1, int rs2, int32_t imm) {
+    return 0x23 | ((imm & 0x1F) << 7) | ((funct3 & 7) << 12) | ((rs1 & 0x1F) << 15) | ((rs2 & 0x1F) << 20)
+           | ((uint32_t)((imm >> 5) & 0x7F) << 25);
+}
+
+static uint32_t create_btype(int funct3, int rs1, int rs2, int32_t off) {
+    return 0x63 | (((off >> 11) & 1) << 7) | (((off >> 1) & 0xF) << 8) | ((funct3 & 7) << 12) | ((rs1 & 0x1F) << 15)
+           | ((rs2 & 0x1F) << 20) | (((off >> 5) & 0x3F) << 25) | ((uint32_t)((off >> 12) & 1) << 31);
+}
+
+static uint32_t create_rtype(int funct3, int rd, int rs1, int rs2) {
+    return 0x33 | ((rd & 0x1F) << 7) | ((funct3 & 7) << 12) | ((rs1 & 0x1F) << 15) | ((rs2 & 0x1F) << 20);
+}
+
+static uint32_t create_jal(int rd, int32_t off) {
+    return 0x6F | ((rd & 0x1F) << 7) | (off & 0xFF000) | (((off >> 11) & 1) << 20) | (((off >> 1) & 0x3FF) << 21)
+           | ((uint32_t)((off >> 20) & 1) << 31);
+}
+
+/*
+ * Warmup stream encoding
+ *
+ * The lines of a level are replayed oldest first.  Each record is a
+ * 16 bit halfword:
+ *
+ *   15..5  line delta from the last line of the previous record, signed
+ *    4..1  run, number of lines that follow the first one, one line apart
+ *       0  the lines were written
+ *
+ * A delta of WARMUP_ESCAPE means the actual delta follows as a 32 bit
+ * signed value in two halfwords, low half first.  The first record is
+ * relative to line 0.
+ */
+#define WARMUP_DELTA_BITS 11
+#define WARMUP_ESCAPE     (-(1 << (WARMUP_DELTA_BITS - 1)))
+#define WARMUP_MAX_RUN    15
+
+/* One warmup stream per modeled level, the n most recent lines */
+typedef struct {
+    LiveCache *cache;
+    uint64_t   n;
+    int        hartid; /* -1 for the shared level, replayed by hart 0 */
+    bool       fetch;  /* instruction level, replayed with prefetch.i */
+    uint16_t  *enc;    /* encoded records */
+    uint32_t   n_enc;  /* halfwords in enc */
+} WarmupStream;
+
+#define WARMUP_DISPATCH_WORDS 3
+#define WARMUP_LOOP_WORDS     27
+#define WARMUP_LOAD_WORDS     3
+#define WARMUP_FETCH_WORDS    1
+
+static uint32_t warmup_code_words(const WarmupStream *w, bool dispatch) {
+    return (dispatch ? WARMUP_DISPATCH_WORDS : 0) + WARMUP_LOOP_WORDS + (w->fetch ? WARMUP_FETCH_WORDS : WARMUP_LOAD_WORDS);
+}
+
+/* The data that follows a stream stays 64 bit aligned */
+static uint32_t warmup_data_words(uint32_t n_enc) { return (n_enc + 3) / 4 * 2; }
+
+/*
+ * warmup_encode --
+ *
+ * Encodes n line addresses (bit 0 set for stores) and returns the
+ * number of halfwords used.  With out == NULL they are only counted.
+ */
+static uint32_t warmup_encode(const uint64_t *addr, uint64_t n, int line_bits, uint16_t *out) {
+    uint64_t prev = 0;
+    uint32_t len  = 0;
+
+    for (uint64_t i = 0; i < n;) {
+        uint64_t line = addr[i] >> line_bits;
+        uint64_t st   = addr[i] & 1;
+        uint64_t run  = 0;
+
+        while (run < WARMUP_MAX_RUN && i + run + 1 < n && addr[i + run + 1] >> line_bits == line + run + 1
+               && (addr[i + run + 1] & 1) == st)
+            run++;
+
+        int64_t delta = (int64_t)(line - prev);
+        bool    near  = WARMUP_ESCAPE < delta && delta < -WARMUP_ESCAPE;
+        int64_t field = near ? delta : WARMUP_ESCAPE;
+
+        assert(near || (INT32_MIN <= delta && delta <= INT32_MAX));
+        if (out)
+            out[len] = (uint16_t)((field & ((1 << WARMUP_DELTA_BITS) - 1)) << 5 | run << 1 | st);
+        len++;
+        if (!near) {
+            if (out) {
+                out[len]     = (uint16_t)delta;
+                out[len + 1] = (uint16_t)(delta >> 16);
+            }
+            len += 2;
+        }
+
+        prev = line + run;
+        i += run + 1;
+    }
 
-// The warmup executes a loop very close to this (the total is not needed, but in C is needed to avoid dead-code-elimination.)
-//
-// int warmup_loop(long int *base, unsigned int base_size) {
-//   unsigned int total=0;
-//   for(unsigned int i=0;i<base_size;++i) {
-//     long int addr = base[i];
-//     char *ptr = (char *)addr; // OK to have 1 at LSB because we do LB/SB
-//     if (addr&1)
-//       *ptr = *ptr+1; // THIS IS TO AVOID elimination. should be *ptr+0
-//     else
-//       total += *ptr;
-//   }
-//
-//   return total;
-// }
-//
-// The assembly (without return at pointer check return)
-//
-    rom[(*code_pos)++] = create_auipc(10, data_off);  // s0 == data_pos (or begin of data trace
+    return len;
+}
+
+/*
+ * create_warmup_loop --
+ *
+ * Replays a stream: a0 walks the records in the data area up to a1 and
+ * a5 is the line being warmed.  Data levels load each line and store
+ * the loaded byte back for the lines that were written.  The
+ * instruction levels use prefetch.i (Zicbop, a hint that is a nop
+ * elsewhere) so nothing is ever executed from the warmed lines.
+ */
+static void create_warmup_loop(uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos, const WarmupStream *w, bool dispatch) {
+    uint32_t start     = *code_pos;
+    int      line_bits = log2i(w->cache->getLineSize());
+
+    if (dispatch) {
+        int32_t skip = 4 * (warmup_code_words(w, true) - 2);
+
+        rom[(*code_pos)++] = 0xf1402573;                                                  // csrr a0, mhartid
+        rom[(*code_pos)++] = create_itype(0x13, 0, 11, 0, w->hartid < 0 ? 0 : w->hartid);  // li   a1, hartid
+        rom[(*code_pos)++] = create_btype(1, 10, 11, skip);                               // bne  a0, a1, 9f
+    }
+
+    uint32_t data_off = sizeof(uint32_t) * (*data_pos - *code_pos);
+    rom[(*code_pos)++] = create_auipc(10, data_off);
     rom[(*code_pos)++] = create_addi(10, data_off);
-    rom[(*code_pos)++] = create_lui(11, warmup_size);
-    rom[(*code_pos)++] = create_addi(11, warmup_size);
-
-//   2:	fff5869b          	addiw	a3,a1,-1
-    rom[(*code_pos)++] = 0xfff5869b;
-//   6:	1682                slli	a3,a3,0x20
-//   8:	82f5                srli	a3,a3,0x1d
-    rom[(*code_pos)++] = 0x82f51682;
-//   a:	00850793          	addi	a5,a0,8
-    rom[(*code_pos)++] = 0x00850793;
-//   e:	96be                add	a3,a3,a5
-//  10:	4581                li	a1,0
-    rom[(*code_pos)++] = 0x458196be;
-//  12:	a039                j	20 <.L5>
-//
-//  14:	2701                addiw	a4,a4,1 // FIXED to a4,a4,0
-    rom[(*code_pos)++] = 0x2701a039;
-//  16:	00e78023          	sb	a4,0(a5)
-    rom[(*code_pos)++] = 0x00e78023;
-//  1a:	0521                addi	a0,a0,8
-//  1c:	00d50c63          	beq	a0,a3,34 <.L9>
-    rom[(*code_pos)++] = 0x0c630521;
-//
-//  20:	611c                ld	a5,0(a0)
-    rom[(*code_pos)++] = 0x611c00d5;
-//  22:	0017f613          	andi	a2,a5,1
-    rom[(*code_pos)++] = 0x0017f613;
-//  26:	0007c703          	lbu	a4,0(a5)
-    rom[(*code_pos)++] = 0x0007c703;
-//  2a:	f66d                bnez	a2,14 <.L10>
-//  2c:	0521                addi	a0,a0,8
-    rom[(*code_pos)++] = 0x0521f66d;
-//  2e:	9db9                addw	a1,a1,a4
-//  30:	fed518e3          	bne	a0,a3,20 <.L5>
-    rom[(*code_pos)++] = 0x18e39db9;
-//  34:	4501                li	a0,0 // A 2 byte NOP to have 4 bytes alignment
-    rom[(*code_pos)++] = 0x4501fed5;
 
+    uint32_t end_off   = sizeof(uint32_t) * (*data_pos - *code_pos) + 2 * w->n_enc;
+    rom[(*code_pos)++] = create_auipc(11, end_off);
+    rom[(*code_pos)++] = create_addi(11, end_off);
+
+    rom[(*code_pos)++] = create_itype(0x13, 0, 15, 0, 0);          //    li   a5, 0
+    rom[(*code_pos)++] = create_itype(0x13, 0, 17, 0, 1);          //    li   a7, 1
+    rom[(*code_pos)++] = create_itype(0x13, 1, 17, 17, line_bits);  //    slli a7, a7, line_bits
+
+    uint32_t loop      = *code_pos;
+    rom[(*code_pos)++] = create_itype(0x03, 1, 12, 10, 0);                 // 0: lh   a2, 0(a0)
+    rom[(*code_pos)++] = create_itype(0x13, 0, 10, 10, 2);                 //    addi a0, a0, 2
+    rom[(*code_pos)++] = create_itype(0x13, 5, 13, 12, 0x400 | 5);         //    srai a3, a2, 5
+    rom[(*code_pos)++] = create_itype(0x13, 0, 14, 0, WARMUP_ESCAPE);      //    li   a4, ESCAPE
+    rom[(*code_pos)++] = create_btype(1, 13, 14, 24);                      //    bne  a3, a4, 1f
+    rom[(*code_pos)++] = create_itype(0x03, 5, 13, 10, 0);                 //    lhu  a3, 0(a0)
+    rom[(*code_pos)++] = create_itype(0x03, 1, 14, 10, 2);                 //    lh   a4, 2(a0)
+    rom[(*code_pos)++] = create_itype(0x13, 0, 10, 10, 4);                 //    addi a0, a0, 4
+    rom[(*code_pos)++] = create_itype(0x13, 1, 14, 14, 16);                //    slli a4, a4, 16
+    rom[(*code_pos)++] = create_rtype(6, 13, 13, 14);                      //    or   a3, a3, a4
+    rom[(*code_pos)++] = create_itype(0x13, 1, 13, 13, line_bits);         // 1: slli a3, a3, line_bits
+    rom[(*code_pos)++] = create_rtype(0, 15, 15, 13);                      //    add  a5, a5, a3
+    rom[(*code_pos)++] = create_itype(0x13, 5, 14, 12, 1);                 //    srli a4, a2, 1
+    rom[(*code_pos)++] = create_itype(0x13, 7, 14, 14, WARMUP_MAX_RUN);    //    andi a4, a4, 15
+    rom[(*code_pos)++] = create_itype(0x13, 7, 12, 12, 1);                 //    andi a2, a2, 1
+
+    uint32_t touch = *code_pos;
+    if (w->fetch) {
+        rom[(*code_pos)++] = create_itype(0x13, 6, 0, 15, 0);  // 2: prefetch.i 0(a5)
+    } else {
+        rom[(*code_pos)++] = create_itype(0x03, 4, 16, 15, 0);  // 2: lbu  a6, 0(a5)
+        rom[(*code_pos)++] = create_btype(0, 12, 0, 8);         //    beqz a2, 3f
+        rom[(*code_pos)++] = create_stype(0, 15, 16, 0);        //    sb   a6, 0(a5)
+    }
+    rom[(*code_pos)++] = create_btype(0, 14, 0, 16);           // 3: beqz a4, 4f
+    rom[(*code_pos)++] = create_itype(0x13, 0, 14, 14, -1);     //    addi a4, a4, -1
+    rom[(*code_pos)++] = create_rtype(0, 15, 15, 17);          //    add  a5, a5, a7
+    int32_t back       = 4 * ((int32_t)touch - (int32_t)*code_pos);
+    rom[(*code_pos)++] = create_jal(0, back);                  //    j    2b
+    back               = 4 * ((int32_t)loop - (int32_t)*code_pos);
+    rom[(*code_pos)++] = create_btype(1, 10, 11, back);        // 4: bne  a0, a1, 0b
+                                                               // 9:
+    assert(*code_pos - start == warmup_code_words(w, dispatch));
+    (void)start;
+
+    memcpy(&rom[*data_pos], w->enc, 2 * w->n_enc);
+    *data_pos += warmup_data_words(w->n_enc);
+}
+
+/*
+ * warmup_fit --
+ *
+ * Encodes the most recent lines of a level that fit in data_words and
+ * returns how many words they take.  At most 16 lines fit in a
+ * halfword, so that many are read from the cache at most.
+ */
+static uint32_t warmup_fit(WarmupStream *w, uint32_t data_words) {
+    uint64_t  max       = w->n < 32 * (uint64_t)data_words ? w->n : 32 * (uint64_t)data_words;
+    uint64_t *addr      = (uint64_t *)malloc(sizeof *addr * (max ? max : 1));
+    int       line_bits = log2i(w->cache->getLineSize());
+
+    assert(addr);
+    // traverse writes the ROM layout, two 32 bit words per line
+    uint64_t n = w->cache->traverse((uint32_t *)addr, max);
+    for (uint64_t i = 0; i < n; ++i) {
+        uint32_t *words = (uint32_t *)&addr[i];
+        addr[i]         = words[0] | (uint64_t)words[1] << 32;
+    }
+
+    // Oldest line to keep, the encoded size only shrinks as it moves up
+    uint64_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (warmup_data_words(warmup_encode(addr + mid, n - mid, line_bits, NULL)) <= data_words)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    w->n     = n - lo;
+    w->n_enc = warmup_encode(addr + lo, w->n, line_bits, NULL);
+    w->enc   = (uint16_t *)malloc(2 * (w->n_enc ? w->n_enc : 1));
+    assert(w->enc);
+    warmup_encode(addr + lo, w->n, line_bits, w->enc);
+    free(addr);
+
+    return warmup_data_words(w->n_enc);
+}
+
+/*
+ * create_warmup --
+ *
+ * Emits the warmup streams of all the LiveCache levels, given room for
+ * code_words and data_words in the ROM.  When they do not fit, the
+ * oldest accesses are dropped.  The private levels split the room
+ * evenly, what one leaves goes to the next, the shared level gets the
+ * rest.  A level left without lines gets no loop.
+ * The shared level is replayed first so the private streams end up in
+ * the L1s.
+ */
+static void create_warmup(RISCVCPUState *s, uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos, uint32_t code_words,
+                          uint32_t data_words) {
+    RISCVMachine *m = s->machine;
+    WarmupStream  w[1 + 2 * MAX_CPUS];
+    int           n_w      = 0;
+    bool          dispatch = m->ncpus > 1;
+
+    livecache_sync(m);
+    memset(w, 0, sizeof w);
+    w[n_w].cache  = m->llc;
+    w[n_w].n      = m->llc->countLines();
+    w[n_w].hartid = -1;
+    w[n_w].fetch  = false;
+    n_w++;
+    for (int i = 0; i < m->ncpus; ++i) {
+        if (m->l1i[i]) {
+            w[n_w].cache  = m->l1i[i];
+            w[n_w].n      = m->l1i[i]->countLines();
+            w[n_w].hartid = i;
+            w[n_w].fetch  = true;
+            n_w++;
+        }
+        if (m->l1d[i]) {
+            w[n_w].cache  = m->l1d[i];
+            w[n_w].n      = m->l1d[i]->countLines();
+            w[n_w].hartid = i;
+            w[n_w].fetch  = false;
+            n_w++;
+        }
+    }
+
+    // Budget, private levels (w[1..i]) first, an even share of what is left each
+    for (int i = n_w - 1; i >= 0; --i) {
+        uint32_t code  = warmup_code_words(&w[i], dispatch);
+        uint64_t lines = w[i].n;
+
+        if (lines == 0 || code > code_words) {
+            w[i].n = 0;
+        } else {
+            data_words -= warmup_fit(&w[i], i ? data_words / i : data_words);
+            if (w[i].n)
+                code_words -= code;
+        }
+
+        if (w[i].n < lines)
+            fprintf(dromajo_stderr,
+                    "LiveCache: warmup of %s%d truncated from %" PRIu64 " to %" PRIu64 " lines (the ROM is full)\n",
+                    w[i].hartid < 0 ? "llc" : w[i].fetch ? "l1i" : "l1d",
+                    w[i].hartid < 0 ? 0 : w[i].hartid,
+                    lines,
+                    w[i].n);
+    }
+
+    for (int i = 0; i < n_w; ++i) {
+        if (w[i].n)
+            create_warmup_loop(rom, code_pos, data_pos, &w[i], dispatch);
+        free(w[i].enc);
+    }
 }
 #endif
 
@@ -2125,151 +2718,160 @@ static void create_hang_nonzero_hart(uint32_t *rom, uint32_t *code_pos, uint32_t
                                       // 1:
 }
 
-static void create_boot_rom(RISCVCPUState *s, const char *file, const uint64_t clint_base_addr) {
-    uint32_t rom[ROM_SIZE / 4];
-    memset(rom, 0, sizeof rom);
-
-    // ROM organization
-    // 0000..003F wasted
-    // 0040..0AFF boot code (2,752 B)
-    // 0B00..0FFF boot data (  512 B)
-
-    uint32_t code_pos       = (BOOT_BASE_ADDR - ROM_BASE_ADDR) / sizeof *rom;
-    uint32_t data_pos       = 0xB00 / sizeof *rom;
-    uint32_t data_pos_start = data_pos;
-
-    if (s->machine->ncpus == 1)  // FIXME: May be interesting to freeze hartid >= ncpus
-        create_hang_nonzero_hart(rom, &code_pos, &data_pos);
-
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x7b1, s->pc);  // Write to DPC (CSR, 0x7b1)
-
-    // Write current priviliege level to prv in dcsr (0 user, 1 supervisor, 2 user)
-    // dcsr is at 0x7b0 prv is bits 0 & 1
-    // dcsr.stopcount = 1
-    // dcsr.stoptime  = 1
-    // dcsr = 0x600 | (PrivLevel & 0x3)
-    if (s->priv == 2) {
-        fprintf(dromajo_stderr, "UNSUPORTED Priv mode (no hyper)\n");
-        exit(-4);
-    }
-
-    create_csr12_recovery(rom, &code_pos, 0x7b0, 0x600 | s->priv);
-
-#ifdef LIVECACHE
-    uint64_t  n_addr=0;
-    uint64_t  n_addr_to_skip=0;
-    uint64_t *addr = s->machine->llc->traverse(n_addr);
-
-    if (n_addr > (ROM_SIZE-1024)) {
-        fprintf(stderr, "LiveCache: truncating boot rom from %" PRIu64 " to %d (you may want to increase ROM_SIZE for better warmup)\n", n_addr, ROM_SIZE-1024);
-        n_addr_to_skip = n_addr - (ROM_SIZE - 1024);
-    }
-    uint32_t n_entries = n_addr-n_addr_to_skip;
-
-    create_warmup_loop(rom, &code_pos, &data_pos, n_entries);
-    for (size_t i = n_addr_to_skip; i < n_addr; ++i) {
-        uint64_t a = addr[i] & ~0x1ULL;
-        printf("addr:%llx %s\n", (unsigned long long)a, (addr[i] & 1) ? "ST" : "LD");
-        create_warmup_data(rom, &data_pos, addr[i]);
-    }
-#endif
-
+/*
+ * create_state_recovery --
+ *
+ * Everything the boot ROM restores after the warmup, ending with the
+ * dret into the checkpointed code.
+ */
+static void create_state_recovery(RISCVCPUState *s, uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos,
+                                  const uint64_t clint_base_addr) {
     // NOTE: mstatus & misa should be one of the first because risvemu breaks down this
     // register for performance reasons. E.g: restoring the fflags also changes
     // parts of the mstats
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x300, get_mstatus(s, (target_ulong)-1));   // mstatus
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x301, s->misa | ((target_ulong)2 << 62));  // misa
+    create_csr64_recovery(rom, code_pos, data_pos, 0x300, get_mstatus(s, (target_ulong)-1));   // mstatus
+    create_csr64_recovery(rom, code_pos, data_pos, 0x301, s->misa | ((target_ulong)2 << 62));  // misa
 
     // All the remaining CSRs
     if (s->fs) {  // If the FPU is down, you can not recover flags
-        create_csr12_recovery(rom, &code_pos, 0x001, s->fflags);
+        create_csr12_recovery(rom, code_pos, 0x001, s->fflags);
         // Only if fflags, otherwise it would raise an illegal instruction
-        create_csr12_recovery(rom, &code_pos, 0x002, s->frm);
-        create_csr12_recovery(rom, &code_pos, 0x003, s->fflags | (s->frm << 5));
+        create_csr12_recovery(rom, code_pos, 0x002, s->frm);
+        create_csr12_recovery(rom, code_pos, 0x003, s->fflags | (s->frm << 5));
 
         // do the FP registers, iff fs is set
         for (int i = 0; i < 32; i++) {
-            uint32_t data_off = sizeof(uint32_t) * (data_pos - code_pos);
-            rom[code_pos++]   = create_auipc(1, data_off);
-            rom[code_pos++]   = create_addi(1, data_off);
-            rom[code_pos++]   = create_fld(i, 1);
+            uint32_t data_off = sizeof(uint32_t) * (*data_pos - *code_pos);
+            rom[(*code_pos)++]   = create_auipc(1, data_off);
+            rom[(*code_pos)++]   = create_addi(1, data_off);
+            rom[(*code_pos)++]   = create_fld(i, 1);
 
-            rom[data_pos++] = (uint32_t)s->fp_reg[i];
-            rom[data_pos++] = (uint64_t)s->reg[i] >> 32;
+            rom[(*data_pos)++] = (uint32_t)s->fp_reg[i];
+            rom[(*data_pos)++] = (uint64_t)s->reg[i] >> 32;
         }
     }
 
     // Recover CPU CSRs
 
     // Cycle and instruction are alias across modes. Just write to m-mode counter
-    // Already done before CLINT. create_csr64_recovery(rom, &code_pos, &data_pos, 0xb00, s->insn_counter); // mcycle
-    // create_csr64_recovery(rom, &code_pos, &data_pos, 0xb02, s->insn_counter); // instret
-
-    for (int i = 3; i < 32; ++i) {
-        create_csr12_recovery(rom, &code_pos, 0xb00 + i, 0);                           // reset mhpmcounter3..31
-        create_csr64_recovery(rom, &code_pos, &data_pos, 0x320 + i, s->mhpmevent[i]);  // mhpmevent3..31
-    }
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a0, s->tselect);  // tselect
-    // FIXME: create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a1, s->tdata1); // tdata1
-    // FIXME: create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a2, s->tdata2); // tdata2
-    // FIXME: create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a3, s->tdata3); // tdata3
-
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x302, s->medeleg);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x303, s->mideleg);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x304, s->mie);  // mie & sie
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x305, s->mtvec);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x105, s->stvec);
-    create_csr12_recovery(rom, &code_pos, 0x320, s->mcountinhibit);
-    create_csr12_recovery(rom, &code_pos, 0x306, s->mcounteren);
-    create_csr12_recovery(rom, &code_pos, 0x106, s->scounteren);
+    // Already done before CLINT. create_csr64_recovery(rom, code_pos, data_pos, 0xb00, s->insn_counter); // mcycle
+    // create_csr64_recovery(rom, code_pos, data_pos, 0xb02, s->insn_counter); // instret
+
+    for (int i = 3; i < 32; ++i)
+        create_csr64_recovery(rom, code_pos, data_pos, 0x320 + i, s->mhpmevent[i]);  // mhpmevent3..31
+    create_csr64_recovery(rom, code_pos, data_pos, 0x7a0, s->tselect);  // tselect
+    // FIXME: create_csr64_recovery(rom, code_pos, data_pos, 0x7a1, s->tdata1); // tdata1
+    // FIXME: create_csr64_recovery(rom, code_pos, data_pos, 0x7a2, s->tdata2); // tdata2
+    // FIXME: create_csr64_recovery(rom, code_pos, data_pos, 0x7a3, s->tdata3); // tdata3
+
+    create_csr64_recovery(rom, code_pos, data_pos, 0x302, s->medeleg);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x303, s->mideleg);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x304, s->mie);  // mie & sie
+    create_csr64_recovery(rom, code_pos, data_pos, 0x305, s->mtvec);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x105, s->stvec);
+    create_csr12_recovery(rom, code_pos, 0x320, s->mcountinhibit);
+    create_csr12_recovery(rom, code_pos, 0x306, s->mcounteren);
+    create_csr12_recovery(rom, code_pos, 0x106, s->scounteren);
 
     // NB: restore addr before cfgs for fewer surprises!
-    for (int i = 0; i < 16; ++i) create_csr64_recovery(rom, &code_pos, &data_pos, CSR_PMPADDR(i), s->csr_pmpaddr[i]);
-    for (int i = 0; i < 4; i += 2) create_csr64_recovery(rom, &code_pos, &data_pos, CSR_PMPCFG(i), s->csr_pmpcfg[i]);
+    for (int i = 0; i < 16; ++i) create_csr64_recovery(rom, code_pos, data_pos, CSR_PMPADDR(i), s->csr_pmpaddr[i]);
+    for (int i = 0; i < 4; i += 2) create_csr64_recovery(rom, code_pos, data_pos, CSR_PMPCFG(i), s->csr_pmpcfg[i]);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x340, s->mscratch);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x341, s->mepc);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x342, s->mcause);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x343, s->mtval);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x340, s->mscratch);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x341, s->mepc);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x342, s->mcause);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x343, s->mtval);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x140, s->sscratch);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x141, s->sepc);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x142, s->scause);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x143, s->stval);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x140, s->sscratch);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x141, s->sepc);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x142, s->scause);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x143, s->stval);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x344, s->mip);  // mip & sip
+    create_csr64_recovery(rom, code_pos, data_pos, 0x344, s->mip);  // mip & sip
 
     for (int i = 3; i < 32; i++) {  // Not 1 and 2 which are used by create_...
-        create_reg_recovery(rom, &code_pos, &data_pos, i, s->reg[i]);
+        create_reg_recovery(rom, code_pos, data_pos, i, s->reg[i]);
     }
 
     // Recover CLINT (Close to the end of the recovery to avoid extra cycles)
     // TODO: One per hart (multicore/SMP)
 
-    fprintf(dromajo_stderr,
-            "clint hartid=%d timecmp=%" PRId64 " cycles (%" PRId64 ")\n",
-            (int)s->mhartid,
-            s->timecmp,
-            s->mcycle / RTC_FREQ_DIV);
-
     // Assuming 16 ratio between CPU and CLINT and that CPU is reset to zero
-    create_io64_recovery(rom, &code_pos, &data_pos, clint_base_addr + 0x4000, s->timecmp);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0xb02, s->minstret);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0xb00, s->mcycle);
+    create_io64_recovery(rom, code_pos, data_pos, clint_base_addr + 0x4000, s->timecmp);
+    for (int i = 3; i < 32; ++i)
+        create_csr64_recovery(rom, code_pos, data_pos, 0xb00 + i, hpm_counter(s, i));  // mhpmcounter3..31
+    create_csr64_recovery(rom, code_pos, data_pos, 0xb02, s->minstret);
+    create_csr64_recovery(rom, code_pos, data_pos, 0xb00, s->mcycle);
 
-    create_io64_recovery(rom, &code_pos, &data_pos, clint_base_addr + 0xbff8, s->mcycle / RTC_FREQ_DIV);
+    create_io64_recovery(rom, code_pos, data_pos, clint_base_addr + 0xbff8, s->mcycle / RTC_FREQ_DIV);
 
     for (int i = 1; i < 3; i++) {  // recover 1 and 2 now
-        create_reg_recovery(rom, &code_pos, &data_pos, i, s->reg[i]);
+        create_reg_recovery(rom, code_pos, data_pos, i, s->reg[i]);
     }
 
-    rom[code_pos++] = create_csrrw(1, 0x7b2);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x180, s->satp);
+    rom[(*code_pos)++] = create_csrrw(1, 0x7b2);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x180, s->satp);
     // last Thing because it changes addresses. Use dscratch register to remember reg 1
-    rom[code_pos++] = create_csrrs(1, 0x7b2);
+    rom[(*code_pos)++] = create_csrrs(1, 0x7b2);
 
     // dret 0x7b200073
-    rom[code_pos++] = 0x7b200073;
+    rom[(*code_pos)++] = 0x7b200073;
+}
+
+static void create_boot_rom(RISCVCPUState *s, const char *file, const uint64_t clint_base_addr) {
+    uint32_t rom[ROM_SIZE / 4];
+    memset(rom, 0, sizeof rom);
+
+    // ROM organization
+    // 0000..003F wasted
+    // 0040..0AFF boot code (2,752 B)
+    // 0B00..0FFF boot data (1,280 B)
+
+    uint32_t code_pos       = (BOOT_BASE_ADDR - ROM_BASE_ADDR) / sizeof *rom;
+    uint32_t data_pos       = 0xB00 / sizeof *rom;
+    uint32_t data_pos_start = data_pos;
+
+    if (s->machine->ncpus == 1)  // FIXME: May be interesting to freeze hartid >= ncpus
+        create_hang_nonzero_hart(rom, &code_pos, &data_pos);
+
+    create_csr64_recovery(rom, &code_pos, &data_pos, 0x7b1, s->pc);  // Write to DPC (CSR, 0x7b1)
+
+    // Write current priviliege level to prv in dcsr (0 user, 1 supervisor, 2 user)
+    // dcsr is at 0x7b0 prv is bits 0 & 1
+    // dcsr.stopcount = 1
+    // dcsr.stoptime  = 1
+    // dcsr = 0x600 | (PrivLevel & 0x3)
+    if (s->priv == 2) {
+        fprintf(dromajo_stderr, "UNSUPORTED Priv mode (no hyper)\n");
+        exit(-4);
+    }
+
+    create_csr12_recovery(rom, &code_pos, 0x7b0, 0x600 | s->priv);
+
+    fprintf(dromajo_stderr,
+            "clint hartid=%d timecmp=%" PRId64 " cycles (%" PRId64 ")\n",
+            (int)s->mhartid,
+            s->timecmp,
+            s->mcycle / RTC_FREQ_DIV);
+
+#ifdef LIVECACHE
+    {
+        // Dry run of the state recovery, the warmup gets what is left
+        uint32_t scratch[ROM_SIZE / 4];
+        uint32_t state_code = 0;
+        uint32_t state_data = 0;
+        create_state_recovery(s, scratch, &state_code, &state_data, clint_base_addr);
+
+        // The final check below wants a free word left in both areas
+        uint32_t code_room  = data_pos_start - code_pos;
+        uint32_t data_room  = sizeof rom / sizeof *rom - data_pos;
+        uint32_t code_words = code_room > state_code + 1 ? code_room - state_code - 1 : 0;
+        uint32_t data_words = data_room > state_data + 1 ? data_room - state_data - 1 : 0;
+        create_warmup(s, rom, &code_pos, &data_pos, code_words, data_words);
+    }
+#endif
+
+    create_state_recovery(s, rom, &code_pos, &data_pos, clint_base_addr);
 
     if (sizeof rom / sizeof *rom <= data_pos || data_pos_start <= code_pos) {
         fprintf(dromajo_stderr,
@@ -56,6 +56,10 @@
 #include "dw_apb_uart.h"
 #include "elf64.h"
 #include "iomem.h"
+#include "journal.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
 
 /* RISCV machine */
 
@@ -124,6 +128,133 @@ static void mmio_write(void *opaque, uint32_t offset, uint32_t val, int size_log
     vm_error("mmio_write: offset=%x size_log2=%d val=%x\n", offset, size_log2, val);
 }
 
+static int mmio_range_cmp(const void *a, const void *b) {
+    uint64_t sa = ((const AddressSet *)a)->start;
+    uint64_t sb = ((const AddressSet *)b)->start;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void mmio_index_add(RISCVMachine *s, uint64_t start, uint64_t end) {
+    if (end <= start)
+        return;
+
+    s->mmio_index[s->mmio_index_size].start = start;
+    s->mmio_index[s->mmio_index_size].size  = end - start;
+    s->mmio_index_size++;
+}
+
+/*
+ * mmio_index_init --
+ *
+ * Builds the sorted list of disjoint ranges behind riscv_machine_is_mmio
+ * from mmio_start/mmio_end and mmio_addrset, which cosim checks on every
+ * load.
+ */
+static void mmio_index_init(RISCVMachine *s) {
+    s->mmio_index      = (AddressSet *)mallocz(sizeof(AddressSet) * (s->mmio_addrset_size + 1));
+    s->mmio_index_size = 0;
+
+    mmio_index_add(s, s->mmio_start, s->mmio_end);
+    for (size_t i = 0; i < s->mmio_addrset_size; ++i) {
+        uint64_t start = s->mmio_addrset[i].start;
+        uint64_t end   = start + s->mmio_addrset[i].size;
+        mmio_index_add(s, start, end < start ? UINT64_MAX : end);
+    }
+
+    qsort(s->mmio_index, s->mmio_index_size, sizeof(AddressSet), mmio_range_cmp);
+
+    /* Merge the ranges that overlap or touch */
+    int n = 0;
+    for (int i = 0; i < s->mmio_index_size; ++i) {
+        AddressSet *r = &s->mmio_index[i];
+        if (n > 0) {
+            AddressSet *last     = &s->mmio_index[n - 1];
+            uint64_t    last_end = last->start + last->size;
+            if (r->start <= last_end) {
+                uint64_t end = r->start + r->size;
+                if (end > last_end)
+                    last->size = end - last->start;
+                continue;
+            }
+        }
+        s->mmio_index[n++] = *r;
+    }
+    s->mmio_index_size = n;
+}
+
+/* True if paddr is in the MMIO space given for co-simulation */
+bool riscv_machine_is_mmio(const RISCVMachine *m, uint64_t paddr) {
+    int lo = 0, hi = m->mmio_index_size;
+
+    /* Find the last range starting at or below paddr */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->mmio_index[mid].start <= paddr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 && paddr - m->mmio_index[lo - 1].start < m->mmio_index[lo - 1].size;
+}
+
+/*
+ * riscv_machine_override_mem --
+ *
+ * Writes memory or a device on behalf of an agent outside the model
+ * (the DUT under cosim, or a replayed journal).  Returns 1 if nothing
+ * is mapped at paddr.
+ */
+int riscv_machine_override_mem(RISCVMachine *m, uint64_t paddr, uint64_t val, int size_log2) {
+    uint8_t *        ptr;
+    target_ulong     offset;
+    PhysMemoryRange *pr = get_phys_mem_range(m->mem_map, paddr);
+
+    if (!pr) {
+#ifdef DUMP_INVALID_MEM_ACCESS
+        fprintf(dromajo_stderr, "riscv_cpu_write_memory: invalid physical address 0x%016" PRIx64 "\n", paddr);
+#endif
+        return 1;
+    } else if (pr->is_ram) {
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);
+        ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+        switch (size_log2) {
+            case 0: *(uint8_t *)ptr = val; break;
+            case 1: *(uint16_t *)ptr = val; break;
+            case 2: *(uint32_t *)ptr = val; break;
+#if MLEN >= 64
+            case 3: *(uint64_t *)ptr = val; break;
+#endif
+#if MLEN >= 128
+            case 4: *(uint128_t *)ptr = val; break;
+#endif
+            default: abort();
+        }
+    } else {
+        offset = paddr - pr->addr;
+        if (((pr->devio_flags >> size_log2) & 1) != 0) {
+            pr->write_func(pr->opaque, offset, val, size_log2);
+        }
+#if MLEN >= 64
+        else if ((pr->devio_flags & DEVIO_SIZE32) && size_log2 == 3) {
+            /* emulate 64 bit access */
+            pr->write_func(pr->opaque, offset, val & 0xffffffff, 2);
+            pr->write_func(pr->opaque, offset + 4, (val >> 32) & 0xffffffff, 2);
+        }
+#endif
+        else {
+#ifdef DUMP_INVALID_MEM_ACCESS
+            fprintf(dromajo_stderr,
+                    "unsupported device write access: addr=0x%016" PRIx64 "  width=%d bits\n",
+                    paddr,
+                    1 << (3 + size_log2));
+#endif
+        }
+    }
+    return 0;
+}
+
 static uint32_t uart_read(void *opaque, uint32_t offset, int size_log2) {
     SiFiveUARTState *s = (SiFiveUARTState *)opaque;
 
@@ -1101,10 +1232,10 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
         s->cpu_state[i] = riscv_cpu_init(s, i);
     }
 
-    /* RAM */
-    cpu_register_ram(s->mem_map, 0, 4096, 0);  // Have memory at 0 for uaccess-etcsr to pass
-    cpu_register_ram(s->mem_map, s->ram_base_addr, s->ram_size, 0);
-    cpu_register_ram(s->mem_map, ROM_BASE_ADDR, ROM_SIZE, 0);
+    /* RAM (dirty bits let virt_machine_restore roll back only modified pages) */
+    cpu_register_ram(s->mem_map, 0, 4096, DEVRAM_FLAG_DIRTY_BITS);  // Have memory at 0 for uaccess-etcsr to pass
+    cpu_register_ram(s->mem_map, s->ram_base_addr, s->ram_size, DEVRAM_FLAG_DIRTY_BITS);
+    cpu_register_ram(s->mem_map, ROM_BASE_ADDR, ROM_SIZE, DEVRAM_FLAG_DIRTY_BITS);
 
     for (int i = 0; i < s->ncpus; ++i) {
         s->cpu_state[i]->physical_addr_len = p->physical_addr_len;
@@ -1246,6 +1377,7 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
     s->mmio_end          = p->mmio_end;
     s->mmio_addrset      = p->mmio_addrset;
     s->mmio_addrset_size = p->mmio_addrset_size;
+    mmio_index_init(s);
 
     /* interrupts and exception setup for cosim */
     s->common.cosim             = false;
@@ -1278,10 +1410,292 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
     return s;
 }
 
+#ifdef LIVECACHE
+static void livecache_apply(RISCVMachine *m, int hartid, uint64_t e) {
+    uint64_t   paddr = e & LiveCacheQueue::ADDR_MASK;
+    int        data  = !(e & LiveCacheQueue::FETCH);
+    LiveCache *l1    = data ? m->l1d[hartid] : m->l1i[hartid];
+    bool       st    = e & LiveCacheQueue::ST;
+
+    /* The hit or miss of the first level is the one of the HPM events */
+    bool hit = l1 && (st ? l1->write(paddr) : l1->read(paddr));
+    if (!hit) {
+        bool llc_hit = st ? m->llc->write(paddr) : m->llc->read(paddr);
+        if (!llc_hit)
+            m->llc_shared_miss[hartid]++;
+        if (!l1)
+            hit = llc_hit;
+    }
+    if (hit)
+        m->llc_hit[hartid][data]++;
+    else
+        m->llc_miss[hartid][data]++;
+}
+
+/*
+ * livecache_consume --
+ *
+ * Applies the published entries run by run, returns how many there
+ * were.  A run ends at the next RUN entry of its ring, or when the
+ * ring is empty and the next turn is already published: the producer
+ * publishes the rings before the turns.
+ */
+static uint64_t livecache_consume(RISCVMachine *m) {
+    LiveCacheQueue *q     = m->llc_queue;
+    LiveCacheRing * turns = &q->turns;
+    uint64_t        n     = 0;
+
+    for (;;) {
+        uint64_t turns_head = turns->head.load(std::memory_order_acquire);
+        uint64_t turns_tail = turns->tail.load(std::memory_order_relaxed);
+        bool     first      = false;
+
+        if (q->run_hart < 0) {
+            if (turns_tail == turns_head)
+                return n;
+            q->run_hart = turns->buf[turns_tail++ & (LiveCacheRing::SIZE - 1)];
+            turns->tail.store(turns_tail, std::memory_order_release);
+            first = true;
+        }
+
+        LiveCacheRing *r     = &q->harts[q->run_hart].ring;
+        uint64_t       start = r->tail.load(std::memory_order_relaxed);
+        uint64_t       head  = r->head.load(std::memory_order_acquire);
+        uint64_t       tail  = start;
+        for (; tail != head; ++tail, first = false) {
+            uint64_t e = r->buf[tail & (LiveCacheRing::SIZE - 1)];
+            if ((e & LiveCacheQueue::RUN) && !first)
+                break;
+            livecache_apply(m, q->run_hart, e);
+        }
+        r->tail.store(tail, std::memory_order_release);
+        n += tail - start;
+
+        if (tail == head && turns_tail == turns_head)
+            return n;
+        q->run_hart = -1;
+    }
+}
+
+static void livecache_consumer(RISCVMachine *m) {
+    LiveCacheQueue *q = m->llc_queue;
+
+    while (!q->stop.load(std::memory_order_acquire))
+        if (!livecache_consume(m))
+            std::this_thread::yield();
+    livecache_consume(m);
+}
+
+static void livecache_init_one(LiveCacheRing *r) {
+    r->buf        = (uint64_t *)malloc(LiveCacheRing::SIZE * sizeof *r->buf);
+    r->head_local = 0;
+    r->tail_cache = 0;
+    r->head       = 0;
+    r->tail       = 0;
+    if (!r->buf) {
+        fprintf(dromajo_stderr, "LiveCache: could not allocate the access ring\n");
+        exit(-3);
+    }
+}
+
+void livecache_init_ring(RISCVMachine *m, int line_shift, bool threaded) {
+    LiveCacheQueue *q = new LiveCacheQueue;
+
+    q->n_harts = m->ncpus;
+    q->harts   = new LiveCacheHart[q->n_harts];
+    for (int i = 0; i < q->n_harts; ++i) {
+        LiveCacheHart *h = &q->harts[i];
+
+        livecache_init_one(&h->ring);
+        for (int fetch = 0; fetch < 2; ++fetch) {
+            h->last_line[fetch] = UINT64_MAX;
+            h->last_st[fetch]   = false;
+            h->repeat[fetch][0] = 0;
+            h->repeat[fetch][1] = 0;
+        }
+    }
+    livecache_init_one(&q->turns);
+
+    q->line_shift  = line_shift;
+    q->last_key    = UINT64_MAX;
+    q->last_hart   = -1;
+    q->unpublished = 0;
+    q->run_hart    = -1;
+    q->threaded    = threaded;
+    q->stop        = false;
+    q->consumer    = NULL;
+
+    m->llc_queue = q;
+    if (threaded)
+        q->consumer = new std::thread(livecache_consumer, m);
+}
+
+/* Makes everything queued so far visible to the consumer */
+static void livecache_publish_all(LiveCacheQueue *q) {
+    for (int i = 0; i < q->n_harts; ++i) {
+        LiveCacheRing *r = &q->harts[i].ring;
+        r->head.store(r->head_local, std::memory_order_release);
+    }
+    q->turns.head.store(q->turns.head_local, std::memory_order_release);
+    q->unpublished = 0;
+}
+
+/* Returns true if a ring is still over limit entries behind */
+static bool livecache_behind(LiveCacheQueue *q, uint64_t limit) {
+    bool behind = false;
+
+    for (int i = -1; i < q->n_harts; ++i) {
+        LiveCacheRing *r = i < 0 ? &q->turns : &q->harts[i].ring;
+        r->tail_cache    = r->tail.load(std::memory_order_acquire);
+        behind |= r->head_local - r->tail_cache > limit;
+    }
+    return behind;
+}
+
+/*
+ * livecache_ring_publish --
+ *
+ * Called by the producer every few entries.  Makes them visible to the
+ * consumer thread and, when a ring is close to full, waits for it or
+ * drains the rings right here.
+ */
+void livecache_ring_publish(RISCVMachine *m) {
+    LiveCacheQueue *q    = m->llc_queue;
+    bool            full = q->turns.half_full();
+
+    livecache_publish_all(q);
+    for (int i = 0; i < q->n_harts; ++i) full |= q->harts[i].ring.half_full();
+    if (!full)
+        return;
+
+    if (!q->threaded)
+        livecache_consume(m);
+    while (livecache_behind(q, LiveCacheRing::SIZE / 2 - 1)) std::this_thread::yield();
+}
+
+/*
+ * livecache_sync --
+ *
+ * Returns once every queued access is in the LiveCache levels and
+ * their hit counts.  Call it before reading them.
+ */
+void livecache_sync(RISCVMachine *m) {
+    LiveCacheQueue *q = m->llc_queue;
+
+    livecache_publish_all(q);
+    if (!q->threaded)
+        livecache_consume(m);
+    while (livecache_behind(q, 0)) std::this_thread::yield();
+
+    /* The consumer is idle, the levels can be updated from here */
+    for (int i = 0; i < q->n_harts; ++i) {
+        LiveCacheHart *h = &q->harts[i];
+
+        for (int fetch = 0; fetch < 2; ++fetch) {
+            LiveCache *l1 = fetch ? m->l1i[i] : m->l1d[i];
+
+            (l1 ? l1 : m->llc)->addHits(h->repeat[fetch][0], h->repeat[fetch][1]);
+            m->llc_hit[i][!fetch] += h->repeat[fetch][0] + h->repeat[fetch][1];
+            h->repeat[fetch][0] = 0;
+            h->repeat[fetch][1] = 0;
+        }
+    }
+}
+
+/*
+ * livecache_after_fork --
+ *
+ * A forked child has the queue of its parent but not its consumer
+ * thread, it gets one of its own.  The std::thread of the parent is
+ * left alone, it does not refer to a thread of the child.
+ */
+void livecache_after_fork(RISCVMachine *m) {
+    LiveCacheQueue *q = m->llc_queue;
+
+    if (q->threaded)
+        q->consumer = new std::thread(livecache_consumer, m);
+}
+
+void livecache_end_ring(RISCVMachine *m) {
+    LiveCacheQueue *q = m->llc_queue;
+
+    livecache_sync(m);
+    if (q->threaded) {
+        q->stop.store(true, std::memory_order_release);
+        q->consumer->join();
+        delete q->consumer;
+    }
+    for (int i = 0; i < q->n_harts; ++i) free(q->harts[i].ring.buf);
+    free(q->turns.buf);
+    delete[] q->harts;
+    delete q;
+    m->llc_queue = NULL;
+}
+#endif
+
+#ifdef LIVECACHE
+static void livecache_stats_sync(void *opaque) { livecache_sync((RISCVMachine *)opaque); }
+#endif
+
+/*
+ * virt_machine_add_stats --
+ *
+ * Registers the counters of the harts, of the virtio devices and of
+ * the LiveCache levels with st.
+ */
+void virt_machine_add_stats(RISCVMachine *m, Stats *st) {
+    for (int i = 0; i < m->ncpus; ++i) {
+        RISCVCPUState *s = m->cpu_state[i];
+        const struct {
+            const char *    name;
+            const uint64_t *counter;
+            bool            insns;
+        } hart[] = {
+            {"insns", &s->insn_counter, true},
+            {"insns_rewound", &s->host_stats.rewound, true},
+            {"translate", &s->host_stats.translate, false},
+            {"mmio_read", &s->host_stats.mmio_read, false},
+            {"mmio_write", &s->host_stats.mmio_write, false},
+            {"itlb_miss", &s->hpm_event[HPM_ITLB_MISS], false},
+            {"dtlb_miss", &s->hpm_event[HPM_DTLB_MISS], false},
+            {"page_walk", &s->hpm_event[HPM_PAGE_WALK], false},
+            {"exception", &s->hpm_event[HPM_EXCEPTION], false},
+            {"interrupt", &s->hpm_event[HPM_INTERRUPT], false},
+#ifdef LIVECACHE
+            {"icache_hit", &m->llc_hit[i][0], false},
+            {"icache_miss", &m->llc_miss[i][0], false},
+            {"dcache_hit", &m->llc_hit[i][1], false},
+            {"dcache_miss", &m->llc_miss[i][1], false},
+            {"llc_miss", &m->llc_shared_miss[i], false},
+#endif
+        };
+
+        for (size_t j = 0; j < countof(hart); ++j) {
+            char name[64];
+            snprintf(name, sizeof name, "hart%d.%s", i, hart[j].name);
+            stats_add(st, name, hart[j].counter, hart[j].insns);
+        }
+    }
+
+    for (int i = 0; i < m->virtio_count; ++i)
+        virtio_add_stats(st, get_phys_mem_range(m->mem_map, VIRTIO_BASE_ADDR + i * VIRTIO_SIZE));
+
+#ifdef LIVECACHE
+    stats_add_sync(st, livecache_stats_sync, m);
+#endif
+}
+
 void virt_machine_end(RISCVMachine *s) {
+    if (s->common.stats)
+        stats_phase(s->common.stats, "end");
+
     if (s->common.snapshot_save_name)
         virt_machine_serialize(s, s->common.snapshot_save_name);
 
+    /* While the counters are still there */
+    if (s->common.stats)
+        stats_close(s->common.stats);
+
     /* XXX: stop all */
     for (int i = 0; i < s->ncpus; ++i) {
         riscv_cpu_end(s->cpu_state[i]);
@@ -1289,6 +1703,28 @@ void virt_machine_end(RISCVMachine *s) {
 
     if (s->mmio_addrset_size > 0)
         free(s->mmio_addrset);
+    free(s->mmio_index);
+
+    while (s->snapshots) virt_machine_snapshot_free(s, s->snapshots);
+    if (s->rewind)
+        virt_machine_rewind_free(s, s->rewind);
+    free(s->watch_page);
+
+    if (s->common.trace_writer)
+        trace_writer_close(s->common.trace_writer);
+    if (s->common.profile)
+        profile_close(s->common.profile);
+    if (s->common.journal)
+        journal_close(s->common.journal);
+
+#ifdef LIVECACHE
+    livecache_end_ring(s);
+    for (int i = 0; i < s->ncpus; ++i) {
+        delete s->l1i[i];
+        delete s->l1d[i];
+    }
+    delete s->llc;
+#endif
 
     phys_mem_map_end(s->mem_map);
     free(s);
@@ -1310,6 +1746,669 @@ void virt_machine_deserialize(RISCVMachine *m, const char *dump_name) {
     riscv_cpu_deserialize(s, dump_name);
 }
 
+/*
+ * In-process snapshots
+ *
+ * A snapshot keeps a full copy of every RAM range plus the CPU and
+ * device state.  RAM pages written after the snapshot are found
+ * through the RAM dirty bits (set whenever a page enters the write
+ * TLB) so a restore only copies back the pages that changed.  Since
+ * the dirty bits are reset on every harvest, each live snapshot keeps
+ * its own accumulated bitmap of pages modified since it was taken or
+ * last restored.
+ *
+ * Virtio device queues and host side state (console, block devices)
+ * are not rolled back.
+ */
+
+typedef struct {
+    uint8_t * mem;   /* copy of the range, NULL if not RAM */
+    uint32_t *dirty; /* pages modified since, NULL if not tracked */
+} SnapshotRAM;
+
+typedef struct {
+    void * opaque; /* device state inside the machine */
+    void * copy;
+    size_t size;
+} SnapshotDevice;
+
+/* Everything but the RAM */
+typedef struct {
+    RISCVCPUState cpu[MAX_CPUS];
+
+    uint64_t maxinsns;
+    int      pending_interrupt;
+    int      pending_exception;
+    int      roi_region;
+
+    uint32_t plic_pending_irq;
+    uint32_t plic_served_irq;
+    uint32_t plic_priority[PLIC_NUM_SOURCES + 1];
+
+    int            n_dev;
+    SnapshotDevice dev[PHYS_MEM_RANGE_MAX];
+} SnapshotState;
+
+struct VirtMachineSnapshot {
+    VirtMachineSnapshot *next;
+
+    SnapshotState state;
+    int           n_ram;
+    SnapshotRAM   ram[PHYS_MEM_RANGE_MAX];
+};
+
+/* Rewind ring, see below */
+typedef struct {
+    uint32_t range;
+    uint32_t page;
+} RewindPage;
+
+typedef struct {
+    SnapshotState state;
+    uint64_t      tag;
+    int           n_pages;
+    RewindPage *  page;
+    uint8_t *     data; /* n_pages * DEVRAM_PAGE_SIZE */
+} RewindCheckpoint;
+
+struct VirtMachineRewind {
+    int               depth;
+    int               n;     /* checkpoints in the ring */
+    int               first; /* index of the oldest */
+    RewindCheckpoint *cp;
+
+    int       n_ram;
+    uint8_t * base[PHYS_MEM_RANGE_MAX];  /* RAM at the oldest checkpoint */
+    uint32_t *dirty[PHYS_MEM_RANGE_MAX]; /* pages written since the newest, NULL if not tracked */
+};
+
+/* Move the RAM dirty bits into every live snapshot and the rewind ring */
+static void snapshot_collect_dirty(RISCVMachine *m) {
+    PhysMemoryMap *map = m->mem_map;
+
+    for (int i = 0; i < map->n_phys_mem_range; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        if (!pr->is_ram || !pr->dirty_bits)
+            continue;
+
+        const uint32_t *bits = phys_mem_get_dirty_bits(pr);
+        size_t          n    = pr->dirty_bits_size / sizeof(uint32_t);
+        for (VirtMachineSnapshot *snap = m->snapshots; snap; snap = snap->next) {
+            if (i >= snap->n_ram || !snap->ram[i].dirty)
+                continue;
+            uint32_t *dirty = snap->ram[i].dirty;
+            for (size_t w = 0; w < n; ++w) dirty[w] |= bits[w];
+        }
+        if (m->rewind && i < m->rewind->n_ram && m->rewind->dirty[i]) {
+            uint32_t *dirty = m->rewind->dirty[i];
+            for (size_t w = 0; w < n; ++w) dirty[w] |= bits[w];
+        }
+    }
+}
+
+static void snapshot_save_state(RISCVMachine *m, SnapshotState *st) {
+    PhysMemoryMap *map = m->mem_map;
+
+    for (int i = 0; i < m->ncpus; ++i) st->cpu[i] = *m->cpu_state[i];
+
+    st->maxinsns          = m->common.maxinsns;
+    st->pending_interrupt = m->common.pending_interrupt;
+    st->pending_exception = m->common.pending_exception;
+    st->roi_region        = roi_region;
+    st->plic_pending_irq  = m->plic_pending_irq;
+    st->plic_served_irq   = m->plic_served_irq;
+    memcpy(st->plic_priority, plic_priority, sizeof plic_priority);
+
+    st->n_dev = 0;
+    for (int i = 0; i < map->n_phys_mem_range; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        SnapshotDevice * d  = &st->dev[st->n_dev];
+
+        if (pr->read_func == uart_read)
+            d->size = sizeof(SiFiveUARTState);
+        else if (pr->read_func == dw_apb_uart_read)
+            d->size = sizeof(DW_apb_uart_state);
+        else
+            continue;
+
+        d->opaque = pr->opaque;
+        d->copy   = malloc(d->size);
+        memcpy(d->copy, d->opaque, d->size);
+        st->n_dev++;
+    }
+}
+
+static void snapshot_load_state(RISCVMachine *m, const SnapshotState *st) {
+    for (int i = 0; i < st->n_dev; ++i) memcpy(st->dev[i].opaque, st->dev[i].copy, st->dev[i].size);
+
+    /* The watched pages may have changed since the state was saved */
+    for (int i = 0; i < m->ncpus; ++i) {
+        RISCVCPUHostStats host_stats = m->cpu_state[i]->host_stats;
+
+        if (m->cpu_state[i]->insn_counter > st->cpu[i].insn_counter)
+            host_stats.rewound += m->cpu_state[i]->insn_counter - st->cpu[i].insn_counter;
+
+        *m->cpu_state[i]            = st->cpu[i];
+        m->cpu_state[i]->host_stats = host_stats;
+        riscv_cpu_flush_tlb(m->cpu_state[i]);
+    }
+
+    m->common.maxinsns          = st->maxinsns;
+    m->common.pending_interrupt = st->pending_interrupt;
+    m->common.pending_exception = st->pending_exception;
+    roi_region                  = st->roi_region;
+    m->plic_pending_irq         = st->plic_pending_irq;
+    m->plic_served_irq          = st->plic_served_irq;
+    memcpy(plic_priority, st->plic_priority, sizeof plic_priority);
+}
+
+static void snapshot_free_state(SnapshotState *st) {
+    for (int i = 0; i < st->n_dev; ++i) free(st->dev[i].copy);
+    st->n_dev = 0;
+}
+
+/* RAM was written behind the dirty bits, the other copies must know */
+static void snapshot_mark_written(RISCVMachine *m, VirtMachineSnapshot *except, int range, size_t w, uint32_t bits) {
+    for (VirtMachineSnapshot *o = m->snapshots; o; o = o->next)
+        if (o != except && range < o->n_ram && o->ram[range].dirty)
+            o->ram[range].dirty[w] |= bits;
+    if (m->rewind && range < m->rewind->n_ram && m->rewind->dirty[range])
+        m->rewind->dirty[range][w] |= bits;
+}
+
+VirtMachineSnapshot *virt_machine_snapshot(RISCVMachine *m) {
+    PhysMemoryMap *      map  = m->mem_map;
+    VirtMachineSnapshot *snap = (VirtMachineSnapshot *)mallocz(sizeof *snap);
+
+    /* Also empties the write TLBs so that later stores are seen */
+    snapshot_collect_dirty(m);
+
+    snap->n_ram = map->n_phys_mem_range;
+    for (int i = 0; i < map->n_phys_mem_range; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+
+        if (!pr->is_ram)
+            continue;
+
+        snap->ram[i].mem = (uint8_t *)malloc(pr->org_size);
+        if (!snap->ram[i].mem) {
+            vm_error("virt_machine_snapshot: could not allocate %" PRIu64 " bytes\n", pr->org_size);
+            snap->n_ram = i;
+            virt_machine_snapshot_free(m, snap);
+            return NULL;
+        }
+        memcpy(snap->ram[i].mem, pr->phys_mem, pr->org_size);
+        if (pr->dirty_bits)
+            snap->ram[i].dirty = (uint32_t *)mallocz(pr->dirty_bits_size);
+    }
+
+    snapshot_save_state(m, &snap->state);
+
+    snap->next   = m->snapshots;
+    m->snapshots = snap;
+
+    return snap;
+}
+
+void virt_machine_restore(RISCVMachine *m, VirtMachineSnapshot *snap) {
+    PhysMemoryMap *map = m->mem_map;
+
+    snapshot_collect_dirty(m);
+
+    for (int i = 0; i < snap->n_ram; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        SnapshotRAM *    r  = &snap->ram[i];
+
+        if (!r->mem)
+            continue;
+
+        if (!r->dirty) {
+            memcpy(pr->phys_mem, r->mem, pr->org_size);
+            continue;
+        }
+
+        size_t n = pr->dirty_bits_size / sizeof(uint32_t);
+        for (size_t w = 0; w < n; ++w) {
+            uint32_t bits = r->dirty[w];
+            if (!bits)
+                continue;
+
+            /* The pages we copy back now differ from the other snapshots */
+            snapshot_mark_written(m, snap, i, w, bits);
+
+            do {
+                size_t page   = w * 32 + ctz32(bits);
+                size_t offset = page << DEVRAM_PAGE_SIZE_LOG2;
+                memcpy(pr->phys_mem + offset, r->mem + offset, DEVRAM_PAGE_SIZE);
+                bits &= bits - 1;
+            } while (bits);
+
+            r->dirty[w] = 0;
+        }
+    }
+
+    snapshot_load_state(m, &snap->state);
+}
+
+void virt_machine_snapshot_free(RISCVMachine *m, VirtMachineSnapshot *snap) {
+    for (VirtMachineSnapshot **p = &m->snapshots; *p; p = &(*p)->next) {
+        if (*p == snap) {
+            *p = snap->next;
+            break;
+        }
+    }
+
+    for (int i = 0; i < snap->n_ram; ++i) {
+        free(snap->ram[i].mem);
+        free(snap->ram[i].dirty);
+    }
+    snapshot_free_state(&snap->state);
+    free(snap);
+}
+
+/*
+ * Rewind ring
+ *
+ * A bounded history of lightweight checkpoints.  The ring keeps one
+ * full copy of the RAM as of its oldest checkpoint; every later
+ * checkpoint only holds the pages written since the one before it, as
+ * they were when it was taken, plus the CPU and device state.  RAM
+ * ranges without dirty bits are copied whole into each checkpoint.
+ * When the ring is full the oldest checkpoint is dropped by copying
+ * the pages of the next one into the base copy.
+ */
+
+static inline bool rewind_tracked(const VirtMachineRewind *rw, int range) { return rw->dirty[range] != NULL; }
+
+static inline size_t rewind_pages(const PhysMemoryRange *pr) { return pr->org_size >> DEVRAM_PAGE_SIZE_LOG2; }
+
+static inline RewindCheckpoint *rewind_cp(VirtMachineRewind *rw, int i) { return &rw->cp[(rw->first + i) % rw->depth]; }
+
+static void rewind_free_cp(RewindCheckpoint *cp) {
+    snapshot_free_state(&cp->state);
+    free(cp->page);
+    free(cp->data);
+    cp->page    = NULL;
+    cp->data    = NULL;
+    cp->n_pages = 0;
+}
+
+/* Saves the pages written since the last checkpoint, clearing the dirty bitmap */
+static bool rewind_save_pages(RISCVMachine *m, VirtMachineRewind *rw, RewindCheckpoint *cp) {
+    PhysMemoryMap *map = m->mem_map;
+    size_t         n   = 0;
+
+    for (int i = 0; i < rw->n_ram; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        if (!rw->base[i])
+            continue;
+        if (!rewind_tracked(rw, i)) {
+            n += rewind_pages(pr);
+            continue;
+        }
+        for (size_t w = 0; w < pr->dirty_bits_size / sizeof(uint32_t); ++w) n += __builtin_popcount(rw->dirty[i][w]);
+    }
+
+    cp->n_pages = n;
+    cp->page    = (RewindPage *)malloc(n * sizeof(RewindPage) + 1);
+    cp->data    = (uint8_t *)malloc(n * DEVRAM_PAGE_SIZE + 1);
+    if (!cp->page || !cp->data) {
+        vm_error("virt_machine_rewind: could not allocate %zu pages\n", n);
+        return false;
+    }
+
+    RewindPage *p    = cp->page;
+    uint8_t *   data = cp->data;
+    for (int i = 0; i < rw->n_ram; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        if (!rw->base[i])
+            continue;
+
+        if (!rewind_tracked(rw, i)) {
+            for (size_t page = 0; page < rewind_pages(pr); ++page) *p++ = {(uint32_t)i, (uint32_t)page};
+            memcpy(data, pr->phys_mem, pr->org_size);
+            data += pr->org_size;
+            continue;
+        }
+
+        for (size_t w = 0; w < pr->dirty_bits_size / sizeof(uint32_t); ++w) {
+            for (uint32_t bits = rw->dirty[i][w]; bits; bits &= bits - 1) {
+                size_t page = w * 32 + ctz32(bits);
+                *p++        = {(uint32_t)i, (uint32_t)page};
+                memcpy(data, pr->phys_mem + (page << DEVRAM_PAGE_SIZE_LOG2), DEVRAM_PAGE_SIZE);
+                data += DEVRAM_PAGE_SIZE;
+            }
+            rw->dirty[i][w] = 0;
+        }
+    }
+
+    return true;
+}
+
+/* Drops the oldest checkpoint, the base copy moves to the next one */
+static void rewind_drop_oldest(VirtMachineRewind *rw) {
+    RewindCheckpoint *next = rewind_cp(rw, 1);
+
+    for (int k = 0; k < next->n_pages; ++k) {
+        const RewindPage *p = &next->page[k];
+        memcpy(rw->base[p->range] + ((size_t)p->page << DEVRAM_PAGE_SIZE_LOG2),
+               next->data + (size_t)k * DEVRAM_PAGE_SIZE,
+               DEVRAM_PAGE_SIZE);
+    }
+
+    rewind_free_cp(rewind_cp(rw, 0));
+    free(next->page);
+    free(next->data);
+    next->page    = NULL;
+    next->data    = NULL;
+    next->n_pages = 0;
+
+    rw->first = (rw->first + 1) % rw->depth;
+    rw->n--;
+}
+
+VirtMachineRewind *virt_machine_rewind_init(RISCVMachine *m, int depth, uint64_t tag) {
+    PhysMemoryMap *    map = m->mem_map;
+    VirtMachineRewind *rw  = (VirtMachineRewind *)mallocz(sizeof *rw);
+
+    assert(!m->rewind && depth >= 1);
+    rw->depth = depth;
+    rw->cp    = (RewindCheckpoint *)mallocz(depth * sizeof(RewindCheckpoint));
+    rw->n_ram = map->n_phys_mem_range;
+
+    /* Start with clean dirty bits */
+    snapshot_collect_dirty(m);
+
+    for (int i = 0; i < map->n_phys_mem_range; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        if (!pr->is_ram)
+            continue;
+
+        rw->base[i] = (uint8_t *)malloc(pr->org_size);
+        if (!rw->base[i]) {
+            vm_error("virt_machine_rewind: could not allocate %" PRIu64 " bytes\n", pr->org_size);
+            virt_machine_rewind_free(m, rw);
+            return NULL;
+        }
+        memcpy(rw->base[i], pr->phys_mem, pr->org_size);
+        if (pr->dirty_bits)
+            rw->dirty[i] = (uint32_t *)mallocz(pr->dirty_bits_size);
+    }
+
+    rw->n       = 1;
+    rw->cp->tag = tag;
+    snapshot_save_state(m, &rw->cp->state);
+    m->rewind = rw;
+
+    return rw;
+}
+
+bool virt_machine_rewind_checkpoint(RISCVMachine *m, VirtMachineRewind *rw, uint64_t tag) {
+    snapshot_collect_dirty(m);
+
+    if (rw->n == rw->depth) {
+        if (rw->depth == 1) {
+            /* The base copy is the only checkpoint */
+            virt_machine_rewind_forget(m, rw, tag);
+            return true;
+        }
+        rewind_drop_oldest(rw);
+    }
+
+    RewindCheckpoint *cp = rewind_cp(rw, rw->n);
+    if (!rewind_save_pages(m, rw, cp)) {
+        rewind_free_cp(cp);
+        return false;
+    }
+    cp->tag = tag;
+    snapshot_save_state(m, &cp->state);
+    rw->n++;
+
+    return true;
+}
+
+void virt_machine_rewind_forget(RISCVMachine *m, VirtMachineRewind *rw, uint64_t tag) {
+    if (rw->depth > 1) {
+        if (rw->n == rw->depth)
+            rewind_drop_oldest(rw);
+        virt_machine_rewind_checkpoint(m, rw, tag);
+        while (rw->n > 1) rewind_drop_oldest(rw);
+        return;
+    }
+
+    /* Single checkpoint, fold the pages written since into the base */
+    PhysMemoryMap *map = m->mem_map;
+    snapshot_collect_dirty(m);
+    for (int i = 0; i < rw->n_ram; ++i) {
+        PhysMemoryRange *pr = &map->phys_mem_range[i];
+        if (!rw->base[i])
+            continue;
+        if (!rewind_tracked(rw, i)) {
+            memcpy(rw->base[i], pr->phys_mem, pr->org_size);
+            continue;
+        }
+        for (size_t w = 0; w < pr->dirty_bits_size / sizeof(uint32_t); ++w) {
+            for (uint32_t bits = rw->dirty[i][w]; bits; bits &= bits - 1) {
+                size_t offset = (w * 32 + ctz32(bits)) << DEVRAM_PAGE_SIZE_LOG2;
+                memcpy(rw->base[i] + offset, pr->phys_mem + offset, DEVRAM_PAGE_SIZE);
+            }
+            rw->dirty[i][w] = 0;
+        }
+    }
+    snapshot_free_state(&rw->cp->state);
+    snapshot_save_state(m, &rw->cp->state);
+    rw->cp->tag = tag;
+}
+
+/*
+ * virt_machine_rewind_drop --
+ *
+ * Drops checkpoint i, keeping the others restorable.  The pages it
+ * holds move to the next checkpoint unless that one has them too, or
+ * back into the dirty bits for the newest.  Thinning out old
+ * checkpoints this way keeps a long history in a bounded ring.
+ */
+void virt_machine_rewind_drop(RISCVMachine *m, VirtMachineRewind *rw, int i) {
+    PhysMemoryMap *   map = m->mem_map;
+    RewindCheckpoint *cp  = rewind_cp(rw, i);
+
+    assert(0 <= i && i < rw->n && rw->n > 1);
+    if (i == 0) {
+        rewind_drop_oldest(rw);
+        return;
+    }
+
+    if (i == rw->n - 1) {
+        for (int k = 0; k < cp->n_pages; ++k) {
+            const RewindPage *p = &cp->page[k];
+            if (rewind_tracked(rw, p->range))
+                rw->dirty[p->range][p->page / 32] |= 1u << (p->page % 32);
+        }
+        rewind_free_cp(cp);
+        rw->n--;
+        return;
+    }
+
+    RewindCheckpoint *next = rewind_cp(rw, i + 1);
+    uint32_t *        has[PHYS_MEM_RANGE_MAX];
+
+    for (int r = 0; r < rw->n_ram; ++r)
+        has[r] = rewind_tracked(rw, r) ? (uint32_t *)mallocz(map->phys_mem_range[r].dirty_bits_size) : NULL;
+    for (int k = 0; k < next->n_pages; ++k) {
+        const RewindPage *p = &next->page[k];
+        if (has[p->range])
+            has[p->range][p->page / 32] |= 1u << (p->page % 32);
+    }
+
+    /* Untracked ranges are whole in both */
+    int n = next->n_pages;
+    for (int k = 0; k < cp->n_pages; ++k) {
+        const RewindPage *p = &cp->page[k];
+        n += has[p->range] && !(has[p->range][p->page / 32] >> (p->page % 32) & 1);
+    }
+
+    if (n > next->n_pages) {
+        RewindPage *page = (RewindPage *)realloc(next->page, n * sizeof(RewindPage));
+        uint8_t *   data = (uint8_t *)realloc(next->data, (size_t)n * DEVRAM_PAGE_SIZE);
+        if (page)
+            next->page = page;
+        if (data)
+            next->data = data;
+        if (!page || !data) {
+            vm_error("virt_machine_rewind: could not allocate %d pages\n", n);
+            abort();
+        }
+
+        int j = next->n_pages;
+        for (int k = 0; k < cp->n_pages; ++k) {
+            const RewindPage *p = &cp->page[k];
+            if (!has[p->range] || has[p->range][p->page / 32] >> (p->page % 32) & 1)
+                continue;
+            next->page[j] = *p;
+            memcpy(next->data + (size_t)j * DEVRAM_PAGE_SIZE, cp->data + (size_t)k * DEVRAM_PAGE_SIZE, DEVRAM_PAGE_SIZE);
+            j++;
+        }
+        next->n_pages = n;
+    }
+
+    for (int r = 0; r < rw->n_ram; ++r) free(has[r]);
+
+    rewind_free_cp(cp);
+    for (int k = i; k < rw->n - 1; ++k) *rewind_cp(rw, k) = *rewind_cp(rw, k + 1);
+    memset(rewind_cp(rw, rw->n - 1), 0, sizeof(RewindCheckpoint));
+    rw->n--;
+}
+
+int virt_machine_rewind_count(const VirtMachineRewind *rw) { return rw->n; }
+
+uint64_t virt_machine_rewind_tag(VirtMachineRewind *rw, int i) { return rewind_cp(rw, i)->tag; }
+
+/*
+ * virt_machine_rewind --
+ *
+ * Brings the machine back to checkpoint i (0 is the oldest) and drops
+ * the checkpoints after it.  A page is restored from the newest
+ * checkpoint up to i holding it, or from the base copy.  Only the
+ * pages written after checkpoint i are touched.
+ */
+void virt_machine_rewind(RISCVMachine *m, VirtMachineRewind *rw, int i) {
+    PhysMemoryMap *map = m->mem_map;
+    uint32_t *     touched[PHYS_MEM_RANGE_MAX];
+
+    assert(0 <= i && i < rw->n);
+    snapshot_collect_dirty(m);
+
+    /* Pages written since checkpoint i */
+    for (int r = 0; r < rw->n_ram; ++r) {
+        touched[r] = NULL;
+        if (!rw->base[r] || !rewind_tracked(rw, r))
+            continue;
+        touched[r] = rw->dirty[r];
+        for (int k = i + 1; k < rw->n; ++k) {
+            RewindCheckpoint *cp = rewind_cp(rw, k);
+            for (int j = 0; j < cp->n_pages; ++j)
+                if (cp->page[j].range == (uint32_t)r)
+                    touched[r][cp->page[j].page / 32] |= 1u << (cp->page[j].page % 32);
+        }
+    }
+
+    for (int r = 0; r < rw->n_ram; ++r) {
+        PhysMemoryRange *pr = &map->phys_mem_range[r];
+        if (!rw->base[r])
+            continue;
+        if (!touched[r]) {
+            memcpy(pr->phys_mem, rw->base[r], pr->org_size);
+            continue;
+        }
+        for (size_t w = 0; w < pr->dirty_bits_size / sizeof(uint32_t); ++w) {
+            uint32_t bits = touched[r][w];
+            if (!bits)
+                continue;
+            snapshot_mark_written(m, NULL, r, w, bits);
+            do {
+                size_t offset = (w * 32 + ctz32(bits)) << DEVRAM_PAGE_SIZE_LOG2;
+                memcpy(pr->phys_mem + offset, rw->base[r] + offset, DEVRAM_PAGE_SIZE);
+                bits &= bits - 1;
+            } while (bits);
+        }
+    }
+
+    for (int k = 1; k <= i; ++k) {
+        RewindCheckpoint *cp = rewind_cp(rw, k);
+        for (int j = 0; j < cp->n_pages; ++j) {
+            const RewindPage *p = &cp->page[j];
+            if (touched[p->range] && !(touched[p->range][p->page / 32] >> (p->page % 32) & 1))
+                continue;
+            memcpy(map->phys_mem_range[p->range].phys_mem + ((size_t)p->page << DEVRAM_PAGE_SIZE_LOG2),
+                   cp->data + (size_t)j * DEVRAM_PAGE_SIZE,
+                   DEVRAM_PAGE_SIZE);
+        }
+    }
+
+    /* Checkpoint i is the newest again, nothing written since */
+    for (int r = 0; r < rw->n_ram; ++r)
+        if (touched[r])
+            memset(touched[r], 0, map->phys_mem_range[r].dirty_bits_size);
+    while (rw->n > i + 1) rewind_free_cp(rewind_cp(rw, --rw->n));
+
+    snapshot_load_state(m, &rewind_cp(rw, i)->state);
+}
+
+void virt_machine_rewind_free(RISCVMachine *m, VirtMachineRewind *rw) {
+    if (m->rewind == rw)
+        m->rewind = NULL;
+
+    for (int i = 0; i < rw->n; ++i) rewind_free_cp(rewind_cp(rw, i));
+    for (int i = 0; i < rw->n_ram; ++i) {
+        free(rw->base[i]);
+        free(rw->dirty[i]);
+    }
+    free(rw->cp);
+    free(rw);
+}
+
+static int watch_page_cmp(const void *a, const void *b) {
+    uint64_t pa = *(const uint64_t *)a;
+    uint64_t pb = *(const uint64_t *)b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * virt_machine_set_watch --
+ *
+ * Watches the physical ranges [paddr[i], paddr[i] + len[i]), replacing
+ * the previous ones.  The pages they touch are kept out of the data
+ * TLBs, so the harts report their accesses to them in watch_access and
+ * the accesses to any other page run at full speed.
+ */
+void virt_machine_set_watch(RISCVMachine *m, const uint64_t *paddr, const uint64_t *len, int n) {
+    int count = 0;
+
+    for (int i = 0; i < n; ++i)
+        if (len[i])
+            count += ((paddr[i] + len[i] - 1) >> PG_SHIFT) - (paddr[i] >> PG_SHIFT) + 1;
+
+    free(m->watch_page);
+    m->watch_page       = count ? (uint64_t *)mallocz(count * sizeof(uint64_t)) : NULL;
+    m->watch_page_count = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!len[i])
+            continue;
+        for (uint64_t p = paddr[i] >> PG_SHIFT; p <= (paddr[i] + len[i] - 1) >> PG_SHIFT; ++p)
+            m->watch_page[m->watch_page_count++] = p;
+    }
+
+    qsort(m->watch_page, m->watch_page_count, sizeof(uint64_t), watch_page_cmp);
+    count = 0;
+    for (int i = 0; i < m->watch_page_count; ++i)
+        if (count == 0 || m->watch_page[count - 1] != m->watch_page[i])
+            m->watch_page[count++] = m->watch_page[i];
+    m->watch_page_count = count;
+
+    for (int i = 0; i < m->ncpus; ++i) riscv_cpu_flush_tlb(m->cpu_state[i]);
+}
+
 int virt_machine_get_sleep_duration(RISCVMachine *m, int hartid, int ms_delay) {
     RISCVCPUState *s = m->cpu_state[hartid];
     int64_t        ms_delay1;
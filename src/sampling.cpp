@@ -0,0 +1,254 @@
+/*
+ * SMARTS style periodic sampling
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sampling.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "cutils.h"
+#include "dromajo.h"
+#include "riscv_machine.h"
+#include "simpoint.h"
+#include "stats.h"
+
+/* Fast-forward chunk, timer interrupts are checked between chunks */
+#define SAMPLE_CHUNK 4096
+
+#define SAMPLE_CSV "dromajo_sample.csv"
+
+/* Two sided 95% Student t values for 1..30 degrees of freedom */
+static const double sample_t95[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+    2.120,  2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static void sample_phase(RISCVMachine *m, const char *phase) {
+    if (m->common.stats)
+        stats_phase(m->common.stats, phase);
+}
+
+static void sample_set_warming(RISCVMachine *m, bool on) {
+#ifdef LIVECACHE
+    m->llc_enabled = on;
+#else
+    (void)m;
+    (void)on;
+#endif
+}
+
+static void sample_get_misses(RISCVMachine *m, uint64_t *read_miss, uint64_t *write_miss) {
+#ifdef LIVECACHE
+    livecache_sync(m);
+    *read_miss  = m->llc->getReadMiss();
+    *write_miss = m->llc->getWriteMiss();
+#else
+    (void)m;
+    *read_miss  = 0;
+    *write_miss = 0;
+#endif
+}
+
+/*
+ * sample_fast_forward --
+ *
+ * Runs up to n instructions on hart 0 in SAMPLE_CHUNK pieces.  Returns
+ * false when the machine should stop, with the same conditions as
+ * virt_machine_run.
+ */
+static bool sample_fast_forward(RISCVMachine *m, uint64_t n) {
+    RISCVCPUState *s = m->cpu_state[0];
+
+    while (n) {
+        uint64_t chunk = n < SAMPLE_CHUNK ? n : SAMPLE_CHUNK;
+        if (chunk > m->common.maxinsns)
+            chunk = m->common.maxinsns;
+        if (chunk == 0)
+            return false;
+
+        (void)virt_machine_get_sleep_duration(m, 0, 0);
+
+        uint64_t last_pc    = s->pc;
+        uint64_t last_count = s->insn_counter;
+        riscv_cpu_interp64(s, chunk);
+        uint64_t done = s->insn_counter - last_count;
+
+        if (done == 0 && s->pc == last_pc)
+            return false;
+
+        m->common.maxinsns -= done < m->common.maxinsns ? done : m->common.maxinsns;
+        n -= done < n ? done : n;
+
+        if (m->htif_tohost_addr) {
+            bool     fail   = true;
+            uint32_t tohost = riscv_phys_read_u32(s, m->htif_tohost_addr, &fail);
+            if (!fail && tohost & 1) {
+                if (tohost != 1)
+                    s->benchmark_exit_code = tohost;
+                return false;
+            }
+        }
+
+        if (riscv_terminated(s))
+            return false;
+
+        stats_poll(m->common.stats);
+    }
+
+    return m->common.maxinsns > 0;
+}
+
+static bool sample_window(RISCVMachine *m, SampleStepFunc step, int id, SampleRecord *r) {
+    RISCVCPUState *s = m->cpu_state[0];
+    bool           keep_going;
+
+    r->start = s->insn_counter;
+    sample_get_misses(m, &r->read_miss, &r->write_miss);
+
+    if (m->common.sample_trace) {
+        uint64_t trace = m->common.trace;
+
+        m->common.trace = 0;
+        keep_going      = true;
+        for (uint64_t i = 0; i < m->common.sample_window && keep_going; ++i) keep_going = step(m, 0);
+        m->common.trace = trace;
+    } else {
+        char name[64];
+        snprintf(name, sizeof name, "smarts%d", id);
+        simpoint_checkpoint(m, name);
+        keep_going = sample_fast_forward(m, m->common.sample_window);
+    }
+
+    uint64_t read_miss, write_miss;
+    sample_get_misses(m, &read_miss, &write_miss);
+    r->insns      = s->insn_counter - r->start;
+    r->read_miss  = read_miss - r->read_miss;
+    r->write_miss = write_miss - r->write_miss;
+
+    return keep_going;
+}
+
+/*
+ * sample_report --
+ *
+ * Prints the mean LiveCache misses per kilo instruction across the
+ * windows with its 95% confidence interval, and the number of samples
+ * SMARTS would need for +-3% at 99.7% confidence given the observed
+ * coefficient of variation.
+ */
+static void sample_report(const std::vector<SampleRecord> &samples) {
+    FILE *f = fopen(SAMPLE_CSV, "w");
+    if (!f) {
+        perror(SAMPLE_CSV);
+    } else {
+        fprintf(f, "sample,start,insns,read_miss,write_miss,mpki\n");
+        for (size_t i = 0; i < samples.size(); ++i) {
+            const SampleRecord &r = samples[i];
+            fprintf(f,
+                    "%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.4f\n",
+                    i,
+                    r.start,
+                    r.insns,
+                    r.read_miss,
+                    r.write_miss,
+                    r.insns ? 1000.0 * (r.read_miss + r.write_miss) / r.insns : 0.0);
+        }
+        fclose(f);
+    }
+
+    size_t n = 0;
+    double sum = 0, sum2 = 0;
+    for (auto &r : samples) {
+        if (!r.insns)
+            continue;
+        double mpki = 1000.0 * (r.read_miss + r.write_miss) / r.insns;
+        sum += mpki;
+        sum2 += mpki * mpki;
+        n++;
+    }
+
+    fprintf(dromajo_stderr, "sampling: %zu samples written to %s\n", samples.size(), SAMPLE_CSV);
+#ifndef LIVECACHE
+    /* Without the LiveCache there is no per window metric to summarize */
+    n = 0;
+#endif
+    if (n < 2)
+        return;
+
+    double mean = sum / n;
+    double var  = (sum2 - n * mean * mean) / (n - 1);
+    double sd   = var > 0 ? sqrt(var) : 0;
+    double t    = n - 1 <= countof(sample_t95) ? sample_t95[n - 2] : 1.96;
+    double ci   = t * sd / sqrt((double)n);
+
+    fprintf(dromajo_stderr, "sampling: LiveCache MPKI %.4f +- %.4f (95%% confidence)\n", mean, ci);
+    if (mean > 0) {
+        double cv     = sd / mean;
+        double needed = ceil((3.0 * cv / 0.03) * (3.0 * cv / 0.03));
+        fprintf(dromajo_stderr, "sampling: CoV %.3f, %.0f samples needed for +-3%% at 99.7%% confidence\n", cv, needed);
+    }
+}
+
+/*
+ * sample_run --
+ *
+ * Runs hart 0 to completion with the sample period set by --sample.
+ * step is used to run the windows in trace mode.  Returns the number
+ * of checkpoints that failed.
+ */
+int sample_run(RISCVMachine *m, SampleStepFunc step) {
+    uint64_t period = m->common.sample_period;
+    uint64_t warmup = m->common.sample_warmup;
+    uint64_t window = m->common.sample_window;
+
+    assert(m->ncpus == 1);  // Only single core for sampling
+    assert(warmup + window <= period);
+
+    std::vector<SampleRecord> samples;
+    bool                      keep_going = true;
+
+    while (keep_going) {
+        sample_phase(m, "fast_forward");
+        sample_set_warming(m, false);
+        keep_going = sample_fast_forward(m, period - warmup - window);
+
+        sample_phase(m, "warmup");
+        sample_set_warming(m, true);
+        if (keep_going)
+            keep_going = sample_fast_forward(m, warmup);
+
+        if (keep_going) {
+            SampleRecord r;
+            sample_phase(m, "window");
+            keep_going = sample_window(m, step, samples.size(), &r);
+            if (r.insns == window)
+                samples.push_back(r);
+        }
+    }
+
+    sample_phase(m, "report");
+    sample_set_warming(m, true);
+    sample_report(samples);
+    int failed = simpoint_checkpoint_wait();
+    sample_phase(m, "run");
+
+    return failed;
+}
@@ -0,0 +1,418 @@
+/*
+ * SimPoint basic block vector collection
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "simpoint.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cutils.h"
+#include "dromajo.h"
+#include "riscv_machine.h"
+
+#define BBV_INITIAL_SLOTS 4096
+#define BBV_BUF_SIZE      (1 << 20)
+
+BBVProfile *bbv_init(const char *filename, uint64_t interval) {
+    BBVProfile *p = (BBVProfile *)mallocz(sizeof *p);
+
+    p->f = fopen(filename, "w");
+    if (!p->f) {
+        fprintf(dromajo_stderr, "\nerror: could not open %s for dumping trace\n", filename);
+        free(p);
+        return NULL;
+    }
+
+    p->interval   = interval;
+    p->table_mask = BBV_INITIAL_SLOTS - 1;
+    p->table      = (BBVEntry *)mallocz(BBV_INITIAL_SLOTS * sizeof(BBVEntry));
+    p->touched    = (uint32_t *)malloc(BBV_INITIAL_SLOTS * sizeof(uint32_t));
+    p->buf        = (char *)malloc(BBV_BUF_SIZE);
+
+    return p;
+}
+
+static void bbv_flush(BBVProfile *p) {
+    if (p->buf_len && fwrite(p->buf, 1, p->buf_len, p->f) != (size_t)p->buf_len)
+        fprintf(dromajo_stderr, "\nerror: could not write the basic block vector\n");
+    p->buf_len = 0;
+}
+
+/* The last, incomplete, interval is dropped as it would skew the weights */
+void bbv_end(BBVProfile *p) {
+    bbv_flush(p);
+    fclose(p->f);
+    free(p->table);
+    free(p->touched);
+    free(p->buf);
+    free(p);
+}
+
+static void bbv_grow(BBVProfile *p) {
+    uint32_t  old_size  = p->table_mask + 1;
+    BBVEntry *old_table = p->table;
+    uint32_t  new_size  = old_size * 2;
+
+    p->table      = (BBVEntry *)mallocz(new_size * sizeof(BBVEntry));
+    p->table_mask = new_size - 1;
+    p->touched    = (uint32_t *)realloc(p->touched, new_size * sizeof(uint32_t));
+    p->n_touched  = 0;
+
+    for (uint32_t i = 0; i < old_size; ++i) {
+        BBVEntry *e = &old_table[i];
+        if (!e->key)
+            continue;
+
+        uint32_t slot = bbv_hash(e->key) & p->table_mask;
+        while (p->table[slot].key) slot = (slot + 1) & p->table_mask;
+        p->table[slot] = *e;
+        if (e->count)
+            p->touched[p->n_touched++] = slot;
+    }
+
+    free(old_table);
+}
+
+void bbv_insert(BBVProfile *p, uint64_t pc, uint64_t count) {
+    uint64_t key  = pc | 1;
+    uint32_t slot = bbv_hash(key) & p->table_mask;
+
+    for (;;) {
+        BBVEntry *e = &p->table[slot];
+
+        if (e->key == key) {
+            if (!e->count)
+                p->touched[p->n_touched++] = slot;
+            e->count += count;
+            return;
+        }
+
+        if (!e->key) {
+            if (2 * (p->n_entries + 1) > p->table_mask + 1) {
+                bbv_grow(p);
+                bbv_insert(p, pc, count);
+                return;
+            }
+            e->key   = key;
+            e->id    = ++p->n_entries;
+            e->count = count;
+            p->touched[p->n_touched++] = slot;
+            return;
+        }
+
+        slot = (slot + 1) & p->table_mask;
+    }
+}
+
+static char *bbv_put_u64(char *q, uint64_t v) {
+    char  tmp[20];
+    char *t = tmp;
+
+    do {
+        *t++ = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    while (t != tmp) *q++ = *--t;
+
+    return q;
+}
+
+void bbv_dump_interval(BBVProfile *p) {
+    if (p->buf_len + 2 > BBV_BUF_SIZE)
+        bbv_flush(p);
+    p->buf[p->buf_len++] = 'T';
+
+    for (uint32_t i = 0; i < p->n_touched; ++i) {
+        BBVEntry *e = &p->table[p->touched[i]];
+
+        /* ":" id ":" count " " */
+        if (p->buf_len + 44 > BBV_BUF_SIZE)
+            bbv_flush(p);
+
+        char *q = p->buf + p->buf_len;
+        *q++    = ':';
+        q       = bbv_put_u64(q, e->id);
+        *q++    = ':';
+        q       = bbv_put_u64(q, e->count);
+        *q++    = ' ';
+
+        p->buf_len = q - p->buf;
+        e->count   = 0;
+    }
+
+    if (p->buf_len + 1 > BBV_BUF_SIZE)
+        bbv_flush(p);
+    p->buf[p->buf_len++] = '\n';
+    p->n_touched         = 0;
+    p->interval_insns    = 0;
+}
+
+/*
+ * Checkpoint writers
+ *
+ * The machine is forked at each simpoint: the child owns a copy on
+ * write image of the whole machine, serializes it, and validates the
+ * result while the parent keeps running towards the next simpoint.
+ * At most SIMPOINT_MAX_WRITERS children are alive at once, which
+ * bounds the memory taken by diverging copies.
+ *
+ * The validation restores the checkpoint on a fresh hart, lets the
+ * boot ROM bring it back to the checkpoint pc, and then checks that a
+ * short run ends with the same pc and registers as the original one.
+ * The checkpoint restores the hart, not the devices, and the boot ROM
+ * itself moves the counters, so the run stops before the first
+ * instruction whose outcome depends on them: a device load, a read of
+ * cycle, time or instret, or an interrupt.
+ */
+
+#define SIMPOINT_VALIDATE_INSNS 10000
+#define SIMPOINT_RESTORE_INSNS  100000000
+
+typedef struct {
+    pid_t pid;
+    char  name[64];
+} SimpointWriter;
+
+static SimpointWriter simpoint_writers[64];
+static int            simpoint_n_writers;
+static int            simpoint_n_failed;
+
+static int simpoint_max_writers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    if (n > (long)countof(simpoint_writers))
+        n = countof(simpoint_writers);
+
+    return n;
+}
+
+/* Reads of the counters the boot ROM does not leave as they were */
+static bool simpoint_reads_counter(RISCVCPUState *s, uint64_t pc) {
+    uint32_t insn;
+
+    if (riscv_read_insn(s, &insn, pc) || (insn & 0x7f) != 0x73 || !(insn >> 12 & 7))
+        return false;
+
+    switch (insn >> 20) {
+        case 0xb00: /* mcycle */
+        case 0xb02: /* minstret */
+        case 0xc00: /* cycle */
+        case 0xc01: /* time */
+        case 0xc02: /* instret */ return true;
+        default: return false;
+    }
+}
+
+/*
+ * simpoint_run_window --
+ *
+ * Steps the hart up to n times, stopping before a step that reads
+ * state the checkpoint does not restore.  pc and reg get the state the
+ * run stops in.  Returns the number of steps.
+ */
+static uint64_t simpoint_run_window(RISCVCPUState *s, uint64_t n, uint64_t *pc, target_ulong *reg) {
+    uint64_t i;
+
+    for (i = 0; i < n && !riscv_terminated(s); ++i) {
+        uint64_t step_pc    = s->pc;
+        uint64_t mmio_read  = s->host_stats.mmio_read;
+        uint64_t interrupts = s->hpm_event[HPM_INTERRUPT];
+
+        *pc = step_pc;
+        memcpy(reg, s->reg, 32 * sizeof *reg);
+        riscv_cpu_interp64(s, 1);
+        if (s->host_stats.mmio_read != mmio_read || s->hpm_event[HPM_INTERRUPT] != interrupts
+            || simpoint_reads_counter(s, step_pc))
+            return i;
+    }
+    *pc = s->pc;
+    memcpy(reg, s->reg, 32 * sizeof *reg);
+
+    return i;
+}
+
+static void simpoint_run(RISCVCPUState *s, uint64_t n) {
+    for (uint64_t i = 0; i < n && !riscv_terminated(s); ++i) riscv_cpu_interp64(s, 1);
+}
+
+static bool simpoint_validate(RISCVMachine *m, const char *name) {
+    RISCVCPUState *s          = m->cpu_state[0];
+    uint64_t       start_pc   = s->pc;
+    int            start_priv = s->priv;
+    int            addr_len   = s->physical_addr_len;
+    target_ulong   ref_reg[32];
+
+    uint64_t ref_pc;
+    uint64_t steps = simpoint_run_window(s, SIMPOINT_VALIDATE_INSNS, &ref_pc, ref_reg);
+
+    riscv_cpu_end(s);
+    s                    = riscv_cpu_init(m, 0);
+    s->physical_addr_len = addr_len;
+    m->cpu_state[0]      = s;
+    riscv_set_debug_mode(s, true); /* as after copy_kernel, the boot ROM ends with a dret */
+    virt_machine_deserialize(m, name);
+
+    uint64_t i;
+    for (i = 0; i < SIMPOINT_RESTORE_INSNS; ++i) {
+        if (s->pc == start_pc && s->priv == start_priv)
+            break;
+        if (riscv_terminated(s))
+            break;
+        riscv_cpu_interp64(s, 1);
+    }
+
+    if (i == SIMPOINT_RESTORE_INSNS || riscv_terminated(s)) {
+        fprintf(dromajo_stderr, "simpoint %s: restore never reached pc 0x%" PRIx64 "\n", name, start_pc);
+        return false;
+    }
+
+    simpoint_run(s, steps);
+
+    if (s->pc != ref_pc) {
+        fprintf(dromajo_stderr,
+                "simpoint %s: restored run ends at pc 0x%" PRIx64 " instead of 0x%" PRIx64 "\n",
+                name,
+                (uint64_t)s->pc,
+                ref_pc);
+        return false;
+    }
+
+    for (int r = 1; r < 32; ++r) {
+        if (s->reg[r] != ref_reg[r]) {
+            fprintf(dromajo_stderr,
+                    "simpoint %s: restored run has x%d=0x%" PRIx64 " instead of 0x%" PRIx64 "\n",
+                    name,
+                    r,
+                    (uint64_t)s->reg[r],
+                    (uint64_t)ref_reg[r]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * simpoint_reap_writer --
+ *
+ * Reaps writer i if it is done, waiting for it if block, and drops it
+ * from simpoint_writers.  A writer that cannot be waited for (reaped
+ * elsewhere, say) counts as failed.  Returns true if it was dropped.
+ */
+static bool simpoint_reap_writer(int i, bool block) {
+    SimpointWriter *w = &simpoint_writers[i];
+    int             status;
+    pid_t           pid;
+
+    while ((pid = waitpid(w->pid, &status, block ? 0 : WNOHANG)) < 0 && errno == EINTR) continue;
+
+    if (pid == 0)
+        return false;
+
+    if (pid < 0) {
+        fprintf(dromajo_stderr, "simpoint %s FAILED: waitpid: %s\n", w->name, strerror(errno));
+        simpoint_n_failed++;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        fprintf(dromajo_stderr, "simpoint %s written and validated\n", w->name);
+    } else {
+        fprintf(dromajo_stderr, "simpoint %s FAILED\n", w->name);
+        simpoint_n_failed++;
+    }
+
+    *w = simpoint_writers[--simpoint_n_writers];
+    return true;
+}
+
+/*
+ * simpoint_reap --
+ *
+ * Reaps the writers that are done.  If block and none is, waits for
+ * one of them.  Only the writers are waited for, other children of the
+ * process are left alone.
+ */
+static void simpoint_reap(bool block) {
+    bool reaped = false;
+
+    for (int i = 0; i < simpoint_n_writers;) {
+        if (simpoint_reap_writer(i, false))
+            reaped = true;
+        else
+            ++i;
+    }
+
+    if (block && !reaped && simpoint_n_writers)
+        simpoint_reap_writer(0, true);
+}
+
+/*
+ * simpoint_checkpoint --
+ *
+ * Writes the checkpoint "name" in the background.  Falls back to a
+ * synchronous write if the machine cannot be forked.
+ */
+void simpoint_checkpoint(RISCVMachine *m, const char *name) {
+    while (simpoint_n_writers >= simpoint_max_writers()) simpoint_reap(true);
+
+    /* Do not let the child flush the parent's pending output */
+    fflush(NULL);
+#ifdef LIVECACHE
+    /* The child sees the LiveCache as of the checkpoint */
+    livecache_sync(m);
+#endif
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        virt_machine_serialize(m, name);
+        return;
+    }
+
+    if (pid == 0) {
+#ifdef LIVECACHE
+        livecache_after_fork(m);
+#endif
+        virt_machine_serialize(m, name);
+        bool ok = simpoint_validate(m, name);
+        fflush(NULL);
+        _exit(ok ? 0 : 1);
+    }
+
+    SimpointWriter *w = &simpoint_writers[simpoint_n_writers++];
+    w->pid            = pid;
+    snprintf(w->name, sizeof w->name, "%s", name);
+
+    simpoint_reap(false);
+}
+
+/*
+ * simpoint_checkpoint_wait --
+ *
+ * Waits for all the writers and returns the number of checkpoints
+ * that failed to be written or validated.
+ */
+int simpoint_checkpoint_wait(void) {
+    while (simpoint_n_writers) simpoint_reap(true);
+
+    return simpoint_n_failed;
+}
@@ -0,0 +1,202 @@
+/*
+ * Host statistics
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+typedef struct {
+    std::string     name;
+    const uint64_t *counter;
+    bool            insns;
+    uint64_t        base; /* value at stats_add, for the MIPS */
+} StatsCounter;
+
+typedef struct {
+    const char *name;
+    double      seconds;
+} StatsPhase;
+
+struct Stats {
+    std::string filename;
+    std::string tmpname;
+
+    std::vector<StatsCounter> counters;
+    std::vector<StatsPhase>   phases;
+    size_t                    phase; /* the one the time goes to */
+    double                    phase_start;
+
+    std::vector<std::pair<void (*)(void *), void *>> syncs;
+
+    double   open_time;
+    double   last_time; /* of the last dump */
+    uint64_t last_insns;
+    int      period; /* seconds between dumps, 0 for none */
+
+    bool             signals; /* stats_signals installed the handler */
+    struct sigaction old_usr1;
+};
+
+/* Polls between two looks at the clock, a few milliseconds of run */
+#define STATS_POLL_CLOCK (1 << 16)
+
+volatile sig_atomic_t stats_requested;
+uint32_t              stats_poll_countdown = STATS_POLL_CLOCK;
+
+static double stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* What comes before stats_open is charged to the "load" phase */
+static double stats_start_time = stats_now();
+
+static void stats_signal(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+Stats *stats_open(const char *filename, int period) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+    fclose(f);
+
+    Stats *st       = new Stats;
+    st->filename    = filename;
+    st->tmpname     = st->filename + ".tmp";
+    st->open_time   = stats_now();
+    st->last_time   = st->open_time;
+    st->last_insns  = 0;
+    st->phase_start = st->open_time;
+    st->phases.push_back({"load", st->open_time - stats_start_time});
+    st->phase       = 0;
+    st->period      = period;
+    st->signals     = false;
+    stats_phase(st, "run");
+
+    return st;
+}
+
+/* Only for dromajo itself, the library leaves the signals of the testbench alone */
+void stats_signals(Stats *st) {
+    struct sigaction sig;
+
+    memset(&sig, 0, sizeof sig);
+    sig.sa_handler = stats_signal;
+    sigemptyset(&sig.sa_mask);
+    sig.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sig, &st->old_usr1);
+    st->signals = true;
+}
+
+void stats_add(Stats *st, const char *name, const uint64_t *counter, bool insns) {
+    st->counters.push_back({name, counter, insns, *counter});
+}
+
+void stats_add_sync(Stats *st, void (*sync)(void *opaque), void *opaque) { st->syncs.push_back({sync, opaque}); }
+
+void stats_phase(Stats *st, const char *phase) {
+    double now = stats_now();
+
+    st->phases[st->phase].seconds += now - st->phase_start;
+    st->phase_start = now;
+
+    for (st->phase = 0; st->phase < st->phases.size(); ++st->phase)
+        if (!strcmp(st->phases[st->phase].name, phase))
+            return;
+    st->phases.push_back({phase, 0});
+}
+
+void stats_tick(Stats *st) {
+    stats_poll_countdown = STATS_POLL_CLOCK;
+    if (stats_requested || (st->period > 0 && stats_now() - st->last_time >= st->period))
+        stats_dump(st);
+}
+
+static double stats_mips(uint64_t insns, double seconds) { return seconds > 0 ? insns / seconds * 1e-6 : 0; }
+
+/*
+ * stats_dump --
+ *
+ * Writes to a temporary file renamed over FILE, so that a reader never
+ * sees half a dump.
+ */
+void stats_dump(Stats *st) {
+    double   now   = stats_now();
+    uint64_t insns = 0;
+
+    stats_requested = 0;
+
+    for (auto &s : st->syncs) s.first(s.second);
+    for (auto &c : st->counters)
+        if (c.insns)
+            insns += *c.counter - c.base;
+
+    FILE *f = fopen(st->tmpname.c_str(), "w");
+    if (!f) {
+        perror(st->tmpname.c_str());
+        return;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"seconds\": %.6f,\n", now - stats_start_time);
+    fprintf(f, "  \"phase\": \"%s\",\n", st->phases[st->phase].name);
+    fprintf(f, "  \"phases\": {");
+    for (size_t i = 0; i < st->phases.size(); ++i) {
+        double seconds = st->phases[i].seconds;
+        if (i == st->phase)
+            seconds += now - st->phase_start;
+        fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", st->phases[i].name, seconds);
+    }
+    fprintf(f, "},\n");
+    fprintf(f, "  \"insns\": %" PRIu64 ",\n", insns);
+    fprintf(f, "  \"mips\": %.3f,\n", stats_mips(insns, now - st->open_time));
+    fprintf(f,
+            "  \"interval\": {\"seconds\": %.6f, \"insns\": %" PRIu64 ", \"mips\": %.3f},\n",
+            now - st->last_time,
+            insns - st->last_insns,
+            stats_mips(insns - st->last_insns, now - st->last_time));
+    fprintf(f, "  \"counters\": {");
+    for (size_t i = 0; i < st->counters.size(); ++i)
+        fprintf(f, "%s\n    \"%s\": %" PRIu64, i ? "," : "", st->counters[i].name.c_str(), *st->counters[i].counter);
+    fprintf(f, "\n  }\n}\n");
+
+    if (fclose(f) || rename(st->tmpname.c_str(), st->filename.c_str()))
+        perror(st->filename.c_str());
+
+    st->last_time  = now;
+    st->last_insns = insns;
+}
+
+void stats_close(Stats *st) {
+    if (st->signals)
+        sigaction(SIGUSR1, &st->old_usr1, NULL);
+
+    stats_dump(st);
+    delete st;
+}
@@ -0,0 +1,337 @@
+/*
+ * Binary trace of retired instructions
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "trace.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* Buffers handed to the writer thread, in order */
+#define TRACE_NBUF       4
+#define TRACE_BUF_SIZE   (8 << 20)
+#define TRACE_MAX_RECORD 64
+
+struct TraceWriter {
+    FILE *f;
+
+    /* Producer side */
+    uint8_t *       buf[TRACE_NBUF];
+    size_t          len[TRACE_NBUF];
+    uint8_t *       p; /* next byte in the current buffer */
+    int             hartid;
+    int             priv;
+    TraceHartState  hart[TRACE_MAX_HARTS];
+    uint64_t        submitted; /* buffers handed to the thread */
+
+    /* Shared with the writer thread */
+    std::mutex              lock;
+    std::condition_variable cv;
+    uint64_t                written;
+    bool                    stop;
+    std::thread             thread;
+};
+
+static void trace_writer_thread(TraceWriter *w) {
+    std::unique_lock<std::mutex> guard(w->lock);
+
+    for (;;) {
+        while (w->written == w->submitted && !w->stop) w->cv.wait(guard);
+        if (w->written == w->submitted)
+            return;
+
+        int i = w->written % TRACE_NBUF;
+        guard.unlock();
+        if (fwrite(w->buf[i], 1, w->len[i], w->f) != w->len[i])
+            perror("trace");
+        guard.lock();
+
+        w->written++;
+        w->cv.notify_all();
+    }
+}
+
+/* Hands the current buffer to the thread and waits for the next one */
+static void trace_writer_submit(TraceWriter *w) {
+    int i = w->submitted % TRACE_NBUF;
+
+    w->len[i] = w->p - w->buf[i];
+
+    std::unique_lock<std::mutex> guard(w->lock);
+    w->submitted++;
+    w->cv.notify_all();
+    while (w->submitted - w->written >= TRACE_NBUF) w->cv.wait(guard);
+
+    w->p = w->buf[w->submitted % TRACE_NBUF];
+}
+
+TraceWriter *trace_writer_open(const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+
+    TraceWriter *w = new TraceWriter;
+    w->f           = f;
+    for (int i = 0; i < TRACE_NBUF; ++i) {
+        w->buf[i] = (uint8_t *)malloc(TRACE_BUF_SIZE);
+        w->len[i] = 0;
+        assert(w->buf[i]);
+    }
+    w->p      = w->buf[0];
+    w->hartid = -1;
+    w->priv   = -1;
+    memset(w->hart, 0, sizeof w->hart);
+    w->submitted = 0;
+    w->written   = 0;
+    w->stop      = false;
+
+    uint32_t version = TRACE_VERSION;
+    memcpy(w->p, TRACE_MAGIC, 8);
+    memcpy(w->p + 8, &version, 4);
+    memset(w->p + 12, 0, 4);
+    w->p += 16;
+
+    w->thread = std::thread(trace_writer_thread, w);
+
+    return w;
+}
+
+void trace_writer_close(TraceWriter *w) {
+    trace_writer_submit(w);
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->stop = true;
+        w->cv.notify_all();
+    }
+    w->thread.join();
+
+    fclose(w->f);
+    for (int i = 0; i < TRACE_NBUF; ++i) free(w->buf[i]);
+    delete w;
+}
+
+static inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+static inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+
+    return p;
+}
+
+void trace_writer_write(TraceWriter *w, const TraceRecord *r) {
+    TraceHartState *h     = &w->hart[r->hartid & (TRACE_MAX_HARTS - 1)];
+    uint8_t *       p     = w->p;
+    uint8_t *       flags = p++;
+    bool            rvc   = (r->insn & 3) != 3;
+
+    *flags = r->kind;
+    if (r->hartid != w->hartid || r->priv != w->priv) {
+        *flags |= TRACE_F_CTX;
+        *p++      = r->hartid;
+        *p++      = r->priv;
+        w->hartid = r->hartid;
+        w->priv   = r->priv;
+    }
+
+    if (r->pc != h->next_pc) {
+        *flags |= TRACE_F_JUMP;
+        p = put_varint(p, zigzag(r->pc - h->next_pc));
+    }
+    h->next_pc = r->pc + (rvc ? 2 : 4);
+
+    if (rvc) {
+        *flags |= TRACE_F_RVC;
+        memcpy(p, &r->insn, 2);
+        p += 2;
+    } else {
+        memcpy(p, &r->insn, 4);
+        p += 4;
+    }
+
+    switch (r->kind) {
+        case TRACE_KIND_XREG:
+        case TRACE_KIND_FREG:
+            *p++ = r->regno;
+            p    = put_varint(p, zigzag(r->value));
+            break;
+        case TRACE_KIND_EXCEPTION:
+            p = put_varint(p, r->cause);
+            p = put_varint(p, r->value);
+            break;
+    }
+
+    if (r->has_mem) {
+        *flags |= TRACE_F_MEM;
+        p           = put_varint(p, zigzag(r->mem_addr - h->last_mem));
+        h->last_mem = r->mem_addr;
+    }
+
+    w->p = p;
+    if (w->p - w->buf[w->submitted % TRACE_NBUF] > TRACE_BUF_SIZE - TRACE_MAX_RECORD)
+        trace_writer_submit(w);
+}
+
+bool trace_reader_init(TraceReader *rd, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t       version;
+
+    if (len < 16 || memcmp(p, TRACE_MAGIC, 8))
+        return false;
+    memcpy(&version, p + 8, 4);
+    if (version != TRACE_VERSION)
+        return false;
+
+    rd->p      = p + 16;
+    rd->end    = p + len;
+    rd->hartid = 0;
+    rd->priv   = 0;
+    memset(rd->hart, 0, sizeof rd->hart);
+
+    return true;
+}
+
+static inline bool get_varint(TraceReader *rd, uint64_t *v) {
+    uint64_t r = 0;
+
+    for (int shift = 0; rd->p < rd->end && shift < 64; shift += 7) {
+        uint8_t b = *rd->p++;
+        r |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int trace_reader_next(TraceReader *rd, TraceRecord *r) {
+    uint64_t v;
+
+    if (rd->p == rd->end)
+        return 0;
+
+    uint8_t flags = *rd->p++;
+    if (flags & TRACE_F_CTX) {
+        if (rd->end - rd->p < 2)
+            return -1;
+        rd->hartid = rd->p[0];
+        rd->priv   = rd->p[1];
+        rd->p += 2;
+    }
+
+    TraceHartState *h = &rd->hart[rd->hartid];
+    r->hartid         = rd->hartid;
+    r->priv           = rd->priv;
+    r->pc             = h->next_pc;
+    if (flags & TRACE_F_JUMP) {
+        if (!get_varint(rd, &v))
+            return -1;
+        r->pc += unzigzag(v);
+    }
+
+    int insn_len = flags & TRACE_F_RVC ? 2 : 4;
+    if (rd->end - rd->p < insn_len)
+        return -1;
+    r->insn = 0;
+    memcpy(&r->insn, rd->p, insn_len);
+    rd->p += insn_len;
+    h->next_pc = r->pc + insn_len;
+
+    r->kind  = flags & TRACE_F_KIND;
+    r->regno = 0;
+    r->value = 0;
+    r->cause = 0;
+    switch (r->kind) {
+        case TRACE_KIND_XREG:
+        case TRACE_KIND_FREG:
+            if (rd->p == rd->end)
+                return -1;
+            r->regno = *rd->p++;
+            if (!get_varint(rd, &v))
+                return -1;
+            r->value = unzigzag(v);
+            break;
+        case TRACE_KIND_EXCEPTION:
+            if (!get_varint(rd, &v))
+                return -1;
+            r->cause = v;
+            if (!get_varint(rd, &r->value))
+                return -1;
+            break;
+    }
+
+    r->has_mem  = flags & TRACE_F_MEM;
+    r->mem_addr = 0;
+    if (r->has_mem) {
+        if (!get_varint(rd, &v))
+            return -1;
+        h->last_mem += unzigzag(v);
+        r->mem_addr = h->last_mem;
+    }
+
+    return 1;
+}
+
+/* Loads, stores and AMOs, including the compressed forms */
+bool trace_insn_is_mem(uint32_t insn) {
+    if ((insn & 3) != 3) {
+        int funct3 = (insn >> 13) & 7;
+        return (insn & 3) != 1 && funct3 != 0 && funct3 != 4;
+    }
+
+    switch (insn & 0x7F) {
+        case 0x03:
+        case 0x07:
+        case 0x23:
+        case 0x27:
+        case 0x2F: return true;
+        default: return false;
+    }
+}
+
+void trace_print_text(FILE *f, const TraceRecord *r, bool with_mem) {
+    fprintf(f,
+            "%d %d 0x%016" PRIx64 " (0x%08x)",
+            r->hartid,
+            r->priv,
+            r->pc,
+            (r->insn & 3) == 3 ? r->insn : (uint16_t)r->insn);
+
+    switch (r->kind) {
+        case TRACE_KIND_EXCEPTION: fprintf(f, " exception %d, tval %016" PRIx64, r->cause, r->value); break;
+        case TRACE_KIND_XREG: fprintf(f, " x%2d 0x%016" PRIx64, r->regno, r->value); break;
+        case TRACE_KIND_FREG: fprintf(f, " f%2d 0x%016" PRIx64, r->regno, r->value); break;
+    }
+    if (with_mem && r->has_mem)
+        fprintf(f, " mem 0x%016" PRIx64, r->mem_addr);
+
+    putc('\n', f);
+}
@@ -48,6 +48,7 @@
 
 #include "cutils.h"
 #include "list.h"
+#include "stats.h"
 
 #define DEBUG_VIRTIO
 
@@ -165,6 +166,12 @@ struct VIRTIODevice {
                                               is written */
     uint32_t config_space_size;            /* in bytes, must be multiple of 4 */
     uint8_t  config_space[MAX_CONFIG_SPACE_SIZE];
+
+    /* Host statistics, see virtio_add_stats */
+    uint64_t stat_notify;        /* queue notifications from the guest */
+    uint64_t stat_requests;      /* descriptor chains given back */
+    uint64_t stat_bytes_read;    /* copied out of the guest buffers */
+    uint64_t stat_bytes_written; /* copied into them */
 };
 
 static uint32_t virtio_mmio_read(void *opaque, uint32_t offset1, int size_log2);
@@ -203,6 +210,17 @@ static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s, virtio_phys_addr_t padd
     return pr->phys_mem + (uintptr_t)(paddr - pr->addr);
 }
 
+/* DMA writes bypass the CPU write TLB, so track the dirty pages here */
+static void virtio_set_dirty(VIRTIODevice *s, virtio_phys_addr_t paddr) {
+    PhysMemoryRange *pr;
+
+    if (!s->mem_map)
+        return;
+    pr = get_phys_mem_range(s->mem_map, paddr);
+    if (pr && pr->is_ram)
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);
+}
+
 static void virtio_add_pci_capability(VIRTIODevice *s, int cfg_type, int bar, uint32_t offset, uint32_t len, uint32_t mult) {
     uint8_t cap[20];
     int     cap_len;
@@ -320,6 +338,7 @@ static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr, uint16_t va
     ptr = s->get_ram_ptr(s, addr);
     if (!ptr)
         return;
+    virtio_set_dirty(s, addr);
     *(uint16_t *)ptr = val;
 }
 
@@ -330,6 +349,7 @@ static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr, uint32_t va
     ptr = s->get_ram_ptr(s, addr);
     if (!ptr)
         return;
+    virtio_set_dirty(s, addr);
     *(uint32_t *)ptr = val;
 }
 
@@ -359,6 +379,7 @@ static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, const
         ptr = s->get_ram_ptr(s, addr);
         if (!ptr)
             return -1;
+        virtio_set_dirty(s, addr);
         memcpy(ptr, buf, l);
         addr += l;
         buf += l;
@@ -379,6 +400,11 @@ static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf, int queue_idx, in
     if (count == 0)
         return 0;
 
+    if (to_queue)
+        s->stat_bytes_written += count;
+    else
+        s->stat_bytes_read += count;
+
     get_desc(s, &desc, queue_idx, desc_idx);
 
     if (to_queue) {
@@ -457,6 +483,7 @@ static void virtio_consume_desc(VIRTIODevice *s, int queue_idx, int desc_idx, in
 
     s->int_status |= 1;
     set_irq(s->irq, 1);
+    s->stat_requests++;
 }
 
 static int get_desc_rw_size(VIRTIODevice *s, int *pread_size, int *pwrite_size, int queue_idx, int desc_idx) {
@@ -671,6 +698,7 @@ static void virtio_mmio_write(void *opaque, uint32_t offset, uint32_t val, int s
                 break;
             case VIRTIO_MMIO_QUEUE_READY: s->queue[s->queue_sel].ready = val & 1; break;
             case VIRTIO_MMIO_QUEUE_NOTIFY:
+                s->stat_notify++;
                 if (val < MAX_QUEUE)
                     queue_notify(s, val);
                 break;
@@ -792,6 +820,7 @@ static void virtio_pci_write(void *opaque, uint32_t offset1, uint32_t val, int s
             break;
         case VIRTIO_PCI_CONFIG_OFFSET >> 12: virtio_config_write(s, offset, val, size_log2); break;
         case VIRTIO_PCI_NOTIFY_OFFSET >> 12:
+            s->stat_notify++;
             if (val < MAX_QUEUE)
                 queue_notify(s, val);
             break;
@@ -800,6 +829,45 @@ static void virtio_pci_write(void *opaque, uint32_t offset1, uint32_t val, int s
 
 void virtio_set_debug(VIRTIODevice *s, int debug) { s->debug = debug; }
 
+/*
+ * virtio_add_stats --
+ *
+ * Registers the counters of the device at pr, if it is a virtio MMIO
+ * one, as "virtio.TYPE@ADDR.COUNTER".  Returns false if it is not.
+ */
+bool virtio_add_stats(Stats *st, PhysMemoryRange *pr) {
+    if (!pr || pr->read_func != virtio_mmio_read)
+        return false;
+
+    VIRTIODevice *s = (VIRTIODevice *)pr->opaque;
+    const char *  type;
+    switch (s->device_id) {
+        case 1: type = "net"; break;
+        case 2: type = "blk"; break;
+        case 3: type = "console"; break;
+        case 9: type = "9p"; break;
+        case 18: type = "input"; break;
+        default: type = "device"; break;
+    }
+
+    const struct {
+        const char *    name;
+        const uint64_t *counter;
+    } stat[] = {
+        {"notify", &s->stat_notify},
+        {"requests", &s->stat_requests},
+        {"bytes_read", &s->stat_bytes_read},
+        {"bytes_written", &s->stat_bytes_written},
+    };
+    for (size_t i = 0; i < countof(stat); ++i) {
+        char name[64];
+        snprintf(name, sizeof name, "virtio.%s@0x%" PRIx64 ".%s", type, pr->addr, stat[i].name);
+        stats_add(st, name, stat[i].counter, false);
+    }
+
+    return true;
+}
+
 static void virtio_config_change_notify(VIRTIODevice *s) {
     /* INT_CONFIG interrupt */
     s->int_status |= 2;